@@ -0,0 +1,368 @@
+=head1 NAME
+
+   Bagger::Agent::Query -- Query Proxy for Bagger
+
+=cut
+
+package Bagger::Agent::Query;
+
+=head1 SYNOPSIS
+
+   Bagger::Agent::Query->run
+
+   # or, usually in testing
+   Bagger::Agent::Query->start(host => '127.0.0.1', port => 0);
+   my $port = Bagger::Agent::Query->port;
+   Bagger::Agent::Query->loop;
+
+   Bagger::Agent::Query->stop;
+
+=cut
+
+use 5.020;
+use strict;
+use warnings;
+use AnyEvent;
+use AnyEvent::Loop;
+use AnyEvent::Socket;
+use AnyEvent::Handle;
+use AnyEvent::Util qw(fork_call);
+use Encode qw(decode encode);
+use JSON;
+use URI::Escape qw(uri_escape_utf8 uri_unescape);
+use Bagger::Storage::Config;
+use Bagger::Storage::PGObject;
+use Bagger::Query;
+use Bagger::Query::Cursor;
+use Bagger::Query::Merge;
+
+=head1 DESCRIPTION
+
+The query proxy serves queries over the storage nodes on HTTP, see
+C<docs/specs/query_proxy_spec.md>.  Requests are planned with C<Bagger::Query>
+against the Lenkwerk database, so the servermap, the dimensions, and the status
+of the nodes are read for each request.  Planning blocks on the database, so it
+is done in a child process with a connection of its own, and the proxy goes on
+serving the other requests meanwhile.  The nodes are then queried in parallel,
+see C<Bagger::Query::Cursor>, and the results merged in time order and streamed
+to the client with chunked transfer encoding as they arrive.
+
+Responses are a JSON array of documents.  If a node fails after streaming has
+started, the last element is an error document with C<Error>, C<SQLSTATE>, and
+C<Message>, and the array is closed.  Requests which cannot be planned get a
+400 response with an error document.
+
+If the query filters on fields other than the dimensions, the
+C<X-Bagger-Index> header tells which index each filter uses, see
+C<Bagger::Query::Planner>, as C<field=index> pairs with the index left empty
+for none, as in C<< X-Bagger-Index: /service=service_idx, /payload= >>.
+
+When a client reads more slowly than the nodes send, the proxy stops taking rows
+once 64kB are waiting to be sent, which in turn stops the cursors on the nodes.
+A client going away cancels the queries.
+
+=head1 CONFIGURATION
+
+=head2 Commandline usage
+
+In addition to the Lenkwerk options of C<Bagger::CLI>:
+
+=over
+
+=item -l --listen  Address to listen on (default: all)
+
+=item -L --listenport  Port to listen on (default: 8080)
+
+=back
+
+These can also be set as C<host> and C<port> in the C<query_proxy> section of
+the config file.
+
+=head2 Lenkwerk Config
+
+=over
+
+=item query_batch_size
+
+Rows read from a node at a time, defaults to 1000.
+
+=item query_max_partitions
+
+Most partitions one query may cover, defaults to 10000.
+
+=item query_connect_timeout
+
+Seconds connecting to a node may take, defaults to 10.
+
+=back
+
+=cut
+
+use constant {
+    QUERY_PATH => '/api/v1.0/query',
+    WBUF_HIGH  => 65536,
+};
+
+my ($listen_host, $listen_port, $server, $bound_port, %handles);
+
+sub _add_opts {
+    return (
+        'listen|l=s'     => \$listen_host,
+        'listenport|L=i' => \$listen_port,
+    );
+}
+
+=head1 FUNCTIONS
+
+=head2 run
+
+Starts the proxy and runs the event loop.
+
+=cut
+
+sub run {
+    start();
+    loop();
+}
+
+=head2 start(host => $host, port => $port)
+
+Starts listening.  The arguments override the command line and config file.
+
+=cut
+
+sub start {
+    my ($class, %args) = @_;
+    ## no critic qw(Variables::ProhibitPackageVars)
+    $listen_host = $args{host} // $listen_host
+                   // $Bagger::CLI::ini{query_proxy}{host};
+    $listen_port = $args{port} // $listen_port
+                   // $Bagger::CLI::ini{query_proxy}{port} // 8080;
+    ## use critic
+    $server = tcp_server($listen_host, $listen_port, \&_accept,
+                         sub { $bound_port = $_[2]; return });
+    return;
+}
+
+=head2 port
+
+Returns the port listened on, which is useful when started on port 0.
+
+=cut
+
+sub port { $bound_port }
+
+=head2 loop
+
+Runs the event loop until C<stop> is called.
+
+=cut
+
+my $stop = 0;
+sub loop {
+    $stop = 0;
+    AnyEvent::Loop::one_event while not $stop;
+}
+
+=head2 stop
+
+Stops listening, cancels the requests being served, and ends the loop.
+
+=cut
+
+sub stop {
+    $stop = 1;
+    undef $server;
+    for my $handle (values %handles) {
+        $handle->{bagger_merge}->cancel if $handle->{bagger_merge};
+        _close($handle);
+    }
+    my $sentinel = AnyEvent->condvar;
+    $sentinel->cb(sub {});
+    $sentinel->send; # noop event so the loop notices
+}
+
+# internal function _accept($fh)
+#
+# Reads the request head of a new connection.
+
+sub _accept {
+    my ($fh) = @_;
+    my $handle = AnyEvent::Handle->new(
+        fh       => $fh,
+        on_error => \&_close,
+        on_eof   => \&_close,
+    );
+    $handles{$handle} = $handle;
+    $handle->push_read(line => qr/\r?\n\r?\n/, \&_request);
+    return;
+}
+
+# internal function _close($handle)
+#
+# Closes a connection, cancelling its query.
+
+sub _close {
+    my ($handle) = @_;
+    my $merge = delete $handle->{bagger_merge};
+    $merge->cancel if $merge;
+    delete $handles{$handle};
+    $handle->destroy;
+    return;
+}
+
+# internal function _respond($handle, $status, $doc)
+#
+# Sends a complete response with a JSON document and closes the connection.
+
+my %reason = (400 => 'Bad Request', 404 => 'Not Found',
+              405 => 'Method Not Allowed');
+
+sub _respond {
+    my ($handle, $status, $doc) = @_;
+    my $body = encode_json($doc);
+    $handle->push_write("HTTP/1.1 $status $reason{$status}\r\n"
+        . "Content-Type: application/json\r\n"
+        . 'Content-Length: ' . length($body) . "\r\n"
+        . "Connection: close\r\n\r\n" . $body);
+    $handle->on_drain(\&_close);
+    return;
+}
+
+sub _error {
+    my ($state, $message) = @_;
+    $message =~ s/ at \S+ line \d+\.?\n?\z//;
+    return { Error => JSON::true, SQLSTATE => $state, Message => $message };
+}
+
+# internal function _chunk($handle, $text)
+#
+# Sends text as one chunk.
+
+sub _chunk {
+    my ($handle, $text) = @_;
+    my $bytes = encode('UTF-8', $text);
+    $handle->push_write(sprintf("%x\r\n", length $bytes) . $bytes . "\r\n");
+    return;
+}
+
+# internal function _params($query_string)
+#
+# Returns the decoded name => value pairs of the query string, in order.
+
+sub _params {
+    my ($query_string) = @_;
+    return map { decode('UTF-8', uri_unescape(tr/+/ /r)) }
+           map { my ($name, $value) = split /=/, $_, 2; ($name, $value // '') }
+           grep { length } split /&/, $query_string // '';
+}
+
+# internal function _request($handle, $head)
+#
+# Plans the query, then streams the results.  The planning is done in a child
+# process, see _plan.
+
+sub _request {
+    my ($handle, $head) = @_;
+    my ($method, $target) = $head =~ m{^(\S+)\s+(\S+)};
+    return _respond($handle, 405, _error('0A000', 'Only GET is supported'))
+        unless ($method // '') eq 'GET';
+    my ($path, $query_string) = split /\?/, $target, 2;
+    return _respond($handle, 404, _error('42704', "No such path $path"))
+        unless $path eq QUERY_PATH;
+
+    fork_call { _plan(@_) } _params($query_string), sub {
+        my ($planned) = @_;
+        # the client may have gone away meanwhile
+        return unless $handles{$handle};
+        $planned //= { error => $@ || 'Planning failed' };
+        return _respond($handle, 400, _error('22023', $planned->{error}))
+            if defined $planned->{error};
+        _stream($handle, $planned);
+    };
+    return;
+}
+
+# internal function _plan(@params)
+#
+# Plans the query, in the child process started by _request.  Returns a
+# hashref with the query, the plan, the index report, the batch size, and the
+# connect timeout, or with the error.
+
+sub _plan {
+    my (@params) = @_;
+    # the parent's connection is its own, see Bagger::Storage::PGObject
+    Bagger::Storage::PGObject::_new_dbh();
+    my %planned;
+    my $ok = eval {
+        my $query = Bagger::Query->from_params(@params);
+        $planned{plan} = $query->plan;
+        $planned{indexes} = [
+            map { uri_escape_utf8($_->{field}, '^\w\-.~/') . '='
+                  . ($_->{index} // '') } $query->index_report
+        ];
+        # built here so that the cursors need not read Lenkwerk
+        $_->[0]->dsn for @{$planned{plan}{nodes}};
+        # a connection cannot be passed to the parent
+        delete $query->{_dbh};
+        $planned{query} = $query;
+        for my $key (qw(query_batch_size query_connect_timeout)) {
+            my $config = Bagger::Storage::Config->get($key);
+            $planned{$key} = $config->value_string if $config;
+        }
+        1;
+    };
+    $planned{error} = $@ || 'Planning failed' unless $ok;
+    return \%planned;
+}
+
+# internal function _stream($handle, $planned)
+#
+# Queries the nodes as planned, and streams the results.
+
+sub _stream {
+    my ($handle, $planned) = @_;
+    my ($query, $plan, @indexes) = ($planned->{query}, $planned->{plan},
+                                    @{$planned->{indexes}});
+    my $batch_size = $planned->{query_batch_size} // 1000;
+    my $timeout = $planned->{query_connect_timeout} // 10;
+    $handle->push_write("HTTP/1.1 200 OK\r\n"
+        . "Content-Type: application/json\r\n"
+        . (@indexes ? 'X-Bagger-Index: ' . join(', ', @indexes) . "\r\n" : '')
+        . "Transfer-Encoding: chunked\r\n"
+        . "Connection: close\r\n\r\n");
+    my $open = '[';
+    my $merge = Bagger::Query::Merge->new(
+        cursors => [ map { Bagger::Query::Cursor->new(
+                               query           => $query,
+                               instance        => $_->[0],
+                               relnames        => $_->[1],
+                               batch_size      => $batch_size,
+                               connect_timeout => $timeout,
+                           ) } @{$plan->{nodes}} ],
+        copies    => $plan->{copies},
+        can_write => sub { length($handle->{wbuf}) < WBUF_HIGH },
+        on_rows   => sub {
+            _chunk($handle, $open . join(",\n", @_));
+            $open = ",\n";
+        },
+        on_done   => sub {
+            my ($error) = @_;
+            delete $handle->{bagger_merge};
+            my $tail = $error ? $open . encode_json(
+                { Error => JSON::true, %$error }
+            ) : ($open eq '[' ? '[' : '');
+            _chunk($handle, "$tail]\n");
+            $handle->push_write("0\r\n\r\n");
+            $handle->on_drain(\&_close);
+        },
+    );
+    $handle->{bagger_merge} = $merge;
+    $handle->on_drain(sub { $merge->pump });
+    $merge->start;
+    return;
+}
+
+1;
+
+# vim:ts=4:sw=4:expandtab
@@ -33,11 +33,14 @@ use Coro;
 use AnyEvent::Loop;
 use Net::Etcd;
 use Getopt::Long;
+use JSON;
 use Config::IniFiles;
 use Sys::Hostname;
+use List::Util 'max';
 use Bagger::Storage::Config;
 use Bagger::Storage::Instance;
 use Bagger::Agent::Storage::Schaufel;
+use Bagger::Agent::Storage::Backfill;
 
 =head1 DESCRIPTION
 
@@ -63,8 +66,8 @@ hour boundary.  These changes do not necessarily require a restart of Schaufel
 instances.  Servermap changes do require a restart of schaufel instances but
 they do not require a new schema just because the servermap changes.
 
-In future versions the agent may publish statistics to the key/value store or
-via other ways.  This is not implemented at present however.
+The agent also publishes ingestion statistics from the storage node to the
+key/value store once a minute, see C<publish_stats> below.
 
 If a Schaufel has crashed erroneously, the correct way to restart it is to
 restart the agent.  If the node is listed as having a read-only or offline
@@ -153,7 +156,9 @@ The ID of the consumer group used
 
 =item schaufel_threads
 
-Integer number of threads to run with Schaufel
+Integer number of threads to run with Schaufel.  With a version 2
+servermap the agent runs a Schaufel for each entry of its instance, one per
+unit of weight, and this is scaled by the entry's C<scale>.
 
 =item schaufel_cmd
 
@@ -163,6 +168,16 @@ The command used to launch schaufel, defaults to /usr/bin/schaufel
 
 The place to log schaufel output.  Defaults to /var/log/schaufel/bagger.log
 
+=item index_backfill_workers
+
+Number of indexes built on existing partitions at the same time.  Defaults to
+2.  See L<Bagger::Agent::Storage::Backfill>.
+
+=item index_backfill_mb_per_sec
+
+Approximate limit on the rate at which index builds on existing partitions read
+data, in megabytes per second.  Defaults to no limit.
+
 =back
 
 =head1 PROGRAM CONTROL FUNCTIONS
@@ -218,7 +233,8 @@ at a time as they are received.
 #
 my ($hostname, $instanceport, $connect_role, $instance, $retention, $servermap,
     $kvstore, $genconfig, $kafka_topic, $kafka_broker, $kafka_consumer_group,
-    $schaufel_threads, @copies, $schaufel, $schaufel_cmd, $schaufel_log);
+    $schaufel_threads, @copies, @shares, @schaufels, $schaufel_cmd,
+    $schaufel_log, $backfill, $compact);
 
 sub _add_opts {
     return (
@@ -232,17 +248,28 @@ sub _add_opts {
 # internal function _my_smap_key()
 #
 # Returns the key of the primary instance we are responsible for (i.e. the one
-# running Schaufel
+# running Schaufel).  Servermap entries for further units of its weight have
+# the unit appended.
 
 sub _my_smap_key { join('_', $instance->host, $instance->port) };
 
+# Internal function _config_value($key)
+#
+# Returns the value of an optional config key, or undef if it is not set.
+
+sub _config_value {
+    my ($key) = @_;
+    my $config = Bagger::Storage::Config->get($key);
+    return $config ? $config->value_string : undef;
+}
+
 # Internal function _cond_start_schaufel
 #
 # Checks to see if Schaufel is running.
 # If not, and it is able to run, we start it
 
 sub _cond_start_schaufel {
-    return if $schaufel; # already running
+    return if @schaufels; # already running
     start_schaufel() if _all_copies_can_write();
 }
 
@@ -286,8 +313,24 @@ sub start {
     # This is needed to write new Schaufel configs as well as to determine
     # states needed for starting or stopping schaufel.
 
-    for my $item (@{$servermap->servermap->{_my_smap_key}->copies}){
-        push @copies, $instance->get_by_info($item->{host}, $item->{port});
+    # In ring mode each row belongs on the nodes storage.bagger_placement()
+    # returns for its partition.  Neither Schaufel nor the ingestion trigger
+    # apply that placement yet, and a Schaufel given every node would store
+    # each row on all of them, so ring servermaps are only used for reading.
+    my $map = $servermap->server_map;
+    die 'Ring mode servermaps cannot be ingested yet, '
+        . 'set servermap_mode to the default'
+        if ($map->{mode} // '') eq 'ring';
+    my @entries = grep { ref $_ eq 'HASH' and join('_', $_->{schaufel}{host},
+                                                   $_->{schaufel}{port})
+                                              eq _my_smap_key() }
+                  map { $map->{$_} } sort keys %$map;
+    my %seen;
+    for my $entry (@entries) {
+        my @hosts = map { $instance->get_by_info($_->{host}, $_->{port}) }
+                    @{$entry->{copies}};
+        push @shares, { hosts => \@hosts, scale => $entry->{scale} };
+        push @copies, grep { not $seen{_instance_key($_)}++ } @hosts;
     }
 
     my $kvstore_type = Bagger::Storage::Config->get('kvstore_type');
@@ -303,11 +346,18 @@ sub start {
     $schaufel_threads = Bagger::Storage::Config->get(
         'schaufel_threads'
     )->value_string;
+    # version 2 servermaps scale the share of the topic of each entry
+    $_->{threads} = $_->{scale}
+                  ? max(1, int($schaufel_threads * $_->{scale} + 0.5))
+                  : $schaufel_threads
+        for @shares;
     $schaufel_cmd = Bagger::Storage::Config->get('schaufel_cmd')->value_string
         || '/usr/bin/schaufel'; # default
     $schaufel_log = Bagger::Storage::Config->get('schaufel_log')->value_string
         || '/var/log/schaufel/bagger.log'; # default
-
+    my $backfill_workers = _config_value('index_backfill_workers') || 2;
+    my $backfill_rate = _config_value('index_backfill_mb_per_sec') || 0;
+    $compact = _config_value('compact_partitions');
 
     # Disconnect from Lenkwerk
     my $dbh = $instance->_dbh->disconnect;
@@ -326,6 +376,16 @@ sub start {
 
     # enforce_retention to set up next callback
     enforce_retention();
+    provision_partitions();
+    seal_partitions();
+    compact_partitions();
+    summarize_partitions();
+    $backfill = Bagger::Agent::Storage::Backfill->new(
+        instance => $instance, workers => $backfill_workers,
+        mb_per_sec => $backfill_rate
+    );
+    $backfill->start;
+    publish_stats();
     # set up watches on kvstore
     $kvstore->watch(\&_process_kvmsg);
     _cond_start_schaufel
@@ -337,9 +397,12 @@ sub start {
 # Clears shared state and starts again.
 
 sub _restart {
+    $backfill->stop if $backfill;
     undef $_ for ($kafka_topic, $kafka_broker, $kafka_consumer_group,
-                  $schaufel_threads, $instance, $retention, $kvstore);
+                  $schaufel_threads, $instance, $retention, $kvstore,
+                  $backfill, $compact);
     undef @copies;
+    undef @shares;
     start();
 }
 
@@ -370,6 +433,7 @@ sub stop {
     my $sentinel = AnyEvent->condvar;
     $sentinel->cb(sub {} );
     $sentinel->send; # send noop to be processed
+    $backfill->stop if $backfill;
     stop_schaufel();
 }
 
@@ -399,7 +463,8 @@ by our schaufel.
 
 =item /Index
 
-Write new data to the storage node
+Write new data to the storage node, and queue building the index on existing
+partitions
 
 =item /Dimension
 
@@ -421,13 +486,17 @@ Write new data to the storage node.
 
 Used to write the data from Etcd to the storage node.
 
+Index definitions usually apply to partitions which were already created ahead
+of time, so after an index is written its backfill is queued.
+
 =cut
 
 sub write_data {
-    my ($key, $value) = $_;
+    my ($key, $value) = @_;
     Bagger::Agent::Storage::Message->new(
         instance => $instance, key => $key, value => $value
     )->save;
+    $backfill->queue if $backfill and $key =~ m#^/Index#;
 }
 
 =head2 postgres_instance
@@ -491,13 +560,13 @@ sub postgres_instance{
     my ($key, $value) = @_;
     write_data($key, $value);
     if (_is_my_instance($key) or _is_copy_instance($key)){
-        if (_all_copies_can_write($key) and $schaufel) {
+        if (_all_copies_can_write($key) and @schaufels) {
             # we may want to log here in the future
-        } elsif (!_all_copies_can_write($key) and $schaufel) {
+        } elsif (!_all_copies_can_write($key) and @schaufels) {
             stop_schaufel();
-        } elsif (_all_copies_can_write($key) and !$schaufel) {
+        } elsif (_all_copies_can_write($key) and !@schaufels) {
             start_schaufel();
-        } elsif (!_all_copies_can_write($key) and !$schaufel) {
+        } elsif (!_all_copies_can_write($key) and !@schaufels) {
             # may want to log here
         }
     }
@@ -587,17 +656,29 @@ sub restart_schaufel{
 
 =head2 start_shchaufel
 
-Starts Schaufel.  An error will be thrown if Schaufel is already started
+Starts a Schaufel for each of our servermap entries, writing to the entry's
+copies.  An error will be thrown if Schaufel is already started
 
 =cut
 
 sub start_schaufel {
-    $schaufel = Bagger::Agent::Storage::Schaufel->new(
-        log => $schaufel_log, broker => $kafka_broker, hosts => [@copies],
-        cmd => $schaufel_cmd, topic  => $kafka_topic,
-        threads => $schaufel_threads, group => $kafka_consumer_group
+    _start_share_schaufel($_) for @shares;
+}
+
+# internal function _start_share_schaufel($share)
+#
+# Starts the Schaufel for one servermap entry.
+
+sub _start_share_schaufel {
+    my ($share) = @_;
+    my $schaufel = Bagger::Agent::Storage::Schaufel->new(
+        log => $schaufel_log, broker => $kafka_broker,
+        hosts => [@{$share->{hosts}}], cmd => $schaufel_cmd,
+        topic => $kafka_topic, threads => $share->{threads},
+        group => $kafka_consumer_group
     );
     $schaufel->start;
+    push @schaufels, $schaufel;
 
     # Set up sigchild handler
     my $sigchild = sub {
@@ -621,32 +702,276 @@ sub start_schaufel {
 
 =head2 stop_schaufel
 
-Stops Schaufel.  An error will be thrown if Schaufel is already stopped.
+Stops our Schaufels.  An error will be thrown if Schaufel is already stopped.
 
-Returns true if schaufel stops with an exit code of 0, returns false if
+Returns true if all Schaufels stop with an exit code of 0, returns false if
 an exit code is above 1.
 
 =cut
 
 sub stop_schaufel{
     my $sig = shift // 'TERM';
-    $schaufel->stop($sig);
+    my @stopped = map { $_->stop($sig) } @schaufels;
+    undef @schaufels;
+    return not grep { not $_ } @stopped;
 }
 
 =head2 enforce_retention
 
-This handles the retention strategy by processing the partition list and
-dropping expired tables.
+This handles the retention strategy by dropping expired partitions, see
+C<storage.enforce_retention> on the storage node.  Partitions are dropped in
+batches, each in its own transaction, so that locks are only held briefly, and
+partitions in use are skipped until the next run.  Partitions skipped by one
+batch are not tried again by the later batches of the same run.  This runs once
+an hour.  On the first run the partition registry is checked against the
+catalog.  The row and size estimates in the registry are refreshed first.
+
+The totals of the run are written to the key/value store under
+C</Retention/host_port> as a JSON object with C<dropped>, C<skipped>,
+C<bytes_reclaimed> and C<retained_hrs> keys, C<skipped> being the number of
+partitions skipped.  Failures only warn, since the
+next run will try again.
 
 =cut
+
+use constant RETENTION_BATCH => 50;
+
 sub enforce_retention{
     state $timer;
+    state $registered;
     $timer = AnyEvent->timer(
         after => 3600, interval => 3600, cb => \&enforce_retention
     ) unless $timer;
-    # Running this directly but could be eventually moved to a pgobject
-    # class
-    $instance->cnx->do('select storage.enforce_retention()');
+    my $dbh = $instance->cnx;
+    my %run = (started => time, dropped => 0, skipped => 0,
+               bytes_reclaimed => 0, retained_hrs => undef);
+    my $ok = eval {
+        unless ($registered) {
+            $dbh->do('select storage.register_partitions()');
+            $dbh->commit;
+            $registered = 1;
+        }
+        $dbh->do('select storage.update_partition_estimates()');
+        $dbh->commit;
+        my $sth = $dbh->prepare(
+            'select * from storage.enforce_retention(?, in_skip => ?)'
+        );
+        my @skip;
+        while (1) {
+            $sth->execute(RETENTION_BATCH, \@skip);
+            my $batch = $sth->fetchrow_hashref;
+            $dbh->commit;
+            $run{$_} += $batch->{$_} // 0 for qw(dropped bytes_reclaimed);
+            push @skip, @{$batch->{skipped} // []};
+            $run{skipped} = scalar @skip;
+            $run{retained_hrs} = $batch->{retained_hrs};
+            last if ($batch->{dropped} // 0) < RETENTION_BATCH;
+        }
+        1;
+    };
+    unless ($ok) {
+        warn "Retention run failed: $@";
+        eval { $dbh->rollback };
+    }
+    eval {
+        $kvstore->write('/Retention/' . _my_smap_key, encode_json(\%run));
+        1;
+    } or warn "Could not publish retention results: $@";
+    return;
+}
+
+=head2 provision_partitions
+
+Creates partitions ahead of time for the hours configured by
+dimensions_hrs_in_future and indexes_hrs_in_future, so that inserts do not wait
+on table creation at the top of the hour.  This runs every 15 minutes so that
+a failed run is retried well before the hour turns.
+
+Partitions for dimension values not seen recently are still created by the
+trigger when the first row for them arrives.
+
+=cut
+
+sub provision_partitions {
+    state $timer;
+    $timer = AnyEvent->timer(
+        after => 900, interval => 900, cb => \&provision_partitions
+    ) unless $timer;
+    my $dbh = $instance->cnx;
+    eval {
+        $dbh->do('select storage.provision_partitions()');
+        $dbh->commit;
+        1;
+    } or do {
+        warn "Could not provision partitions: $@";
+        eval { $dbh->rollback };
+    };
+    return;
+}
+
+=head2 seal_partitions
+
+Seals the partitions whose hour is over, see C<storage.seal_partitions> on the
+storage node, every 5 minutes.  Partitions created with deferred indexes get
+their full set of indexes from the backfill workers once sealed.
+
+=cut
+
+sub seal_partitions {
+    state $timer;
+    $timer = AnyEvent->timer(
+        after => 300, interval => 300, cb => \&seal_partitions
+    ) unless $timer;
+    my $dbh = $instance->cnx;
+    eval {
+        $dbh->do('select storage.seal_partitions()');
+        $dbh->commit;
+        1;
+    } or do {
+        warn "Could not seal partitions: $@";
+        eval { $dbh->rollback };
+    };
+    return;
+}
+
+=head2 compact_partitions
+
+If the compact_partitions config key is true, rewrites sealed partitions into
+a sorted and compressed layout, see C<storage.compact_partitions> on the
+storage node.  Each partition is locked while it is rewritten, so they are
+done one per transaction, until none are left or the run has taken
+MAINTENANCE_SECONDS, since the other timers of the agent wait for it.
+Partitions being written to are skipped for the rest of the run, and those
+which fail to compact are not tried again, see C<storage.partition>'s
+compact_error.  This runs every 5 minutes.
+
+The totals of the run are written to the key/value store under
+C</Compaction/host_port> as a JSON object with C<compacted>, C<skipped>,
+C<failed>, C<bytes_before> and C<bytes_after> keys.
+
+=cut
+
+use constant MAINTENANCE_SECONDS => 120;
+
+sub compact_partitions {
+    state $timer;
+    $timer = AnyEvent->timer(
+        after => 300, interval => 300, cb => \&compact_partitions
+    ) unless $timer;
+    return unless $compact;
+    my $dbh = $instance->cnx;
+    my %run = (started => time, compacted => 0, skipped => 0, failed => 0,
+               bytes_before => 0, bytes_after => 0);
+    my @skip;
+    my $ok = eval {
+        my $sth = $dbh->prepare(
+            'select * from storage.compact_partitions(1, in_skip => ?)'
+        );
+        while (time - $run{started} < MAINTENANCE_SECONDS) {
+            $sth->execute(\@skip);
+            my $part = $sth->fetchrow_hashref;
+            $dbh->commit;
+            $run{$_} += $part->{$_} // 0
+                for qw(compacted failed bytes_before bytes_after);
+            push @skip, @{$part->{skipped} // []};
+            last unless $part->{compacted} or $part->{failed}
+                or @{$part->{skipped} // []};
+        }
+        1;
+    };
+    $run{skipped} = scalar @skip;
+    unless ($ok) {
+        warn "Compaction run failed: $@";
+        eval { $dbh->rollback };
+    }
+    return unless $run{compacted} or $run{skipped} or $run{failed};
+    eval {
+        $kvstore->write('/Compaction/' . _my_smap_key, encode_json(\%run));
+        1;
+    } or warn "Could not publish compaction results: $@";
+    return;
+}
+
+=head2 summarize_partitions
+
+Builds the summaries of sealed partitions which the read path uses to skip
+partitions, see C<storage.summarize_partitions> on the storage node.  Each
+partition is read in full under a share lock, so they are done one per
+transaction, until none are left or the run has taken MAINTENANCE_SECONDS.
+Partitions being written to are skipped for the rest of the run.  This runs
+every 5 minutes.
+
+=cut
+
+sub summarize_partitions {
+    state $timer;
+    $timer = AnyEvent->timer(
+        after => 300, interval => 300, cb => \&summarize_partitions
+    ) unless $timer;
+    my $dbh = $instance->cnx;
+    my $started = time;
+    my @skip;
+    eval {
+        my $sth = $dbh->prepare(
+            'select * from storage.summarize_partitions(1, in_skip => ?)'
+        );
+        while (time - $started < MAINTENANCE_SECONDS) {
+            $sth->execute(\@skip);
+            my $part = $sth->fetchrow_hashref;
+            $dbh->commit;
+            push @skip, @{$part->{skipped} // []};
+            last unless $part->{summarized} or @{$part->{skipped} // []};
+        }
+        1;
+    } or do {
+        warn "Could not summarize partitions: $@";
+        eval { $dbh->rollback };
+    };
+    return;
+}
+
+=head2 publish_stats
+
+Reads the ingestion trigger statistics from the storage node and writes them to
+the key/value store under C</Stats/host_port>, once a minute.  The value is a
+JSON object with a C<backends> array as returned by the
+C<storage.bagger_trigger_stats> view, a C<partitions> array of partition
+row counts, and a C<backfill> array with the progress of index builds on
+existing partitions from the C<storage.index_backfill_progress> view.
+
+Statistics are best effort, and failing to read or publish them only warns.
+
+=cut
+
+sub publish_stats {
+    state $timer;
+    $timer = AnyEvent->timer(
+        after => 60, interval => 60, cb => \&publish_stats
+    ) unless $timer;
+    my $dbh = $instance->cnx;
+    my ($stats) = eval {
+        my ($row) = $dbh->selectrow_array(
+            q{SELECT json_build_object(
+                   'collected', now(),
+                   'backends', (SELECT coalesce(json_agg(s), '[]')
+                                  FROM storage.bagger_trigger_stats s),
+                   'partitions',
+                       (SELECT coalesce(json_agg(p), '[]')
+                          FROM storage.bagger_trigger_partition_stats p),
+                   'backfill', (SELECT coalesce(json_agg(b), '[]')
+                                  FROM storage.index_backfill_progress b))}
+        );
+        $dbh->commit;
+        $row;
+    };
+    if (not defined $stats) {
+        warn "Could not read ingestion statistics: $@";
+        eval { $dbh->rollback };
+        return;
+    }
+    eval { $kvstore->write('/Stats/' . _my_smap_key, $stats); 1 }
+        or warn "Could not publish ingestion statistics: $@";
+    return;
 }
 
 1;
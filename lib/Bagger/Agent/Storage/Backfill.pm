@@ -0,0 +1,320 @@
+=head1 NAME
+
+    Bagger::Agent::Storage::Backfill -- Index Backfill for Bagger Storage Nodes
+
+=cut
+
+package Bagger::Agent::Storage::Backfill;
+
+=head1 SYNOPSIS
+
+    my $backfill = Bagger::Agent::Storage::Backfill->new(
+        instance => $instance, workers => 2, mb_per_sec => 50
+    );
+    $backfill->start;   # resumes jobs left over and starts the workers
+    $backfill->queue;   # after index definitions have changed
+    $backfill->stop;
+
+=cut
+
+use 5.020;
+use strict;
+use warnings;
+use Moose;
+use namespace::autoclean;
+use AnyEvent;
+use DBD::Pg ':async';
+use Bagger::Storage::Index;
+use Bagger::Storage::Index::Field;
+use Bagger::Type::DateTime;
+
+=head1 DESCRIPTION
+
+Partitions are created with the indexes valid for their hour.  An index defined
+after a partition was created, including the partitions created ahead of time,
+has to be built on it afterwards.  This module does that with
+C<CREATE INDEX CONCURRENTLY>, so ingest and queries on the partition are not
+blocked while it runs.
+
+The jobs are kept in C<storage.index_backfill> on the storage node, see
+C<storage.queue_index_backfill()>.  Since the queue is in the database, the
+work survives a restart of the agent: jobs left running are put back in the
+queue on start, and an invalid index left by an interrupted build is dropped
+before it is built again.  Failed builds are retried up to three times.
+
+Builds run on a pool of C<workers> connections, each running one build at a
+time asynchronously, so the agent's event loop is never blocked.  To keep
+backfill from starving ingest of I/O, each worker pauses after a build for as
+long as the partition's size would take at its share of C<mb_per_sec>.
+
+Progress is in the C<storage.index_backfill_progress> view, which the agent
+publishes with its statistics.
+
+=head1 ATTRIBUTES
+
+=head2 instance Bagger::Storage::Instance, required
+
+The storage node.  Jobs are claimed and recorded over its connection, and the
+worker connections are cloned from it.
+
+=cut
+
+has instance => (is => 'ro', isa => 'Bagger::Storage::Instance',
+                 required => 1);
+
+=head2 workers Int
+
+Number of builds run at the same time.  Defaults to 2.
+
+=cut
+
+has workers => (is => 'ro', isa => 'Int', default => 2);
+
+=head2 mb_per_sec Num
+
+Approximate rate at which all workers together read partitions, in megabytes
+per second.  0, the default, means no limit.
+
+=cut
+
+has mb_per_sec => (is => 'ro', isa => 'Num', default => 0);
+
+=head2 poll_interval Int
+
+Seconds an idle worker waits before looking for new jobs.  Defaults to 60.
+
+=cut
+
+has poll_interval => (is => 'ro', isa => 'Int', default => 60);
+
+# per worker state: dbh, the job being built, and the AnyEvent watcher
+has _workers => (is => 'ro', isa => 'ArrayRef', default => sub { [] });
+
+has _running => (is => 'rw', isa => 'Bool', default => 0);
+
+=head1 METHODS
+
+=head2 start
+
+Puts back jobs left running by a previous agent, queues jobs for all indexes,
+and starts the workers.
+
+=cut
+
+sub start {
+    my ($self) = @_;
+    my $dbh = $self->instance->cnx;
+    $dbh->do('select storage.reset_index_backfill()');
+    $dbh->commit;
+    $self->queue;
+    $self->_running(1);
+    for my $n (1 .. $self->workers) {
+        my $worker = { id => $n };
+        push @{$self->_workers}, $worker;
+        $self->_next($worker);
+    }
+    return;
+}
+
+=head2 queue($index_id)
+
+Queues the partitions missing the index, or missing any index if $index_id is
+not given.  Returns the number of jobs queued.
+
+=cut
+
+sub queue {
+    my ($self, $index_id) = @_;
+    my $dbh = $self->instance->cnx;
+    my ($queued) = $dbh->selectrow_array(
+        'select storage.queue_index_backfill(?)', {}, $index_id
+    );
+    $dbh->commit;
+    return $queued;
+}
+
+=head2 stop
+
+Stops the workers.  Builds in progress are cancelled, and their jobs are put
+back in the queue when the agent starts again.
+
+=cut
+
+sub stop {
+    my ($self) = @_;
+    $self->_running(0);
+    for my $worker (@{$self->_workers}) {
+        delete $worker->{watcher};
+        next unless $worker->{dbh};
+        $worker->{dbh}->pg_cancel if $worker->{job};
+        $worker->{dbh}->disconnect;
+    }
+    @{$self->_workers} = ();
+    return;
+}
+
+# internal method _next($worker)
+#
+# Claims the next job for the worker and starts building it, or waits
+# poll_interval seconds if there is none.
+
+sub _next {
+    my ($self, $worker) = @_;
+    return unless $self->_running;
+    my $dbh = $self->instance->cnx;
+    my $job = eval {
+        my $row = $dbh->selectrow_hashref(
+            'select * from storage.claim_index_backfill()'
+        );
+        $dbh->commit;
+        $row;
+    };
+    if ($@) {
+        warn "Could not claim an index backfill job: $@";
+        eval { $dbh->rollback };
+    }
+    return $self->_wait($worker, $self->poll_interval) unless $job;
+
+    my @statements = eval { $self->_statements($job) };
+    if ($@ or not @statements) {
+        $self->_finish($worker, $job, $@ || 'Index not valid for partition');
+        return $self->_next($worker);
+    }
+    $worker->{job} = $job;
+    $worker->{statements} = \@statements;
+    $self->_run($worker);
+    return;
+}
+
+# internal method _statements($job)
+#
+# Returns the statements to run for a job: dropping an invalid index left
+# over from an earlier attempt if there is one, and the build itself.  The
+# index definition is read from the storage node's own copy.
+
+sub _statements {
+    my ($self, $job) = @_;
+    my $dbh = $self->instance->cnx;
+    my $def = $dbh->selectrow_hashref(
+        'select * from storage.index where id = ?', {}, $job->{index_id}
+    );
+    my $fields = $dbh->selectall_arrayref(
+        'select * from storage.index_field where index_id = ?',
+        { Slice => {} }, $job->{index_id}
+    );
+    $dbh->commit;
+    return unless $def;
+
+    my $index = Bagger::Storage::Index->new(
+        %$def, _dbh => $dbh,
+        fields => [ map { Bagger::Storage::Index::Field->new(%$_) } @$fields ],
+    );
+    my $stmt = $index->create_statement(
+        'partitions', $job->{relname}, concurrently => 1,
+        at => Bagger::Type::DateTime->from_db($job->{bucket}),
+    );
+    return unless $stmt;
+    my @statements = ($stmt);
+    unshift @statements, 'DROP INDEX CONCURRENTLY IF EXISTS '
+        . $dbh->quote_identifier(
+              'partitions', $job->{relname} . '_' . $index->indexname)
+        if $job->{invalid_index};
+    return @statements;
+}
+
+# internal method _run($worker)
+#
+# Sends the worker's next statement asynchronously, and watches the
+# connection for the result.  CREATE INDEX CONCURRENTLY cannot run in a
+# transaction block, so worker connections are in autocommit mode.
+
+sub _run {
+    my ($self, $worker) = @_;
+    my $ok = eval {
+        $worker->{dbh} //= $self->instance->cnx->clone({ AutoCommit => 1 });
+        $worker->{dbh}->do(shift @{$worker->{statements}},
+                           { pg_async => PG_ASYNC });
+        1;
+    };
+    unless ($ok) {
+        delete $worker->{dbh};
+        $self->_finish($worker, $worker->{job}, $@);
+        return $self->_wait($worker, $self->poll_interval);
+    }
+    $worker->{watcher} = AnyEvent->io(
+        fh => $worker->{dbh}->{pg_socket}, poll => 'r',
+        cb => sub { $self->_ready($worker) },
+    );
+    return;
+}
+
+# internal method _ready($worker)
+#
+# Called when the worker's connection is readable.  Collects the result once
+# the statement is done, and goes on with the next statement or job.
+
+sub _ready {
+    my ($self, $worker) = @_;
+    my $dbh = $worker->{dbh};
+    return unless $dbh->pg_ready;
+    delete $worker->{watcher};
+    my $ok = eval { $dbh->pg_result; 1 };
+    my $error = $ok ? undef : ($@ || $dbh->errstr);
+    if ($ok and @{$worker->{statements}}) {
+        return $self->_run($worker);
+    }
+    my $job = $worker->{job};
+    $self->_finish($worker, $job, $error);
+    return $self->_wait($worker, $self->_pause($job));
+}
+
+# internal method _finish($worker, $job, $error)
+#
+# Records the outcome of the job.
+
+sub _finish {
+    my ($self, $worker, $job, $error) = @_;
+    my $dbh = $self->instance->cnx;
+    delete $worker->{job};
+    delete $worker->{statements};
+    warn "Index backfill on $job->{relname} failed: $error" if $error;
+    eval {
+        $dbh->do('select storage.finish_index_backfill(?, ?, ?)', {},
+                 $job->{index_id}, $job->{relname}, $error);
+        $dbh->commit;
+        1;
+    } or do {
+        warn "Could not record index backfill result: $@";
+        eval { $dbh->rollback };
+    };
+    return;
+}
+
+# internal method _pause($job)
+#
+# Returns the seconds to wait after a job so that the workers together stay
+# under mb_per_sec.
+
+sub _pause {
+    my ($self, $job) = @_;
+    return 0 unless $self->mb_per_sec > 0 and $job->{byte_estimate};
+    my $worker_rate = $self->mb_per_sec * 1024 * 1024 / $self->workers;
+    return $job->{byte_estimate} / $worker_rate;
+}
+
+# internal method _wait($worker, $seconds)
+#
+# Claims the next job after $seconds.
+
+sub _wait {
+    my ($self, $worker, $seconds) = @_;
+    return unless $self->_running;
+    $worker->{watcher} = AnyEvent->timer(
+        after => $seconds, cb => sub { $self->_next($worker) }
+    );
+    return;
+}
+
+__PACKAGE__->meta->make_immutable;
+
+# vim:ts=4:sw=4:expandtab
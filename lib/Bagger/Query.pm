@@ -0,0 +1,426 @@
+=head1 NAME
+
+    Bagger::Query -- Queries over Bagger Storage Nodes
+
+=cut
+
+package Bagger::Query;
+
+=head1 SYNOPSIS
+
+    # the parameters of a query proxy request, in order
+    my $query = Bagger::Query->from_params(
+        time    => '2024-01-01T03:02:00..2024-01-01T05:02:00',
+        service => 'myapp',        service => 'callbacks',
+        payload => '"""foo".."bar.."',
+    );
+    my $plan = $query->plan;
+    for my $node (@{$plan->{nodes}}) {
+        my ($instance, $relnames) = @$node;
+        ...
+    }
+
+    # on a storage node, for the partitions of one hour
+    my $sql = $query->statement($dbh, @relnames);
+
+=cut
+
+use 5.020;
+use strict;
+use warnings;
+use Moose;
+use namespace::autoclean;
+use Carp 'croak';
+use JSON;
+use Bagger::Storage::Config;
+use Bagger::Storage::Dimension;
+use Bagger::Storage::Index;
+use Bagger::Storage::Instance;
+use Bagger::Storage::Servermap;
+use Bagger::Query::Planner;
+use Bagger::Type::DateTime;
+use Bagger::Type::JSONPointer;
+with 'Bagger::Storage::PGObject';
+
+=head1 DESCRIPTION
+
+A query selects documents by a value for each partition dimension, a time
+range, and optionally values of other fields.  This module turns a query into
+the partitions to search, the storage nodes to search them on, and the SQL to
+run there.  Running the SQL and merging the results is done by
+C<Bagger::Query::Cursor> and C<Bagger::Query::Merge>, and serving queries over
+HTTP by C<Bagger::Agent::Query>.
+
+Partitions are named after their dimension labels and hour, so the partitions
+a query can find rows in are known without looking at the storage nodes: one
+for each combination of the wanted labels, for each hour in the time range.
+See C<storage.query_partitions()>.
+
+Which nodes are searched depends on the servermap.  A ring mode servermap
+places each partition on its own, so each partition is searched on one
+readable node holding a copy of it, and every row is found once.  Other
+servermaps place whole streams of data, so the same partition exists on every
+node, holding the rows of each entry the node has a copy of.  These are
+searched on every readable node, and each row is found once on each of its
+copies.  The merge then drops the extra copies, see C<plan> below.
+
+=head1 QUERY VALUES
+
+Values are given as in the query proxy API.  A value is either a single value,
+or a range written as C<from..to>, either side of which can be left out for an
+open range.  Values containing C<..> or double quotes have to be double
+quoted, with double quotes in them doubled.
+
+For example C<"""foo".."bar.."> is the range from C<"foo> to C<bar..>.
+
+Ranges between numbers compare as numbers, other ranges as text, see
+C<Bagger::Query::Planner>.
+
+=head1 ATTRIBUTES
+
+=head2 labels ArrayRef[ArrayRef[Str]], required
+
+The labels wanted for each dimension, in dimension order.
+
+=cut
+
+has labels => (is => 'ro', isa => 'ArrayRef[ArrayRef[Str]]', required => 1);
+
+=head2 from Str, required
+
+=head2 to Str, required
+
+The time range, inclusive, as timestamps in UTC.
+
+=cut
+
+has from => (is => 'ro', isa => 'Str', required => 1);
+
+has to => (is => 'ro', isa => 'Str', required => 1);
+
+=head2 filters ArrayRef[HashRef]
+
+Conditions on other fields.  Each is a hashref with a C<pointer>, a
+C<Bagger::Type::JSONPointer> to the field, and C<values>, an arrayref of values
+as returned by C<parse_value>.  A document matches a filter if its field
+matches any of the values, and it has to match all filters.
+
+Values are compared as text, unless the index used for the field compares
+them otherwise, see C<Bagger::Query::Planner>.
+
+=cut
+
+has filters => (is => 'ro', isa => 'ArrayRef[HashRef]',
+                default => sub { [] });
+
+=head2 indexes ArrayRef[Bagger::Storage::Index]
+
+The indexes the filters can use: those valid over the whole time range, with
+only their fields valid over it.  Read from the Lenkwerk database by default.
+
+=cut
+
+has indexes => (is => 'ro', isa => 'ArrayRef[Bagger::Storage::Index]',
+                lazy => 1, builder => '_indexes');
+
+sub _indexes {
+    my ($self) = @_;
+    my @at = map { Bagger::Type::DateTime->from_db($_) }
+             $self->from, $self->to;
+    my $valid = sub {
+        my ($bound) = @_;
+        return not grep { not $bound->in_time_bounds($_) } @at;
+    };
+    my @indexes;
+    for my $index (grep { $valid->($_) } Bagger::Storage::Index->list) {
+        my @fields = grep { $valid->($_) } @{$index->fields};
+        push @indexes, $index->new(%$index, fields => \@fields) if @fields;
+    }
+    return \@indexes;
+}
+
+has _planner => (is => 'ro', isa => 'Bagger::Query::Planner', lazy => 1,
+                 builder => '_build_planner');
+
+sub _build_planner {
+    my ($self) = @_;
+    return Bagger::Query::Planner->new(filters => $self->filters,
+                                       indexes => $self->indexes);
+}
+
+=head2 timestamp_field Str
+
+The field holding the document time.  Defaults to the C<timestamp_field>
+config key, or C<timestamp>.
+
+=cut
+
+has timestamp_field => (is => 'ro', isa => 'Str', lazy => 1,
+                        builder => '_timestamp_field');
+
+sub _config {
+    my ($key) = @_;
+    my $config = Bagger::Storage::Config->get($key);
+    return $config ? $config->value_string : undef;
+}
+
+sub _timestamp_field { _config('timestamp_field') // 'timestamp' }
+
+=head1 METHODS
+
+=head2 parse_value($string)
+
+Parses a query value.  Returns a hashref with either C<value>, or C<from> and
+C<to>, which are undef for open ends.  Dies if the value is not well formed.
+
+=cut
+
+my $part = qr/"(?:[^"]|"")*"|(?:(?!\.\.)[^"])*/;
+
+sub _unquote {
+    my ($value) = @_;
+    return $value unless $value =~ s/^"(.*)"\z/$1/s;
+    $value =~ s/""/"/g;
+    return $value;
+}
+
+sub parse_value {
+    my ($self, $string) = @_;
+    croak "Invalid query value $string"
+        unless $string =~ /^($part)(?:(\.\.)($part))?\z/;
+    return { value => _unquote($1) } unless $2;
+    my ($from, $to) = ($1, $3);
+    return { from => length $from ? _unquote($from) : undef,
+             to   => length $to ? _unquote($to) : undef };
+}
+
+=head2 from_params(name => value, ...)
+
+Creates a query from request parameters, in order, repeating names with more
+than one value.  This reads the dimensions, the config, and the time range
+through the Lenkwerk database.
+
+The C<time> parameter is required, and must be a closed range.  Its ends are
+read like the timestamps of documents, see C<storage.document_time()>.
+
+Every other name is a JSON pointer, or a top level field if it does not start
+with C</>.  There must be a value for each dimension valid at the start of the
+time range, and these must not be ranges.  The other fields are filters.
+
+Partition names depend on the dimensions, so the time range must not cross a
+change to them.  Dies naming the time of the change if it does, and the parts
+before and after have to be queried separately.
+
+=cut
+
+sub _document_time {
+    my ($class, $value) = @_;
+    $value += 0 if $value =~ /^-?\d+(?:\.\d+)?$/; # seconds since the epoch
+    my ($row) = $class->call_procedure(
+        funcname => 'document_time',
+        args     => [ JSON->new->allow_nonref->encode($value) ],
+    );
+    croak "Invalid time $value" unless defined $row->{document_time};
+    return $row->{document_time};
+}
+
+sub from_params {
+    my ($class, @params) = @_;
+    my (%values, @order, $time);
+    while (my ($name, $string) = splice(@params, 0, 2)) {
+        if ($name eq 'time') {
+            croak 'Only one time range can be given' if $time;
+            $time = $class->parse_value($string);
+            next;
+        }
+        my $pointer = Bagger::Type::JSONPointer->new($name)->stringify;
+        push @order, $pointer unless $values{$pointer};
+        push @{$values{$pointer}}, $class->parse_value($string);
+    }
+    croak 'A time range is required'
+        unless $time and defined $time->{from} and defined $time->{to};
+    my $from = $class->_document_time($time->{from});
+    my $to = $class->_document_time($time->{to});
+    croak 'The time range ends before it starts' if $to lt $from;
+
+    my $at = Bagger::Type::DateTime->from_db($from);
+    my $end = Bagger::Type::DateTime->from_db($to);
+    my @dimensions = Bagger::Storage::Dimension->list;
+    my $fields_at = sub {
+        my ($time) = @_;
+        return join("\n", map { $_->fieldname->stringify }
+                          grep { $_->in_time_bounds($time) } @dimensions);
+    };
+    my $fields = $fields_at->($at);
+    for my $change (sort { $a <=> $b }
+                    grep { $_ > $at and $_ <= $end }
+                    map { ($_->valid_from, $_->valid_until) } @dimensions) {
+        croak "The dimensions change at $change, "
+              . 'query the time before and after it separately'
+            if $fields_at->($change) ne $fields;
+    }
+
+    my @labels;
+    for my $dimension (@dimensions) {
+        next unless $dimension->in_time_bounds($at);
+        my $pointer = $dimension->fieldname->stringify;
+        my $wanted = delete $values{$pointer}
+            or croak "A value is required for dimension $pointer";
+        croak "Dimension $pointer cannot be queried by range"
+            if grep { not exists $_->{value} } @$wanted;
+        push @labels, [ map { $_->{value} } @$wanted ];
+    }
+    my @filters = map { { pointer => Bagger::Type::JSONPointer->new($_),
+                          values  => $values{$_} } }
+                  grep { $values{$_} } @order;
+    return $class->new(labels => \@labels, from => $from, to => $to,
+                       filters => \@filters);
+}
+
+=head2 partitions
+
+Returns the partitions the query can find rows in, as hashrefs of C<relname>,
+C<dimensions>, and C<bucket>, in hour order.  Dies if there are more than the
+C<query_max_partitions> config key allows, 10000 by default.
+
+=cut
+
+sub partitions {
+    my ($self) = @_;
+    my @partitions = $self->call_procedure(
+        funcname => 'query_partitions',
+        args     => [ encode_json($self->labels), $self->from, $self->to ],
+    );
+    my $max = _config('query_max_partitions') // 10000;
+    croak "Query covers more than $max partitions" if @partitions > $max;
+    return @partitions;
+}
+
+=head2 plan(servermap => $servermap, instances => [...])
+
+Returns which nodes to search for which partitions, as a hashref with:
+
+=over
+
+=item nodes
+
+An arrayref of C<[ $instance, [ @relnames ] ]> pairs.
+
+=item copies
+
+How many times each row is found on the nodes, which is 1 for ring mode
+servermaps and the replication factor otherwise.
+
+=back
+
+The servermap defaults to the most recent one, and the instances to all
+registered ones.  Only instances which can be read are searched.  Dies if no
+readable instance holds a copy of some of the data.
+
+=cut
+
+sub plan {
+    my ($self, %args) = @_;
+    my $servermap = $args{servermap} // Bagger::Storage::Servermap->most_recent
+        // croak 'No servermap set yet';
+    my $map = $servermap->server_map;
+    my %readable = map { join('_', $_->host, $_->port) => $_ }
+                   grep { $_->can_read }
+                   @{$args{instances} // [ Bagger::Storage::Instance->list ]};
+    my @partitions = $self->partitions;
+
+    if (($map->{mode} // '') eq 'ring') {
+        my %relnames;
+        for my $relname (map { $_->{relname} } @partitions) {
+            my ($node) = grep { $readable{$_} }
+                         map { join('_', $_->{host}, $_->{port}) }
+                         $servermap->ring_lookup($relname);
+            croak "No readable copy of $relname" unless $node;
+            push @{$relnames{$node}}, $relname;
+        }
+        return { copies => 1,
+                 nodes  => [ map { [ $readable{$_}, $relnames{$_} ] }
+                             sort keys %relnames ] };
+    }
+
+    my %nodes;
+    for my $key (grep { ref $map->{$_} eq 'HASH' } keys %$map) {
+        my @copies = grep { $readable{$_} }
+                     map { join('_', $_->{host}, $_->{port}) }
+                     @{$map->{$key}{copies}};
+        croak "No readable copy of the data of $key" unless @copies;
+        $nodes{$_} = 1 for @copies;
+    }
+    my @relnames = map { $_->{relname} } @partitions;
+    return { copies => $map->{replication} // 2,
+             nodes  => [ map { [ $readable{$_}, \@relnames ] }
+                         sort keys %nodes ] };
+}
+
+=head2 index_report
+
+Returns which index each filter uses, see C<Bagger::Query::Planner>.
+
+=cut
+
+sub index_report { $_[0]->_planner->report }
+
+=head2 may_match($dbh)
+
+Returns a condition on C<relname> for C<storage.partition> on a storage node,
+with $dbh its connection, which is false for partitions whose summary rules
+out matching documents, see C<storage.partition_may_match>.
+
+=cut
+
+sub may_match {
+    my ($self, $dbh) = @_;
+    my $values = JSON->new->canonical->encode($self->_planner->summary_values);
+    return 'storage.partition_may_match(relname, '
+           . $dbh->quote($self->from) . '::timestamp, '
+           . $dbh->quote($self->to) . '::timestamp, '
+           . $dbh->quote($values) . '::jsonb)';
+}
+
+=head2 statement($dbh, @partitions)
+
+Returns the query for the given partitions on a storage node, with $dbh its
+connection.  This returns the document time, as an ISO 8601 string in UTC with
+microseconds, and the document as text, for the matching documents, ordered by
+time.
+
+Each partition is a relname, or a hashref with C<relname> and C<indexed> as in
+C<storage.partition_status>.  Partitions which are not indexed are searched
+without the predicates which need their indexes, see
+C<Bagger::Query::Planner>.
+
+The partitions should all be for the same hour, so that the nodes can stream
+the hours of a long time range one after the other instead of sorting the
+whole range first.
+
+=cut
+
+sub statement {
+    my ($self, $dbh, @partitions) = @_;
+    my $ts = 'storage.document_time(data -> '
+             . $dbh->quote($self->timestamp_field) . ')';
+    my $time = "$ts BETWEEN " . $dbh->quote($self->from) . '::timestamp AND '
+               . $dbh->quote($self->to) . '::timestamp';
+    my %where = map {
+        $_ => join("\n           AND ", $time,
+                   $self->_planner->predicates($dbh, indexed => $_))
+    } 0, 1;
+    my $union = join("\n     UNION ALL\n",
+        map { my $part = ref $_ ? $_ : { relname => $_, indexed => 1 };
+              "    SELECT $ts AS ts, data\n      FROM "
+              . $dbh->quote_identifier('partitions', $part->{relname})
+              . "\n     WHERE " . $where{$part->{indexed} ? 1 : 0} }
+            @partitions
+    );
+    return qq{SELECT to_char(q.ts, 'YYYY-MM-DD"T"HH24:MI:SS.US'),\n}
+         . "       q.data::text\n  FROM (\n$union\n) q\n ORDER BY q.ts";
+}
+
+__PACKAGE__->meta->make_immutable;
+
+# vim:ts=4:sw=4:expandtab
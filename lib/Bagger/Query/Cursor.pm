@@ -0,0 +1,369 @@
+=head1 NAME
+
+    Bagger::Query::Cursor -- Streaming Query Results from a Storage Node
+
+=cut
+
+package Bagger::Query::Cursor;
+
+=head1 SYNOPSIS
+
+    my $cursor = Bagger::Query::Cursor->new(
+        query    => $query,   instance   => $instance,
+        relnames => \@names,  batch_size => 1000,
+        on_ready => sub { ... },
+    );
+    $cursor->start;
+
+    # in on_ready
+    while (my $row = $cursor->next_row) {
+        my ($ts, $doc) = @$row;
+    }
+    warn $cursor->error->{Message} if $cursor->error;
+
+=cut
+
+use 5.020;
+use strict;
+use warnings;
+use Moose;
+use namespace::autoclean;
+use AnyEvent;
+use DBI;
+use DBD::Pg ':async';
+
+=head1 DESCRIPTION
+
+A cursor runs a C<Bagger::Query> on one storage node and buffers its rows, in
+time order, without blocking the event loop.
+
+The node is first asked which of the partitions exist on it, see
+C<storage.partition>, and which of those may have matching documents according
+to their summaries, see C<Bagger::Query::may_match>.  These are then searched
+one hour at a time, each hour with a server side cursor on the query from
+C<Bagger::Query::statement>, which is read C<batch_size> rows at a time.  The
+next batch is only read once the buffer is down to a quarter of a batch, so a
+consumer which stops taking rows stops the cursor too, and no more than about a
+batch and a quarter of rows are ever buffered.
+
+Queries are sent asynchronously and the connection is watched with AnyEvent,
+as for index backfill.  DBD::Pg cannot connect without blocking, so cursors
+connect one at a time, when the event loop has nothing else to do, and each
+connection may take at most C<connect_timeout>.  A slow node then holds up the
+other queries for no longer than that, and not while they have rows to send.
+
+=head1 ATTRIBUTES
+
+=head2 query Bagger::Query, required
+
+=cut
+
+has query => (is => 'ro', isa => 'Bagger::Query', required => 1);
+
+=head2 instance Bagger::Storage::Instance, required
+
+The storage node.  The cursor connects to its C<dsn> as its C<username>.
+
+=cut
+
+has instance => (is => 'ro', isa => 'Bagger::Storage::Instance',
+                 required => 1);
+
+=head2 relnames ArrayRef[Str], required
+
+The partitions to search.  Those missing on the node are skipped.
+
+=cut
+
+has relnames => (is => 'ro', isa => 'ArrayRef[Str]', required => 1);
+
+=head2 batch_size Int
+
+Rows read at a time.  Defaults to 1000.
+
+=cut
+
+has batch_size => (is => 'ro', isa => 'Int', default => 1000);
+
+=head2 connect_timeout Int
+
+Seconds connecting to the node may take.  Defaults to 10.
+
+=cut
+
+has connect_timeout => (is => 'ro', isa => 'Int', default => 10);
+
+=head2 on_ready CodeRef
+
+Called with the cursor whenever rows have been added to the buffer, the cursor
+is done, or it has failed.
+
+=cut
+
+has on_ready => (is => 'rw', isa => 'CodeRef', default => sub { sub {} });
+
+=head2 rows ArrayRef
+
+The buffer, of C<[ $ts, $doc ]> rows.
+
+=cut
+
+has rows => (is => 'ro', isa => 'ArrayRef', default => sub { [] });
+
+=head2 done Bool
+
+True once no more rows will be added to the buffer, either because all have
+been read or on an error.
+
+=head2 error HashRef
+
+Set if the cursor has failed, with the C<SQLSTATE> and C<Message> of the error.
+
+=cut
+
+has done => (is => 'rw', isa => 'Bool', default => 0);
+
+has error => (is => 'rw', isa => 'Maybe[HashRef]');
+
+=head2 skipped Int
+
+The number of partitions on the node not searched because their summaries
+ruled out matching documents.
+
+=cut
+
+has skipped => (is => 'rw', isa => 'Int', default => 0);
+
+has _dbh => (is => 'rw');
+
+has _watcher => (is => 'rw');
+
+# partitions left, by hour, with whether they are indexed
+has _hours => (is => 'rw', isa => 'ArrayRef', default => sub { [] });
+
+# a query is in flight
+has _busy => (is => 'rw', isa => 'Bool', default => 0);
+
+# the cursor for the current hour is declared and not exhausted
+has _open => (is => 'rw', isa => 'Bool', default => 0);
+
+=head1 METHODS
+
+=head2 start
+
+Connects to the node, once the other cursors waiting to do so have, and starts
+reading.
+
+=cut
+
+# cursors waiting to connect, and the watcher connecting them
+my (@connecting, $idle);
+
+sub start {
+    my ($self) = @_;
+    push @connecting, $self;
+    $idle //= AnyEvent->idle(cb => \&_connect_next);
+    return;
+}
+
+sub _connect_next {
+    my $self = shift @connecting;
+    undef $idle unless @connecting;
+    $self->_connect if $self;
+    return;
+}
+
+# internal method _connect
+#
+# Connects, then lists the partitions to search.
+
+sub _connect {
+    my ($self) = @_;
+    my $ok = eval {
+        $self->_dbh(DBI->connect(
+            $self->instance->dsn . ';connect_timeout=' . $self->connect_timeout,
+            $self->instance->username, undef,
+            { AutoCommit => 0, RaiseError => 1 }
+        ));
+        1;
+    };
+    return $self->_fail($@) unless $ok;
+    return $self->_finish unless @{$self->relnames};
+    my $dbh = $self->_dbh;
+    my $names = join(', ', map { $dbh->quote($_) } @{$self->relnames});
+    $self->_send(
+        'SELECT relname, bucket, ' . $self->query->may_match($dbh)
+        . ', indexed FROM storage.partition_status '
+        . "WHERE relname = ANY (ARRAY[$names]::name[]) "
+        . 'ORDER BY bucket, relname',
+        sub {
+            my ($sth) = @_;
+            my (@hours, $last);
+            for my $row (@{$sth->fetchall_arrayref}) {
+                unless ($row->[2]) {
+                    $self->skipped($self->skipped + 1);
+                    next;
+                }
+                push @hours, [] unless defined $last and $last eq $row->[1];
+                $last = $row->[1];
+                push @{$hours[-1]},
+                     { relname => $row->[0], indexed => $row->[3] };
+            }
+            $self->_hours(\@hours);
+            $self->_next_hour;
+        }
+    );
+    return;
+}
+
+=head2 next_row
+
+Removes and returns the first row of the buffer, or undef if it is empty.
+Reads the next batch if the buffer is running low.
+
+=cut
+
+sub next_row {
+    my ($self) = @_;
+    my $row = shift @{$self->rows};
+    $self->_want;
+    return $row;
+}
+
+=head2 cancel
+
+Stops reading and disconnects.  No more callbacks are made.
+
+=cut
+
+sub cancel {
+    my ($self) = @_;
+    @connecting = grep { $_ != $self } @connecting;
+    undef $idle unless @connecting;
+    $self->_watcher(undef);
+    $self->_open(0);
+    my $dbh = $self->_dbh or return;
+    $self->_dbh(undef);
+    eval {
+        $dbh->pg_cancel if $self->_busy;
+        $dbh->rollback;
+        $dbh->disconnect;
+    };
+    $self->_busy(0);
+    return;
+}
+
+# internal method _want
+#
+# Reads the next batch unless one is in flight or enough rows are buffered.
+
+sub _want {
+    my ($self) = @_;
+    return if $self->_busy or $self->done or not $self->_open;
+    return if @{$self->rows} > $self->batch_size / 4;
+    $self->_send('FETCH ' . $self->batch_size . ' FROM bagger_query', sub {
+        my ($sth) = @_;
+        my $rows = $sth->fetchall_arrayref;
+        unless (@$rows) {
+            $self->_open(0);
+            return $self->_send('CLOSE bagger_query',
+                                sub { $self->_next_hour });
+        }
+        push @{$self->rows}, @$rows;
+        $self->_want;
+        $self->on_ready->($self);
+    });
+    return;
+}
+
+# internal method _next_hour
+#
+# Declares the cursor for the next hour's partitions, or finishes if there
+# are none left.
+
+sub _next_hour {
+    my ($self) = @_;
+    my $partitions = shift @{$self->_hours};
+    return $self->_finish unless $partitions;
+    $self->_send(
+        'DECLARE bagger_query NO SCROLL CURSOR FOR '
+        . $self->query->statement($self->_dbh, @$partitions),
+        sub { $self->_open(1); $self->_want }
+    );
+    return;
+}
+
+# internal method _send($sql, $then)
+#
+# Sends the statement asynchronously, and calls $then with the statement
+# handle once it is done.
+
+sub _send {
+    my ($self, $sql, $then) = @_;
+    my $dbh = $self->_dbh;
+    my $ok = eval {
+        my $sth = $dbh->prepare($sql, { pg_async => PG_ASYNC });
+        $sth->execute;
+        $self->_busy(1);
+        $self->_watcher(AnyEvent->io(
+            fh => $dbh->{pg_socket}, poll => 'r',
+            cb => sub { $self->_ready($sth, $then) },
+        ));
+        1;
+    };
+    $self->_fail($@) unless $ok;
+    return;
+}
+
+# internal method _ready($sth, $then)
+#
+# Called when the connection is readable.  Collects the result once the
+# statement is done.
+
+sub _ready {
+    my ($self, $sth, $then) = @_;
+    my $dbh = $self->_dbh;
+    return unless $dbh->pg_ready;
+    $self->_watcher(undef);
+    $self->_busy(0);
+    my $ok = eval { $dbh->pg_result; $then->($sth); 1 };
+    $self->_fail($@) unless $ok;
+    return;
+}
+
+# internal method _finish
+#
+# All rows have been read.
+
+sub _finish {
+    my ($self) = @_;
+    $self->cancel;
+    $self->done(1);
+    $self->on_ready->($self);
+    return;
+}
+
+# internal method _fail($error)
+#
+# Records the error and stops.
+
+sub _fail {
+    my ($self, $error) = @_;
+    my $dbh = $self->_dbh;
+    my $state = $dbh ? $dbh->state : '';
+    my $message = $dbh && $dbh->errstr ? $dbh->errstr : "$error";
+    chomp $message;
+    $self->error({
+        SQLSTATE => $state || 'XX000',
+        Message  => join(':', $self->instance->host, $self->instance->port)
+                    . ": $message",
+    });
+    $self->cancel;
+    $self->done(1);
+    $self->on_ready->($self);
+    return;
+}
+
+__PACKAGE__->meta->make_immutable;
+
+# vim:ts=4:sw=4:expandtab
@@ -0,0 +1,199 @@
+=head1 NAME
+
+    Bagger::Query::Merge -- Merging Query Results in Time Order
+
+=cut
+
+package Bagger::Query::Merge;
+
+=head1 SYNOPSIS
+
+    my $merge = Bagger::Query::Merge->new(
+        cursors   => \@cursors,          copies  => $plan->{copies},
+        on_rows   => sub { print join(",\n", @_) },
+        on_done   => sub { my ($error) = @_; ... },
+        can_write => sub { length $handle->{wbuf} < 65536 },
+    );
+    $merge->start;
+
+    # when the consumer can take more again
+    $merge->pump;
+
+=cut
+
+use 5.020;
+use strict;
+use warnings;
+use Moose;
+use namespace::autoclean;
+
+=head1 DESCRIPTION
+
+The merge takes the rows of a query from several C<Bagger::Query::Cursor>s,
+each in time order, and passes the documents on in time order.  A row is only
+passed on once every cursor which is not done has a row buffered, so memory is
+bounded by the cursors' buffers.
+
+The consumer controls the pace through C<can_write>: rows are passed on in
+chunks while it returns true, and the merge then waits for C<pump> to be
+called.  The cursors stop reading when their buffers are full, so a slow
+client slows the queries on the storage nodes instead of filling memory.
+
+If each row is found on several nodes, as with servermaps which are not in ring
+mode, C<copies> is the number of copies.  Identical documents with the same
+time are then passed on once for every C<copies> found, which also keeps
+documents which really were ingested more than once.  If copies are missing
+because a node could not be read, documents are still passed on once.  Only the
+documents of the current time are remembered for this.
+
+=head1 ATTRIBUTES
+
+=head2 cursors ArrayRef, required
+
+The cursors, which are started by C<start>.
+
+=cut
+
+has cursors => (is => 'ro', isa => 'ArrayRef', required => 1);
+
+=head2 copies Int
+
+How many times each row is found.  Defaults to 1.
+
+=cut
+
+has copies => (is => 'ro', isa => 'Int', default => 1);
+
+=head2 on_rows CodeRef, required
+
+Called with a list of documents, as JSON text, whenever some can be passed on.
+
+=head2 on_done CodeRef, required
+
+Called once all rows have been passed on, or with the C<error> of the first
+cursor which failed, after which all cursors are cancelled.
+
+=head2 can_write CodeRef
+
+Returns true while the consumer can take more rows.  Defaults to always.
+
+=cut
+
+has on_rows => (is => 'ro', isa => 'CodeRef', required => 1);
+
+has on_done => (is => 'ro', isa => 'CodeRef', required => 1);
+
+has can_write => (is => 'ro', isa => 'CodeRef', default => sub { sub { 1 } });
+
+=head2 chunk_rows Int
+
+Most rows passed to one call of C<on_rows>.  Defaults to 500.
+
+=cut
+
+has chunk_rows => (is => 'ro', isa => 'Int', default => 500);
+
+has _finished => (is => 'rw', isa => 'Bool', default => 0);
+
+# time of the last row taken, and how often each document was seen at it
+has _ts => (is => 'rw', isa => 'Maybe[Str]');
+
+has _seen => (is => 'rw', isa => 'HashRef', default => sub { {} });
+
+=head1 METHODS
+
+=head2 start
+
+Starts the cursors.
+
+=cut
+
+sub start {
+    my ($self) = @_;
+    for my $cursor (@{$self->cursors}) {
+        $cursor->on_ready(sub { $self->pump });
+    }
+    for my $cursor (@{$self->cursors}) {
+        last if $self->_finished; # one failed to connect
+        $cursor->start;
+    }
+    $self->pump;
+    return;
+}
+
+=head2 pump
+
+Passes on rows as long as all cursors have some and the consumer can take
+them.  This is called by the cursors when rows arrive, and should be called by
+the consumer when it can take rows again.
+
+=cut
+
+sub pump {
+    my ($self) = @_;
+    while (not $self->_finished and $self->can_write->()) {
+        my ($docs, $state) = $self->_take;
+        $self->on_rows->(@$docs) if @$docs;
+        if ($state eq 'error') {
+            my ($failed) = grep { $_->error } @{$self->cursors};
+            $self->cancel;
+            $self->on_done->($failed->error);
+        } elsif ($state eq 'done') {
+            $self->_finished(1);
+            $self->on_done->(undef);
+        }
+        last unless $state eq 'more';
+    }
+    return;
+}
+
+=head2 cancel
+
+Cancels all cursors.  No more callbacks are made.
+
+=cut
+
+sub cancel {
+    my ($self) = @_;
+    $self->_finished(1);
+    $_->cancel for @{$self->cursors};
+    return;
+}
+
+# internal method _take
+#
+# Takes up to chunk_rows rows.  Returns the documents to pass on and whether
+# there may be more now ('more'), we have to wait for a cursor ('wait'), all
+# rows are taken ('done'), or a cursor failed ('error').
+
+sub _take {
+    my ($self) = @_;
+    my @docs;
+    return (\@docs, 'error') if grep { $_->error } @{$self->cursors};
+    for (1 .. $self->chunk_rows) {
+        my $next;
+        for my $cursor (@{$self->cursors}) {
+            my $row = $cursor->rows->[0];
+            unless ($row) {
+                next if $cursor->done;
+                return (\@docs, 'wait');
+            }
+            $next = $cursor if not $next or $row->[0] lt $next->rows->[0][0];
+        }
+        return (\@docs, 'done') unless $next;
+        my ($ts, $doc) = @{$next->next_row};
+        if ($self->copies > 1) {
+            unless (defined $self->_ts and $self->_ts eq $ts) {
+                $self->_ts($ts);
+                $self->_seen({});
+            }
+            next if $self->_seen->{$doc}++ % $self->copies;
+        }
+        push @docs, $doc;
+    }
+    return (\@docs, 'more');
+}
+
+__PACKAGE__->meta->make_immutable;
+
+# vim:ts=4:sw=4:expandtab
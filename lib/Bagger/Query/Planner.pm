@@ -0,0 +1,371 @@
+=head1 NAME
+
+    Bagger::Query::Planner -- Index Selection for Query Filters
+
+=cut
+
+package Bagger::Query::Planner;
+
+=head1 SYNOPSIS
+
+    my $planner = Bagger::Query::Planner->new(
+        filters => $query->filters,
+        indexes => [ Bagger::Storage::Index->list ],
+    );
+    for my $choice ($planner->report) {
+        say "$choice->{field}: ", $choice->{index} // 'none';
+    }
+
+    # on a storage node
+    my @where = $planner->predicates($dbh);
+    my @unindexed = $planner->predicates($dbh, indexed => 0);
+
+=cut
+
+use 5.020;
+use strict;
+use warnings;
+use Moose;
+use namespace::autoclean;
+use JSON;
+use Bagger::Storage::Index;
+use Bagger::Storage::Index::Field;
+
+=head1 DESCRIPTION
+
+The filters of a query name a field by JSON pointer and the values it may
+have.  PostgreSQL only uses an expression index if the query contains the
+indexed expression itself, so a filter written as
+C<< (data->'service' #>> '{}') = 'myapp' >> never uses an index on
+C<< data->>'service' >>, and every filter ends up scanning whole partitions.
+
+The planner looks through the fields of the indexes for one on the filtered
+field, as written by the C<Bagger::Storage::Index::Field> helpers, and writes
+the filter's predicate with the indexed expression, textually the same.  It
+knows the following kinds of index expressions:
+
+=over
+
+=item The field as text, C<< data->>'service' >> or C<< (data->'a')->>'b' >>
+
+Compared as text, as without an index, so values and ranges can use it,
+except ranges between numbers, see below.
+
+=item The field cast to a type, C<< (data->'n')::int >>
+
+Or C<< (data->>'n')::int >>.  Compared as that type, for integer, numeric, and
+boolean types, and as text for text types of the text field, which ranges
+between numbers cannot use.  If a value is
+not valid for the type the index is not used.  Such a predicate fails on
+documents whose field cannot be cast, which the index rules out only where it
+has been built: partitions created with deferred indexes get it once sealed,
+and a failed concurrent build leaves it invalid.  Partitions without all
+their indexes get the text comparison instead, see C<predicates>.
+
+=item The field as JSON, C<< data->'service' >>
+
+Only single values, compared with the JSON values they can stand for: the JSON
+string, and the JSON number or boolean if the value is one.
+
+=item A GIN index on the document or an object in it, C<data>
+
+Only single values, with containment, as in
+C<< data @> '{"service":"myapp"}' >>.  This is the fallback for fields no
+index names.
+
+=back
+
+B-tree indexes are only used for their first field, and hash indexes only for
+single values on their only field.  Text and cast expressions are preferred,
+then JSON equality, then containment, and among indexes alike the first by
+name.  JSON equality and containment can match more than the text comparison,
+so that is checked as well.  Filters without an index keep the text
+comparison, which scans the partitions.
+
+Ranges whose ends are numbers compare as numbers, so C<..4> does not match
+C<10>, and only match fields which are JSON numbers.  Other ranges compare as
+text.
+
+=head1 ATTRIBUTES
+
+=head2 filters ArrayRef[HashRef], required
+
+The filters, as in C<Bagger::Query>.
+
+=cut
+
+has filters => (is => 'ro', isa => 'ArrayRef[HashRef]', required => 1);
+
+=head2 indexes ArrayRef[Bagger::Storage::Index]
+
+The indexes which can be used, with their fields.  These have to be valid for
+the hours of all partitions searched, see C<Bagger::Query>.
+
+=cut
+
+has indexes => (is => 'ro', isa => 'ArrayRef[Bagger::Storage::Index]',
+                default => sub { [] });
+
+has _choices => (is => 'ro', isa => 'ArrayRef', lazy => 1,
+                 builder => '_choose');
+
+use constant {
+    CONTAINMENT   => 1,
+    JSON_EQUALITY => 2,
+    EXACT         => 3,
+};
+
+my $integer = qr/^[-+]?\d+\z/;
+my $number  = qr/^[-+]?(?:\d+(?:\.\d*)?|\.\d+)(?:[eE][-+]?\d+)?\z/;
+my $boolean = qr/^(?:true|false)\z/;
+
+# values valid for the types fields can be cast to, from JSON and from text
+my %json_casts = (
+    (map { $_ => $integer } qw(int int2 int4 int8 integer smallint bigint)),
+    (map { $_ => $number } 'numeric', 'decimal', 'float4', 'float8', 'real',
+                           'double precision'),
+    (map { $_ => $boolean } qw(bool boolean)),
+);
+my %text_casts = (%json_casts,
+                  map { $_ => qr/^/ } 'text', 'varchar', 'character varying');
+
+=head1 METHODS
+
+=head2 report
+
+Returns which index each filter uses, as hashrefs in filter order with:
+
+=over
+
+=item field
+
+The JSON pointer of the field.
+
+=item index
+
+The name of the index, undef if none.
+
+=item access
+
+How the index is used: C<text>, C<cast>, C<json>, C<containment>, or C<scan>
+without index.
+
+=back
+
+=cut
+
+sub report {
+    my ($self) = @_;
+    return map { { field  => $_->{field},
+                   index  => $_->{index},
+                   access => $_->{kind} } } @{$self->_choices};
+}
+
+=head2 predicates($dbh, indexed => $bool)
+
+Returns the condition for each filter, for a storage node with $dbh its
+connection.  Unless indexed is true, the default, the partitions searched
+may be missing indexes, see C<storage.partition_status>, and filters which
+would be compared as another type are compared as text.
+
+=cut
+
+sub predicates {
+    my ($self, $dbh, %args) = @_;
+    my $indexed = $args{indexed} // 1;
+    return map { _predicate($dbh, $_) }
+           map { $indexed || $_->{kind} ne 'cast' ? $_
+                                                  : { %$_, kind => 'scan' } }
+           @{$self->_choices};
+}
+
+=head2 summary_values
+
+Returns the values partitions must have for the filters, as a hashref of JSON
+pointer to values, for skipping partitions with the bloom filters of their
+summaries, see C<storage.partition_may_match>.  Only filters on single values
+are included, and none compared as another type, for which a value can match
+field values written differently.
+
+=cut
+
+sub summary_values {
+    my ($self) = @_;
+    return { map { $_->{field} => [ map { $_->{value} } @{$_->{values}} ] }
+             grep { my $choice = $_;
+                    $choice->{kind} ne 'cast'
+                    and not grep { not exists $_->{value} }
+                            @{$choice->{values}} }
+             @{$self->_choices} };
+}
+
+# internal function _bare($expression)
+#
+# Returns the expression without surrounding parentheses.
+
+sub _bare {
+    my ($expression) = @_;
+    $expression =~ s/^\s+|\s+\z//g;
+    while ($expression =~ /^\((.*)\)\z/s) {
+        my $inner = $1;
+        my $depth = 0;
+        for my $paren ($inner =~ /[()]/g) {
+            $depth += $paren eq '(' ? 1 : -1;
+            last if $depth < 0;
+        }
+        last if $depth; # as in (a) + (b)
+        $expression = $inner;
+    }
+    return $expression;
+}
+
+# internal method _choose
+#
+# Picks the best index for each filter.  A choice has the field's JSON and
+# text expressions, the filter's values, and for an index its name, the kind
+# of expression, and the indexed expression.
+
+sub _choose {
+    my ($self) = @_;
+    return [ map { $self->_choice($_) } @{$self->filters} ];
+}
+
+sub _choice {
+    my ($self, $filter) = @_;
+    my $field = 'Bagger::Storage::Index::Field';
+    my @elems = @{$filter->{pointer}};
+    my ($json, $text);
+    my @containers = ([ $field->root_element, [ @elems ] ]);
+    for my $i (0 .. $#elems) {
+        my $key = $field->_get_dbh->quote($elems[$i]);
+        $text = defined $json ? "($json)->>$key"
+                              : $field->root_element . "->>$key";
+        $json = defined $json
+              ? $field->extract_from_json_object($json, $elems[$i])
+              : $field->json_field($elems[$i]);
+        push @containers, [ $json, [ @elems[$i + 1 .. $#elems] ] ];
+    }
+    my $single = not grep { not exists $_->{value} } @{$filter->{values}};
+
+    my $best = { field => $filter->{pointer}->stringify, json => $json,
+                 text => $text, values => $filter->{values}, kind => 'scan',
+                 rank => 0 };
+    for my $index (@{$self->indexes}) {
+        my $am = $index->access_method;
+        my @fields = sort { $a->ordinality <=> $b->ordinality }
+                     @{$index->fields};
+        my $choice;
+        if ($am eq 'gin' and $single) {
+            for my $expression (map { _bare($_->expression) } @fields) {
+                my ($container) = grep { $_->[0] eq $expression } @containers;
+                $choice = { rank => CONTAINMENT, kind => 'containment',
+                            expression => $expression,
+                            path => $container->[1] } if $container;
+                last if $choice;
+            }
+        } elsif ($am eq 'btree' and @fields
+                 or $am eq 'hash' and @fields == 1 and $single) {
+            $choice = _comparison(_bare($fields[0]->expression), $best,
+                                  $single);
+        }
+        next unless $choice and $choice->{rank} > $best->{rank};
+        $best = { %$best, %$choice, index => $index->indexname };
+    }
+    return $best;
+}
+
+# internal function _comparison($expression, $choice, $single)
+#
+# Returns how a b-tree or hash index on the expression can be used for the
+# field, if at all.
+
+sub _comparison {
+    my ($expression, $choice, $single) = @_;
+    my $numeric = grep { _numeric_range($_) } @{$choice->{values}};
+    return { rank => EXACT, kind => 'text', expression => $expression }
+        if $expression eq $choice->{text} and not $numeric;
+    return { rank => JSON_EQUALITY, kind => 'json',
+             expression => $expression }
+        if $expression eq $choice->{json} and $single;
+    return unless $expression =~ /^(.*)::\s*("?)([a-z][\w ]*?)\2\z/is;
+    my ($base, $type) = (_bare($1), lc $3);
+    my $valid = $base eq $choice->{json} ? $json_casts{$type}
+              : $base eq $choice->{text} ? $text_casts{$type}
+              : undef;
+    return unless $valid;
+    return if $numeric and not grep { $valid == $_ } $integer, $number;
+    for my $value (@{$choice->{values}}) {
+        return if grep { defined $_ and $_ !~ $valid }
+                  map { $value->{$_} } qw(value from to);
+    }
+    return { rank => EXACT, kind => 'cast', expression => $expression };
+}
+
+# internal function _predicate($dbh, $choice)
+#
+# Returns the condition for a filter.
+
+sub _any { '(' . join(' OR ', @_) . ')' }
+
+sub _condition {
+    my ($dbh, $expression, $value) = @_;
+    return "$expression = " . $dbh->quote($value->{value})
+        if exists $value->{value};
+    my @range;
+    push @range, "$expression >= " . $dbh->quote($value->{from})
+        if defined $value->{from};
+    push @range, "$expression <= " . $dbh->quote($value->{to})
+        if defined $value->{to};
+    return @range ? join(' AND ', @range) : "$expression IS NOT NULL";
+}
+
+# ranges between numbers, which compare as numbers whatever the index
+sub _numeric_range {
+    my ($value) = @_;
+    return 0 if exists $value->{value};
+    my @ends = grep { defined } @{$value}{qw(from to)};
+    return @ends && !grep { $_ !~ $number } @ends;
+}
+
+# the JSON values a query value can stand for
+sub _json_values {
+    my ($value) = @_;
+    my @json = (JSON->new->allow_nonref->encode("$value"));
+    push @json, $value
+        if $value =~ /^-?(?:0|[1-9]\d*)(?:\.\d+)?(?:[eE][-+]?\d+)?\z/
+           or $value =~ $boolean;
+    return @json;
+}
+
+sub _predicate {
+    my ($dbh, $choice) = @_;
+    my $kind = $choice->{kind};
+    my @values = @{$choice->{values}};
+    return _any(map { _condition($dbh, "($choice->{expression})", $_) }
+                @values)
+        if $kind eq 'text' or $kind eq 'cast';
+
+    my $json = $choice->{json};
+    my $recheck = _any(map {
+        _condition($dbh, _numeric_range($_)
+                         ? "(CASE WHEN jsonb_typeof($json) = 'number'"
+                           . " THEN ($json)::numeric END)"
+                         : "($json #>> '{}')", $_)
+    } @values);
+    return $recheck if $kind eq 'scan';
+    my @json = map { _json_values($_->{value}) } @values;
+    if ($kind eq 'containment') {
+        my $encoder = JSON->new->allow_nonref->canonical;
+        @json = map { my $doc = $encoder->decode($_);
+                      $doc = { $_ => $doc } for reverse @{$choice->{path}};
+                      $encoder->encode($doc) } @json;
+    }
+    my $operator = $kind eq 'containment' ? '@>' : '=';
+    return _any(map { "($choice->{expression}) $operator "
+                      . $dbh->quote($_) . '::jsonb' } @json)
+         . " AND $recheck";
+}
+
+__PACKAGE__->meta->make_immutable;
+
+# vim:ts=4:sw=4:expandtab
@@ -178,6 +178,14 @@ retrieved.
 dbmethod get => (funcname => 'get_index', arg_list => ['indexname'],
     returns_objects => 1);
 
+=head2 @indexes = Bagger::Storage::Index->list() - all indexes
+
+Returns all indexes, including expired ones, in name order.
+
+=cut
+
+dbmethod list => (funcname => 'list_indexes', returns_objects => 1);
+
 =head2 $newindex = $index->save()
 
 This function saves the index (if no id set yet) and all fields where id is
@@ -232,20 +240,37 @@ sub expire {
     return $self->new(%{$retval}, fields => $self->fields);
 }
 
-=head2 $create_statement = $index->create_statement($schema_name, $table_name)
+=head2 $create_statement = $index->create_statement($schema_name, $table_name, %opts)
 
 This function generates a CREATE INDEX statement from the current object.
 
 This is intended to be useful for backfilling indexes onto older partitions and
-is unlikely to be called routinely.
+is unlikely to be called routinely.  See C<Bagger::Agent::Storage::Backfill>.
+
+Options are:
+
+=over
+
+=item concurrently
+
+If true, the statement is C<CREATE INDEX CONCURRENTLY>.
+
+=item at
+
+A C<Bagger::Type::DateTime> at which the index and its fields must be valid,
+normally the hour of the partition.  Defaults to now.
+
+=back
+
+Returns an empty string if the index is not valid at that time.
 
 =cut
 
 sub create_statement {
-    my ($self, $schema_name, $table_name) = @_;
+    my ($self, $schema_name, $table_name, %opts) = @_;
     croak 'Must supply a schema_name to create_statement' unless $schema_name;
     croak 'Must supply a table_name to create_statement' unless $table_name;
-    return "" unless $self->in_time_bounds;
+    return "" unless $self->in_time_bounds($opts{at});
     croak "Index must have fields added first" unless $self->next_ordinal;
 
     my $idx_name    = $self->_dbh->quote_identifier(
@@ -255,14 +280,16 @@ sub create_statement {
 
     my $field_str   = join ',',
                    map { '(' . $_->expression . ')' } # indexes require this extra paren set
-                   grep { $_->in_time_bounds }
+                   grep { $_->in_time_bounds($opts{at}) }
                    sort { $a->ordinality <=> $b->ordinality }
                    @{$self->fields};
 
-    my $stmt =  "CREATE INDEX $idx_name ON $schema_name.$table_name ".
-           "($field_str) using " . $self->access_method;
+    my $stmt = 'CREATE INDEX ' . ($opts{concurrently} ? 'CONCURRENTLY ' : '')
+             . "$idx_name ON $schema_name.$table_name USING "
+             . $self->access_method . " ($field_str)";
     $stmt .= " TABLESPACE " .
            $self->_dbh->quote_identifier($self->tablespc) if $self->tablespc;
+    return $stmt;
 }
 
 __PACKAGE__->meta->make_immutable;
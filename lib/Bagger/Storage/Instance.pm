@@ -101,6 +101,25 @@ for more on this.  This should not be set on new nodes.
 
 has status => (is => 'ro', isa => 'Int', default => 0);
 
+=head2 weight
+
+The relative capacity of the instance, a positive integer.  Servermaps place
+ingest on instances in proportion to their weight.  Defaults to 1.
+
+=cut
+
+has weight => (is => 'ro', isa => 'Int', default => 1);
+
+=head2 rack
+
+The failure domain of the instance, such as a rack or availability zone.
+Servermaps keep copies of data in different failure domains where they can.
+Optional.  If not set, the host is the failure domain.
+
+=cut
+
+has rack => (is => 'ro', isa => 'Maybe[Str]');
+
 =head2 can_read
 
 This indicates whether the node can be queried.  This is generated from
@@ -130,6 +149,22 @@ sub _can_write {
     return bool($self->status & F_WRITE);
 }
 
+=head2 dsn
+
+The DBI data source for the Bagger database on the instance, as used for
+C<cnx>.  Read from the C<bagger_db> config key on first use.
+
+=cut
+
+has dsn => (is => 'ro', isa => 'Str', lazy => 1, builder => '_build_dsn');
+
+sub _build_dsn {
+    my $self = shift;
+    my $dbname = Bagger::Storage::Config->get('bagger_db')->value_string;
+    return "dbi:Pg:host=" . $self->host . ";port=" . $self->port .
+        ";dbname=" . ($dbname // 'bagger');
+}
+
 =head2 cnx
 
 This is a database connection to the host instance itself.  It is used for
@@ -139,10 +174,8 @@ interacting with the storage nodes.
 
 sub _build_cnx {
     my $self = shift;
-    my $dbname = Bagger::Storage::Config->get('bagger_db')->value_string;
-    return DBI->connect("dbi:Pg:host=" . $self->host . ";port=" . $self->port .
-        ";dbname=" . ($dbname // 'bagger'),
-        $self->username, undef, { AutoCommit => 0, RaiseError => 1 });
+    return DBI->connect($self->dsn, $self->username, undef,
+                        { AutoCommit => 0, RaiseError => 1 });
 }
 
 has cnx => (is => 'ro', lazy => 1, builder => '_build_cnx', isa => 'DBI::db');
@@ -212,6 +245,17 @@ sub export {
     return { id => $self->id, host => $self->host, port => $self->port }
 }
 
+=head2 failure_domain
+
+Returns the rack, or the host if no rack is set.
+
+=cut
+
+sub failure_domain {
+    my ($self) = @_;
+    return $self->rack // $self->host;
+}
+
 =head2 TO_JSON()
 
 Exports a full copy of the object as a hashref for JSON serialization
@@ -57,6 +57,9 @@ In this implementation, database handles will be created
 lazily on the first use and reused as a singleton within this
 module.
 
+A forked child leaves the handle it inherits to its parent,
+and must connect again before using the database.
+
 =cut
 
 {
@@ -71,7 +74,7 @@ sub _new_dbh() {
             Bagger::Storage::LenkwerkSetup->dbi_str,
             Bagger::Storage::LenkwerkSetup->dbuser,
             Bagger::Storage::LenkwerkSetup->dbpass,
-            {AutoCommit => 0, RaiseError => 1 })
+            {AutoCommit => 0, RaiseError => 1, AutoInactiveDestroy => 1 })
                or die Bagger::Type::Exception::DB->new();
    return $dbh;
 }
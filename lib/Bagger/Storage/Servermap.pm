@@ -23,6 +23,9 @@ use strict;
 use warnings;
 use Moose;
 use namespace::autoclean;
+use Carp 'croak';
+use Scalar::Util 'refaddr';
+use Bagger::Storage::Config;
 use Bagger::Storage::Instance;
 use Bagger::Type::JSON;
 use PGObject::Util::DBMethod;
@@ -37,7 +40,9 @@ both ingestion management and query building.
 
 Unlike more dynamic distributed data environments, Bagger's network data
 distribution is fixed at the point of ingestion.  No provisions for moving
-data around are present.  These are not C<Bagger::Storage::Time_Bound>
+data around are present, so a new servermap only changes where new data goes.
+New servermaps are still placed to change as little as possible, since every
+entry which changes means a restart of its Schaufel.  These are not C<Bagger::Storage::Time_Bound>
 however because they are chaos-sharded and so servermaps do not need to
 respect partition boundaries.
 
@@ -80,51 +85,389 @@ user but not always used.
 This produces the hash data for the server_map and sets up the serialization to
 JSON.
 
-As of this version, we use a simple circular algorith where a copy of the data
-is stored on a different physical host in a circle.
+The map is placed from all registered instances by C<placement> below, with
+the replication factor from the C<replication_factor> config key (default 2),
+starting from the most recent servermap so that as little as possible changes
+between generations.
 
-For version 1, only a replication factor of 2 is supported.
-
-Version 1 of the servermap has a structure as follows
+Version 2 of the servermap has a structure as follows
 
  {
-    host1_port1 => { shaulfel => { host info},
-                     copies   => { [
-                                      { primary host info } ,
-                                      { seconary host info }
-                                     ] }
+    version     => 2,
+    replication => 2,
+    host1_port1 => { schaufel => { host info },
+                     copies   => [ { primary host info },
+                                   { replica host info },
+                                   ...
+                                 ],
+                     scale    => 0.75,
+                   },
+    host1_port1_2 => { ... },
     ...
  }
 
+There is one entry for each unit of an instance's weight, keyed by the
+instance's host and port, and from the second unit on by the unit's number as
+well.  The instance runs a Schaufel for each of its entries and holds their
+primary copies.  The other copies of each entry are placed on their own, so
+the replicas of a heavy instance are spread over several others.  C<scale> is
+one over the average weight, by which each Schaufel's share of the Kafka topic
+is scaled.
+
+Version 1 servermaps had the same entries, without C<scale>, and only two
+copies in a circle of hosts.
+
+If the C<servermap_mode> config key is C<ring>, this dies.  Ring mode
+servermaps, see C<ring_map> below, cannot be ingested until Schaufel or the
+ingestion trigger apply ring placement, and storage agents refuse to start
+with one, so saving one would halt ingestion.
+
 =cut
 
-# Not the most computationally efficient approach but this isn't a frequent
-# task.
+sub _config {
+    my ($key, $default) = @_;
+    my $config = Bagger::Storage::Config->get($key);
+    return $config ? $config->value_string : $default;
+}
 
 sub generate_server_map {
     my ($self) = @_;
-    my @hosts = sort { $a->host cmp $b->host } Bagger::Storage::Instance->list;
-    my $rotate = $self->call_procedure(funcname => 'servermap_rotate_num');
-    ($rotate) = values %$rotate;
-    my $first = $hosts[0];
-    my $primaries = [@hosts];
-    my $secondaries = [@hosts]; # independent copies
-    # Rotate physical hosts
-    for (1 .. $rotate){
-        my $s = shift @$secondaries;
-        push @$secondaries, $s;
+    my $replication = _config('replication_factor', 2);
+    croak 'Ring mode servermaps cannot be ingested yet, '
+        . 'set servermap_mode to the default'
+        if _config('servermap_mode', '') eq 'ring';
+    my $previous = $self->most_recent;
+    my $map = $self->placement(
+        instances   => [ Bagger::Storage::Instance->list ],
+        replication => $replication,
+        previous    => $previous ? $previous->server_map : undef,
+    );
+    return Bagger::Type::JSON->new($map);
+}
+
+=item placement(instances => [...], replication => $n, previous => $map)
+
+Returns a version 2 servermap hashref for the instances, a list of
+C<Bagger::Storage::Instance> objects, with C<replication> copies of the data
+of each entry.  This does not touch the database.
+
+Each instance is the primary of one entry per unit of its weight, so it takes a
+share of ingest in proportion to its weight.  Each instance should then hold
+replication times its weight in copies.  The other copies of each entry are
+placed as follows:
+
+=over
+
+=item 1
+
+Copies on the same instances as in C<previous>, if given, are kept as long as
+the instance does not go over its share and no other copy of the entry is in
+its failure domain.
+
+=item 2
+
+Missing copies are placed on the least loaded instance for its weight, in a
+failure domain not yet used by the entry.  If there is none, a host not yet used
+is taken, and then any other instance.  Ties go to the instance following the
+primary in host and port order, so equal instances without a previous map get
+the circle of version 1.
+
+=item 3
+
+Copies are then moved from the most to the least loaded instance, while this
+evens out the load without putting two copies in one failure domain.
+
+=back
+
+Dies if there are fewer instances than copies.
+
+=cut
+
+sub _smap_key { join('_', $_[0]->host, $_[0]->port) }
+
+sub placement {
+    my ($self, %args) = @_;
+    my @instances = sort { $a->host cmp $b->host or $a->port <=> $b->port }
+                    @{$args{instances}};
+    my $replication = $args{replication} // 2;
+    croak "Replication factor must be at least 1" if $replication < 1;
+    croak "Need at least $replication instances for $replication copies"
+        if @instances < $replication;
+
+    my %by_key = map { _smap_key($_) => $_ } @instances;
+    my %pos;
+    @pos{map { _smap_key($_) } @instances} = (0 .. $#instances);
+    my %load = map { _smap_key($_) => $_->weight } @instances;
+    my %target = map { _smap_key($_) => $replication * $_->weight }
+                 @instances;
+
+    # one entry per unit of weight, each with a share of one
+    my (@entries, %primary, %unit);
+    for my $key (map { _smap_key($_) } @instances) {
+        for my $n (1 .. $by_key{$key}->weight) {
+            my $entry = $n == 1 ? $key : "${key}_$n";
+            push @entries, $entry;
+            $primary{$entry} = $key;
+            $unit{$entry} = $n;
+        }
+    }
+    my %copies = map { $_ => [ $primary{$_} ] } @entries;
+
+    my $ratio = sub { $load{$_[0]} / $by_key{$_[0]}->weight };
+    my $domain = sub { $by_key{$_[0]}->failure_domain };
+    # number of failure domains in a list of keys
+    my $domains = sub { my %d = map { $domain->($_) => 1 } @_; scalar keys %d };
+
+    # 1. keep previous copies
+    my $previous = $args{previous} // {};
+    for my $key (@entries) {
+        my $entry = $previous->{$key};
+        next unless ref $entry eq 'HASH';
+        for my $copy (@{$entry->{copies} // []}) {
+            last if @{$copies{$key}} >= $replication;
+            my $ckey = join('_', $copy->{host}, $copy->{port});
+            next unless $by_key{$ckey};
+            next if grep { $_ eq $ckey } @{$copies{$key}};
+            next if grep { $domain->($_) eq $domain->($ckey) }
+                    @{$copies{$key}};
+            next if $load{$ckey} + 1 > $target{$ckey};
+            push @{$copies{$key}}, $ckey;
+            $load{$ckey} += 1;
+        }
+    }
+
+    # 2. fill missing copies, entries of the heaviest instances first
+    for my $key (sort { $by_key{$primary{$b}}->weight
+                            <=> $by_key{$primary{$a}}->weight
+                        or $unit{$a} <=> $unit{$b}
+                        or $pos{$primary{$a}} <=> $pos{$primary{$b}} }
+                 @entries) {
+        my $after = sub {
+            ($pos{$_[0]} - $pos{$primary{$key}}) % @instances
+        };
+        while (@{$copies{$key}} < $replication) {
+            my %used = map { $_ => 1 } @{$copies{$key}};
+            my %used_domain = map { $domain->($_) => 1 } @{$copies{$key}};
+            my %used_host = map { $by_key{$_}->host => 1 } @{$copies{$key}};
+            my @free = grep { not $used{$_} } keys %by_key;
+            my @candidates = grep { not $used_domain{$domain->($_)} } @free;
+            @candidates = grep { not $used_host{$by_key{$_}->host} } @free
+                unless @candidates;
+            @candidates = @free unless @candidates;
+            my ($best) = sort { $ratio->($a) <=> $ratio->($b)
+                                or $after->($a) <=> $after->($b) }
+                         @candidates;
+            push @{$copies{$key}}, $best;
+            $load{$best} += 1;
+        }
+    }
+
+    # 3. even out the load.  Each move strictly lowers the load of the most
+    # loaded instance it takes from, so this ends.
+    my $moves = 0;
+    MOVE: while ($moves++ < @entries * $replication) {
+        my @order = sort { $ratio->($b) <=> $ratio->($a)
+                           or $pos{$a} <=> $pos{$b} } keys %by_key;
+        for my $from (@order) {
+            for my $to (reverse @order) {
+                last if $ratio->($to) >= $ratio->($from);
+                for my $key (@entries) {
+                    my @c = @{$copies{$key}};
+                    next if $c[0] eq $from; # primaries stay
+                    next unless grep { $_ eq $from } @c;
+                    next if grep { $_ eq $to } @c;
+                    # only if both end up no more loaded than $from was
+                    next if ($load{$to} + 1) / $by_key{$to}->weight
+                            >= $ratio->($from);
+                    my @moved = map { $_ eq $from ? $to : $_ } @c;
+                    next if $domains->(@moved) < $domains->(@c);
+                    $copies{$key} = \@moved;
+                    $load{$from} -= 1;
+                    $load{$to} += 1;
+                    next MOVE;
+                }
+            }
+        }
+        last;
+    }
+
+    my $mean = 0;
+    $mean += $_->weight for @instances;
+    $mean /= @instances;
+    my $servmap = { version => 2, replication => $replication };
+    for my $key (@entries) {
+        $servmap->{$key} = {
+            schaufel => $by_key{$primary{$key}}->export,
+            copies   => [ map { $by_key{$_}->export } @{$copies{$key}} ],
+            scale    => 1 / $mean,
+        };
+    }
+    return $servmap;
+}
+
+=item ring_map(instances => [...], replication => $n, vnodes => $n)
+
+Returns a version 3, or ring mode, servermap hashref for the instances.  This
+does not touch the database.
+
+In ring mode data is not tied to entries.  Each partition is placed on its own,
+by its name, which stands for the dimension labels and the hour, on a
+consistent hash ring.  So the hours of one busy set of labels are spread over
+the whole cluster, and adding an instance moves only about its share of the
+partitions to it, instead of changing the entries of other instances.
+
+The map lists the instances, in host and port order, as follows:
+
+ {
+    version     => 3,
+    mode        => 'ring',
+    replication => 2,
+    vnodes      => 64,
+    nodes       => [ { id => 1, host => 'host1', port => 5432, weight => 1,
+                       domain => 'rack1' },
+                     ...
+                   ],
+ }
+
+Each row belongs on the copies C<ring_lookup> returns for its partition.  The
+same lookup is available on the storage nodes as
+C<storage.bagger_placement(servermap, partition)>, and both follow
+C<src/placement.c> in the trigger extension.  Nothing ingests by this
+placement yet, so the storage agent refuses ring mode servermaps, and they are
+only used for placing and querying data.
+
+Dies if there are fewer instances than copies, or more than 8 copies.
+
+=cut
+
+use constant RING_MAX_REPLICAS => 8;
+
+sub ring_map {
+    my ($self, %args) = @_;
+    my @instances = sort { $a->host cmp $b->host or $a->port <=> $b->port }
+                    @{$args{instances}};
+    my $replication = $args{replication} // 2;
+    my $vnodes = $args{vnodes} // 64;
+    croak "Replication factor must be between 1 and " . RING_MAX_REPLICAS
+        if $replication < 1 or $replication > RING_MAX_REPLICAS;
+    croak "Need at least $replication instances for $replication copies"
+        if @instances < $replication;
+    croak "Virtual nodes must be at least 1" if $vnodes < 1;
+    return {
+        version     => 3,
+        mode        => 'ring',
+        replication => $replication,
+        vnodes      => $vnodes,
+        nodes       => [ map { { %{$_->export}, weight => $_->weight,
+                                 domain => $_->failure_domain } }
+                         @instances ],
+    };
+}
+
+=item ring_lookup($partition, $map)
+
+Returns the nodes of a ring mode servermap holding the partition, as in the
+map, the primary first.  $map defaults to this servermap's map.
+
+Each node owns weight * vnodes points on the ring, at the hashes of
+C<host_port#i>.  The partition goes to the nodes owning the first points at or
+after its hash, going around the ring, skipping nodes already taken and, while
+there are others, nodes in a failure domain already taken.
+
+The ring of the last map looked up is kept.
+
+=cut
+
+my $last_ring = { map => undef };
+
+sub ring_lookup {
+    my ($self, $partition, $map) = @_;
+    $map //= $self->server_map;
+    croak 'Servermap is not in ring mode' unless ($map->{mode} // '') eq 'ring';
+    my $nodes = $map->{nodes};
+    unless ($last_ring->{map} and refaddr($last_ring->{map}) == refaddr($map)) {
+        my @points;
+        for my $n (0 .. $#$nodes) {
+            my $name = join('_', $nodes->[$n]{host}, $nodes->[$n]{port});
+            push @points, map { [ $self->placement_hash("$name#$_"), $n ] }
+                          0 .. $nodes->[$n]{weight} * $map->{vnodes} - 1;
+        }
+        @points = sort { $a->[0] <=> $b->[0] or $a->[1] <=> $b->[1] } @points;
+        $last_ring = { map => $map, points => \@points };
     }
-    my $servmap = { version => 1 };
-    for (@hosts) {
-        my $primary = shift @$primaries;
-        my $secondary = shift @$secondaries;
-        my $keystr = join('_', $primary->host, $primary->port);
-        $servmap->{$keystr} = { schaufel => $primary->export,
-                                copies   => [ $primary->export,
-                                              $secondary->export, ],
-                              }
+    my $points = $last_ring->{points};
+    return unless @$points;
+
+    # first point at or after the key
+    my $hash = $self->placement_hash($partition);
+    my ($lo, $hi) = (0, scalar @$points);
+    while ($lo < $hi) {
+        my $mid = int(($lo + $hi) / 2);
+        if ($points->[$mid][0] < $hash) {
+            $lo = $mid + 1;
+        } else {
+            $hi = $mid;
+        }
     }
-    return Bagger::Type::JSON->new($servmap);
+
+    # once around for new failure domains, and once for any other node
+    my $replication = $map->{replication};
+    $replication = RING_MAX_REPLICAS if $replication > RING_MAX_REPLICAS;
+    my @found;
+    for my $pass (0, 1) {
+        for my $step (0 .. $#$points) {
+            last if @found >= $replication;
+            my $node = $nodes->[$points->[($lo + $step) % @$points][1]];
+            next if grep { $_ == $node } @found;
+            next if not $pass
+                and grep { $_->{domain} eq $node->{domain} } @found;
+            push @found, $node;
+        }
+    }
+    return @found;
+}
+
+=item placement_hash($string)
+
+Returns the 64 bit ring position of a string: FNV-1a followed by the
+MurmurHash3 finalizer, as C<placement_hash()> in C<src/placement.c>.  Needs a
+Perl with 64 bit integers.
+
+=cut
+
+use constant {
+    FNV_OFFSET_BASIS => 14695981039346656037,
+    FNV_PRIME        => 1099511628211,
+    MASK32           => 0xffffffff,
+};
+
+# 64 bit multiplication, wrapping as in C, in 32 bit halves so that no
+# product leaves the integers
+sub _mul64 {
+    my ($x, $y) = @_;
+    my ($xh, $xl) = ($x >> 32, $x & MASK32);
+    my ($yh, $yl) = ($y >> 32, $y & MASK32);
+    my $lo = $xl * $yl;
+    my $hi = (($lo >> 32) + (($xh * $yl) & MASK32) + (($xl * $yh) & MASK32))
+             & MASK32;
+    return ($hi << 32) | ($lo & MASK32);
+}
+
+sub _fmix64 {
+    my ($k) = @_;
+    $k ^= $k >> 33;
+    $k = _mul64($k, 18397679294719823053);
+    $k ^= $k >> 33;
+    $k = _mul64($k, 14181476777654086739);
+    $k ^= $k >> 33;
+    return $k;
+}
+
+sub placement_hash {
+    my ($self, $data) = @_;
+    my $hash = FNV_OFFSET_BASIS;
+    $hash = _mul64($hash ^ $_, FNV_PRIME) for unpack('C*', $data);
+    return _fmix64($hash);
 }
 
 =item save
@@ -165,15 +165,18 @@ sub expire_proxy {
     return $self->new(%$self, valid_until => $self->next_expiration_date);
 }
 
-=head1 in_time_bounds
+=head1 in_time_bounds($at)
 
 Returns 1 if the current time is between the valid_from and valid_until times
 
+If $at (a C<Bagger::Type::DateTime>) is given, it is checked instead of the
+current time.
+
 =cut
 
 sub in_time_bounds {
-    my $self = shift;
-    my $now = Bagger::Type::DateTime->now();
+    my ($self, $at) = @_;
+    my $now = $at // Bagger::Type::DateTime->now();
     return ($self->valid_from <= $now)
         && ($self->valid_until > $now);
     return 1;
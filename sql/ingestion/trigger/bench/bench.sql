@@ -0,0 +1,131 @@
+-- Routing micro-benchmark for the bagger ingestion trigger.
+--
+-- Run with make bench, which installs the module with the benchmark
+-- functions of src/bench.c linked in, creates a scratch database, installs
+-- the extensions, and runs this file.  Plain builds of the module leave the
+-- benchmark functions out, so they are declared here rather than in the
+-- extension.
+--
+-- Each scenario sets up dimensions, reconnects so that the backend loads
+-- them, and routes a synthetic corpus with bagger_bench.routing().
+-- The corpora vary in:
+--
+--   width        filler keys per document besides the dimensions
+--   depth        nesting depth of the dimension fields
+--   dims         number of dimensions
+--   cardinality  number of distinct partitions the corpus routes to
+--
+-- Results are collected and printed at the end, followed by the throughput
+-- of the raw message checks over the baseline corpus.
+
+\set ON_ERROR_STOP 1
+\set QUIET 1
+\o /dev/null
+
+CREATE EXTENSION IF NOT EXISTS bagger_trigger CASCADE;
+CREATE SCHEMA bagger_bench;
+
+CREATE TABLE bagger_bench.results (
+    scenario text,
+    width int,
+    depth int,
+    dims int,
+    cardinality int,
+    cache_size int,
+    rows bigint,
+    name_ns_per_row numeric,
+    ns_per_row numeric,
+    rows_per_sec numeric,
+    ctx_bytes_per_row numeric
+);
+
+CREATE FUNCTION bagger_bench.routing
+(docs jsonb[], loops int,
+ OUT rows bigint, OUT name_ns_per_row float8, OUT ns_per_row float8,
+ OUT rows_per_sec float8, OUT ctx_bytes_per_row float8)
+RETURNS record
+AS '$libdir/bagger_data', 'bagger_bench_routing'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION bagger_bench.validate
+(message bytea, loops int, OUT bytes bigint, OUT gb_per_sec float8)
+RETURNS record
+AS '$libdir/bagger_data', 'bagger_bench_validate'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION bagger_bench.nest(in_obj jsonb, in_depth int)
+RETURNS jsonb LANGUAGE SQL IMMUTABLE
+RETURN CASE WHEN in_depth <= 1 THEN in_obj
+            ELSE jsonb_build_object('nest',
+                                    bagger_bench.nest(in_obj, in_depth - 1))
+       END;
+
+CREATE FUNCTION bagger_bench.pointer(in_depth int, in_dim int)
+RETURNS text LANGUAGE SQL IMMUTABLE
+RETURN '/' || repeat('nest/', in_depth - 1) || 'd' || in_dim;
+
+CREATE FUNCTION bagger_bench.docs
+(in_rows int, in_width int, in_depth int, in_dims int, in_cardinality int)
+RETURNS jsonb[] LANGUAGE SQL
+BEGIN ATOMIC
+SELECT array_agg(
+           coalesce((SELECT jsonb_object_agg('f' || f, repeat('x', 16))
+                       FROM generate_series(1, in_width) f), '{}')
+           || jsonb_build_object('timestamp',
+                                 '2024-01-01T03:' || lpad((i % 60)::text, 2, '0')
+                                 || ':00Z')
+           || bagger_bench.nest(
+                  (SELECT jsonb_object_agg('d' || d,
+                                           'v' || ((i + d) % in_cardinality))
+                     FROM generate_series(1, in_dims) d),
+                  in_depth))
+  FROM generate_series(1, in_rows) i;
+END;
+
+\set rows 10000
+\set loops 10
+
+\set scenario baseline
+\set width 10
+\set depth 1
+\set dims 2
+\set cardinality 10
+\set cache_size 1024
+\ir scenario.sql
+
+\set scenario wide
+\set width 200
+\ir scenario.sql
+
+\set scenario deep
+\set width 10
+\set depth 8
+\ir scenario.sql
+
+\set scenario many_dims
+\set depth 1
+\set dims 8
+\ir scenario.sql
+
+\set scenario high_cardinality
+\set dims 2
+\set cardinality 1000
+\ir scenario.sql
+
+\set scenario cache_thrash
+\set cache_size 100
+\ir scenario.sql
+
+\o
+\unset QUIET
+SELECT scenario, width, depth, dims, cardinality, cache_size,
+       round(name_ns_per_row) AS name_ns_row, round(ns_per_row) AS ns_row,
+       round(rows_per_sec) AS rows_sec,
+       round(ctx_bytes_per_row, 1) AS ctx_bytes_row
+  FROM bagger_bench.results;
+
+SELECT pg_size_pretty(bytes) AS checked, round(gb_per_sec::numeric, 2) AS gb_sec
+  FROM bagger_bench.validate(
+           (SELECT convert_to(string_agg(d::text, E'\n'), 'UTF8')
+              FROM unnest(bagger_bench.docs(:rows, 10, 1, 2, 10)) d),
+           100);
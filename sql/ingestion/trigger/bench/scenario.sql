@@ -0,0 +1,16 @@
+-- One benchmark scenario, see bench.sql for the variables used.
+
+DELETE FROM storage.dimension;
+SELECT storage.append_dimension(bagger_bench.pointer(:depth, d),
+                                NULL, NULL, NULL)
+  FROM generate_series(1, :dims) d;
+
+-- dimensions are loaded once per backend
+\connect
+SET bagger.plan_cache_size = :cache_size;
+
+INSERT INTO bagger_bench.results
+SELECT :'scenario', :width, :depth, :dims, :cardinality, :cache_size, b.*
+  FROM bagger_bench.routing(
+           bagger_bench.docs(:rows, :width, :depth, :dims, :cardinality),
+           :loops) b;
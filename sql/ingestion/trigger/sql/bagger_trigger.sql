@@ -0,0 +1,200 @@
+---------------------
+-- Plan cache
+---------------------
+
+CREATE FUNCTION storage.bagger_plan_cache_stats
+(OUT hits bigint, OUT misses bigint, OUT invalidations bigint,
+ OUT evictions bigint, OUT entries bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'bagger_plan_cache_stats'
+LANGUAGE C STRICT VOLATILE;
+
+COMMENT ON FUNCTION storage.bagger_plan_cache_stats() IS
+$$ Returns the insert plan cache counters for the current backend.  Counters
+are kept for the life of the backend.  Invalidations count cached plans marked
+stale by relcache invalidations; most of these are revalidated without being
+prepared again.$$;
+
+---------------------
+-- Statistics
+---------------------
+
+CREATE FUNCTION storage.bagger_trigger_stats
+(OUT pid int, OUT rows_routed bigint, OUT cache_hits bigint,
+ OUT cache_misses bigint, OUT cache_evictions bigint,
+ OUT cache_invalidations bigint, OUT partitions_not_found bigint,
+ OUT partitions_created bigint, OUT rows_dead_lettered bigint,
+ OUT extract_time float8,
+ OUT insert_time float8, OUT shared boolean)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'bagger_trigger_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW storage.bagger_trigger_stats AS
+SELECT * FROM storage.bagger_trigger_stats();
+
+COMMENT ON FUNCTION storage.bagger_trigger_stats() IS
+$$ Returns the routing counters of each backend which has used the trigger,
+for the life of the backend.  Times are in milliseconds; extract_time is spent
+building partition names and insert_time writing rows.  partitions_created
+counts calls to storage.create_partition(), including those which found the
+partition already created by another backend.  rows_dead_lettered counts rows
+written to storage.dead_letter instead of a partition.
+
+Other backends can only be seen when bagger_data is in
+shared_preload_libraries.  Otherwise only the current backend is returned, with
+shared set to false.$$;
+
+CREATE FUNCTION storage.bagger_trigger_partition_stats
+(OUT partition text, OUT rows bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'bagger_trigger_partition_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW storage.bagger_trigger_partition_stats AS
+SELECT * FROM storage.bagger_trigger_partition_stats();
+
+COMMENT ON FUNCTION storage.bagger_trigger_partition_stats() IS
+$$ Returns the number of rows routed to each partition.  Counts are merged at
+the end of each statement.  At most bagger.stats_max_partitions partitions are
+tracked, and rows for partitions beyond that are returned with a null
+partition.$$;
+
+CREATE FUNCTION storage.bagger_trigger_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'bagger_trigger_stats_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION storage.bagger_trigger_stats_reset() FROM PUBLIC;
+
+COMMENT ON FUNCTION storage.bagger_trigger_stats_reset() IS
+$$ Zeroes the counters of all backends and clears the partition counts.$$;
+
+---------------------
+-- Shared catalog
+---------------------
+
+CREATE FUNCTION storage.bagger_catalog_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'bagger_catalog_changed'
+LANGUAGE C;
+
+COMMENT ON FUNCTION storage.bagger_catalog_changed() IS
+$$ Statement trigger on the configuration loaded by the ingestion trigger.
+When the transaction commits, ingestion backends load the new dimensions at
+their next row, through the configuration generation in shared memory when
+bagger_data is in shared_preload_libraries and through relcache invalidation
+otherwise.  New dimensions take effect at the hour in their valid_from.$$;
+
+CREATE TRIGGER bagger_catalog_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON storage.dimension
+FOR EACH STATEMENT EXECUTE FUNCTION storage.bagger_catalog_changed();
+
+CREATE TRIGGER bagger_catalog_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON storage.config
+FOR EACH STATEMENT EXECUTE FUNCTION storage.bagger_catalog_changed();
+
+---------------------
+-- Dead letters
+---------------------
+
+CREATE TABLE storage.dead_letter (
+    received_at timestamptz NOT NULL DEFAULT now(),
+    reason text NOT NULL,
+    partition text,
+    doc_timestamp text,
+    doc jsonb,
+    message bytea,
+    CHECK (doc IS NOT NULL OR message IS NOT NULL)
+);
+
+CREATE INDEX dead_letter_received_at_idx ON storage.dead_letter
+ USING brin (received_at);
+
+SELECT pg_catalog.pg_extension_config_dump('storage.dead_letter', '');
+
+COMMENT ON TABLE storage.dead_letter IS
+$$ Inbound rows which could not be routed, with the reason, when bagger.on_error
+is dead_letter.  The rest of the inbound statement goes on and commits.
+
+Rows which could be parsed have the document in doc, with its timestamp field
+as text in doc_timestamp and the partition it was meant for, if it got that
+far, in partition.  Raw messages which could not be parsed are kept in message
+as the bytes received.  received_at is when the row was diverted.$$;
+
+CREATE FUNCTION storage.bagger_check_message(message bytea)
+RETURNS text
+AS 'MODULE_PATHNAME', 'bagger_check_message'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+COMMENT ON FUNCTION storage.bagger_check_message(bytea) IS
+$$ Returns why the message would be rejected by the inbound checks, and where,
+or null if it passes.  Messages must be valid UTF-8 without null bytes or the
+\u0000, \uFFFE, and \uFEFF escapes.  Whether the message is valid JSON is not
+checked.$$;
+
+---------------------
+-- Ring placement
+---------------------
+
+CREATE FUNCTION storage.bagger_placement(servermap jsonb, key text)
+RETURNS int[]
+AS 'MODULE_PATHNAME', 'bagger_placement'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+COMMENT ON FUNCTION storage.bagger_placement(jsonb, text) IS
+$$ Returns the ids of the postgres instances holding key, normally a partition
+name, on a ring mode servermap, the primary first.  Placement is the same as in
+Schaufel and Bagger::Storage::Servermap::ring_lookup().$$;
+
+---------------------
+-- Routing triggers
+---------------------
+
+CREATE FUNCTION storage.bagger_route_row()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'bagger_route_row'
+LANGUAGE C;
+
+COMMENT ON FUNCTION storage.bagger_route_row() IS
+$$ BEFORE INSERT FOR EACH ROW trigger for the inbound table.  This routes
+each document to its partition and skips the insert into the inbound table.
+
+The bagger.routing_mode setting selects whether rows are written as they
+arrive through SPI (row), buffered until the end of the statement (batch), or
+written to the partition directly without SPI (direct).  Direct mode does not
+check CHECK constraints or fire triggers on partitions.  All modes require the
+bagger_flush_batch() statement trigger to be installed as well:
+
+  CREATE TRIGGER route BEFORE INSERT ON inbound
+     FOR EACH ROW EXECUTE FUNCTION storage.bagger_route_row();
+  CREATE TRIGGER flush AFTER INSERT ON inbound
+     FOR EACH STATEMENT EXECUTE FUNCTION storage.bagger_flush_batch();
+
+The inbound column may be jsonb, or text or bytea holding the raw message.  Raw
+messages are checked as by storage.bagger_check_message() before they are
+parsed.
+
+Rows which cannot be routed are stored in storage.dead_letter, or fail the
+statement if bagger.on_error is error.  This covers messages failing the checks
+or, on PostgreSQL 16 and later, jsonb input, documents without a usable
+timestamp or which do not fit the dimensions, and partitions which do not
+exist.
+
+Partitions are looked up in the partitions schema.  A partition which does not
+exist yet is created with storage.create_partition() unless
+bagger.create_missing_partitions is off, in which case the row cannot be
+routed.
+$$;
+
+CREATE FUNCTION storage.bagger_flush_batch()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'bagger_flush_batch'
+LANGUAGE C;
+
+COMMENT ON FUNCTION storage.bagger_flush_batch() IS
+$$ AFTER INSERT FOR EACH STATEMENT trigger for the inbound table.  In batch
+mode this writes the rows buffered by bagger_route_row(), one multi-row insert
+per partition.  In direct mode it closes the partitions opened during the
+statement.  A transaction with buffered rows or open partitions left over fails
+to commit.$$;
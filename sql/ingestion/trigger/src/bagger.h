@@ -8,10 +8,117 @@
 #include <commands/trigger.h>
 #include <utils/rel.h>
 #include <utils/builtins.h>
+#include <datatype/timestamp.h>
+
+#define MAXTABLELEN NAMEDATALEN * 2 + 1 
+
+/* Schema holding the partitions, see storage.create_partition() */
+#define PARTITION_SCHEMA "partitions"
+
+/* Routing modes for the bagger.routing_mode GUC */
+typedef enum RoutingMode
+{
+    ROUTING_MODE_ROW,       /* one prepared insert per row */
+    ROUTING_MODE_BATCH,     /* buffered per statement, one insert per table */
+    ROUTING_MODE_DIRECT     /* table_tuple_insert without SPI */
+} RoutingMode;
+
+/* Handling of rows which cannot be routed, for bagger.on_error */
+typedef enum ErrorAction
+{
+    ERROR_ACTION_ERROR,         /* fail the statement */
+    ERROR_ACTION_DEAD_LETTER    /* store in storage.dead_letter and go on */
+} ErrorAction;
+
+/*
+ * Trigger statistics of one backend, see stats.c.  Times are in
+ * milliseconds.
+ */
+typedef struct BaggerStats
+{
+    int pid;
+    uint64 rows_routed;
+    uint64 cache_hits;
+    uint64 cache_misses;
+    uint64 cache_evictions;
+    uint64 cache_invalidations;
+    uint64 partitions_not_found;
+    uint64 partitions_created;  /* includes those a concurrent caller made */
+    uint64 rows_dead_lettered;
+    double extract_time;        /* building partition names */
+    double insert_time;         /* writing rows, including batch flushes */
+} BaggerStats;
+
+/*
+ * 32 bit FNV-1a, which can be computed a piece at a time.  Used for
+ * partition names and for the keys of compiled JSON pointers.
+ */
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+static inline uint32
+bagger_hash_bytes(uint32 hash, const char *str, int len)
+{
+    const unsigned char *c = (const unsigned char *) str;
+    const unsigned char *end = c + len;
+
+    for (; c < end; ++c)
+    {
+        hash ^= *c;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
 
 /* Shared prototypes */
 extern void initialize_ctx(void);
 extern void clear_plan_cache(void);
-extern SPIPlanPtr get_cached_plan(char *tablename);
+extern SPIPlanPtr get_cached_plan(const char *tablename, uint32 hash);
+extern SPIPlanPtr get_cached_batch_plan(const char *tablename, uint32 hash);
+extern Oid get_cached_relid(const char *tablename, uint32 hash);
+extern uint32 partition_name_hash(const void *key, Size keysize);
+extern Datum partition_key_from_name(const char *tablename,
+                                     Timestamp *bucket);
+extern void batch_add_row(const char *tablename, uint32 hash, Datum doc);
+extern void batch_flush_all(void);
+extern bool direct_insert_row(const char *tablename, uint32 hash, Datum doc);
+extern void direct_close_all(void);
+extern void bagger_stats_register_hooks(void);
+extern void bagger_stats_attach(void);
+extern void bagger_stats_count_partition(const char *partition, uint32 hash);
+extern void bagger_stats_uncount_partition(const char *partition, uint32 hash,
+                                           uint64 rows);
+extern void bagger_stats_flush(void);
+extern void bagger_catalog_register_hooks(void);
+extern uint64 bagger_catalog_generation(void);
+extern void *bagger_catalog_copy_dimensions(uint64 generation,
+                                            MemoryContext cxt,
+                                            const void **base);
+extern void bagger_catalog_store_dimensions(uint64 generation,
+                                            const void *set, Size size);
+extern bool bagger_catalog_lookup_partition(const char *partition,
+                                            uint32 hash, Oid *relid,
+                                            Oid *argtype);
+extern void bagger_catalog_store_partition(const char *partition,
+                                           uint32 hash, Oid relid,
+                                           Oid argtype);
+extern void dead_letter_raw(const char *reason, const char *buf, size_t len);
+extern void dead_letter_doc(const char *reason, const char *partition,
+                            Datum doc);
+extern void reject_missing_partition(const char *tablename, Datum doc);
+extern void invalidate_summary(const char *tablename, uint32 hash);
+extern BaggerStats *bagger_stats;
 extern FunctionCallInfo fcinfo;
+extern int TrigInitialized;
+extern MemoryContext TrigStateCtx;
+
+/* GUCs, defined in trigger.c */
+extern int bagger_plan_cache_size;
+extern int bagger_routing_mode;
+extern int bagger_batch_size;
+extern bool bagger_create_missing_partitions;
+extern int bagger_stats_max_partitions;
+extern bool bagger_track_timing;
+extern int bagger_on_error;
+extern int bagger_shared_partitions;
 #endif
@@ -0,0 +1,221 @@
+#include "bagger.h"
+#include "xactbuf.h"
+#include <utils/array.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+
+/* Bagger batched routing
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * In batch mode the row trigger does not insert anything.  Instead the
+ * documents are buffered here, grouped by target table, and each group is
+ * written with one multi-row insert (an unnest over an array of documents)
+ * when the statement-level flush trigger fires at the end of the statement.
+ * Schaufel sends rows with COPY and multi-row inserts so a statement
+ * typically covers many rows for the same few tables, and this replaces one
+ * executor startup per row with one per table.
+ *
+ * A group is also flushed early once it reaches bagger.batch_size rows.
+ * This bounds the memory held by the buffer for very large statements.
+ *
+ * The buffer is a per-transaction buffer, see xactbuf.c.  Each row
+ * remembers the subtransaction it was buffered in.  When a subtransaction
+ * aborts, only the rows buffered in it, or in those below it, are discarded:
+ * the statement which buffered them failed.  Errors caught further down, such
+ * as in a function called for a row, leave the rows buffered before them
+ * alone.  Rows are appended in order, so these are the rows at the end of
+ * each group.  Committing with rows still buffered means the flush trigger
+ * is missing, and we error rather than lose data.
+ */
+
+typedef struct batch_group
+{
+    char table[MAXTABLELEN];    /* hash key, must be first */
+    uint32 hash;                /* partition_name_hash() of table */
+    int nrows;
+    int maxrows;
+    Datum *rows;
+    SubTransactionId *subids;   /* subtransaction each row was buffered in */
+} batch_group;
+
+/* starting size of the per-table row array, doubled as needed */
+#define BATCH_GROUP_INIT_ROWS 64
+#define BATCH_INIT_SIZE 64
+
+/* prototypes */
+void batch_add_row(const char *, uint32, Datum);
+void batch_flush_all(void);
+static void flush_group(batch_group *);
+static void batch_check_flushed(HTAB *);
+static void batch_subxact_abort(HTAB *, SubTransactionId);
+
+static XactBuffer batch_buffer = {
+    .name = "Bagger batch buffer",
+    .entrysize = sizeof(batch_group),
+    .nelem = BATCH_INIT_SIZE,
+    .small = false,
+    .pre_commit = batch_check_flushed,
+    .subxact_abort = batch_subxact_abort,
+};
+
+/*
+ * void batch_add_row(const char *tablename, uint32 hash, Datum doc)
+ *
+ * Buffers a copy of the document for insertion into tablename.  hash is the
+ * hash of the name as computed by partition_name_from_doc().
+ */
+void
+batch_add_row(const char *tablename, uint32 hash, Datum doc)
+{
+    batch_group *group;
+    bool found;
+    MemoryContext oldcontext;
+
+    group = hash_search_with_hash_value(xact_buffer_table(&batch_buffer),
+                                        tablename, hash, HASH_ENTER, &found);
+    if (!found)
+    {
+        group->hash = hash;
+        group->nrows = 0;
+        group->maxrows = BATCH_GROUP_INIT_ROWS;
+        group->rows = MemoryContextAlloc(batch_buffer.cxt,
+                                         sizeof(Datum) * group->maxrows);
+        group->subids = MemoryContextAlloc(batch_buffer.cxt,
+                                           sizeof(SubTransactionId)
+                                           * group->maxrows);
+        /* a missing partition can only be created while its document is
+         * being routed, not at flush time
+         */
+        (void) get_cached_relid(tablename, hash);
+    }
+    else if (group->nrows == group->maxrows)
+    {
+        group->maxrows *= 2;
+        group->rows = repalloc(group->rows, sizeof(Datum) * group->maxrows);
+        group->subids = repalloc(group->subids,
+                                 sizeof(SubTransactionId) * group->maxrows);
+    }
+
+    /* the trigger tuple goes away after the row, so we need our own copy */
+    oldcontext = MemoryContextSwitchTo(batch_buffer.cxt);
+    group->rows[group->nrows] = PointerGetDatum(PG_DETOAST_DATUM_COPY(doc));
+    group->subids[group->nrows++] = GetCurrentSubTransactionId();
+    MemoryContextSwitchTo(oldcontext);
+
+    if (group->nrows >= bagger_batch_size)
+        flush_group(group);
+}
+
+/*
+ * static void flush_group(batch_group *group)
+ *
+ * Writes all buffered rows of the group with a single insert and empties
+ * the group.  If the partition does not exist, or was dropped since the
+ * group was started, the rows are dead lettered one by one instead.  The
+ * caller must be connected to SPI.
+ */
+static void
+flush_group(batch_group *group)
+{
+    SPIPlanPtr plan;
+    ArrayType *docs;
+    Datum arg;
+    Oid elemtype;
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    int ret;
+
+    if (0 == group->nrows)
+        return;
+
+    plan = get_cached_batch_plan(group->table, group->hash);
+    if (NULL == plan)
+    {
+        for (int i = 0; i < group->nrows; ++i)
+        {
+            reject_missing_partition(group->table, group->rows[i]);
+            pfree(DatumGetPointer(group->rows[i]));
+        }
+        /* they were counted as routed when buffered */
+        bagger_stats->rows_routed -= group->nrows;
+        bagger_stats_uncount_partition(group->table, group->hash,
+                                       group->nrows);
+        group->nrows = 0;
+        return;
+    }
+
+    elemtype = SPI_getargtypeid(plan, 0);
+    elemtype = get_element_type(elemtype);
+    get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+    docs = construct_array(group->rows, group->nrows, elemtype,
+                           typlen, typbyval, typalign);
+    arg = PointerGetDatum(docs);
+
+    if (SPI_OK_INSERT != (ret = SPI_execute_plan(plan, &arg, NULL, false, 0)))
+        elog(ERROR, "SPI_execute_plan returned %d", ret);
+    invalidate_summary(group->table, group->hash);
+
+    for (int i = 0; i < group->nrows; ++i)
+        pfree(DatumGetPointer(group->rows[i]));
+    pfree(docs);
+    group->nrows = 0;
+}
+
+/*
+ * void batch_flush_all()
+ *
+ * Flushes every group in the buffer and releases it.  Called from the
+ * statement-level flush trigger.  The caller must be connected to SPI.
+ */
+void
+batch_flush_all()
+{
+    HASH_SEQ_STATUS status;
+    batch_group *group;
+
+    if (NULL == batch_buffer.table)
+        return;
+
+    hash_seq_init(&status, batch_buffer.table);
+    while (NULL != (group = hash_seq_search(&status)))
+        flush_group(group);
+
+    xact_buffer_release(&batch_buffer);
+}
+
+/* Errors at commit if rows are left buffered */
+static void
+batch_check_flushed(HTAB *table)
+{
+    HASH_SEQ_STATUS status;
+    batch_group *group;
+
+    hash_seq_init(&status, table);
+    while (NULL != (group = hash_seq_search(&status)))
+    {
+        if (group->nrows > 0)
+        {
+            hash_seq_term(&status);
+            ereport(ERROR,
+                    errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("Bagger batch buffer was not flushed"),
+                    errhint("Batch routing requires the bagger_flush_batch "
+                            "statement trigger on the inbound table."));
+        }
+    }
+}
+
+/* Discards the rows buffered in the aborted subtransaction and below it */
+static void
+batch_subxact_abort(HTAB *table, SubTransactionId subid)
+{
+    HASH_SEQ_STATUS status;
+    batch_group *group;
+
+    hash_seq_init(&status, table);
+    while (NULL != (group = hash_seq_search(&status)))
+        while (group->nrows > 0 && group->subids[group->nrows - 1] >= subid)
+            pfree(DatumGetPointer(group->rows[--group->nrows]));
+}
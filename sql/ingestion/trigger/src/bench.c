@@ -0,0 +1,209 @@
+#include "bagger.h"
+#include "names.h"
+#include "validate.h"
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <catalog/pg_type.h>
+#include <portability/instr_time.h>
+#include <utils/array.h>
+#include <utils/memutils.h>
+
+/* Bagger routing micro-benchmark
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * bagger_bench_routing() runs the routing hot path over an array of
+ * documents without inserting anything, so the cost of working out where a
+ * row goes can be measured apart from the cost of writing it.  Two stages
+ * are timed: building the partition name from the document, and building
+ * the name plus looking up the cached insert plan for it.
+ *
+ * Before timing, one untimed pass looks up every partition, creating any
+ * that are missing and preparing the plans.  The timed passes then measure
+ * the steady state.  Plans evicted because the cache is smaller than the
+ * number of partitions are prepared again inside the timed passes, as they
+ * would be in production.
+ *
+ * PostgreSQL does not count allocations, so memory is reported as the bytes
+ * a dedicated memory context grew by over the timed passes, per row
+ * (ctx_bytes_per_row).  This is the memory held by allocations which outlive
+ * a row in that context, rounded up to the context's blocks, rather than a
+ * count of allocations.  Allocations made in longer lived contexts, such as
+ * the plan cache, are not seen.
+ *
+ * bagger_bench_validate() measures the throughput of the raw message
+ * checks in validate.c, which run before parsing when the inbound column
+ * is text or bytea.
+ *
+ * The harness around this is bench/bench.sql, run with make bench.  This
+ * file is only linked into the module by make bench, and the functions are
+ * declared by bench.sql, so production installs have neither.
+ */
+
+PG_FUNCTION_INFO_V1(bagger_bench_routing);
+PG_FUNCTION_INFO_V1(bagger_bench_validate);
+
+/*
+ * bagger_bench_routing(docs jsonb[], loops int)
+ *
+ * Returns a row with the number of rows routed, the nanoseconds per row
+ * for name building alone and with the plan lookup, the rows per second of
+ * the latter, and the growth of the memory context per row.
+ */
+Datum
+bagger_bench_routing(PG_FUNCTION_ARGS)
+{
+    ArrayType *arr = PG_GETARG_ARRAYTYPE_P(0);
+    int32 loops = PG_GETARG_INT32(1);
+    Datum *elems;
+    bool *nulls;
+    int nelems;
+    Jsonb **docs;
+    MemoryContext benchctx;
+    MemoryContext oldcontext;
+    Size before;
+    instr_time start;
+    instr_time name_time;
+    instr_time lookup_time;
+    double rows;
+    TupleDesc tupdesc;
+    Datum values[5];
+    bool isnull[5] = {false, false, false, false, false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    if (loops < 1)
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("loops must be at least 1"));
+
+    deconstruct_array(arr, JSONBOID, -1, false, TYPALIGN_INT,
+                      &elems, &nulls, &nelems);
+    if (0 == nelems)
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("docs must not be empty"));
+
+    /* detoasting is not part of routing, the trigger gets a plain tuple */
+    docs = palloc(sizeof(Jsonb *) * nelems);
+    for (int i = 0; i < nelems; ++i)
+    {
+        if (nulls[i])
+            ereport(ERROR,
+                    errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                    errmsg("docs must not contain nulls"));
+        docs[i] = DatumGetJsonbP(elems[i]);
+    }
+
+    if (!TrigInitialized)
+        initialize_ctx();
+    if (SPI_OK_CONNECT != SPI_connect())
+        elog(ERROR, "SPI_connect failed");
+
+    /* warm up: create partitions and prepare plans */
+    for (int i = 0; i < nelems; ++i)
+    {
+        Partition_name *table = partition_name_from_doc(docs[i]);
+
+        /* rejected documents would be dead lettered, not routed */
+        if (NULL == table)
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Document %d cannot be routed: %s", i + 1,
+                           partition_name_error()));
+        if (NULL == get_cached_plan(table->name, table->hash))
+            ereport(ERROR,
+                    errcode(ERRCODE_UNDEFINED_TABLE),
+                    errmsg("Partition %s does not exist", table->name));
+    }
+
+    benchctx = AllocSetContextCreate(CurrentMemoryContext, "BaggerBenchCtx",
+                                     ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(benchctx);
+    before = MemoryContextMemAllocated(benchctx, true);
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (int l = 0; l < loops; ++l)
+        for (int i = 0; i < nelems; ++i)
+            partition_name_from_doc(docs[i]);
+    INSTR_TIME_SET_CURRENT(name_time);
+    INSTR_TIME_SUBTRACT(name_time, start);
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (int l = 0; l < loops; ++l)
+    {
+        for (int i = 0; i < nelems; ++i)
+        {
+            Partition_name *table = partition_name_from_doc(docs[i]);
+
+            get_cached_plan(table->name, table->hash);
+        }
+    }
+    INSTR_TIME_SET_CURRENT(lookup_time);
+    INSTR_TIME_SUBTRACT(lookup_time, start);
+
+    rows = (double) nelems * loops;
+    values[0] = Int64GetDatum((int64) rows);
+    values[1] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(name_time) * 1e9 / rows);
+    values[2] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(lookup_time) * 1e9 / rows);
+    values[3] = Float8GetDatum(rows / INSTR_TIME_GET_DOUBLE(lookup_time));
+    /* both timed passes allocate in benchctx */
+    values[4] = Float8GetDatum((MemoryContextMemAllocated(benchctx, true)
+                                - before) / (rows * 2));
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(benchctx);
+    SPI_finish();
+
+    tupdesc = BlessTupleDesc(tupdesc);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+                                                      isnull)));
+}
+
+/*
+ * bagger_bench_validate(message bytea, loops int)
+ *
+ * Checks the message loops times and returns the bytes checked and the
+ * throughput in GB per second.  The message must pass the check.
+ */
+Datum
+bagger_bench_validate(PG_FUNCTION_ARGS)
+{
+    bytea *message = PG_GETARG_BYTEA_PP(0);
+    int32 loops = PG_GETARG_INT32(1);
+    const char *buf = VARDATA_ANY(message);
+    size_t len = VARSIZE_ANY_EXHDR(message);
+    size_t pos;
+    instr_time start;
+    instr_time elapsed;
+    double bytes;
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool isnull[2] = {false, false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    if (loops < 1)
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("loops must be at least 1"));
+    if (MESSAGE_OK != check_message(buf, len, &pos))
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("message must pass the inbound checks"));
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (int l = 0; l < loops; ++l)
+        if (MESSAGE_OK != check_message(buf, len, &pos))
+            elog(ERROR, "message check is not repeatable");
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, start);
+
+    bytes = (double) len * loops;
+    values[0] = Int64GetDatum((int64) bytes);
+    values[1] = Float8GetDatum(bytes / INSTR_TIME_GET_DOUBLE(elapsed) / 1e9);
+
+    tupdesc = BlessTupleDesc(tupdesc);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+                                                      isnull)));
+}
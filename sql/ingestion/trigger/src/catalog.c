@@ -0,0 +1,356 @@
+#include "bagger.h"
+#include <access/xact.h>
+#include <miscadmin.h>
+#include <port/atomics.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/memutils.h>
+
+/* Bagger shared catalog
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Every ingestion backend needs the same compiled dimension set, and looks
+ * up the same partitions.  When bagger_data is in shared_preload_libraries,
+ * this module keeps one copy of both in shared memory so that backends
+ * attach to them rather than each going to the catalogs.
+ *
+ * The dimension set is the flat block built by names.c.  It is copied in
+ * and out whole under a lock and relocated by the caller, so a backend
+ * never reads a set which is being replaced.  The first backend to need a
+ * set after a change builds it over SPI and publishes it.  Sets larger than
+ * CATALOG_DIMENSIONS_SIZE are not shared and each backend builds its own.
+ *
+ * The partition directory maps partition names to their oid and document
+ * type, so a backend missing a partition in its plan cache does not need to
+ * look the name up or try to create it.  Entries are checked against the
+ * syscache on use, since retention may have dropped the partition, and
+ * removed if they are stale.  When the directory is full new partitions are
+ * simply not added.
+ *
+ * Both are for one database, the first one to use them.  Backends of other
+ * databases fall back to their own lookups.
+ *
+ * Changes to storage.dimension and storage.config bump a generation counter
+ * when they commit, see bagger_catalog_changed().  Backends compare the
+ * counter with the generation of the set they hold at the start of each
+ * row, and reload lazily.  The partition directory is not affected since
+ * partition names do not depend on the generation.  A set covers every
+ * version of the dimensions, so a change made ahead of its valid_from is
+ * loaded right away and takes effect at that hour.
+ */
+
+typedef struct partition_dir_entry
+{
+    char partition[NAMEDATALEN];    /* hash key, must be first */
+    Oid relid;
+    Oid argtype;
+} partition_dir_entry;
+
+/* largest dimension set which can be shared */
+#define CATALOG_DIMENSIONS_SIZE (64 * 1024)
+
+typedef struct BaggerSharedCatalog
+{
+    LWLock *lock;               /* protects everything but generation */
+    pg_atomic_uint64 generation;
+    Oid database;               /* InvalidOid until first used */
+    uint64 dimensions_generation;   /* of the stored set, 0 if none */
+    const void *dimensions_base;    /* address the set was built at */
+    Size dimensions_size;
+    char dimensions[CATALOG_DIMENSIONS_SIZE];
+} BaggerSharedCatalog;
+
+int bagger_shared_partitions = 10000;
+
+static BaggerSharedCatalog *shared_catalog = NULL;
+static HTAB *partition_directory = NULL;
+static bool generation_bump_pending = false;
+static bool xact_callback_registered = false;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* prototypes */
+void bagger_catalog_register_hooks(void);
+uint64 bagger_catalog_generation(void);
+void *bagger_catalog_copy_dimensions(uint64, MemoryContext, const void **);
+void bagger_catalog_store_dimensions(uint64, const void *, Size);
+bool bagger_catalog_lookup_partition(const char *, uint32, Oid *, Oid *);
+void bagger_catalog_store_partition(const char *, uint32, Oid, Oid);
+static bool catalog_usable(void);
+static void catalog_shmem_request(void);
+static void catalog_shmem_startup(void);
+static void catalog_xact_cb(XactEvent, void *);
+PG_FUNCTION_INFO_V1(bagger_catalog_changed);
+
+/*
+ * void bagger_catalog_register_hooks()
+ *
+ * Requests shared memory if we are being preloaded.  Called from _PG_init.
+ */
+void
+bagger_catalog_register_hooks()
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = catalog_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = catalog_shmem_startup;
+}
+
+static void
+catalog_shmem_request()
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(add_size(sizeof(BaggerSharedCatalog),
+                                    hash_estimate_size(
+                                        bagger_shared_partitions,
+                                        sizeof(partition_dir_entry))));
+    RequestNamedLWLockTranche("bagger_catalog", 1);
+}
+
+static void
+catalog_shmem_startup()
+{
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    shared_catalog = ShmemInitStruct("bagger_catalog",
+                                     sizeof(BaggerSharedCatalog), &found);
+    if (!found)
+    {
+        memset(shared_catalog, 0, offsetof(BaggerSharedCatalog, dimensions));
+        shared_catalog->lock =
+            &(GetNamedLWLockTranche("bagger_catalog"))->lock;
+        /* generation 0 means no shared memory to the callers */
+        pg_atomic_init_u64(&shared_catalog->generation, 1);
+    }
+
+    info.keysize = NAMEDATALEN;
+    info.entrysize = sizeof(partition_dir_entry);
+    info.hash = partition_name_hash;
+    info.match = (HashCompareFunc) strncmp;
+    info.keycopy = (HashCopyFunc) strlcpy;
+    partition_directory = ShmemInitHash("bagger partition directory",
+                                        bagger_shared_partitions,
+                                        bagger_shared_partitions,
+                                        &info,
+                                        HASH_ELEM | HASH_FUNCTION
+                                        | HASH_COMPARE | HASH_KEYCOPY);
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* Whether this backend may use the shared catalog, claiming it for our
+ * database if nobody has yet.
+ */
+static bool
+catalog_usable()
+{
+    bool usable;
+
+    if (NULL == shared_catalog)
+        return false;
+    if (MyDatabaseId == shared_catalog->database)
+        return true;
+
+    LWLockAcquire(shared_catalog->lock, LW_EXCLUSIVE);
+    if (InvalidOid == shared_catalog->database)
+        shared_catalog->database = MyDatabaseId;
+    usable = (MyDatabaseId == shared_catalog->database);
+    LWLockRelease(shared_catalog->lock);
+    return usable;
+}
+
+/*
+ * uint64 bagger_catalog_generation()
+ *
+ * Returns the current generation of the dimension configuration, or 0 if
+ * there is no shared catalog for this backend.
+ */
+uint64
+bagger_catalog_generation()
+{
+    if (!catalog_usable())
+        return 0;
+    return pg_atomic_read_u64(&shared_catalog->generation);
+}
+
+/*
+ * void *bagger_catalog_copy_dimensions(uint64 generation, MemoryContext cxt,
+ *                                      const void **base)
+ *
+ * Returns a copy in cxt of the shared dimension set if one is stored for
+ * generation, setting *base to the address it was built at so the caller
+ * can relocate it.  Returns NULL otherwise.
+ */
+void *
+bagger_catalog_copy_dimensions(uint64 generation, MemoryContext cxt,
+                               const void **base)
+{
+    void *copy = NULL;
+
+    if (0 == generation || !catalog_usable())
+        return NULL;
+
+    LWLockAcquire(shared_catalog->lock, LW_SHARED);
+    if (generation == shared_catalog->dimensions_generation)
+    {
+        copy = MemoryContextAlloc(cxt, shared_catalog->dimensions_size);
+        memcpy(copy, shared_catalog->dimensions,
+               shared_catalog->dimensions_size);
+        *base = shared_catalog->dimensions_base;
+    }
+    LWLockRelease(shared_catalog->lock);
+    return copy;
+}
+
+/*
+ * void bagger_catalog_store_dimensions(uint64 generation, const void *set,
+ *                                      Size size)
+ *
+ * Publishes a dimension set built from the catalogs as they were at
+ * generation.  Nothing is stored if the generation has moved on since, or
+ * if the set is too large.
+ */
+void
+bagger_catalog_store_dimensions(uint64 generation, const void *set, Size size)
+{
+    if (0 == generation || size > CATALOG_DIMENSIONS_SIZE
+        || !catalog_usable())
+        return;
+
+    LWLockAcquire(shared_catalog->lock, LW_EXCLUSIVE);
+    if (generation == pg_atomic_read_u64(&shared_catalog->generation))
+    {
+        memcpy(shared_catalog->dimensions, set, size);
+        shared_catalog->dimensions_size = size;
+        shared_catalog->dimensions_base = set;
+        shared_catalog->dimensions_generation = generation;
+    }
+    LWLockRelease(shared_catalog->lock);
+}
+
+/*
+ * bool bagger_catalog_lookup_partition(const char *partition, uint32 hash,
+ *                                      Oid *relid, Oid *argtype)
+ *
+ * Looks up the partition in the directory.  hash is partition_name_hash()
+ * of the name.  The result must still be checked by the caller.
+ */
+bool
+bagger_catalog_lookup_partition(const char *partition, uint32 hash,
+                                Oid *relid, Oid *argtype)
+{
+    partition_dir_entry *entry;
+
+    if (!catalog_usable())
+        return false;
+
+    LWLockAcquire(shared_catalog->lock, LW_SHARED);
+    entry = hash_search_with_hash_value(partition_directory, partition, hash,
+                                        HASH_FIND, NULL);
+    if (NULL != entry)
+    {
+        *relid = entry->relid;
+        *argtype = entry->argtype;
+    }
+    LWLockRelease(shared_catalog->lock);
+    return NULL != entry;
+}
+
+/*
+ * void bagger_catalog_store_partition(const char *partition, uint32 hash,
+ *                                     Oid relid, Oid argtype)
+ *
+ * Adds or replaces the directory entry for the partition.  InvalidOid as
+ * relid removes it.
+ */
+void
+bagger_catalog_store_partition(const char *partition, uint32 hash, Oid relid,
+                               Oid argtype)
+{
+    partition_dir_entry *entry;
+
+    if (!catalog_usable())
+        return;
+
+    LWLockAcquire(shared_catalog->lock, LW_EXCLUSIVE);
+    if (InvalidOid == relid)
+        hash_search_with_hash_value(partition_directory, partition, hash,
+                                    HASH_REMOVE, NULL);
+    else
+    {
+        entry = hash_search_with_hash_value(partition_directory, partition,
+                                            hash, HASH_ENTER_NULL, NULL);
+        if (NULL != entry)
+        {
+            entry->relid = relid;
+            entry->argtype = argtype;
+        }
+    }
+    LWLockRelease(shared_catalog->lock);
+}
+
+/* Bumps the generation once the transaction which changed the
+ * configuration commits, so that backends reloading see the change.
+ */
+static void
+catalog_xact_cb(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+        if (generation_bump_pending && NULL != shared_catalog)
+            pg_atomic_fetch_add_u64(&shared_catalog->generation, 1);
+        generation_bump_pending = false;
+        break;
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+        generation_bump_pending = false;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * bagger_catalog_changed()
+ *
+ * AFTER FOR EACH STATEMENT trigger on the configuration tables the
+ * ingestion trigger loads.  Makes backends reload them once the
+ * transaction commits.
+ *
+ * The table's relcache entry is invalidated as well.  Backends without the
+ * shared generation watch for that instead, see names.c.
+ */
+Datum
+bagger_catalog_changed(PG_FUNCTION_ARGS)
+{
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        ereport(ERROR,
+                errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                errmsg("bagger_catalog_changed must be called as a trigger"));
+
+    CacheInvalidateRelcache(((TriggerData *) fcinfo->context)->tg_relation);
+
+    if (!xact_callback_registered)
+    {
+        RegisterXactCallback(catalog_xact_cb, NULL);
+        xact_callback_registered = true;
+    }
+    generation_bump_pending = true;
+    return PointerGetDatum(NULL);
+}
@@ -0,0 +1,169 @@
+#include "bagger.h"
+#include <catalog/pg_type.h>
+#include "validate.h"
+
+/* Bagger dead letters
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Rows which cannot be routed are written to storage.dead_letter rather
+ * than failing the inbound statement when bagger.on_error is dead_letter.
+ * One malformed producer would otherwise make Schaufel retry whole batches
+ * for every other producer's rows too.  This covers raw messages failing
+ * the checks in validate.c or jsonb input, documents rejected while
+ * building the partition name, and partitions which do not exist and are
+ * not created.
+ *
+ * Each dead letter carries the reason, the partition the row was meant for
+ * if it got that far, and the document's timestamp field as text, since
+ * the timestamp itself may be what is wrong.
+ *
+ * Dead letters are rare, so they are written with ordinary prepared
+ * inserts.  The plans are kept for the life of the backend.  Errors writing
+ * a dead letter are not caught, they fail the statement as before.
+ */
+
+/* how rows which cannot be routed are handled, see bagger.h */
+int bagger_on_error = ERROR_ACTION_DEAD_LETTER;
+
+static SPIPlanPtr dead_letter_raw_plan = NULL;
+static SPIPlanPtr dead_letter_doc_plan = NULL;
+
+/* prototypes */
+void dead_letter_raw(const char *reason, const char *buf, size_t len);
+void dead_letter_doc(const char *reason, const char *partition, Datum doc);
+void reject_missing_partition(const char *tablename, Datum doc);
+static SPIPlanPtr prepare_dead_letter(const char *sql, int nargs,
+                                      Oid *argtypes);
+PG_FUNCTION_INFO_V1(bagger_check_message);
+
+/* Prepares and keeps one of the dead letter inserts */
+static SPIPlanPtr
+prepare_dead_letter(const char *sql, int nargs, Oid *argtypes)
+{
+    SPIPlanPtr plan = SPI_prepare(sql, nargs, argtypes);
+
+    if (NULL == plan)
+        elog(ERROR, "SPI_prepare failed for dead letter insert: %s",
+             SPI_result_code_string(SPI_result));
+    SPI_keepplan(plan);
+    return plan;
+}
+
+/*
+ * void dead_letter_raw(const char *reason, const char *buf, size_t len)
+ *
+ * Stores a raw message which could not be parsed, with the reason.  The
+ * caller must be connected to SPI.
+ */
+void
+dead_letter_raw(const char *reason, const char *buf, size_t len)
+{
+    Datum args[2];
+    bytea *message;
+    int ret;
+
+    if (NULL == dead_letter_raw_plan)
+    {
+        Oid argtypes[2] = {TEXTOID, BYTEAOID};
+
+        dead_letter_raw_plan = prepare_dead_letter(
+            "INSERT INTO storage.dead_letter (reason, message) "
+            "VALUES ($1, $2)", 2, argtypes);
+    }
+
+    message = palloc(len + VARHDRSZ);
+    SET_VARSIZE(message, len + VARHDRSZ);
+    memcpy(VARDATA(message), buf, len);
+    args[0] = CStringGetTextDatum(reason);
+    args[1] = PointerGetDatum(message);
+
+    ret = SPI_execute_plan(dead_letter_raw_plan, args, NULL, false, 0);
+    if (SPI_OK_INSERT != ret)
+        elog(ERROR, "SPI_execute_plan returned %d", ret);
+    pfree(message);
+    ++bagger_stats->rows_dead_lettered;
+}
+
+/*
+ * void dead_letter_doc(const char *reason, const char *partition, Datum doc)
+ *
+ * Stores a parsed document which could not be routed, with the reason and
+ * the partition it was meant for, which may be NULL.  The caller must be
+ * connected to SPI.
+ */
+void
+dead_letter_doc(const char *reason, const char *partition, Datum doc)
+{
+    Datum args[3];
+    char nulls[3] = {' ', ' ', ' '};
+    int ret;
+
+    if (NULL == dead_letter_doc_plan)
+    {
+        Oid argtypes[3] = {TEXTOID, TEXTOID, JSONBOID};
+
+        dead_letter_doc_plan = prepare_dead_letter(
+            "INSERT INTO storage.dead_letter "
+            "            (reason, partition, doc_timestamp, doc) "
+            "SELECT $1, $2, $3 ->> coalesce((SELECT value #>> '{}' "
+            "                                  FROM storage.config "
+            "                                 WHERE key = 'timestamp_field'), "
+            "                               'timestamp'), $3",
+            3, argtypes);
+    }
+
+    args[0] = CStringGetTextDatum(reason);
+    if (NULL == partition)
+    {
+        args[1] = (Datum) 0;
+        nulls[1] = 'n';
+    }
+    else
+        args[1] = CStringGetTextDatum(partition);
+    args[2] = doc;
+
+    ret = SPI_execute_plan(dead_letter_doc_plan, args, nulls, false, 0);
+    if (SPI_OK_INSERT != ret)
+        elog(ERROR, "SPI_execute_plan returned %d", ret);
+    ++bagger_stats->rows_dead_lettered;
+}
+
+/*
+ * void reject_missing_partition(const char *tablename, Datum doc)
+ *
+ * Handles a row for a partition which does not exist, following
+ * bagger.on_error.  The caller must be connected to SPI.
+ */
+void
+reject_missing_partition(const char *tablename, Datum doc)
+{
+    if (ERROR_ACTION_DEAD_LETTER != bagger_on_error)
+        ereport(ERROR,
+                errcode(ERRCODE_UNDEFINED_TABLE),
+                errmsg("Partition %s does not exist", tablename));
+    dead_letter_doc("Partition does not exist", tablename, doc);
+}
+
+/*
+ * bagger_check_message(bytea)
+ *
+ * Returns why the message would be rejected by the inbound checks, or null
+ * if it would not be.  Useful for looking at dead letters and for checking
+ * producers.
+ */
+Datum
+bagger_check_message(PG_FUNCTION_ARGS)
+{
+    bytea *message = PG_GETARG_BYTEA_PP(0);
+    MessageCheck check;
+    size_t pos;
+
+    check = check_message(VARDATA_ANY(message), VARSIZE_ANY_EXHDR(message),
+                          &pos);
+    if (MESSAGE_OK == check)
+        PG_RETURN_NULL();
+    PG_RETURN_TEXT_P(cstring_to_text(psprintf("%s at byte %zu",
+                                              message_check_reason(check),
+                                              pos)));
+}
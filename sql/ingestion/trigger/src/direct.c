@@ -0,0 +1,271 @@
+#include "bagger.h"
+#include <access/table.h>
+#include <access/tableam.h>
+#include <access/xact.h>
+#include <executor/executor.h>
+#include <executor/nodeModifyTable.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+
+/* Bagger direct insertion path
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * In direct mode the trigger does not use SPI for writing at all.  The
+ * partition is opened once per statement, and each document is stored in a
+ * slot and written with table_tuple_insert, followed by index maintenance
+ * with ExecInsertIndexTuples.  Partitions hold a single jsonb column, so
+ * going through a prepared INSERT is mostly executor startup overhead.
+ *
+ * Since nothing goes through the executor proper, direct mode does not
+ * check CHECK constraints or fire triggers on the partitions.  Partitions
+ * created by Bagger have neither.  Summaries of the partitions written are
+ * cleared as in the other modes, see summary.c.  Unique indexes are still
+ * enforced, and stored generated columns, which compaction adds to sealed
+ * partitions, are computed.
+ *
+ * Open partitions are kept in a hash keyed by oid and closed by the
+ * statement-level flush trigger.  They must be closed under the same
+ * resource owner which opened them, so we cannot leave this to commit time.
+ * Committing with partitions still open means the flush trigger is missing
+ * and we error.  On abort, the resource owners release everything and we
+ * only forget our pointers.  A subtransaction abort only releases what was
+ * opened in that subtransaction or below it, so each partition remembers the
+ * subtransaction it was opened in, and only those are forgotten.  The others
+ * stay open for the flush trigger, such as when a function called for a row
+ * catches an error.
+ */
+
+typedef struct direct_target
+{
+    Oid relid;              /* hash key, must be first */
+    Relation rel;
+    ResultRelInfo *rri;
+    TupleTableSlot *slot;
+    SubTransactionId subid;     /* subtransaction which opened it */
+} direct_target;
+
+#define DIRECT_INIT_SIZE 64
+
+static MemoryContext DirectCtx = NULL;
+static HTAB *direct_table = NULL;
+static EState *direct_estate = NULL;
+static bool direct_callbacks_registered = false;
+
+/* prototypes */
+bool direct_insert_row(const char *, uint32, Datum);
+void direct_close_all(void);
+static void initialize_direct(void);
+static direct_target *open_target(Oid);
+static void direct_forget(void);
+static void direct_xact_cb(XactEvent, void *);
+static void direct_subxact_cb(SubXactEvent, SubTransactionId,
+                              SubTransactionId, void *);
+
+/*
+ * static void initialize_direct()
+ *
+ * Sets up the memory context, executor state, and hash of open partitions
+ * for the current statement.
+ */
+static void
+initialize_direct()
+{
+    HASHCTL ctl;
+    MemoryContext oldcontext;
+
+    if (!direct_callbacks_registered)
+    {
+        RegisterXactCallback(direct_xact_cb, NULL);
+        RegisterSubXactCallback(direct_subxact_cb, NULL);
+        direct_callbacks_registered = true;
+    }
+
+    DirectCtx = AllocSetContextCreate(TopTransactionContext, "BaggerDirectCtx",
+                                      ALLOCSET_DEFAULT_SIZES);
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(direct_target);
+    ctl.hcxt = DirectCtx;
+    direct_table = hash_create("Bagger direct targets", DIRECT_INIT_SIZE, &ctl,
+                               HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    oldcontext = MemoryContextSwitchTo(DirectCtx);
+    direct_estate = CreateExecutorState();
+    direct_estate->es_output_cid = GetCurrentCommandId(true);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * static direct_target *open_target(Oid relid)
+ *
+ * Returns the open partition for relid, opening it and its indexes on first
+ * use in the statement.
+ */
+static direct_target *
+open_target(Oid relid)
+{
+    direct_target *target;
+    bool found;
+    MemoryContext oldcontext;
+
+    target = hash_search(direct_table, &relid, HASH_ENTER, &found);
+    if (found)
+        return target;
+
+    oldcontext = MemoryContextSwitchTo(DirectCtx);
+    target->rel = table_open(relid, RowExclusiveLock);
+    target->rri = makeNode(ResultRelInfo);
+    InitResultRelInfo(target->rri, target->rel, 1, NULL, 0);
+    ExecOpenIndices(target->rri, false);
+    target->slot = table_slot_create(target->rel, NULL);
+    target->subid = GetCurrentSubTransactionId();
+    MemoryContextSwitchTo(oldcontext);
+    return target;
+}
+
+/*
+ * bool direct_insert_row(const char *tablename, uint32 hash, Datum doc)
+ *
+ * Writes the document to the table, and to its indexes.  Any other columns
+ * of the table are set to null.  Returns false if the table does not exist
+ * and the row was dead lettered.
+ */
+bool
+direct_insert_row(const char *tablename, uint32 hash, Datum doc)
+{
+    Oid relid;
+    direct_target *target;
+    TupleTableSlot *slot;
+    MemoryContext oldcontext;
+    List *recheck;
+
+    relid = get_cached_relid(tablename, hash);
+    if (InvalidOid == relid)
+    {
+        reject_missing_partition(tablename, doc);
+        return false;
+    }
+
+    if (NULL == direct_table)
+        initialize_direct();
+    target = open_target(relid);
+    slot = target->slot;
+
+    ExecClearTuple(slot);
+    memset(slot->tts_isnull, true,
+           sizeof(bool) * slot->tts_tupleDescriptor->natts);
+    slot->tts_values[0] = doc;
+    slot->tts_isnull[0] = false;
+    ExecStoreVirtualTuple(slot);
+
+    oldcontext = MemoryContextSwitchTo(GetPerTupleMemoryContext(direct_estate));
+    if (NULL != target->rel->rd_att->constr
+        && target->rel->rd_att->constr->has_generated_stored)
+        ExecComputeStoredGenerated(target->rri, direct_estate, slot,
+                                   CMD_INSERT);
+    table_tuple_insert(target->rel, slot, direct_estate->es_output_cid, 0, NULL);
+    if (target->rri->ri_NumIndices > 0)
+    {
+#if PG_VERSION_NUM >= 160000
+        recheck = ExecInsertIndexTuples(target->rri, slot, direct_estate,
+                                        false, false, NULL, NIL, false);
+#else
+        recheck = ExecInsertIndexTuples(target->rri, slot, direct_estate,
+                                        false, false, NULL, NIL);
+#endif
+        list_free(recheck);
+    }
+    MemoryContextSwitchTo(oldcontext);
+    ResetPerTupleExprContext(direct_estate);
+    invalidate_summary(tablename, hash);
+    return true;
+}
+
+/*
+ * void direct_close_all()
+ *
+ * Closes every partition opened in this statement and frees the executor
+ * state.  Called from the statement-level flush trigger.  Locks are kept
+ * until the end of the transaction.
+ */
+void
+direct_close_all()
+{
+    HASH_SEQ_STATUS status;
+    direct_target *target;
+
+    if (NULL == direct_table)
+        return;
+
+    hash_seq_init(&status, direct_table);
+    while (NULL != (target = hash_seq_search(&status)))
+    {
+        ExecDropSingleTupleTableSlot(target->slot);
+        ExecCloseIndices(target->rri);
+        table_close(target->rel, NoLock);
+    }
+    FreeExecutorState(direct_estate);
+    MemoryContextDelete(DirectCtx);
+    direct_forget();
+}
+
+/* Forgets the open targets without closing them, for when they are gone */
+static void
+direct_forget()
+{
+    DirectCtx = NULL;
+    direct_table = NULL;
+    direct_estate = NULL;
+}
+
+static void
+direct_xact_cb(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+    case XACT_EVENT_PRE_COMMIT:
+    case XACT_EVENT_PARALLEL_PRE_COMMIT:
+    case XACT_EVENT_PRE_PREPARE:
+        if (NULL != direct_table)
+            ereport(ERROR,
+                    errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("Bagger direct insertion targets were not closed"),
+                    errhint("Direct routing requires the bagger_flush_batch "
+                            "statement trigger on the inbound table."));
+        break;
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+    case XACT_EVENT_PREPARE:
+        direct_forget();
+        break;
+    }
+}
+
+/*
+ * The partitions opened in the aborted subtransaction, or below it, are
+ * released by its resource owner, and we forget them.  Partitions opened
+ * further up stay open.
+ */
+static void
+direct_subxact_cb(SubXactEvent event, SubTransactionId mySubid,
+                  SubTransactionId parentSubid, void *arg)
+{
+    HASH_SEQ_STATUS status;
+    direct_target *target;
+
+    if (SUBXACT_EVENT_ABORT_SUB != event || NULL == direct_table)
+        return;
+
+    hash_seq_init(&status, direct_table);
+    while (NULL != (target = hash_seq_search(&status)))
+        if (target->subid >= mySubid)
+            hash_search(direct_table, &target->relid, HASH_REMOVE, NULL);
+
+    if (0 == hash_get_num_entries(direct_table))
+    {
+        MemoryContextDelete(DirectCtx);
+        direct_forget();
+    }
+}
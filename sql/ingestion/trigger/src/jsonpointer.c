@@ -73,11 +73,76 @@ jsonpointer_parse(size_t size, char *ptr)
 int
 Jsonpointer_isdigit(Jsonpointer *ptr)
 {
-    for (; ptr->ref; ptr->ref++)
+    const char *c;
+
+    if ('\0' == *ptr->ref)
+        return 0;
+    for (c = ptr->ref; *c; c++)
     {
-        if (!isdigit(ptr->ref))
+        if (!isdigit((unsigned char) *c))
             return 0;
     }
     return 1;
 }
 
+/*
+ * Compiles a parsed Jsonpointer into a flat array of tokens, returning the
+ * array and setting *ntokens to its length.  The tokens and the key strings
+ * they point to are a single palloc'd block in the current memory context,
+ * and do not depend on the list they were built from.
+ *
+ * Whether a step can be an array index, its index, and the hash and length
+ * of its key are all worked out here, so that code following the pointer
+ * does not need to look at the strings again.  Steps made of digits which
+ * do not fit in 32 bits can only be object keys.
+ */
+
+Jsonpointer_token *
+jsonpointer_compile(Jsonpointer *ptr, int *ntokens)
+{
+	Jsonpointer *jp;
+	Jsonpointer_token *tokens;
+	char *keys;
+	size_t keysize = 0;
+	int n = 0;
+	int i;
+
+	for (jp = ptr; NULL != jp; jp = jp->next)
+	{
+		keysize += strlen(jp->ref) + 1;
+		++n;
+	}
+
+	tokens = palloc(sizeof(Jsonpointer_token) * n + keysize);
+	keys = (char *) (tokens + n);
+
+	for (jp = ptr, i = 0; NULL != jp; jp = jp->next, ++i)
+	{
+		Jsonpointer_token *tok = &tokens[i];
+		size_t len = strlen(jp->ref);
+
+		memcpy(keys, jp->ref, len + 1);
+		tok->key = keys;
+		tok->keylen = len;
+		tok->hash = bagger_hash_bytes(FNV_OFFSET_BASIS, keys, len);
+		tok->kind = JSONPOINTER_KEY;
+		tok->index = 0;
+		if (Jsonpointer_isdigit(jp))
+		{
+			uint64 index = 0;
+			const char *c;
+
+			for (c = jp->ref; *c && index <= PG_UINT32_MAX; c++)
+				index = index * 10 + (*c - '0');
+			if (index <= PG_UINT32_MAX)
+			{
+				tok->kind = JSONPOINTER_INDEX;
+				tok->index = (uint32) index;
+			}
+		}
+		keys += len + 1;
+	}
+
+	*ntokens = n;
+	return tokens;
+}
@@ -10,9 +10,27 @@ typedef struct Jsonpointer {
 Jsonpointer *jsonpointer_parse(size_t, char *);
 int Jsonpointer_isdigit(Jsonpointer* ptr);
 
+/* A step of a compiled pointer, see jsonpointer_compile() */
+typedef enum Jsonpointer_kind {
+    JSONPOINTER_KEY,        /* can only be an object key */
+    JSONPOINTER_INDEX       /* an object key, or an array index */
+} Jsonpointer_kind;
+
+typedef struct Jsonpointer_token {
+    const char *key;        /* null terminated, stored after the tokens */
+    uint32 keylen;
+    uint32 hash;            /* bagger_hash_bytes() of the key */
+    uint32 index;           /* only set for JSONPOINTER_INDEX */
+    Jsonpointer_kind kind;
+} Jsonpointer_token;
+
+Jsonpointer_token *jsonpointer_compile(Jsonpointer *ptr, int *ntokens);
+
 typedef struct Partition_dimension Partition_dimension;
 typedef struct Partition_dimension {
     Jsonpointer *entry;
+    Jsonpointer_token *tokens;
+    int ntokens;
     int ord;
     Partition_dimension *next;
 } Partition_dimension;
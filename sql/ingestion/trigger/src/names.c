@@ -1,7 +1,16 @@
 #include "bagger.h"
 #include "jsonpointer.h"
 #include <string.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_type.h>
+#include <utils/array.h>
+#include <utils/inval.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/numeric.h>
 #include "names.h"
+#include "partname.h"
+#include "timebucket.h"
 
 /* Bagger name munger module
  *
@@ -10,303 +19,884 @@
  * This module generates table names looking at json paths stored in our
  * config.
  *
- * The name structure is bp_[partition fields]_YYYY_MM_DD_HH
+ * The name structure is bp_[hash of partition fields]_YYYY_MM_DD_HH
  */
 
 
-/* The overall approach we take is to retrieve and store the jsonpointers
- * in alphabetical order (which in c locale corresponds to the same collation
- * order as our search order.
+/* The overall approach we take is to parse and compile all the dimension
+ * jsonpointers once and merge them into a trie, so that pointers sharing a
+ * prefix share the nodes for it.  The trie is then flattened into a single
+ * array in breadth first order, so the children of a node are contiguous
+ * and each node carries its compiled step (key, length, and array index if
+ * there is one) by value.  Each document is then walked once, following
+ * only the branches of the trie, without looking at the pointer strings.
+ * Each step is a lookup in the jsonb container (binary search for object
+ * keys, direct access for array elements) rather than a scan through the
+ * keys, and nested containers are used in place without being copied.
  *
- * We then store this with the ordinal, and sort the labels by ordinal before
-  generating the table name.  We can generally assume that there are fewer
- * dimensions than JSON keys so this should be a performance win.
+ * Nodes where a dimension pointer ends carry its ordinal, and the ordinals
+ * are numbered from 1 without gaps.  The label found for a dimension goes
+ * straight into its slot in an array indexed by ordinal, so the labels are
+ * in name order as soon as the walk is done.  String labels point into the
+ * document itself.
+ *
+ * The labels are not part of the name.  They are hashed, each prefixed with
+ * its length so that labels containing "_" cannot run together, and the
+ * name is "bp_", the 64 bit hash in hex, and the hour suffix.  Names are
+ * therefore always 33 bytes, whatever the labels, and never truncated at
+ * NAMEDATALEN.  storage.partition_name() computes the same name in SQL, and
+ * the labels and hour of each partition are kept in the storage.partition
+ * registry, so nothing needs to parse names.  partition_key_from_name()
+ * gives the labels of the last name built, for creating the partition.
+ *
+ * The name is written into a buffer owned by this module.  The "bp_"
+ * prefix is written once, and each row only overwrites what follows it.
+ * Apart from numeric labels, which need numeric_out, and array lookups,
+ * nothing is allocated per row.
+ *
+ * The hour comes from the top-level field named by the timestamp_field
+ * config key, see timebucket.c.  Nearly all rows in a burst fall into the
+ * same hour so the suffix is only formatted again when the hour changes.
+ * Unlike dimensions, a document without a usable timestamp cannot be routed
+ * at all.
+ *
+ * Documents which cannot be routed, for that or because they do not fit the
+ * dimensions (an array where a pointer needs an object key), are
+ * rejected.  With bagger.on_error set to error
+ * this is an ERROR.  Otherwise the reason is kept, see
+ * partition_name_error(), and partition_name_from_doc() returns NULL so the
+ * caller can send the row to the dead letter table and go on with the rest
+ * of the statement.
+ *
+ * Dimensions are time bound.  A new dimension takes effect at the hour
+ * boundary in its valid_from, and an expired one stops at its valid_until,
+ * so the dimensions in force differ from one hour to the next.  We split
+ * time at every valid_from and valid_until into versions, each with the
+ * dimensions valid for all of it, and build one trie per version.  A
+ * document is routed with the version covering its hour, so rows for the
+ * same hour always get the same name whatever the time they arrive at, and
+ * the switch happens exactly at the boundary.  Since rows mostly arrive in
+ * hour order, the version used last is tried first.
+ *
+ * The flattened tries, the versions, the key strings, and the timestamp
+ * field make up the dimension set, a single block which can be copied and
+ * relocated.  With shared memory, the set is shared through catalog.c and
+ * only the first backend after a change builds it.  Backends check the
+ * generation of the configuration at the start of each document and load
+ * the current set when it has changed.  Without shared memory, the change
+ * trigger invalidates the relcache entry of the changed table instead, and
+ * a relcache callback marks the set stale.  Either way the new set is
+ * swapped in between two documents, never during one.
  */
 
-Name_slist_entry* find_next_in_doc(Jsonb* jsondoc, JsonbIterator* iter, Jsonpointer* jptr);
+/* The trie as it is built, before flatten_trie() */
+typedef struct Trie_build Trie_build;
+typedef struct Trie_build {
+    Jsonpointer_token *token;   /* NULL for the root */
+    int ord;
+    int nchildren;
+    int maxchildren;
+    Trie_build *children;
+} Trie_build;
+
+/* A node of the flattened trie.  Node 0 is the root. */
+typedef struct Dimension_node {
+    Jsonpointer_token token;
+    int ord;                /* ordinal if a dimension ends here, else 0 */
+    int first_child;        /* index of the first child in nodes */
+    int nchildren;
+} Dimension_node;
+
+/* A trie as it is built, with the hours it applies to */
+typedef struct Version_build {
+    int64 from_hour;
+    int64 until_hour;
+    Trie_build root;
+} Version_build;
+
+/* The dimensions in force for a range of hours.  Hours are epoch hours as
+ * used by timebucket.c.
+ */
+typedef struct Dimension_version {
+    int64 from_hour;        /* first hour, inclusive */
+    int64 until_hour;       /* exclusive */
+    int root;               /* index of the trie root in nodes */
+    int dimension_count;
+} Dimension_version;
+
+/* The compiled dimensions.  One block, the nodes are followed by the
+ * versions and then the key strings.
+ */
+typedef struct Dimension_set {
+    Size size;              /* of the whole block */
+    int max_dimensions;     /* largest dimension_count of any version */
+    int nversions;
+    int nnodes;
+    Dimension_version *versions;    /* in hour order */
+    const char *timestamp_field;
+    int timestamp_len;
+    Dimension_node nodes[FLEXIBLE_ARRAY_MEMBER];
+} Dimension_set;
+
+typedef struct Dimension_label {
+    const char *val;        /* not null terminated */
+    int len;
+} Dimension_label;
+
+static Dimension_set *dimensions = NULL;
+static uint64 dimensions_generation;
+static bool dimensions_stale = false;
+static bool relcache_callback_registered = false;
+static Oid dimension_relid = InvalidOid;
+static Oid config_relid = InvalidOid;
+static Dimension_node *dimension_nodes;     /* dimensions->nodes */
+static const Dimension_version *current_version;
+static Dimension_label *dimension_labels;     /* indexed by ord - 1 */
+static Partition_name partition_name_buf;
+static char name_buf[NAMEDATALEN];
+static bool name_valid = false;     /* name_buf is the last document's */
+static const Dimension_version *name_version;
+static int64 name_hour;
+static bool hour_cached = false;
+static int64 cached_hour;
+static char hour_suffix_buf[HOUR_SUFFIX_LEN + 1];
+static bool doc_rejected;
+static char reject_reason[256];
+
+void load_dimensions(void);
+
+Partition_name *partition_name_from_doc(Jsonb *jsondoc);
+const char *partition_name_error(void);
+uint32 partition_name_hash(const void *key, Size keysize);
+
+static Dimension_set *build_dimension_set(void);
+static char *load_timestamp_field(void);
+static void relocate_dimension_set(Dimension_set *set, const void *base);
+static void dimension_relcache_cb(Datum arg, Oid relid);
+static bool hour_from_doc(Jsonb *jsondoc, int64 *hour);
+static const Dimension_version *version_for_hour(int64 hour);
+static const char *hour_suffix(int64 hour);
+static void add_to_trie(Trie_build *root, Partition_dimension *dim);
+static Dimension_set *flatten_trie(Version_build *versions, int nversions,
+                                   int maxnodes, Size keysize,
+                                   const char *timestamp);
+static int64 hour_or_default(HeapTuple tuple, TupleDesc tupdesc, int col,
+                             int64 dflt);
+static void walk_trie(JsonbContainer *container, const Dimension_node *node);
+static void set_label(int ord, JsonbValue *val);
+static void set_missing_labels(const Dimension_node *node);
+static uint64 labels_hash(int count);
+static void reject_doc(int sqlerrcode, const char *fmt, ...)
+    pg_attribute_printf(2, 3);
+
+/* void load_dimensions()
+ *
+ * Makes the current dimension set the one in use, replacing any set loaded
+ * before.  The set is copied from shared memory when it is there for the
+ * current generation, and built from the catalogs otherwise.  The label
+ * slots and the fixed part of the name are set up here too.
+ *
+ * Everything kept is allocated in TrigStateCtx since it must outlive the
+ * SPI connection it is loaded over.  The caller must be connected to SPI.
+ */
+void
+load_dimensions()
+{
+    uint64 generation = bagger_catalog_generation();
+    const void *base;
+    Dimension_set *set;
+    Oid nspid;
 
+    if (!relcache_callback_registered)
+    {
+        CacheRegisterRelcacheCallback(dimension_relcache_cb, (Datum) 0);
+        relcache_callback_registered = true;
+    }
+    /* cleared first so that a change arriving during the load is kept */
+    dimensions_stale = false;
+    nspid = get_namespace_oid("storage", false);
+    dimension_relid = get_relname_relid("dimension", nspid);
+    config_relid = get_relname_relid("config", nspid);
+
+    set = bagger_catalog_copy_dimensions(generation, TrigStateCtx, &base);
+    if (NULL != set)
+        relocate_dimension_set(set, base);
+    else
+    {
+        set = build_dimension_set();
+        bagger_catalog_store_dimensions(generation, set, set->size);
+    }
 
-Partition_dimension *dimension_ptr_head;
+    if (NULL != dimensions)
+    {
+        pfree(dimensions);
+        pfree(dimension_labels);
+    }
+    dimensions = set;
+    dimensions_generation = generation;
+    dimension_nodes = set->nodes;
+    current_version = &set->versions[0];
+    dimension_labels = MemoryContextAllocZero(TrigStateCtx,
+                                              sizeof(Dimension_label)
+                                              * Max(set->max_dimensions, 1));
+
+    name_valid = false;
+    partition_name_buf.name = name_buf;
+}
 
-void initialize_dimensions( void );
+/* Loads the paths we will need to follow and parses them.  Each path is
+ * compiled to an array of tokens which is then merged into the trie of each
+ * version it is valid in, and the tries are flattened into a new dimension
+ * set in TrigStateCtx.  The parsed paths themselves are only needed until
+ * then.
+ *
+ * The versions come from splitting time at every valid_from and
+ * valid_until.  A dimension is in a version if it is valid for the whole of
+ * it, and the ordinals are numbered within each version.  Versions are
+ * given in whole hours, a version starting within an hour taking effect at
+ * the next one.
+ */
+static Dimension_set *
+build_dimension_set()
+{
+    Version_build *versions;
+    int nversions = 0;
+    int ret;
+    int r;
+    SPITupleTable *tuptable;
+    TupleDesc tupdesc;
+    int maxnodes = 0;
+    Size keysize = 0;
+    char *timestamp;
+
+    /* not read only, so that we see configuration committed since the
+     * statement started
+     */
+    ret = SPI_execute("WITH bounds AS ( "
+                      "     SELECT valid_from AS t FROM storage.dimension "
+                      "     UNION "
+                      "     SELECT valid_until FROM storage.dimension "
+                      "), intervals AS ( "
+                      "     SELECT t AS from_t, "
+                      "            lead(t) over(order by t) AS until_t "
+                      "     FROM bounds "
+                      ") "
+                      "SELECT fieldname, row_number() "
+                      "     over(partition by i.from_t "
+                      "          order by d.ordinality asc) "
+                      "     as ordinality, "
+                      "     CASE WHEN isfinite(i.from_t) "
+                      "          THEN ceil(extract(epoch FROM i.from_t) "
+                      "                    / 3600)::int8 END, "
+                      "     CASE WHEN isfinite(i.until_t) "
+                      "          THEN ceil(extract(epoch FROM i.until_t) "
+                      "                    / 3600)::int8 END "
+                      "FROM intervals i "
+                      "JOIN storage.dimension d "
+                      "     ON d.valid_from <= i.from_t "
+                      "        AND d.valid_until >= i.until_t "
+                      "ORDER BY i.from_t, fieldname ASC", false, 0);
+    if (SPI_OK_SELECT != ret)
+        elog(ERROR, "SPI_execute returned %d", ret);
+    if (NULL == SPI_tuptable)
+        elog(ERROR, "Dimensions query returned no results!");
+
+    tuptable = SPI_tuptable;
+    tupdesc = tuptable->tupdesc;
+    if (tuptable->numvals == 0)
+        elog(ERROR, "0 Dimensions Returned");
+
+    /* at most one version per row */
+    versions = palloc0(sizeof(Version_build) * tuptable->numvals);
+    for (r = 0; r < tuptable->numvals; r++)
+    {
+        HeapTuple tuple = tuptable->vals[r];
+        char *jptr = SPI_getvalue(tuple, tupdesc, 1);
+        int64 from = hour_or_default(tuple, tupdesc, 3, PG_INT64_MIN);
+        int64 until = hour_or_default(tuple, tupdesc, 4, PG_INT64_MAX);
+        Partition_dimension *curr;
+
+        /* shorter than an hour, no hour is routed with it */
+        if (from >= until)
+            continue;
+        if (0 == nversions || versions[nversions - 1].from_hour != from)
+        {
+            versions[nversions].from_hour = from;
+            versions[nversions].until_hour = until;
+            ++nversions;
+            ++maxnodes;     /* the root */
+        }
 
-Name_slist_entry* dimensions_from_doc(Jsonb *jsondoc);
+        curr = palloc0(sizeof(Partition_dimension));
+        curr->entry = jsonpointer_parse(strlen(jptr) + 1, jptr);
+        curr->tokens = jsonpointer_compile(curr->entry, &curr->ntokens);
+        curr->ord = atoi(SPI_getvalue(tuple, tupdesc, 2));
+        maxnodes += curr->ntokens;
+        for (int t = 0; t < curr->ntokens; ++t)
+            keysize += curr->tokens[t].keylen + 1;
+        add_to_trie(&versions[nversions - 1].root, curr);
+    }
+    if (0 == nversions)
+        elog(ERROR, "No dimensions are valid for a whole hour");
 
-static void sort_name_slist(Name_slist_entry* head);
+    timestamp = load_timestamp_field();
 
-Partition_dimension *paths;
-/* initialize loads the paths we will need to follow and parses them.
- * Each path becomes an array of strings and this allows us to loop through
- * them.
+    /* the build tries are only needed until they are flattened */
+    return flatten_trie(versions, nversions, maxnodes, keysize, timestamp);
+}
+
+/* Returns the hour in column col of the dimensions query, or dflt if it is
+ * null (an infinite bound).
  */
-void
-initialize_dimensions()
+static int64
+hour_or_default(HeapTuple tuple, TupleDesc tupdesc, int col, int64 dflt)
 {
-   Partition_dimension *curr;
-   int ret;
-   int r;
-   SPITupleTable *tuptable = SPI_tuptable;
-   TupleDesc tupdesc;
-
-   /* This perhaps could be a warning but better safe than sorry */
-   if (NULL != dimension_ptr_head)
-       elog(ERROR, "Dimension list already initialized");
-
-   paths = NULL;
-
-   /* still need to bring the date/time in for partitioning */
-   if (SPI_OK_SELECT != (ret = SPI_execute("SELECT fieldname, row_number() "
-                                          "     over(order by ordinality asc) "
-                                          "     as ordinality "
-                                          "FROM storage.dimension "
-                                          "ORDER BY fieldname ASC", true, 0)))
-       elog(ERROR, "SPI_execute returned %d", ret);
-   if (NULL == SPI_tuptable)
-       elog(ERROR, "Dimensions query returned no results!");
-
-   dimension_ptr_head = palloc0(sizeof(Partition_dimension ));
-   curr = dimension_ptr_head;
-   tupdesc = tuptable->tupdesc;
-   if (tuptable->numvals == 0)
-       elog(ERROR, "0 Dimensions Returned");
-
-   for (r = 0; r < tuptable->numvals; r++)
-   {
-       /* yes we are leaving some spare allocations around but this is not
-        * intended to be very many or have much of an effect.
-        *
-        * Prioritizing readability over memory efficiency especially for a
-        * small amount of memory.
-        */
-       HeapTuple tuple = tuptable->vals[r];
-       char *jptr = SPI_getvalue(tuple, tupdesc, 1);
-       int ord = atoi(SPI_getvalue(tuple,tupdesc,2));
-       curr->entry = jsonpointer_parse(strlen(jptr) + 1, jptr);
-       curr->ord = ord;
-
-       if (r + 1 < tuptable->numvals)
-       {
-           curr->next = palloc0(sizeof(Partition_dimension ));
-           curr = curr->next;
-       }
-       else
-       {
-           /* just making this explicit */
-           curr->next = NULL;
-       }
-
-
-   }
+    bool isnull;
+    Datum d = SPI_getbinval(tuple, tupdesc, col, &isnull);
+
+    return isnull ? dflt : DatumGetInt64(d);
 }
 
-/* Takes a jsonb document and returns the dimensions from the jsonb document
- * based on the jsonpointers for the dimensions.
- *
- * Returns the head entry in the single linked list of name entries
+/* Loads the name of the timestamp field.  This is a top-level key, and
+ * defaults to "timestamp".
  */
-Name_slist_entry*
-dimensions_from_doc(Jsonb *jsondoc)
+static char *
+load_timestamp_field()
 {
-    Name_slist_entry *head;
-    Name_slist_entry *curr;
-    Name_slist_entry *next;
+    int ret;
+    char *field = "timestamp";
+
+    if (SPI_OK_SELECT != (ret = SPI_execute("SELECT value #>> '{}' "
+                                           "FROM storage.config "
+                                           "WHERE key = 'timestamp_field'",
+                                           false, 0)))
+        elog(ERROR, "SPI_execute returned %d", ret);
+    if (SPI_processed > 0)
+        field = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+    if (NULL == field || '\0' == *field)
+        elog(ERROR, "timestamp_field must be a non-empty string");
+    return field;
+}
 
-    Partition_dimension *jsonptr;
+/* Adjusts the pointers in a dimension set copied from base to where it is
+ * now.
+ */
+static void
+relocate_dimension_set(Dimension_set *set, const void *base)
+{
+    ptrdiff_t delta = (const char *) set - (const char *) base;
 
-    if (NULL == dimension_ptr_head)
-        initialize_dimensions();
+    for (int i = 0; i < set->nnodes; ++i)
+        if (NULL != set->nodes[i].token.key)
+            set->nodes[i].token.key += delta;
+    set->versions = (Dimension_version *) ((char *) set->versions + delta);
+    set->timestamp_field += delta;
+}
 
-    head = palloc0(sizeof(Name_slist_entry));
-    curr = head;
-    for (jsonptr = dimension_ptr_head; NULL != jsonptr; jsonptr = jsonptr->next)
+/* Relcache callback.  Marks the set stale when storage.dimension or
+ * storage.config have changed, which is how backends learn about changes
+ * when there is no shared generation.  relid is InvalidOid when the whole
+ * relcache is reset.
+ */
+static void
+dimension_relcache_cb(Datum arg, Oid relid)
+{
+    if (InvalidOid == relid || dimension_relid == relid
+        || config_relid == relid)
+        dimensions_stale = true;
+}
+
+/* Merges one compiled pointer into the trie, marking the last node with
+ * the dimension's ordinal.
+ */
+static void
+add_to_trie(Trie_build *root, Partition_dimension *dim)
+{
+    Trie_build *node = root;
+    int t;
+
+    for (t = 0; t < dim->ntokens; ++t)
     {
-        next = find_next_in_doc(jsondoc, JsonbIteratorInit (&jsondoc->root), jsonptr->entry);
-        curr->next = next;
-        next->node->ord = jsonptr->ord;
-        jsonptr = jsonptr->next;
-        if (NULL != jsonptr->next)
+        Jsonpointer_token *tok = &dim->tokens[t];
+        Trie_build *child = NULL;
+        int i;
+
+        for (i = 0; i < node->nchildren; ++i)
+        {
+            Jsonpointer_token *other = node->children[i].token;
+
+            if (other->hash == tok->hash && other->keylen == tok->keylen
+                && 0 == memcmp(other->key, tok->key, tok->keylen))
+            {
+                child = &node->children[i];
+                break;
+            }
+        }
+
+        if (NULL == child)
         {
-            curr->next = palloc0(sizeof(Name_slist_entry));
-            curr = curr->next;
+            if (node->nchildren == node->maxchildren)
+            {
+                node->maxchildren = node->maxchildren
+                                    ? node->maxchildren * 2 : 4;
+                node->children = node->children
+                    ? repalloc(node->children,
+                               sizeof(Trie_build) * node->maxchildren)
+                    : palloc(sizeof(Trie_build) * node->maxchildren);
+            }
+            child = &node->children[node->nchildren++];
+            memset(child, 0, sizeof(Trie_build));
+            child->token = tok;
         }
+        node = child;
     }
-    return head;
+    if (0 != node->ord)
+        elog(ERROR, "Duplicate dimension pointer");
+    if (dim->ord < 1)
+        elog(ERROR, "Invalid dimension ordinal %d", dim->ord);
+    node->ord = dim->ord;
 }
 
-/* Most of the work is done here.
- *
- * Takes in a jsonb document, an iterator, and the jsonptr to find.
- * Calls recursively on deeper sub-documents when we need to search pieces
- * within the document.
+/* Copies the tries breadth first into a new dimension set in TrigStateCtx.
+ * Breadth first order puts the children of each node next to each other,
+ * so the walk reads siblings from consecutive memory.  Each version's trie
+ * is copied in turn, so its nodes are together too.  maxnodes is an upper
+ * bound on the number of nodes, including the roots, and keysize on the
+ * space needed for the keys.  The keys and the timestamp field are copied
+ * into the set so that it is a single block.
+ */
+static Dimension_set *
+flatten_trie(Version_build *versions, int nversions, int maxnodes,
+             Size keysize, const char *timestamp)
+{
+    Trie_build **queue = palloc(sizeof(Trie_build *) * maxnodes);
+    Dimension_set *set;
+    Size size;
+    char *keys;
+    int head = 0;
+    int tail = 0;
+
+    size = offsetof(Dimension_set, nodes) + sizeof(Dimension_node) * maxnodes
+           + sizeof(Dimension_version) * nversions
+           + keysize + strlen(timestamp) + 1;
+    set = MemoryContextAllocZero(TrigStateCtx, size);
+    set->versions = (Dimension_version *) &set->nodes[maxnodes];
+    keys = (char *) &set->versions[nversions];
+
+    for (int v = 0; v < nversions; ++v)
+    {
+        Dimension_version *version = &set->versions[v];
+        int count = 0;
+
+        version->from_hour = versions[v].from_hour;
+        version->until_hour = versions[v].until_hour;
+        version->root = tail;
+        queue[tail++] = &versions[v].root;
+        while (head < tail)
+        {
+            Trie_build *build = queue[head];
+            Dimension_node *node = &set->nodes[head++];
+            int i;
+
+            if (NULL != build->token)
+            {
+                node->token = *build->token;
+                memcpy(keys, build->token->key, build->token->keylen + 1);
+                node->token.key = keys;
+                keys += build->token->keylen + 1;
+            }
+            if (0 != build->ord)
+                ++count;
+            node->ord = build->ord;
+            node->first_child = tail;
+            node->nchildren = build->nchildren;
+            for (i = 0; i < build->nchildren; ++i)
+                queue[tail++] = &build->children[i];
+        }
+        version->dimension_count = count;
+        set->max_dimensions = Max(set->max_dimensions, count);
+    }
+    pfree(queue);
+
+    strcpy(keys, timestamp);
+    set->timestamp_field = keys;
+    set->timestamp_len = strlen(timestamp);
+    set->size = size;
+    set->nnodes = tail;
+    set->nversions = nversions;
+    return set;
+}
+
+/* Takes a jsonb document and returns the name of the partition for it,
+ * along with its length and hash.  Returns NULL if the document was
+ * rejected, see partition_name_error().
  *
- * This function modifies the JsonbIterator and so repeated calls must be in
- * JSONB key order (alphabetical, C locale collation).
+ * The result points to a buffer in this module and is overwritten by the
+ * next call.  Callers which need to keep the name must copy it.
+ */
+Partition_name *
+partition_name_from_doc(Jsonb *jsondoc)
+{
+    const Dimension_version *version;
+    const char *suffix;
+    int64 hour;
+
+    if (NULL == dimensions || dimensions_stale
+        || dimensions_generation != bagger_catalog_generation())
+        load_dimensions();
+
+    doc_rejected = false;
+    name_valid = false;
+    if (!hour_from_doc(jsondoc, &hour))
+        return NULL;
+    if (NULL == (version = version_for_hour(hour)))
+    {
+        reject_doc(ERRCODE_DATA_EXCEPTION,
+                   "No dimensions are valid for the document's hour");
+        return NULL;
+    }
+
+    walk_trie(&jsondoc->root, &dimension_nodes[version->root]);
+    if (doc_rejected)
+        return NULL;
+
+    if (NULL == (suffix = hour_suffix(hour)))
+        return NULL;
+
+    format_partition_name(labels_hash(version->dimension_count), suffix,
+                          name_buf);
+
+    name_valid = true;
+    name_version = version;
+    name_hour = hour;
+    partition_name_buf.len = PARTITION_NAME_LEN;
+    partition_name_buf.hash = bagger_hash_bytes(FNV_OFFSET_BASIS, name_buf,
+                                                PARTITION_NAME_LEN);
+    return &partition_name_buf;
+}
+
+/* Datum partition_key_from_name(const char *tablename, Timestamp *bucket)
  *
+ * Returns the labels of the partition as a text array, and sets *bucket to
+ * the start of its hour, for storage.create_partition().  These are only
+ * known for the name partition_name_from_doc() built last, and (Datum) 0 is
+ * returned for any other name.  The labels may point into the document, so
+ * this must be called while the document is still around.
  */
+Datum
+partition_key_from_name(const char *tablename, Timestamp *bucket)
+{
+    int count;
+    Datum *elems;
+
+    if (!name_valid || 0 != strcmp(tablename, name_buf))
+        return (Datum) 0;
+
+    count = name_version->dimension_count;
+    elems = palloc(sizeof(Datum) * Max(count, 1));
+    for (int i = 0; i < count; ++i)
+        elems[i] = PointerGetDatum(cstring_to_text_with_len(
+                                       dimension_labels[i].val,
+                                       dimension_labels[i].len));
+    *bucket = (name_hour * SECS_PER_HOUR
+               - (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY)
+              * USECS_PER_SEC;
+    return PointerGetDatum(construct_array(elems, count, TEXTOID, -1, false,
+                                           TYPALIGN_INT));
+}
 
+/* const char *partition_name_error()
+ *
+ * Returns why partition_name_from_doc() last returned NULL.
+ */
+const char *
+partition_name_error()
+{
+    return reject_reason;
+}
 
-Name_slist_entry*
-find_next_in_doc(Jsonb* jsondoc, JsonbIterator* iter, Jsonpointer* jptr)
+/* Rejects the current document.  Throws unless bagger.on_error is
+ * dead_letter, in which case the reason is kept and the caller must stop
+ * working on the document.
+ */
+static void
+reject_doc(int sqlerrcode, const char *fmt, ...)
 {
-    JsonbValue val;
-    JsonbIteratorToken typ;
-    JsonbIterator last;
+    va_list args;
 
-    Name_slist_entry *ret = palloc0(sizeof(Name_slist_entry));
-    if (NULL == jsondoc)
-    {
-        elog(WARNING, "JSONPointer did not reach deep enough.");
-        ret->node->label = "";
-    }
+    va_start(args, fmt);
+    vsnprintf(reject_reason, sizeof(reject_reason), fmt, args);
+    va_end(args);
+
+    if (ERROR_ACTION_DEAD_LETTER != bagger_on_error)
+        ereport(ERROR,
+                errcode(sqlerrcode),
+                errmsg_internal("%s", reject_reason));
+    doc_rejected = true;
+}
 
-    while ((typ = JsonbIteratorNext(&iter, &val, false)))
+/* Most of the work is done here.
+ *
+ * Takes in a jsonb container and a trie node, and looks up each child of the
+ * node in the container, filling in the label slots for dimensions found.
+ * Calls recursively on nested containers when the trie goes deeper.
+ *
+ * Dimensions which cannot be found get an empty label and a warning.  An
+ * array where the trie has an object key rejects the document.
+ */
+static void
+walk_trie(JsonbContainer *container, const Dimension_node *node)
+{
+    const Dimension_node *child = &dimension_nodes[node->first_child];
+    const Dimension_node *end = child + node->nchildren;
+
+    for (; child < end; ++child)
     {
-        if (typ == WJB_BEGIN_ARRAY)
+        JsonbValue found;
+        JsonbValue *val = NULL;
+
+        if (JsonContainerIsObject(container))
+            val = getKeyJsonValueFromContainer(container,
+                                               child->token.key,
+                                               child->token.keylen,
+                                               &found);
+        else if (JsonContainerIsArray(container))
         {
-            int itcount;
-            int index;
             /* ok we have an array.  We had better make sure our next search
              * is numeric
              */
-            if (0 == Jsonpointer_isdigit(jptr))
-                elog(ERROR, "Trying to get non-int index of a JSON array");
-
-            index = atoi(jptr->ref);
-            for (itcount = 0; itcount < index; ++itcount)
+            if (JSONPOINTER_INDEX != child->token.kind)
             {
-                typ = JsonbIteratorNext(&iter, &val, false);
+                reject_doc(ERRCODE_DATA_EXCEPTION,
+                           "Trying to get non-int index \"%s\" of a JSON "
+                           "array", child->token.key);
+                return;
             }
-            if (typ == WJB_VALUE)
-            {
-                if ((val.type == jbvArray) || (val.type == jbvObject))
-                {
-                    Jsonb *doc = JsonbValueToJsonb(&val);
-                    return find_next_in_doc(doc, JsonbIteratorInit(&doc->root), jptr->next);
-                }
-                if (val.type == jbvString)
-                {
-                    ret->node->label = val.val.string.val;
-                }
+            val = getIthJsonbValueFromContainer(container,
+                                                child->token.index);
+        }
 
-            }
-            else
-            {
-                elog(WARNING, "Could not find index in document");
-                ret->node->label = "";
-                return ret;
-            }
+        /* missing fields are normal input, and get empty labels */
+        if (NULL == val)
+        {
+            set_missing_labels(child);
+            continue;
         }
-        else
+
+        if (0 != child->ord)
+            set_label(child->ord, val);
+
+        if (0 != child->nchildren)
         {
-            /* Here we assume it is an object.  We may want to eventually
-             * test for it explicitly though.
-             */
-            while ((typ = JsonbIteratorNext(&iter, &val, false)))
+            if (jbvBinary == val->type)
             {
-               if (typ == WJB_KEY)
-               {
-                  last = *iter; /* copy for restore if we need it */
-                  if (val.type == jbvString)
-                  {
-                      if (strcmp(val.val.string.val, jptr->ref) == 0)
-                      {
-                          typ = JsonbIteratorNext(&iter, &val, false);
-                          if (typ != WJB_VALUE)
-                              elog(WARNING, "Malformed JSON object, no value");
-                          if (val.type == jbvString)
-                          {
-                              ret->node->label = val.val.string.val;
-                          }
-                          else if ((val.type == jbvArray) || (val.type == jbvObject))
-                          {
-                              Jsonb *doc = JsonbValueToJsonb(&val);
-                              return find_next_in_doc(doc, JsonbIteratorInit(&doc->root), jptr->next);
-                          }
-                      } else if (strcmp(val.val.string.val, jptr->ref) > 0)
-                      {
-                          /* we went too far, return empty string
-                           * I am concerned about corner cases
-                           */
-                          iter = &last;
-                          ret->node->label = "";
-                          return ret;
-
-                      }
-                  }
-               }
+                walk_trie(val->val.binary.data, child);
+                if (doc_rejected)
+                    return;
+            }
+            else
+            {
+                elog(WARNING, "JSONPointer did not reach deep enough.");
+                set_missing_labels(child);
             }
-            /* if we get here and haven't returned, something went wrong.
-             * Most likely the document did not have the field in question.
-             * Warn and return empty string
-             */
-            elog(WARNING, "JSONB key not found in document");
-            ret->node->label = "";
-            return ret;
-
         }
     }
-    return NULL;
 }
 
-static void
-append_to_name(char *name, const char *value)
+/* Returns whether the numeric is at least the bound. */
+static bool
+numeric_at_least(Numeric num, int64 bound)
+{
+    return DatumGetBool(DirectFunctionCall2(numeric_ge,
+                        NumericGetDatum(num),
+                        DirectFunctionCall1(int8_numeric,
+                                            Int64GetDatum(bound))));
+}
+
+/* Returns whether a numeric timestamp falls in the years which can be
+ * partitioned.  This is checked before converting it, since numeric_int8
+ * raises an error for numbers out of its range, and the unit is decided on
+ * the number as it is, as storage.document_time() does, not once floored.
+ */
+static bool
+epoch_in_range(Numeric num)
 {
-    /* 1 for the null terminator and one for the separator, so 2 */
-    if (strlen(name) + strlen(value) == NAMEDATALEN - 2)
-        elog(ERROR, "NAMEDATALEN exceeded for partition name");
+    int64 scale = numeric_at_least(DatumGetNumeric(
+                      DirectFunctionCall1(numeric_abs, NumericGetDatum(num))),
+                                   EPOCH_MS_THRESHOLD) ? 1000 : 1;
 
-    strcat(name, "_");
-    strcat(name, value);
+    return numeric_at_least(num, EPOCH_MIN * scale)
+           && !numeric_at_least(num, EPOCH_MAX * scale);
 }
 
-static void 
-sort_name_slist(Name_slist_entry *head)
+/* Finds the epoch hour of the document's timestamp.  Returns false if the
+ * document was rejected.
+ */
+static bool
+hour_from_doc(Jsonb *jsondoc, int64 *hour)
 {
-    int ord = 1;
-    int found;
-    Name_slist_entry *curr;
-    Name_slist_entry *search;
-    Namenode* temp;
-    
-
-    /* we will just do a bubble sort and swap name nodes */
-    for (curr = head; curr != NULL; curr = curr->next)
+    JsonbValue found;
+    JsonbValue *val = NULL;
+
+    if (JsonContainerIsObject(&jsondoc->root))
+        val = getKeyJsonValueFromContainer(&jsondoc->root,
+                                           dimensions->timestamp_field,
+                                           dimensions->timestamp_len,
+                                           &found);
+    if (NULL == val)
     {
-        if (curr->node->ord == ord)
+        reject_doc(ERRCODE_DATA_EXCEPTION,
+                   "Timestamp field \"%s\" not found in document",
+                   dimensions->timestamp_field);
+        return false;
+    }
+
+    switch (val->type)
+    {
+    case jbvString:
+        if (!iso8601_to_hour(val->val.string.val, val->val.string.len, hour))
         {
-            continue;
-        } 
+            reject_doc(ERRCODE_INVALID_DATETIME_FORMAT,
+                       "Invalid timestamp \"%.*s\"",
+                       val->val.string.len, val->val.string.val);
+            return false;
+        }
+        break;
+    case jbvNumeric:
+        /* seconds since the epoch, possibly fractional */
+        if (!epoch_in_range(val->val.numeric))
+        {
+            reject_doc(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE,
+                       "Timestamp out of range for partitioning");
+            return false;
+        }
+        *hour = epoch_to_hour(DatumGetInt64(DirectFunctionCall1(numeric_int8,
+                              DirectFunctionCall1(numeric_floor,
+                                      NumericGetDatum(val->val.numeric)))));
+        break;
+    default:
+        reject_doc(ERRCODE_INVALID_DATETIME_FORMAT,
+                   "Timestamp field \"%s\" must be a string or number",
+                   dimensions->timestamp_field);
+        return false;
+    }
+    return true;
+}
+
+/* Returns the version of the dimensions in force for the hour, or NULL if
+ * there is none.  The version used last is checked first, and the others
+ * are searched by bisection.
+ */
+static const Dimension_version *
+version_for_hour(int64 hour)
+{
+    int lo = 0;
+    int hi = dimensions->nversions;
+
+    if (hour >= current_version->from_hour
+        && hour < current_version->until_hour)
+        return current_version;
+
+    /* find the last version starting at or before the hour */
+    while (hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (dimensions->versions[mid].from_hour <= hour)
+            lo = mid;
         else
+            hi = mid;
+    }
+    if (hour < dimensions->versions[lo].from_hour
+        || hour >= dimensions->versions[lo].until_hour)
+        return NULL;
+    current_version = &dimensions->versions[lo];
+    return current_version;
+}
+
+/* Returns the YYYY_MM_DD_HH suffix for the hour.  The result is a buffer in
+ * this module.  Returns NULL if the document was rejected.
+ */
+static const char *
+hour_suffix(int64 hour)
+{
+    if (!hour_cached || hour != cached_hour)
+    {
+        if (!format_hour(hour, hour_suffix_buf))
         {
-            for (found = 0, search = curr; search != NULL || found; search = search->next)
-            {
-                if (search->node->ord == ord)
-                {
-                    temp = search->node;
-                    search->node = curr->node;
-                    curr->node = temp;
-
-                    found = 1;
-                }
-            }
+            reject_doc(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE,
+                       "Timestamp out of range for partitioning");
+            return NULL;
         }
+        cached_hour = hour;
+        hour_cached = true;
     }
+    return hour_suffix_buf;
 }
 
-char *
-partition_name(Name_slist_entry *head)
+/* Sets the label for a dimension from a scalar value. */
+static void
+set_label(int ord, JsonbValue *val)
 {
-    char* name = palloc0(NAMEDATALEN + 1);
-    Name_slist_entry *curr = head;
+    Dimension_label *label = &dimension_labels[ord - 1];
 
-    strcpy(name, "data");
-    sort_name_slist(head);
+    switch (val->type)
+    {
+    case jbvString:
+        label->val = val->val.string.val;
+        label->len = val->val.string.len;
+        break;
+    case jbvNumeric:
+        label->val = DatumGetCString(DirectFunctionCall1(numeric_out,
+                                     NumericGetDatum(val->val.numeric)));
+        label->len = strlen(label->val);
+        break;
+    case jbvBool:
+        label->val = val->val.boolean ? "true" : "false";
+        label->len = strlen(label->val);
+        break;
+    default:
+        /* nulls and containers do not make sensible names */
+        label->val = "";
+        label->len = 0;
+    }
+}
 
+/* Sets empty labels for every dimension at or below node */
+static void
+set_missing_labels(const Dimension_node *node)
+{
+    int i;
 
-    while (NULL != curr)
+    if (0 != node->ord)
     {
-        append_to_name(name, curr->node->label);
-        curr = curr->next;
+        dimension_labels[node->ord - 1].val = "";
+        dimension_labels[node->ord - 1].len = 0;
     }
-    return name;
+    for (i = 0; i < node->nchildren; ++i)
+        set_missing_labels(&dimension_nodes[node->first_child + i]);
+}
+
+/* Hashes the first count labels, in name order, see partname.c. */
+static uint64
+labels_hash(int count)
+{
+    uint64 hash = LABELS_HASH_INIT;
+
+    for (int i = 0; i < count; ++i)
+        hash = labels_hash_add(hash, dimension_labels[i].val,
+                               dimension_labels[i].len);
+    return hash;
+}
+
+/* uint32 partition_name_hash(const void *key, Size keysize)
+ *
+ * Hash function for tables keyed by partition name.  This gives the same
+ * value as partition_name_from_doc() computes for the name, so those tables
+ * can be searched with hash_search_with_hash_value() on the hot path.
+ */
+uint32
+partition_name_hash(const void *key, Size keysize)
+{
+    return bagger_hash_bytes(FNV_OFFSET_BASIS, key, strnlen(key, keysize - 1));
 }
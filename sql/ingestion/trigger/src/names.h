@@ -0,0 +1,16 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <utils/jsonb.h>
+
+/* A partition name, see partition_name_from_doc() */
+typedef struct Partition_name {
+    char *name;
+    int len;
+    uint32 hash;
+} Partition_name;
+
+Partition_name *partition_name_from_doc(Jsonb *jsondoc);
+const char *partition_name_error(void);
+
+#endif
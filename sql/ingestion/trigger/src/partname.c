@@ -0,0 +1,79 @@
+#include <string.h>
+#include <postgres.h>
+#include "partname.h"
+
+/* Bagger partition name module
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Partition names are bp_, a 64 bit FNV-1a hash of the dimension labels in
+ * hex, and the hour as YYYY_MM_DD_HH.  Each label is hashed with its length
+ * in bytes and a colon in front of it, so that labels cannot run together.
+ * This must give the same names as storage.partition_name() in SQL, which
+ * test/partname_test.c and the storage pgTAP tests both check against the
+ * same names.
+ *
+ * Like the time bucket module, nothing in this file depends on the backend,
+ * so it can be tested standalone.
+ */
+
+#define FNV64_PRIME UINT64CONST(1099511628211)
+
+static inline uint64
+hash_bytes64(uint64 hash, const char *str, int len)
+{
+    const unsigned char *c = (const unsigned char *) str;
+    const unsigned char *end = c + len;
+
+    for (; c < end; ++c)
+    {
+        hash ^= *c;
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * uint64 labels_hash_add(uint64 hash, const char *label, int len)
+ *
+ * Adds the next label, of len bytes and not null terminated, to the hash of
+ * the labels before it, or to LABELS_HASH_INIT for the first one.
+ */
+uint64
+labels_hash_add(uint64 hash, const char *label, int len)
+{
+    char lenbuf[16];
+    int n = sizeof(lenbuf);
+    int rest = len;
+
+    /* the length in decimal and a colon, written from the end */
+    lenbuf[--n] = ':';
+    do
+    {
+        lenbuf[--n] = '0' + rest % 10;
+        rest /= 10;
+    } while (rest > 0);
+    hash = hash_bytes64(hash, lenbuf + n, sizeof(lenbuf) - n);
+    return hash_bytes64(hash, label, len);
+}
+
+/*
+ * void format_partition_name(uint64 labels, const char *suffix, char *buf)
+ *
+ * Writes the name of the partition with the labels hash and the hour suffix
+ * from format_hour() into buf, which must have room for PARTITION_NAME_LEN
+ * bytes plus a terminator.
+ */
+void
+format_partition_name(uint64 labels, const char *suffix, char *buf)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    char *hex = buf + PARTITION_NAME_PREFIX_LEN;
+
+    memcpy(buf, PARTITION_NAME_PREFIX, PARTITION_NAME_PREFIX_LEN);
+    for (int i = 15; i >= 0; --i, labels >>= 4)
+        hex[i] = hexdigits[labels & 0xf];
+    hex[16] = '_';
+    memcpy(hex + 17, suffix, HOUR_SUFFIX_LEN);
+    buf[PARTITION_NAME_LEN] = '\0';
+}
@@ -0,0 +1,18 @@
+#ifndef PARTNAME_H
+#define PARTNAME_H
+
+#include "timebucket.h"
+
+#define PARTITION_NAME_PREFIX "bp_"
+#define PARTITION_NAME_PREFIX_LEN (sizeof(PARTITION_NAME_PREFIX) - 1)
+/* bp_, 16 hex digits, _, and the hour suffix */
+#define PARTITION_NAME_LEN (PARTITION_NAME_PREFIX_LEN + 16 + 1 \
+                            + HOUR_SUFFIX_LEN)
+
+/* the hash of no labels, to which each label is added */
+#define LABELS_HASH_INIT UINT64CONST(14695981039346656037)
+
+uint64 labels_hash_add(uint64 hash, const char *label, int len);
+void format_partition_name(uint64 labels, const char *suffix, char *buf);
+
+#endif
@@ -0,0 +1,185 @@
+#include <postgres.h>
+#include "placement.h"
+
+/* Bagger consistent hash placement
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * In ring mode a servermap does not tie data to fixed groups of nodes.
+ * Instead each partition key, that is the partition name which stands for
+ * the dimension labels and the hour, is placed on a hash ring.  Each node
+ * owns weight * vnodes points on the ring, and a key is stored on the nodes
+ * owning the first points at or after the key's hash, going around the ring,
+ * skipping nodes already taken and, while there are other choices, nodes in
+ * a failure domain already taken.
+ *
+ * Since the labels and the hour both go into the key, the hours of a hot
+ * tenant are spread over the cluster instead of pinning one node.  Adding
+ * or removing a node only moves the keys next to its points.
+ *
+ * Schaufel, the trigger, and the query side must all place keys the same
+ * way, so this file depends on nothing but the integer types and qsort, and
+ * the Perl side (Bagger::Storage::Servermap) implements the same functions.
+ * Hashes are 64 bit FNV-1a, as for partition names, followed by the
+ * MurmurHash3 finalizer, since FNV alone spreads the short and similar
+ * strings naming virtual nodes poorly.
+ *
+ * A point is the hash of "name#i", with i counting from 0.  Points with the
+ * same hash are ordered by node index, and nodes are in servermap order.
+ */
+
+#define PLACEMENT_FNV_OFFSET_BASIS UINT64CONST(14695981039346656037)
+#define PLACEMENT_FNV_PRIME UINT64CONST(1099511628211)
+
+/* prototypes */
+static inline uint64 fnv1a(uint64 hash, const char *data, size_t len);
+static inline uint64 fmix64(uint64 k);
+static int token_cmp(const void *a, const void *b);
+
+static inline uint64
+fnv1a(uint64 hash, const char *data, size_t len)
+{
+    const unsigned char *c = (const unsigned char *) data;
+    const unsigned char *end = c + len;
+
+    for (; c < end; ++c)
+    {
+        hash ^= *c;
+        hash *= PLACEMENT_FNV_PRIME;
+    }
+    return hash;
+}
+
+static inline uint64
+fmix64(uint64 k)
+{
+    k ^= k >> 33;
+    k *= UINT64CONST(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * uint64 placement_hash(const char *data, size_t len)
+ *
+ * Returns the ring position of a key.
+ */
+uint64
+placement_hash(const char *data, size_t len)
+{
+    return fmix64(fnv1a(PLACEMENT_FNV_OFFSET_BASIS, data, len));
+}
+
+/*
+ * int placement_ring_size(const placement_node *nodes, int nnodes,
+ *                         int vnodes)
+ *
+ * Returns the number of points on the ring, which is the size of the array
+ * placement_ring_build() needs.
+ */
+int
+placement_ring_size(const placement_node *nodes, int nnodes, int vnodes)
+{
+    int size = 0;
+
+    for (int i = 0; i < nnodes; ++i)
+        size += nodes[i].weight * vnodes;
+    return size;
+}
+
+static int
+token_cmp(const void *a, const void *b)
+{
+    const placement_token *ta = a;
+    const placement_token *tb = b;
+
+    if (ta->hash != tb->hash)
+        return ta->hash < tb->hash ? -1 : 1;
+    return ta->node - tb->node;
+}
+
+/*
+ * void placement_ring_build(const placement_node *nodes, int nnodes,
+ *                           int vnodes, placement_token *ring)
+ *
+ * Fills ring with the sorted points of the nodes.
+ */
+void
+placement_ring_build(const placement_node *nodes, int nnodes, int vnodes,
+                     placement_token *ring)
+{
+    int n = 0;
+
+    for (int i = 0; i < nnodes; ++i)
+    {
+        uint64 base = fnv1a(PLACEMENT_FNV_OFFSET_BASIS, nodes[i].name,
+                            strlen(nodes[i].name));
+
+        base = fnv1a(base, "#", 1);
+        for (int v = 0; v < nodes[i].weight * vnodes; ++v)
+        {
+            char digits[12];
+            int len = snprintf(digits, sizeof(digits), "%d", v);
+
+            ring[n].hash = fmix64(fnv1a(base, digits, len));
+            ring[n].node = i;
+            ++n;
+        }
+    }
+    qsort(ring, n, sizeof(placement_token), token_cmp);
+}
+
+/*
+ * int placement_lookup(const placement_token *ring, int ntokens,
+ *                      const placement_node *nodes, uint64 key,
+ *                      int replicas, int *out)
+ *
+ * Writes the indexes of the nodes holding the key to out, the first being
+ * the primary, and returns how many were written.  This is replicas, up to
+ * PLACEMENT_MAX_REPLICAS, unless there are fewer nodes.
+ */
+int
+placement_lookup(const placement_token *ring, int ntokens,
+                 const placement_node *nodes, uint64 key, int replicas,
+                 int *out)
+{
+    int lo = 0;
+    int hi = ntokens;
+    int found = 0;
+
+    if (replicas > PLACEMENT_MAX_REPLICAS)
+        replicas = PLACEMENT_MAX_REPLICAS;
+    if (0 == ntokens)
+        return 0;
+
+    /* first point at or after the key */
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ring[mid].hash < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* once around for new failure domains, and once for any other node */
+    for (int pass = 0; pass < 2 && found < replicas; ++pass)
+    {
+        for (int step = 0; step < ntokens && found < replicas; ++step)
+        {
+            int node = ring[(lo + step) % ntokens].node;
+            bool taken = false;
+
+            for (int i = 0; i < found && !taken; ++i)
+                taken = out[i] == node
+                        || (0 == pass
+                            && nodes[out[i]].domain == nodes[node].domain);
+            if (!taken)
+                out[found++] = node;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,29 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+/* Most copies a lookup returns */
+#define PLACEMENT_MAX_REPLICAS 8
+
+/* A storage node in the ring, see placement.c */
+typedef struct placement_node
+{
+    const char *name;   /* host_port, as in servermap keys */
+    int weight;         /* virtual nodes are weight * vnodes */
+    int domain;         /* nodes with the same number share a failure domain */
+} placement_node;
+
+typedef struct placement_token
+{
+    uint64 hash;
+    int node;           /* index into the node array */
+} placement_token;
+
+uint64 placement_hash(const char *data, size_t len);
+int placement_ring_size(const placement_node *nodes, int nnodes, int vnodes);
+void placement_ring_build(const placement_node *nodes, int nnodes, int vnodes,
+                          placement_token *ring);
+int placement_lookup(const placement_token *ring, int ntokens,
+                     const placement_node *nodes, uint64 key, int replicas,
+                     int *out);
+
+#endif
@@ -5,6 +5,17 @@
 #include <access/relation.h>
 #include <catalog/namespace.h>
 #include <utils/varlena.h>
+#include <nodes/makefuncs.h>
+#include <utils/hsearch.h>
+#include <utils/lsyscache.h>
+#include <lib/ilist.h>
+#include <utils/inval.h>
+#include <utils/syscache.h>
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <catalog/pg_class.h>
+#include <catalog/pg_type.h>
+#include <utils/timestamp.h>
 
 /********************************************************************
  *  This file handles the memory context globals and the plan cache
@@ -20,70 +31,102 @@
  *  The state context is small and expected to hold only 1kb of data at most.
  *  The cache context may grow as needed.
  *
- *  Here we have decided to use a double linked list in order to have a fully
- *  functioning LRU cache, but the rest of the code doesn't need to be aware
- *  of the implementation.  The trigger only has to ask for a cached plan and
- *  it will get an SPIPlanPtr back which it can then operate.  The caching is
- *  thus entirely opaque to the trigger.
+ *  The plan cache is a dynahash table keyed by table name, with a doubly
+ *  linked list threaded through the entries in order to have a fully
+ *  functioning LRU cache.  Lookups are thus O(1) regardless of how many
+ *  partitions are live, and the list is only used to decide what to evict.
+ *  The rest of the code doesn't need to be aware of the implementation.  The
+ *  trigger only has to ask for a cached plan and it will get an SPIPlanPtr
+ *  back which it can then operate.  The caching is thus entirely opaque to
+ *  the trigger.
  *
- *  Future work exploration might be whether a secondary hashmap might be faster
- *  for plan retrieval.  However given that most tables will be repeatedly used
- *  the double linked list may be the access path that works best.
+ *  The cache is bounded by the bagger.plan_cache_size GUC.  When a new plan
+ *  would exceed that size, the least recently used plan is freed with
+ *  SPI_freeplan and its entry removed.  For very wide partitioning sets the
+ *  GUC can be raised, since otherwise plans will be evicted and prepared
+ *  again over the course of an hour.
  *
- *  For the query cache, the expectation is that the most frequently used tables
- *  will stay at the head of the cache.  For very wide partitioning sets and
- *  few time partitions this might need to be changed for a hashmap.
+ *  Partitions are dropped by retention while plans for them may still be
+ *  cached.  Rather than checking the relation on every cache hit, we register
+ *  a relcache invalidation callback which marks the entries for an
+ *  invalidated relation as stale.  The hot path is then a flag check, and
+ *  only stale entries are checked against the syscache.  Relcache
+ *  invalidations are frequent for other reasons too (ANALYZE, index builds)
+ *  so a stale entry whose relation still exists is simply marked valid again.
+ *  SPI itself revalidates the plan if the relation changed in other ways.
+ *
+ *  Before resolving a name through the catalogs we try the shared partition
+ *  directory, see catalog.c, which other backends fill in as they resolve
+ *  and create partitions.  A directory entry is only trusted if the syscache
+ *  still has a relation of that oid and name.  This saves resolving the
+ *  name and looking up the column type, and for partitions created by
+ *  another backend, a call to storage.create_partition().
+ *
+ *  Partitions are normally created ahead of time by the storage agent.  When
+ *  a row arrives for one that does not exist, which happens for new
+ *  dimension values, we create it with storage.create_partition().  That
+ *  function serializes concurrent creators with an advisory lock, so only
+ *  the backends which hit the same missing partition wait on each other.
+ *  Names are hashes, so the partition is created from the labels and hour
+ *  of the document being routed, see partition_key_from_name().  A missing
+ *  partition is only created while routing a document for it.
  */
 
-#define DisconnectNode(node) \
-    if (NULL != node->prev) { \
-        node->prev->next = node->next;\
-    } \
-    if (NULL != node->next) { \
-        node->next->prev = node->prev->next; \
-    }
-#define PrependNode(node) \
-    node->next = plancache.head; \
-    node->next->prev = node;
-
-#define MAXTABLELEN NAMEDATALEN * 2 + 1 
-
 /* Type oid for jsonb */
 #define JSON_TYPE 3802
 
-/* a little over here but keeping things generally aligned */
-#define INSERT_SIZE 32 + MAXTABLELEN
+/* initial number of buckets, the table grows as needed */
+#define PLANCACHE_INIT_SIZE 256
 
 MemoryContext TrigCacheCtx;
 MemoryContext TrigStateCtx;
 int TrigInitialized = 0;
 const char *insertfmt = "INSERT INTO %s VALUES ($1)";
+const char *batchfmt = "INSERT INTO %s SELECT unnest($1)";
 
 /* private type for this file */
-    
+
+/* The table name must be the first member since it is the hash key */
 struct lru_cache_plan
 {
     char table[MAXTABLELEN];
     SPIPlanPtr plan;
+    SPIPlanPtr batch_plan;  /* prepared on first use in batch mode */
     Oid reloid;
-    struct lru_cache_plan *next;
-    struct lru_cache_plan *prev;
+    Oid argtype;
+    dlist_node lru;
     time_t last_exec;
+    bool stale;
 };
 typedef struct lru_cache_plan lru_cache_plan;
 
-typedef struct dlist_h plancache_t;
-struct dlist_h
+typedef struct plancache_t plancache_t;
+struct plancache_t
 {
-    lru_cache_plan *head;
+    HTAB *table;
+    dlist_head lru;     /* most recently used at the head */
+    long entries;
 };
 
 plancache_t plancache;
+
+static bool relcache_callback_registered = false;
+
 /* prototypes */
 void initialize_ctx(void);
-void clear_cache(void);
-SPIPlanPtr get_cached_plan(char *);
-SPIPlanPtr create_cached_plan(char *);
+void clear_plan_cache(void);
+SPIPlanPtr get_cached_plan(const char *, uint32);
+SPIPlanPtr get_cached_batch_plan(const char *, uint32);
+Oid get_cached_relid(const char *, uint32);
+static lru_cache_plan *get_cached_entry(const char *, uint32);
+static lru_cache_plan *create_cached_entry(const char *, uint32);
+static SPIPlanPtr prepare_insert(const char *, Oid, Oid);
+static Oid create_partition(const char *);
+static Oid lookup_directory(const char *, uint32, Oid *);
+static void initialize_plan_cache(void);
+static void evict_cached_plan(lru_cache_plan *);
+static void plancache_relcache_cb(Datum, Oid);
+PG_FUNCTION_INFO_V1(bagger_plan_cache_stats);
 
 /* void initialize_ctx() 
  * Initializes the memory contexts we need to use and key state for the query
@@ -100,13 +143,102 @@ initialize_ctx()
                 errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
                 errmsg("Failed to initialize Memory Contexts:  Already Initialized"));
     }
+    /* the dimension set is small, and shared when it can be */
     TrigStateCtx = AllocSetContextCreate(TopMemoryContext, "TrigStateCtx",
-                          1024 * 1024, 1024 * 1024, 1024 * 1024);
+                                         ALLOCSET_SMALL_SIZES);
     TrigCacheCtx = AllocSetContextCreate(TopMemoryContext, "TrigCacheCtx",
-                          1024 * 1024, 1024 * 1024, 1024 * 1024 * 1024);
+                                         ALLOCSET_DEFAULT_SIZES);
     TrigInitialized = 1;
 }
 
+/*
+ * static void initialize_plan_cache()
+ *
+ * Creates the hash table for the plan cache in TrigCacheCtx.  Called lazily
+ * on first use and after the cache has been cleared.
+ *
+ * The table uses partition_name_hash() so that callers can pass in the hash
+ * computed while the name was built.
+ */
+static void
+initialize_plan_cache()
+{
+    HASHCTL ctl;
+
+    ctl.keysize = MAXTABLELEN;
+    ctl.entrysize = sizeof(lru_cache_plan);
+    ctl.hash = partition_name_hash;
+    ctl.match = (HashCompareFunc) strncmp;
+    ctl.keycopy = (HashCopyFunc) strlcpy;
+    ctl.hcxt = TrigCacheCtx;
+    plancache.table = hash_create("Bagger plan cache", PLANCACHE_INIT_SIZE,
+                                  &ctl, HASH_ELEM | HASH_FUNCTION | HASH_COMPARE
+                                  | HASH_KEYCOPY | HASH_CONTEXT);
+    dlist_init(&plancache.lru);
+    plancache.entries = 0;
+
+    /* callbacks cannot be unregistered so this happens once per backend */
+    if (!relcache_callback_registered)
+    {
+        CacheRegisterRelcacheCallback(plancache_relcache_cb, (Datum) 0);
+        relcache_callback_registered = true;
+    }
+}
+
+/*
+ * static void plancache_relcache_cb(Datum arg, Oid relid)
+ *
+ * Relcache invalidation callback.  Marks entries for relid as stale, or all
+ * entries if relid is InvalidOid (i.e. the whole relcache was reset).
+ *
+ * This may be called at almost any time when invalidation messages are
+ * processed, so it must not do any catalog access or free anything.  The
+ * cache is keyed by name so we have to scan, but invalidations are rare
+ * compared to inserts.
+ */
+static void
+plancache_relcache_cb(Datum arg, Oid relid)
+{
+    HASH_SEQ_STATUS status;
+    lru_cache_plan *entry;
+
+    if (NULL == plancache.table)
+        return;
+
+    hash_seq_init(&status, plancache.table);
+    while (NULL != (entry = hash_seq_search(&status)))
+    {
+        if (InvalidOid == relid || entry->reloid == relid)
+        {
+            entry->stale = true;
+            ++bagger_stats->cache_invalidations;
+        }
+    }
+}
+
+/*
+ * static void evict_cached_plan(lru_cache_plan *entry)
+ *
+ * Frees the plan and removes the entry from both the list and the hash
+ * table.  The entry must not be used after this.
+ */
+static void
+evict_cached_plan(lru_cache_plan *entry)
+{
+    bool found;
+
+    dlist_delete(&entry->lru);
+    if (NULL != entry->plan)
+        SPI_freeplan(entry->plan);
+    if (NULL != entry->batch_plan)
+        SPI_freeplan(entry->batch_plan);
+    hash_search(plancache.table, entry->table, HASH_REMOVE, &found);
+    if (!found)
+        elog(ERROR, "Plan cache corrupted: entry not found on eviction");
+    --plancache.entries;
+    ++bagger_stats->cache_evictions;
+}
+
 /*
  * void clear_plan_cache()
  *
@@ -115,96 +247,322 @@ initialize_ctx()
 void
 clear_plan_cache()
 {
-    plancache.head = NULL;
+    if (NULL != plancache.table)
+    {
+        dlist_iter iter;
+
+        dlist_foreach(iter, &plancache.lru)
+        {
+            lru_cache_plan *entry = dlist_container(lru_cache_plan, lru,
+                                                    iter.cur);
+            if (NULL != entry->plan)
+                SPI_freeplan(entry->plan);
+            if (NULL != entry->batch_plan)
+                SPI_freeplan(entry->batch_plan);
+        }
+    }
+    plancache.table = NULL;
+    plancache.entries = 0;
     MemoryContextReset(TrigCacheCtx);
 }
 
 /*
- * SPIPlanPtr get_cached_plan(char *tablename)
+ * SPIPlanPtr get_cached_plan(const char *tablename, uint32 hash)
  *
  * Takes a tablename and returns a plan for inserting the row into it.  The
  * idea is to abstract the whole cache handling from the rest of the trigger.
+ * hash must be partition_name_hash() of the name, as computed by
+ * partition_name_from_doc().
  *
  * Returns NULL if the table does not exist.
  */
 
 SPIPlanPtr 
-get_cached_plan(char *tablename)
-{
-    /* I can see the argument to move this into a macro, but only used once
-     */
-    for (lru_cache_plan *cur_node = plancache.head;
-            NULL != cur_node; 
-            cur_node = cur_node->next
-    )
+get_cached_plan(const char *tablename, uint32 hash)
+{
+    lru_cache_plan *entry = get_cached_entry(tablename, hash);
+
+    if (NULL == entry)
+        return NULL;
+    if (NULL == entry->plan)
+        entry->plan = prepare_insert(insertfmt, entry->reloid, entry->argtype);
+    return entry->plan;
+}
+
+/*
+ * SPIPlanPtr get_cached_batch_plan(const char *tablename, uint32 hash)
+ *
+ * As get_cached_plan() but the plan takes a single array of documents and
+ * inserts all of them in one statement.  Used when flushing batches.
+ *
+ * Returns NULL if the table does not exist.
+ */
+
+SPIPlanPtr
+get_cached_batch_plan(const char *tablename, uint32 hash)
+{
+    lru_cache_plan *entry = get_cached_entry(tablename, hash);
+
+    if (NULL == entry)
+        return NULL;
+    if (NULL == entry->batch_plan)
+        entry->batch_plan = prepare_insert(batchfmt, entry->reloid,
+                                           get_array_type(entry->argtype));
+    return entry->batch_plan;
+}
+
+/*
+ * Oid get_cached_relid(const char *tablename, uint32 hash)
+ *
+ * Returns the oid of the table without preparing any plan.  This is used by
+ * the direct insertion path which does not go through SPI at all.
+ *
+ * Returns InvalidOid if the table does not exist.
+ */
+
+Oid
+get_cached_relid(const char *tablename, uint32 hash)
+{
+    lru_cache_plan *entry = get_cached_entry(tablename, hash);
+
+    return NULL == entry ? InvalidOid : entry->reloid;
+}
+
+/*
+ * static lru_cache_plan *get_cached_entry(const char *tablename, uint32 hash)
+ *
+ * Does the actual cache lookup for the functions above, creating the entry
+ * on a miss.
+ *
+ * Returns NULL if the table does not exist.
+ */
+
+static lru_cache_plan *
+get_cached_entry(const char *tablename, uint32 hash)
+{
+    lru_cache_plan *cur_node;
+
+    if (NULL == plancache.table)
+        initialize_plan_cache();
+
+    cur_node = hash_search_with_hash_value(plancache.table, tablename, hash,
+                                           HASH_FIND, NULL);
+    if (NULL == cur_node)
+    {
+        ++bagger_stats->cache_misses;
+        return create_cached_entry(tablename, hash);
+    }
+
+    if (cur_node->stale)
     {
-        if (0 == strncmp(tablename, cur_node->table, MAXTABLELEN)){
-            SPIPlanPtr plan = cur_node->plan;
-            cur_node->last_exec = time(0);
-            DisconnectNode(cur_node);
-
-            // This does do subtransactions but does not use XIDs
-            // This avoids writing to tables which have been dropped.
-            //
-            BeginInternalSubTransaction(NULL);
-            PG_TRY();
-            {
-                relation_open(cur_node->reloid, AccessShareLock);
-                ReleaseCurrentSubTransaction();
-            }
-            PG_CATCH();
-            { 
-                //roll back subtransaction and return null
-                DisconnectNode(cur_node);
-                pfree(cur_node);
-                RollbackAndReleaseCurrentSubTransaction();
-                FlushErrorState();
-                return NULL;
-            }
-            PG_END_TRY();
-            RollbackAndReleaseCurrentSubTransaction();
-            PrependNode(cur_node);
-
-            return plan;
+        /* Dropped tables must not be written to.  If the table is gone we
+         * drop the plan and try again by name, since retention or
+         * provisioning may have replaced it with a new table.
+         */
+        if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(cur_node->reloid)))
+        {
+            evict_cached_plan(cur_node);
+            ++bagger_stats->cache_misses;
+            return create_cached_entry(tablename, hash);
         }
+        cur_node->stale = false;
+    }
+
+    ++bagger_stats->cache_hits;
+    cur_node->last_exec = time(0);
+    dlist_move_head(&plancache.lru, &cur_node->lru);
+    return cur_node;
+}
+
+/*
+ * static SPIPlanPtr prepare_insert(const char *fmt, Oid relid, Oid argtype)
+ *
+ * Prepares and keeps an insert statement for the relation, taking one
+ * parameter of argtype.
+ */
+
+static SPIPlanPtr
+prepare_insert(const char *fmt, Oid relid, Oid argtype)
+{
+    char *stmt_buff;
+    SPIPlanPtr plan;
+
+    /* quoting from the catalog since the name is built from document data */
+    stmt_buff = psprintf(fmt,
+             quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+                                        get_rel_name(relid)));
+    plan = SPI_prepare(stmt_buff, 1, &argtype);
+    if (NULL == plan)
+        elog(ERROR, "SPI_prepare failed for %s: %s", stmt_buff,
+             SPI_result_code_string(SPI_result));
+    SPI_keepplan(plan);
+    pfree(stmt_buff);
+    return plan;
+}
+
+/*
+ * static Oid create_partition(const char *tablename)
+ *
+ * Creates the partition, or waits for a concurrent creator, and returns its
+ * oid.  Returns InvalidOid if tablename is not the partition of the
+ * document being routed, since only then are its labels known.  The caller
+ * must be connected to SPI.
+ */
+
+static Oid
+create_partition(const char *tablename)
+{
+    Oid argtypes[2] = {TEXTARRAYOID, TIMESTAMPOID};
+    Datum args[2];
+    Timestamp bucket;
+    Datum result;
+    bool isnull;
+    int ret;
+    Oid relid;
+
+    args[0] = partition_key_from_name(tablename, &bucket);
+    if ((Datum) 0 == args[0])
+        return InvalidOid;
+    args[1] = TimestampGetDatum(bucket);
+
+    ret = SPI_execute_with_args("SELECT storage.create_partition($1, $2)",
+                                2, argtypes, args, NULL, false, 1);
+    if (SPI_OK_SELECT != ret || 1 != SPI_processed)
+        elog(ERROR, "storage.create_partition failed for %s: %s", tablename,
+             SPI_result_code_string(ret));
+    result = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+                           &isnull);
+    ++bagger_stats->partitions_created;
+    relid = isnull ? InvalidOid : DatumGetObjectId(result);
+
+    /* the SQL and C versions of the name must agree */
+    if (InvalidOid != relid && 0 != strcmp(get_rel_name(relid), tablename))
+        elog(ERROR, "storage.create_partition created %s for %s",
+             get_rel_name(relid), tablename);
+    return relid;
+}
+
+/*
+ * static Oid lookup_directory(const char *tablename, uint32 hash,
+ *                             Oid *argtype)
+ *
+ * Returns the oid of the partition from the shared directory and sets
+ * *argtype, or returns InvalidOid.  Entries whose relation has gone, or
+ * whose oid has been reused, are removed.
+ */
+static Oid
+lookup_directory(const char *tablename, uint32 hash, Oid *argtype)
+{
+    Oid relid;
+    HeapTuple tuple;
+    bool valid = false;
+
+    if (!bagger_catalog_lookup_partition(tablename, hash, &relid, argtype))
+        return InvalidOid;
+
+    /* one syscache lookup, where resolving the name takes two */
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    if (HeapTupleIsValid(tuple))
+    {
+        Form_pg_class form = (Form_pg_class) GETSTRUCT(tuple);
+
+        valid = (0 == strcmp(NameStr(form->relname), tablename));
+        ReleaseSysCache(tuple);
     }
-    return create_cached_plan(tablename);
+    if (valid)
+        return relid;
+    bagger_catalog_store_partition(tablename, hash, InvalidOid, InvalidOid);
+    return InvalidOid;
 }
 
 /*
- *  SPIPlanPtr *create_cached_plan(char *tablename)
+ *  static lru_cache_plan *create_cached_entry(const char *tablename, uint32 hash)
  *
- *  Takes in a tablename, creates a cached plan, and returns it.
+ *  Takes in a tablename, creates a cache entry for it, and returns it.  Plans
+ *  are prepared on first use since which plans are needed depends on the
+ *  routing mode.  If the cache is full, the least recently used entry is
+ *  evicted first.
  *
  *  Returns NULL if table does not exist.
  */
 
-/* not sure if this should be static or inline or not.  
- * Considering testability first and keeping it separate. */
-SPIPlanPtr 
-create_cached_plan(char *tablename)
+/* Considering testability first and keeping it separate. */
+static lru_cache_plan *
+create_cached_entry(const char *tablename, uint32 hash)
 {
     RangeVar *rv;
     Oid jsontype;
     Oid relid;
-    char *stmt_buff;
-    TriggerData *tgdata = (TriggerData *) fcinfo->context;
+    lru_cache_plan *entry;
+    bool found;
 
-    lru_cache_plan *entry = MemoryContextAllocZero(TrigCacheCtx, sizeof(lru_cache_plan));
+    if (NULL == plancache.table)
+        initialize_plan_cache();
 
-    memcpy(entry->table, tablename, MAXTABLELEN);
+    relid = lookup_directory(tablename, hash, &jsontype);
+    if (InvalidOid == relid)
+    {
+        /* The name is built from document data, so it is taken as a single
+         * identifier and never parsed for schema qualification or quotes.
+         */
+        rv = makeRangeVar(PARTITION_SCHEMA, pstrdup(tablename), -1);
+        relid = RangeVarGetRelid(rv, NoLock, true);
 
-    /* we are only doing this when we create a cached plan so probably ok. */
-    rv = makeRangeVarFromNameList(textToQualifiedNameList(cstring_to_text(entry->table)));
-    relid = RangeVarGetRelid(rv, NoLock, false);
+        if (InvalidOid == relid && bagger_create_missing_partitions)
+            relid = create_partition(tablename);
+        if (InvalidOid == relid)
+        {
+            ++bagger_stats->partitions_not_found;
+            return NULL;
+        }
+        /* the document column of the partition, not of the inbound table */
+        jsontype = get_atttype(relid, 1);
+        bagger_catalog_store_partition(tablename, hash, relid, jsontype);
+    }
 
-    if (InvalidOid == relid)
-        return NULL;
-    jsontype = SPI_gettypeid(tgdata->tg_relation->rd_att, 1);
-    stmt_buff = MemoryContextAllocZero(TrigCacheCtx, INSERT_SIZE);
-    snprintf(stmt_buff, sizeof(stmt_buff), insertfmt, tablename);
-    entry->plan = SPI_prepare(stmt_buff, 1, &jsontype);
-    PrependNode(entry);
-    SPI_keepplan(entry->plan);
-    return entry->plan;
+    while (plancache.entries >= bagger_plan_cache_size
+           && !dlist_is_empty(&plancache.lru))
+        evict_cached_plan(dlist_tail_element(lru_cache_plan, lru,
+                                             &plancache.lru));
+
+    entry = hash_search_with_hash_value(plancache.table, tablename, hash,
+                                        HASH_ENTER, &found);
+    if (found)
+        elog(ERROR, "Plan cache corrupted: duplicate entry for %s", tablename);
+    entry->plan = NULL;
+    entry->batch_plan = NULL;
+    entry->reloid = relid;
+    entry->argtype = jsontype;
+    entry->last_exec = time(0);
+    entry->stale = false;
+    dlist_push_head(&plancache.lru, &entry->lru);
+    ++plancache.entries;
+    return entry;
+}
+
+/*
+ * bagger_plan_cache_stats()
+ *
+ * SQL-callable function returning the plan cache counters of the current
+ * backend as a single row of hits, misses, invalidations, evictions, and
+ * the number of entries currently cached.
+ */
+Datum
+bagger_plan_cache_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    values[0] = Int64GetDatum((int64) bagger_stats->cache_hits);
+    values[1] = Int64GetDatum((int64) bagger_stats->cache_misses);
+    values[2] = Int64GetDatum((int64) bagger_stats->cache_invalidations);
+    values[3] = Int64GetDatum((int64) bagger_stats->cache_evictions);
+    values[4] = Int64GetDatum((int64) plancache.entries);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
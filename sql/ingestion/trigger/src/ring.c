@@ -0,0 +1,205 @@
+#include "bagger.h"
+#include "placement.h"
+#include <catalog/pg_type.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/jsonb.h>
+#include <utils/memutils.h>
+#include <utils/numeric.h>
+
+/* Bagger ring placement from SQL
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * bagger_placement() places a partition key on a ring mode servermap with
+ * the functions in placement.c, so that the storage nodes and anything
+ * querying them through SQL agree with Schaufel on where data goes.
+ *
+ * The servermap is passed in as jsonb, normally straight from
+ * storage.servermap.  Building the ring is much more work than a lookup, so
+ * the ring is kept in fn_extra for as long as calls pass the same servermap,
+ * which is checked by hashing its binary form.
+ */
+
+typedef struct ring_cache
+{
+    MemoryContext cxt;
+    uint64 map_hash;
+    int replicas;
+    int nnodes;
+    placement_node *nodes;
+    int32 *ids;
+    int ntokens;
+    placement_token *tokens;
+} ring_cache;
+
+#define RING_DEFAULT_VNODES 64
+#define RING_DEFAULT_REPLICAS 2
+
+/* prototypes */
+static ring_cache *build_ring(Jsonb *map, uint64 map_hash,
+                              MemoryContext parent);
+static char *json_string(JsonbContainer *obj, const char *key);
+static int json_int(JsonbContainer *obj, const char *key, int dflt);
+PG_FUNCTION_INFO_V1(bagger_placement);
+
+/* Returns the string value of key in obj, or NULL if it is not a string */
+static char *
+json_string(JsonbContainer *obj, const char *key)
+{
+    JsonbValue v;
+
+    if (NULL == getKeyJsonValueFromContainer(obj, key, strlen(key), &v)
+        || jbvString != v.type)
+        return NULL;
+    return pnstrdup(v.val.string.val, v.val.string.len);
+}
+
+/* Returns the integer value of key in obj, or dflt if it is not a number */
+static int
+json_int(JsonbContainer *obj, const char *key, int dflt)
+{
+    JsonbValue v;
+
+    if (NULL == getKeyJsonValueFromContainer(obj, key, strlen(key), &v)
+        || jbvNumeric != v.type)
+        return dflt;
+    return DatumGetInt32(DirectFunctionCall1(numeric_int4,
+                                             NumericGetDatum(v.val.numeric)));
+}
+
+/*
+ * static ring_cache *build_ring(Jsonb *map, uint64 map_hash,
+ *                               MemoryContext parent)
+ *
+ * Reads the nodes of a ring mode servermap and builds its ring, in a new
+ * context under parent.
+ */
+static ring_cache *
+build_ring(Jsonb *map, uint64 map_hash, MemoryContext parent)
+{
+    MemoryContext cxt;
+    MemoryContext oldcontext;
+    ring_cache *ring;
+    JsonbValue v;
+    JsonbContainer *nodes;
+    char **domains;
+    char *mode;
+    int vnodes;
+
+    mode = json_string(&map->root, "mode");
+    if (NULL == mode || 0 != strcmp(mode, "ring"))
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Servermap is not in ring mode"));
+    if (NULL == getKeyJsonValueFromContainer(&map->root, "nodes", 5, &v)
+        || jbvBinary != v.type || !JsonContainerIsArray(v.val.binary.data)
+        || 0 == JsonContainerSize(v.val.binary.data))
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Servermap has no nodes"));
+    nodes = v.val.binary.data;
+    vnodes = json_int(&map->root, "vnodes", RING_DEFAULT_VNODES);
+    if (vnodes < 1)
+        ereport(ERROR,
+                errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Servermap vnodes must be positive"));
+
+    cxt = AllocSetContextCreate(parent, "Bagger ring", ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(cxt);
+    ring = palloc0(sizeof(ring_cache));
+    ring->cxt = cxt;
+    ring->map_hash = map_hash;
+    ring->replicas = json_int(&map->root, "replication",
+                              RING_DEFAULT_REPLICAS);
+    ring->nnodes = JsonContainerSize(nodes);
+    ring->nodes = palloc(sizeof(placement_node) * ring->nnodes);
+    ring->ids = palloc(sizeof(int32) * ring->nnodes);
+    domains = palloc(sizeof(char *) * ring->nnodes);
+
+    for (int i = 0; i < ring->nnodes; ++i)
+    {
+        JsonbValue *node = getIthJsonbValueFromContainer(nodes, i);
+        JsonbContainer *obj;
+        char *host;
+
+        if (jbvBinary != node->type
+            || !JsonContainerIsObject(node->val.binary.data))
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Servermap node %d is not an object", i));
+        obj = node->val.binary.data;
+        host = json_string(obj, "host");
+        if (NULL == host)
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Servermap node %d has no host", i));
+        ring->nodes[i].name = psprintf("%s_%d", host,
+                                       json_int(obj, "port", 5432));
+        ring->nodes[i].weight = json_int(obj, "weight", 1);
+        if (ring->nodes[i].weight < 1)
+            ereport(ERROR,
+                    errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Servermap node %s has a weight below 1",
+                           ring->nodes[i].name));
+        ring->ids[i] = json_int(obj, "id", 0);
+
+        /* nodes with the same domain string share a domain number */
+        domains[i] = json_string(obj, "domain");
+        if (NULL == domains[i])
+            domains[i] = host;
+        ring->nodes[i].domain = i;
+        for (int j = 0; j < i; ++j)
+        {
+            if (0 == strcmp(domains[i], domains[j]))
+            {
+                ring->nodes[i].domain = ring->nodes[j].domain;
+                break;
+            }
+        }
+    }
+
+    ring->ntokens = placement_ring_size(ring->nodes, ring->nnodes, vnodes);
+    ring->tokens = palloc(sizeof(placement_token) * ring->ntokens);
+    placement_ring_build(ring->nodes, ring->nnodes, vnodes, ring->tokens);
+    pfree(domains);
+    MemoryContextSwitchTo(oldcontext);
+    return ring;
+}
+
+/*
+ * bagger_placement(jsonb servermap, text key)
+ *
+ * Returns the ids of the instances holding the key, normally a partition
+ * name, primary first.
+ */
+Datum
+bagger_placement(PG_FUNCTION_ARGS)
+{
+    Jsonb *map = PG_GETARG_JSONB_P(0);
+    text *key = PG_GETARG_TEXT_PP(1);
+    ring_cache *ring = fcinfo->flinfo->fn_extra;
+    uint64 map_hash;
+    int found[PLACEMENT_MAX_REPLICAS];
+    Datum ids[PLACEMENT_MAX_REPLICAS];
+    int count;
+
+    map_hash = placement_hash(VARDATA(map), VARSIZE(map) - VARHDRSZ);
+    if (NULL == ring || ring->map_hash != map_hash)
+    {
+        if (NULL != ring)
+            MemoryContextDelete(ring->cxt);
+        fcinfo->flinfo->fn_extra = NULL;
+        ring = build_ring(map, map_hash, fcinfo->flinfo->fn_mcxt);
+        fcinfo->flinfo->fn_extra = ring;
+    }
+
+    count = placement_lookup(ring->tokens, ring->ntokens, ring->nodes,
+                             placement_hash(VARDATA_ANY(key),
+                                            VARSIZE_ANY_EXHDR(key)),
+                             ring->replicas, found);
+    for (int i = 0; i < count; ++i)
+        ids[i] = Int32GetDatum(ring->ids[found[i]]);
+    PG_RETURN_ARRAYTYPE_P(construct_array(ids, count, INT4OID, sizeof(int32),
+                                          true, TYPALIGN_INT));
+}
@@ -0,0 +1,484 @@
+#include "bagger.h"
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#if PG_VERSION_NUM < 170000
+#include <storage/backendid.h>
+#endif
+
+/* Bagger ingestion statistics
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Counters for what the trigger is doing, exposed through
+ * bagger_trigger_stats() and bagger_trigger_partition_stats() in the same
+ * spirit as pg_stat_statements.
+ *
+ * When bagger_data is in shared_preload_libraries, each backend gets a slot
+ * of counters in shared memory, indexed by its backend number.  Only the
+ * owning backend writes to its slot, so no locking is needed and readers
+ * may see values which are a few rows stale.  Slots are claimed on first
+ * use and released at backend exit, and counters are for the life of the
+ * backend.  Without shared memory, counters are kept in backend-local
+ * memory and only the current backend can be seen.
+ *
+ * Per-partition row counts are accumulated in a local hash table and
+ * merged into a shared hash table at the end of each statement, or when
+ * the local table gets large.  This keeps the shared lock off the per-row
+ * path.  The shared table has a fixed size set by
+ * bagger.stats_max_partitions.  Rows for partitions which do not fit are
+ * counted as overflow.  Partition counts survive backends and are cleared
+ * by bagger_trigger_stats_reset().
+ */
+
+typedef struct partition_stats
+{
+    char partition[NAMEDATALEN];    /* hash key, must be first */
+    uint64 rows;
+} partition_stats;
+
+typedef struct BaggerSharedStats
+{
+    LWLock *lock;           /* protects the partition hash and overflow */
+    uint64 partition_overflow;
+    int nslots;
+    BaggerStats slots[FLEXIBLE_ARRAY_MEMBER];
+} BaggerSharedStats;
+
+/* local partition entries before they are merged into shared memory */
+#define LOCAL_PARTITIONS_MAX 256
+
+int bagger_stats_max_partitions = 5000;
+bool bagger_track_timing = true;
+
+static BaggerStats local_stats;
+BaggerStats *bagger_stats = &local_stats;
+
+static BaggerSharedStats *shared_stats = NULL;
+static HTAB *shared_partitions = NULL;
+static HTAB *local_partitions = NULL;
+static uint64 local_partition_overflow = 0;
+static bool stats_attached = false;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* prototypes */
+void bagger_stats_register_hooks(void);
+void bagger_stats_attach(void);
+void bagger_stats_count_partition(const char *, uint32);
+void bagger_stats_uncount_partition(const char *, uint32, uint64);
+void bagger_stats_flush(void);
+static Size stats_shmem_size(void);
+static void stats_shmem_request(void);
+static void stats_shmem_startup(void);
+static void stats_detach(int, Datum);
+static void initialize_local_partitions(void);
+PG_FUNCTION_INFO_V1(bagger_trigger_stats);
+PG_FUNCTION_INFO_V1(bagger_trigger_partition_stats);
+PG_FUNCTION_INFO_V1(bagger_trigger_stats_reset);
+
+/*
+ * void bagger_stats_register_hooks()
+ *
+ * Requests shared memory if we are being preloaded.  Called from _PG_init.
+ */
+void
+bagger_stats_register_hooks()
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = stats_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = stats_shmem_startup;
+}
+
+static Size
+stats_shmem_size()
+{
+    Size size;
+
+    size = add_size(offsetof(BaggerSharedStats, slots),
+                    mul_size(MaxBackends, sizeof(BaggerStats)));
+    return add_size(size, hash_estimate_size(bagger_stats_max_partitions,
+                                             sizeof(partition_stats)));
+}
+
+static void
+stats_shmem_request()
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(stats_shmem_size());
+    RequestNamedLWLockTranche("bagger_stats", 1);
+}
+
+static void
+stats_shmem_startup()
+{
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    shared_stats = ShmemInitStruct("bagger_stats",
+                                   add_size(offsetof(BaggerSharedStats, slots),
+                                            mul_size(MaxBackends,
+                                                     sizeof(BaggerStats))),
+                                   &found);
+    if (!found)
+    {
+        memset(shared_stats, 0, offsetof(BaggerSharedStats, slots)
+                                + MaxBackends * sizeof(BaggerStats));
+        shared_stats->lock = &(GetNamedLWLockTranche("bagger_stats"))->lock;
+        shared_stats->nslots = MaxBackends;
+    }
+
+    info.keysize = NAMEDATALEN;
+    info.entrysize = sizeof(partition_stats);
+    shared_partitions = ShmemInitHash("bagger partition stats",
+                                      bagger_stats_max_partitions,
+                                      bagger_stats_max_partitions,
+                                      &info, HASH_ELEM | HASH_STRINGS);
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * void bagger_stats_attach()
+ *
+ * Moves the counters of this backend into its shared slot, if there is
+ * shared memory.  Anything counted before this is carried over.  Called on
+ * every trigger call, and does nothing after the first.
+ */
+void
+bagger_stats_attach()
+{
+    int slot;
+
+    if (stats_attached)
+        return;
+    stats_attached = true;
+    if (NULL == shared_stats)
+        return;
+
+#if PG_VERSION_NUM >= 170000
+    slot = MyProcNumber;
+#else
+    slot = MyBackendId - 1;
+#endif
+    if (slot < 0 || slot >= shared_stats->nslots)
+        return;
+
+    shared_stats->slots[slot] = local_stats;
+    shared_stats->slots[slot].pid = MyProcPid;
+    bagger_stats = &shared_stats->slots[slot];
+    before_shmem_exit(stats_detach, (Datum) 0);
+}
+
+/* Releases our slot at backend exit, after merging our partition counts */
+static void
+stats_detach(int code, Datum arg)
+{
+    bagger_stats_flush();
+    bagger_stats->pid = 0;
+    bagger_stats = &local_stats;
+}
+
+static void
+initialize_local_partitions()
+{
+    HASHCTL ctl;
+
+    ctl.keysize = NAMEDATALEN;
+    ctl.entrysize = sizeof(partition_stats);
+    ctl.hash = partition_name_hash;
+    ctl.match = (HashCompareFunc) strncmp;
+    ctl.keycopy = (HashCopyFunc) strlcpy;
+    ctl.hcxt = TopMemoryContext;
+    local_partitions = hash_create("Bagger local partition stats",
+                                   LOCAL_PARTITIONS_MAX, &ctl,
+                                   HASH_ELEM | HASH_FUNCTION | HASH_COMPARE
+                                   | HASH_KEYCOPY | HASH_CONTEXT);
+}
+
+/*
+ * void bagger_stats_count_partition(const char *partition, uint32 hash)
+ *
+ * Counts a row routed to partition.  hash is partition_name_hash() of the
+ * name.
+ */
+void
+bagger_stats_count_partition(const char *partition, uint32 hash)
+{
+    partition_stats *entry;
+    bool found;
+
+    if (NULL == local_partitions)
+        initialize_local_partitions();
+
+    /* without shared memory the local table is all there is, so it is
+     * bounded the same way
+     */
+    if (hash_get_num_entries(local_partitions)
+        >= (NULL == shared_partitions ? bagger_stats_max_partitions
+                                      : LOCAL_PARTITIONS_MAX))
+    {
+        entry = hash_search_with_hash_value(local_partitions, partition, hash,
+                                            HASH_FIND, NULL);
+        if (NULL == entry && NULL == shared_partitions)
+        {
+            ++local_partition_overflow;
+            return;
+        }
+        if (NULL == entry)
+        {
+            bagger_stats_flush();
+            entry = hash_search_with_hash_value(local_partitions, partition,
+                                                hash, HASH_ENTER, &found);
+            entry->rows = 0;
+        }
+    }
+    else
+    {
+        entry = hash_search_with_hash_value(local_partitions, partition, hash,
+                                            HASH_ENTER, &found);
+        if (!found)
+            entry->rows = 0;
+    }
+    ++entry->rows;
+}
+
+/*
+ * void bagger_stats_uncount_partition(const char *partition, uint32 hash,
+ *                                     uint64 rows)
+ *
+ * Takes back rows counted for partition which were not written after all,
+ * such as buffered rows dead lettered when their batch is flushed.  The
+ * counts may have been merged into shared memory or gone to overflow since.
+ */
+void
+bagger_stats_uncount_partition(const char *partition, uint32 hash,
+                               uint64 rows)
+{
+    partition_stats *entry = NULL;
+    uint64 n;
+
+    if (NULL != local_partitions)
+        entry = hash_search_with_hash_value(local_partitions, partition, hash,
+                                            HASH_FIND, NULL);
+    if (NULL != entry)
+    {
+        n = Min(rows, entry->rows);
+        entry->rows -= n;
+        rows -= n;
+    }
+    if (0 == rows)
+        return;
+
+    if (NULL == shared_partitions)
+    {
+        local_partition_overflow -= Min(rows, local_partition_overflow);
+        return;
+    }
+    LWLockAcquire(shared_stats->lock, LW_EXCLUSIVE);
+    entry = hash_search(shared_partitions, partition, HASH_FIND, NULL);
+    if (NULL != entry)
+    {
+        n = Min(rows, entry->rows);
+        entry->rows -= n;
+        rows -= n;
+    }
+    shared_stats->partition_overflow -= Min(rows,
+                                            shared_stats->partition_overflow);
+    LWLockRelease(shared_stats->lock);
+}
+
+/*
+ * void bagger_stats_flush()
+ *
+ * Merges the local partition counts into shared memory.  Called at the end
+ * of each statement by the flush trigger.  Does nothing without shared
+ * memory.
+ */
+void
+bagger_stats_flush()
+{
+    HASH_SEQ_STATUS status;
+    partition_stats *local;
+
+    if (NULL == shared_partitions || NULL == local_partitions
+        || 0 == hash_get_num_entries(local_partitions))
+        return;
+
+    LWLockAcquire(shared_stats->lock, LW_EXCLUSIVE);
+    hash_seq_init(&status, local_partitions);
+    while (NULL != (local = hash_seq_search(&status)))
+    {
+        partition_stats *entry;
+        bool found;
+
+        entry = hash_search(shared_partitions, local->partition,
+                            HASH_ENTER_NULL, &found);
+        if (NULL == entry)
+            shared_stats->partition_overflow += local->rows;
+        else if (found)
+            entry->rows += local->rows;
+        else
+            entry->rows = local->rows;
+        hash_search(local_partitions, local->partition, HASH_REMOVE, NULL);
+    }
+    LWLockRelease(shared_stats->lock);
+}
+
+/*
+ * bagger_trigger_stats()
+ *
+ * Returns one row of counters per backend which has used the trigger, or
+ * only the current backend without shared memory.
+ */
+Datum
+bagger_trigger_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int nslots = (NULL == shared_stats) ? 1 : shared_stats->nslots;
+
+    InitMaterializedSRF(fcinfo, 0);
+    for (int i = 0; i < nslots; ++i)
+    {
+        BaggerStats *s;
+        Datum values[12];
+        bool nulls[12] = {false};
+
+        if (NULL == shared_stats)
+            s = bagger_stats;
+        else
+            s = &shared_stats->slots[i];
+        if (NULL != shared_stats && 0 == s->pid)
+            continue;
+
+        values[0] = Int32GetDatum(NULL == shared_stats ? MyProcPid : s->pid);
+        values[1] = Int64GetDatum((int64) s->rows_routed);
+        values[2] = Int64GetDatum((int64) s->cache_hits);
+        values[3] = Int64GetDatum((int64) s->cache_misses);
+        values[4] = Int64GetDatum((int64) s->cache_evictions);
+        values[5] = Int64GetDatum((int64) s->cache_invalidations);
+        values[6] = Int64GetDatum((int64) s->partitions_not_found);
+        values[7] = Int64GetDatum((int64) s->partitions_created);
+        values[8] = Int64GetDatum((int64) s->rows_dead_lettered);
+        values[9] = Float8GetDatum(s->extract_time);
+        values[10] = Float8GetDatum(s->insert_time);
+        values[11] = BoolGetDatum(NULL != shared_stats);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values,
+                             nulls);
+    }
+    return (Datum) 0;
+}
+
+/*
+ * bagger_trigger_partition_stats()
+ *
+ * Returns the rows routed to each partition.  Rows for partitions which
+ * did not fit in the table are returned with a null partition.
+ */
+Datum
+bagger_trigger_partition_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    partition_stats *entry;
+    HTAB *table;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+    uint64 overflow;
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    /* our own counts should be visible to us */
+    bagger_stats_flush();
+    table = (NULL == shared_partitions) ? local_partitions : shared_partitions;
+    if (NULL != shared_stats)
+        LWLockAcquire(shared_stats->lock, LW_SHARED);
+
+    if (NULL != table)
+    {
+        hash_seq_init(&status, table);
+        while (NULL != (entry = hash_seq_search(&status)))
+        {
+            values[0] = CStringGetTextDatum(entry->partition);
+            values[1] = Int64GetDatum((int64) entry->rows);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values,
+                                 nulls);
+        }
+    }
+    overflow = (NULL == shared_stats) ? local_partition_overflow
+                                      : shared_stats->partition_overflow;
+
+    if (NULL != shared_stats)
+        LWLockRelease(shared_stats->lock);
+
+    if (overflow > 0)
+    {
+        nulls[0] = true;
+        values[1] = Int64GetDatum((int64) overflow);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values,
+                             nulls);
+    }
+    return (Datum) 0;
+}
+
+/*
+ * bagger_trigger_stats_reset()
+ *
+ * Zeroes the counters of all backends and clears the partition counts.
+ * Backends write their counters without locking, so a row being counted
+ * while this runs may survive the reset.
+ */
+Datum
+bagger_trigger_stats_reset(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS status;
+    partition_stats *entry;
+
+    if (NULL == shared_stats)
+    {
+        int pid = local_stats.pid;
+
+        memset(&local_stats, 0, sizeof(local_stats));
+        local_stats.pid = pid;
+        local_partition_overflow = 0;
+        if (NULL != local_partitions)
+        {
+            hash_seq_init(&status, local_partitions);
+            while (NULL != (entry = hash_seq_search(&status)))
+                hash_search(local_partitions, entry->partition, HASH_REMOVE,
+                            NULL);
+        }
+        PG_RETURN_VOID();
+    }
+
+    for (int i = 0; i < shared_stats->nslots; ++i)
+    {
+        BaggerStats *s = &shared_stats->slots[i];
+        int pid = s->pid;
+
+        memset(s, 0, sizeof(BaggerStats));
+        s->pid = pid;
+    }
+
+    LWLockAcquire(shared_stats->lock, LW_EXCLUSIVE);
+    hash_seq_init(&status, shared_partitions);
+    while (NULL != (entry = hash_seq_search(&status)))
+        hash_search(shared_partitions, entry->partition, HASH_REMOVE, NULL);
+    shared_stats->partition_overflow = 0;
+    LWLockRelease(shared_stats->lock);
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,108 @@
+#include "bagger.h"
+#include "xactbuf.h"
+#include <catalog/pg_type.h>
+
+/* Bagger summary invalidation
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Sealed partitions get a summary, see storage.summarize_partitions(), which
+ * the read path uses to skip partitions which cannot match a query.  Rows
+ * still arrive late for sealed partitions, and a summary which does not
+ * cover them would hide them from queries.  So the first write to each
+ * partition in a transaction clears the partition's summarized_at, in the
+ * same transaction, and the storage agent builds the summary again later.
+ *
+ * This is done after the write, when we hold the partition's row exclusive
+ * lock.  A summary is built under a share lock on the partition, so either
+ * the summary is committed before our write and we clear it, or our write
+ * commits before the summary is built and it covers our rows.
+ *
+ * Partitions without a summary, which is nearly all rows, cost an index
+ * lookup on storage.partition per partition and transaction, and take no
+ * row lock.  The partitions already done are kept in a per-transaction
+ * buffer, see xactbuf.c, with the subtransaction which cleared the summary.
+ * When a subtransaction aborts, its updates are rolled back, so the
+ * partitions it cleared, or those below it cleared, are forgotten.
+ */
+
+typedef struct summary_entry
+{
+    char table[MAXTABLELEN];    /* hash key, must be first */
+    SubTransactionId subid;     /* subtransaction which cleared it */
+} summary_entry;
+
+#define SUMMARY_INIT_SIZE 64
+
+static SPIPlanPtr invalidate_plan = NULL;
+
+/* prototypes */
+void invalidate_summary(const char *tablename, uint32 hash);
+static void summary_subxact_abort(HTAB *, SubTransactionId);
+
+static XactBuffer summary_buffer = {
+    .name = "Bagger written partitions",
+    .entrysize = sizeof(summary_entry),
+    .nelem = SUMMARY_INIT_SIZE,
+    .small = true,
+    .pre_commit = NULL,
+    .subxact_abort = summary_subxact_abort,
+};
+
+/*
+ * void invalidate_summary(const char *tablename, uint32 hash)
+ *
+ * Clears the summary of the partition, once per transaction.  Must be
+ * called after rows were written to it.  hash is partition_name_hash() of
+ * the name.  The caller must be connected to SPI.
+ */
+void
+invalidate_summary(const char *tablename, uint32 hash)
+{
+    HTAB *table = xact_buffer_table(&summary_buffer);
+    summary_entry *entry;
+    Datum arg;
+    bool found;
+    int ret;
+
+    hash_search_with_hash_value(table, tablename, hash, HASH_FIND, &found);
+    if (found)
+        return;
+
+    if (NULL == invalidate_plan)
+    {
+        Oid argtype = NAMEOID;
+
+        invalidate_plan = SPI_prepare(
+            "UPDATE storage.partition SET summarized_at = NULL "
+            "WHERE relname = $1 AND summarized_at IS NOT NULL",
+            1, &argtype);
+        if (NULL == invalidate_plan)
+            elog(ERROR, "SPI_prepare failed for summary invalidation: %s",
+                 SPI_result_code_string(SPI_result));
+        SPI_keepplan(invalidate_plan);
+    }
+
+    arg = DirectFunctionCall1(namein, CStringGetDatum(tablename));
+    if (SPI_OK_UPDATE != (ret = SPI_execute_plan(invalidate_plan, &arg, NULL,
+                                                 false, 0)))
+        elog(ERROR, "SPI_execute_plan returned %d", ret);
+
+    /* only remembered once the update went through */
+    entry = hash_search_with_hash_value(table, tablename, hash, HASH_ENTER,
+                                        NULL);
+    entry->subid = GetCurrentSubTransactionId();
+}
+
+/* Forgets the partitions cleared in the aborted subtransaction and below */
+static void
+summary_subxact_abort(HTAB *table, SubTransactionId subid)
+{
+    HASH_SEQ_STATUS status;
+    summary_entry *entry;
+
+    hash_seq_init(&status, table);
+    while (NULL != (entry = hash_seq_search(&status)))
+        if (entry->subid >= subid)
+            hash_search(table, entry->table, HASH_REMOVE, NULL);
+}
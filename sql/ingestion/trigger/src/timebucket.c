@@ -0,0 +1,256 @@
+#include <postgres.h>
+#include "timebucket.h"
+
+/* Bagger time bucket module
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Partitions are bucketed by the hour of the document's timestamp, in UTC.
+ * Hours are represented as hours since the Unix epoch.
+ *
+ * Timestamps come in as either ISO-8601 strings or as numbers of seconds
+ * since the epoch.  Going through timestamptz_in for every row would mean
+ * the full datetime parser, time zone lookups, and a copy of the string, all
+ * to get one hour out of it.  Instead we only accept the fixed layout that
+ * producers actually send:
+ *
+ *   YYYY-MM-DD[Thh[:mm[:ss[.fff]]]][Z|+hh[:mm]|-hh[:mm]]
+ *
+ * A space may be used instead of the T, and a comma instead of the point.
+ * Timestamps without a zone are taken to be UTC.  Seconds are checked but
+ * otherwise ignored, they cannot change the hour.  Every field is checked,
+ * including the day against the length of the month, so that only times
+ * which storage.document_time() also accepts are routed.
+ *
+ * Nothing in this file allocates or depends on the backend, so it can be
+ * tested standalone.
+ */
+
+#define DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static inline int64 days_from_civil(int64 y, int m, int d);
+static inline void civil_from_days(int64 days, int64 *y, int *m, int *d);
+static inline bool read_digits(const char *str, int len, int *pos, int n,
+                               int *val);
+static inline int days_in_month(int y, int m);
+
+static inline int64
+floor_div(int64 a, int64 b)
+{
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/* Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+ * This is the well known algorithm by Howard Hinnant.
+ */
+static inline int64
+days_from_civil(int64 y, int m, int d)
+{
+    int64 era;
+    int64 yoe;
+    int64 doy;
+    int64 doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* Inverse of days_from_civil */
+static inline void
+civil_from_days(int64 days, int64 *y, int *m, int *d)
+{
+    int64 era;
+    int64 doe;
+    int64 yoe;
+    int64 doy;
+    int64 mp;
+
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+/* Days in month m of year y, in the proleptic Gregorian calendar */
+static inline int
+days_in_month(int y, int m)
+{
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30,
+                                 31};
+
+    if (2 == m && 0 == y % 4 && (0 != y % 100 || 0 == y % 400))
+        return 29;
+    return days[m - 1];
+}
+
+/* Reads exactly n digits at *pos, advancing it.  Returns false if there are
+ * not n digits there.
+ */
+static inline bool
+read_digits(const char *str, int len, int *pos, int n, int *val)
+{
+    int v = 0;
+
+    if (*pos + n > len)
+        return false;
+    for (int i = 0; i < n; ++i)
+    {
+        char c = str[*pos + i];
+
+        if (!DIGIT(c))
+            return false;
+        v = v * 10 + (c - '0');
+    }
+    *pos += n;
+    *val = v;
+    return true;
+}
+
+/*
+ * bool iso8601_to_hour(const char *str, int len, int64 *hour)
+ *
+ * Parses an ISO-8601 timestamp of len bytes (not null terminated) and sets
+ * hour to the epoch hour it falls in.
+ *
+ * Returns false if the string is not in the layout described above.
+ */
+bool
+iso8601_to_hour(const char *str, int len, int64 *hour)
+{
+    int pos = 0;
+    int year, month, day;
+    int hh = 0;
+    int mm = 0;
+    int ss;
+    int offset = 0;         /* zone offset in minutes */
+    int64 minutes;
+
+    if (!read_digits(str, len, &pos, 4, &year)
+        || pos >= len || '-' != str[pos++]
+        || !read_digits(str, len, &pos, 2, &month)
+        || pos >= len || '-' != str[pos++]
+        || !read_digits(str, len, &pos, 2, &day))
+        return false;
+    if (year < 1 || month < 1 || month > 12 || day < 1
+        || day > days_in_month(year, month))
+        return false;
+
+    if (pos < len && ('T' == str[pos] || 't' == str[pos] || ' ' == str[pos]))
+    {
+        ++pos;
+        if (!read_digits(str, len, &pos, 2, &hh) || hh > 23)
+            return false;
+        if (pos < len && ':' == str[pos])
+        {
+            ++pos;
+            if (!read_digits(str, len, &pos, 2, &mm) || mm > 59)
+                return false;
+            if (pos < len && ':' == str[pos])
+            {
+                ++pos;
+                if (!read_digits(str, len, &pos, 2, &ss) || ss > 59)
+                    return false;
+                /* fractions of a second, at least one digit */
+                if (pos < len && ('.' == str[pos] || ',' == str[pos]))
+                {
+                    if (++pos >= len || !DIGIT(str[pos]))
+                        return false;
+                    while (pos < len && DIGIT(str[pos]))
+                        ++pos;
+                }
+            }
+        }
+    }
+
+    if (pos < len)
+    {
+        char sign = str[pos++];
+        int oh;
+        int om = 0;
+
+        if ('Z' == sign || 'z' == sign)
+        {
+            if (pos != len)
+                return false;
+        }
+        else if ('+' == sign || '-' == sign)
+        {
+            if (!read_digits(str, len, &pos, 2, &oh) || oh > 23)
+                return false;
+            if (pos < len && ':' == str[pos] && ++pos >= len)
+                return false;
+            if (pos < len && !read_digits(str, len, &pos, 2, &om))
+                return false;
+            if (pos != len || om > 59)
+                return false;
+            offset = oh * 60 + om;
+            if ('-' == sign)
+                offset = -offset;
+        }
+        else
+            return false;
+    }
+
+    minutes = days_from_civil(year, month, day) * 1440 + hh * 60 + mm - offset;
+    *hour = floor_div(minutes, 60);
+    return true;
+}
+
+/*
+ * int64 epoch_to_hour(int64 epoch)
+ *
+ * Returns the epoch hour for a number of seconds since the epoch.  Values
+ * too large to be seconds in any sensible year are taken as milliseconds.
+ */
+int64
+epoch_to_hour(int64 epoch)
+{
+    if (epoch >= EPOCH_MS_THRESHOLD || epoch <= -EPOCH_MS_THRESHOLD)
+        epoch = floor_div(epoch, 1000);
+    return floor_div(epoch, 3600);
+}
+
+/*
+ * bool format_hour(int64 hour, char *buf)
+ *
+ * Writes the YYYY_MM_DD_HH suffix for the epoch hour into buf, which must
+ * have room for HOUR_SUFFIX_LEN bytes plus a terminator.
+ *
+ * Returns false if the year is not between 1 and 9999.
+ */
+bool
+format_hour(int64 hour, char *buf)
+{
+    int64 year;
+    int month, day;
+    int hh = (int) (hour - floor_div(hour, 24) * 24);
+
+    civil_from_days(floor_div(hour, 24), &year, &month, &day);
+    if (year < 1 || year > 9999)
+        return false;
+
+    buf[0] = '0' + year / 1000;
+    buf[1] = '0' + year / 100 % 10;
+    buf[2] = '0' + year / 10 % 10;
+    buf[3] = '0' + year % 10;
+    buf[4] = '_';
+    buf[5] = '0' + month / 10;
+    buf[6] = '0' + month % 10;
+    buf[7] = '_';
+    buf[8] = '0' + day / 10;
+    buf[9] = '0' + day % 10;
+    buf[10] = '_';
+    buf[11] = '0' + hh / 10;
+    buf[12] = '0' + hh % 10;
+    buf[13] = '\0';
+    return true;
+}
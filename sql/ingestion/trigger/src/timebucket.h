@@ -0,0 +1,19 @@
+#ifndef TIMEBUCKET_H
+#define TIMEBUCKET_H
+
+/* Length of an hour bucket suffix, YYYY_MM_DD_HH */
+#define HOUR_SUFFIX_LEN 13
+
+/* epoch values at least this large are taken to be in milliseconds */
+#define EPOCH_MS_THRESHOLD INT64CONST(100000000000)
+
+/* seconds since the epoch of 0001-01-01 and 10000-01-01, the years which can
+ * be partitioned, as in storage.document_time() */
+#define EPOCH_MIN INT64CONST(-62135596800)
+#define EPOCH_MAX INT64CONST(253402300800)
+
+bool iso8601_to_hour(const char *str, int len, int64 *hour);
+int64 epoch_to_hour(int64 epoch);
+bool format_hour(int64 hour, char *buf);
+
+#endif
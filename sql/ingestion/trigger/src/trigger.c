@@ -0,0 +1,446 @@
+#include "bagger.h"
+#include "names.h"
+#include "validate.h"
+#include <utils/guc.h>
+#include <utils/jsonb.h>
+#include <access/htup_details.h>
+#include <catalog/pg_type.h>
+#include <portability/instr_time.h>
+#if PG_VERSION_NUM >= 160000
+#include <nodes/miscnodes.h>
+#endif
+
+/* Bagger ingestion trigger module entry points
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * This file holds the module magic block, the module initialization
+ * routine, and the trigger functions.  Tunables for the routing code are
+ * registered here as GUCs under the bagger. prefix so that they can be set
+ * per database or per role for the Schaufel connections.
+ *
+ * The inbound table has a single jsonb column.  bagger_route_row() is a
+ * BEFORE INSERT row trigger on it which works out the partition for the
+ * document and writes it there, returning NULL so nothing is stored in the
+ * inbound table itself.  How the write happens depends on
+ * bagger.routing_mode:
+ *
+ *   row    -- each row is inserted with a cached prepared statement
+ *   batch  -- rows are buffered per table and written by
+ *             bagger_flush_batch(), an AFTER INSERT statement trigger
+ *   direct -- rows are written with table_tuple_insert, bypassing SPI, and
+ *             the partitions are closed by bagger_flush_batch()
+ *
+ * The modes can be switched per session, so they can be compared on the
+ * same data.  The flush trigger is harmless in row mode so both triggers
+ * should always be installed.
+ *
+ * The inbound column may also be text or bytea, in which case the trigger
+ * gets the raw message.  It is checked with check_message() before being
+ * parsed as jsonb.  bytea is the better choice since text input already
+ * rejects invalid UTF-8 with an error, before the trigger.
+ *
+ * Rows which cannot be routed, because the message is invalid, because the
+ * document does not fit the dimensions or has no usable timestamp, or
+ * because the partition does not exist and is not created, fail the
+ * statement if bagger.on_error is error.  By default they are stored in
+ * storage.dead_letter instead, see deadletter.c, and the statement goes on.
+ * Invalid JSON is only caught this way on PostgreSQL 16 and later, which
+ * have soft input errors.
+ */
+
+PG_MODULE_MAGIC;
+
+void _PG_init(void);
+
+/* The trigger call currently being processed, see bagger.h */
+FunctionCallInfo fcinfo;
+
+/*
+ * Maximum number of cached insert plans per backend.  When the cache is full
+ * the least recently used plan is freed.
+ */
+int bagger_plan_cache_size = 1024;
+
+int bagger_routing_mode = ROUTING_MODE_ROW;
+
+/* rows buffered per table in batch mode before an early flush */
+int bagger_batch_size = 10000;
+
+/*
+ * Whether rows for a partition which does not exist yet create it.  The
+ * storage agent creates partitions ahead of time, so this is only a fallback
+ * for new dimension values.
+ */
+bool bagger_create_missing_partitions = true;
+
+static const struct config_enum_entry routing_mode_options[] = {
+    {"row", ROUTING_MODE_ROW, false},
+    {"batch", ROUTING_MODE_BATCH, false},
+    {"direct", ROUTING_MODE_DIRECT, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry on_error_options[] = {
+    {"error", ERROR_ACTION_ERROR, false},
+    {"dead_letter", ERROR_ACTION_DEAD_LETTER, false},
+    {"quarantine", ERROR_ACTION_DEAD_LETTER, true},
+    {NULL, 0, false}
+};
+
+PG_FUNCTION_INFO_V1(bagger_route_row);
+PG_FUNCTION_INFO_V1(bagger_flush_batch);
+
+static void set_current_call(FunctionCallInfo);
+static bool route_row(Partition_name *, Datum);
+static bool message_to_jsonb(Oid, Datum, Datum *);
+
+void
+_PG_init(void)
+{
+    DefineCustomIntVariable("bagger.plan_cache_size",
+                            "Maximum number of cached partition insert plans "
+                            "per backend.",
+                            NULL,
+                            &bagger_plan_cache_size,
+                            1024,
+                            1,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomEnumVariable("bagger.routing_mode",
+                             "How the ingestion trigger writes routed rows.",
+                             "row inserts each row as it arrives, batch "
+                             "buffers rows until the end of the statement, "
+                             "direct writes rows to the table without SPI.",
+                             &bagger_routing_mode,
+                             ROUTING_MODE_ROW,
+                             routing_mode_options,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("bagger.batch_size",
+                            "Rows buffered per partition in batch mode before "
+                            "they are written early.",
+                            NULL,
+                            &bagger_batch_size,
+                            10000,
+                            1,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("bagger.create_missing_partitions",
+                             "Create partitions which do not exist yet on "
+                             "first insert.",
+                             NULL,
+                             &bagger_create_missing_partitions,
+                             true,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("bagger.stats_max_partitions",
+                            "Maximum number of partitions tracked in the "
+                            "shared partition statistics.",
+                            NULL,
+                            &bagger_stats_max_partitions,
+                            5000,
+                            100,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("bagger.track_timing",
+                             "Collect time spent building partition names "
+                             "and writing rows.",
+                             NULL,
+                             &bagger_track_timing,
+                             true,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomEnumVariable("bagger.on_error",
+                             "What to do with inbound rows which cannot be "
+                             "routed.",
+                             "error fails the statement, dead_letter stores "
+                             "the row in storage.dead_letter.",
+                             &bagger_on_error,
+                             ERROR_ACTION_DEAD_LETTER,
+                             on_error_options,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("bagger.shared_partitions",
+                            "Maximum number of partitions in the shared "
+                            "partition directory.",
+                            NULL,
+                            &bagger_shared_partitions,
+                            10000,
+                            100,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    MarkGUCPrefixReserved("bagger");
+    bagger_stats_register_hooks();
+    bagger_catalog_register_hooks();
+}
+
+/*
+ * static void set_current_call(FunctionCallInfo call)
+ *
+ * Checks that we were called as a trigger on the inbound table and sets the
+ * fcinfo global for the rest of the module.  Trigger functions cannot do
+ * this themselves since their fcinfo argument hides the global.
+ */
+static void
+set_current_call(FunctionCallInfo call)
+{
+    if (!CALLED_AS_TRIGGER(call))
+        ereport(ERROR,
+                errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                errmsg("Bagger routing functions must be called as triggers"));
+    if (!TRIGGER_FIRED_BY_INSERT(((TriggerData *) call->context)->tg_event))
+        ereport(ERROR,
+                errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                errmsg("Bagger routing functions must be fired on insert"));
+    fcinfo = call;
+    if (!TrigInitialized)
+        initialize_ctx();
+    bagger_stats_attach();
+}
+
+/*
+ * static bool route_row(Partition_name *table, Datum doc)
+ *
+ * Inserts a single document with the cached plan for the table.  Returns
+ * false if the partition does not exist and the row was dead lettered.
+ */
+static bool
+route_row(Partition_name *table, Datum doc)
+{
+    SPIPlanPtr plan = get_cached_plan(table->name, table->hash);
+    int ret;
+
+    if (NULL == plan)
+    {
+        reject_missing_partition(table->name, doc);
+        return false;
+    }
+    if (SPI_OK_INSERT != (ret = SPI_execute_plan(plan, &doc, NULL, false, 0)))
+        elog(ERROR, "SPI_execute_plan returned %d", ret);
+    invalidate_summary(table->name, table->hash);
+    return true;
+}
+
+/*
+ * static bool message_to_jsonb(Oid type, Datum message, Datum *doc)
+ *
+ * Turns the inbound column into a jsonb document.  jsonb is used as it is.
+ * Raw text and bytea messages are checked first, and parsed only if they
+ * pass.  Returns false if the message was dead lettered instead.  The
+ * caller must be connected to SPI.
+ */
+static bool
+message_to_jsonb(Oid type, Datum message, Datum *doc)
+{
+    struct varlena *raw;
+    const char *buf;
+    size_t len;
+    size_t pos;
+    MessageCheck check;
+
+    if (JSONBOID == type)
+    {
+        *doc = message;
+        return true;
+    }
+    if (TEXTOID != type && BYTEAOID != type)
+        ereport(ERROR,
+                errcode(ERRCODE_DATATYPE_MISMATCH),
+                errmsg("The inbound column must be jsonb, text, or bytea"));
+
+    raw = PG_DETOAST_DATUM_PACKED(message);
+    buf = VARDATA_ANY(raw);
+    len = VARSIZE_ANY_EXHDR(raw);
+    check = check_message(buf, len, &pos);
+    if (MESSAGE_OK == check)
+    {
+#if PG_VERSION_NUM >= 160000
+        ErrorSaveContext escontext = {T_ErrorSaveContext};
+
+        escontext.details_wanted = true;
+        if (DirectInputFunctionCallSafe(jsonb_in, pnstrdup(buf, len),
+                                        InvalidOid, -1, (Node *) &escontext,
+                                        doc))
+            return true;
+        if (ERROR_ACTION_DEAD_LETTER != bagger_on_error)
+            ThrowErrorData(escontext.error_data);
+        dead_letter_raw(escontext.error_data->message, buf, len);
+        return false;
+#else
+        *doc = DirectFunctionCall1(jsonb_in,
+                                   CStringGetDatum(pnstrdup(buf, len)));
+        return true;
+#endif
+    }
+
+    if (ERROR_ACTION_DEAD_LETTER != bagger_on_error)
+        ereport(ERROR,
+                errcode(MESSAGE_FORBIDDEN_ESCAPE == check
+                        ? ERRCODE_UNTRANSLATABLE_CHARACTER
+                        : ERRCODE_CHARACTER_NOT_IN_REPERTOIRE),
+                errmsg("Inbound message rejected: %s at byte %zu",
+                       message_check_reason(check), pos));
+    dead_letter_raw(message_check_reason(check), buf, len);
+    return false;
+}
+
+/*
+ * bagger_route_row()
+ *
+ * BEFORE INSERT FOR EACH ROW trigger routing the document to its partition.
+ * Always returns NULL.
+ */
+Datum
+bagger_route_row(PG_FUNCTION_ARGS)
+{
+    TriggerData *tgdata;
+    Datum message;
+    Datum doc;
+    bool isnull;
+    Partition_name *table;
+    bool routed = true;
+    instr_time start;
+    instr_time end;
+
+    set_current_call(fcinfo);
+    tgdata = (TriggerData *) fcinfo->context;
+    if (!TRIGGER_FIRED_BEFORE(tgdata->tg_event)
+        || !TRIGGER_FIRED_FOR_ROW(tgdata->tg_event))
+        ereport(ERROR,
+                errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                errmsg("bagger_route_row must be fired before insert for each row"));
+
+    message = heap_getattr(tgdata->tg_trigtuple, 1,
+                           tgdata->tg_relation->rd_att, &isnull);
+    if (isnull)
+        ereport(ERROR,
+                errcode(ERRCODE_NOT_NULL_VIOLATION),
+                errmsg("Cannot route a null document"));
+
+    if (SPI_OK_CONNECT != SPI_connect())
+        elog(ERROR, "SPI_connect failed");
+
+    if (bagger_track_timing)
+        INSTR_TIME_SET_CURRENT(start);
+    if (!message_to_jsonb(TupleDescAttr(tgdata->tg_relation->rd_att,
+                                        0)->atttypid, message, &doc))
+    {
+        SPI_finish();
+        return PointerGetDatum(NULL);
+    }
+    table = partition_name_from_doc(DatumGetJsonbP(doc));
+    if (NULL == table)
+    {
+        dead_letter_doc(partition_name_error(), NULL, doc);
+        SPI_finish();
+        return PointerGetDatum(NULL);
+    }
+    if (bagger_track_timing)
+    {
+        INSTR_TIME_SET_CURRENT(end);
+        bagger_stats->extract_time += INSTR_TIME_GET_MILLISEC(end)
+                                      - INSTR_TIME_GET_MILLISEC(start);
+        start = end;
+    }
+
+    switch (bagger_routing_mode)
+    {
+    case ROUTING_MODE_BATCH:
+        batch_add_row(table->name, table->hash, doc);
+        break;
+    case ROUTING_MODE_DIRECT:
+        routed = direct_insert_row(table->name, table->hash, doc);
+        break;
+    default:
+        routed = route_row(table, doc);
+    }
+
+    if (bagger_track_timing)
+    {
+        INSTR_TIME_SET_CURRENT(end);
+        bagger_stats->insert_time += INSTR_TIME_GET_MILLISEC(end)
+                                     - INSTR_TIME_GET_MILLISEC(start);
+    }
+    if (routed)
+    {
+        ++bagger_stats->rows_routed;
+        bagger_stats_count_partition(table->name, table->hash);
+    }
+
+    SPI_finish();
+    return PointerGetDatum(NULL);
+}
+
+/*
+ * bagger_flush_batch()
+ *
+ * AFTER INSERT FOR EACH STATEMENT trigger writing out anything buffered in
+ * batch mode and closing partitions opened in direct mode.  This is done
+ * regardless of the current mode, in case the mode changed mid-statement.
+ */
+Datum
+bagger_flush_batch(PG_FUNCTION_ARGS)
+{
+    instr_time start;
+    instr_time end;
+
+    set_current_call(fcinfo);
+    if (!TRIGGER_FIRED_AFTER(((TriggerData *) fcinfo->context)->tg_event)
+        || !TRIGGER_FIRED_FOR_STATEMENT(((TriggerData *) fcinfo->context)->tg_event))
+        ereport(ERROR,
+                errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                errmsg("bagger_flush_batch must be fired after insert for each statement"));
+
+    if (SPI_OK_CONNECT != SPI_connect())
+        elog(ERROR, "SPI_connect failed");
+    if (bagger_track_timing)
+        INSTR_TIME_SET_CURRENT(start);
+    batch_flush_all();
+    direct_close_all();
+    if (bagger_track_timing)
+    {
+        INSTR_TIME_SET_CURRENT(end);
+        bagger_stats->insert_time += INSTR_TIME_GET_MILLISEC(end)
+                                     - INSTR_TIME_GET_MILLISEC(start);
+    }
+    SPI_finish();
+    bagger_stats_flush();
+    return PointerGetDatum(NULL);
+}
@@ -0,0 +1,250 @@
+#include <postgres.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "validate.h"
+
+/* Bagger inbound message validation
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * Inbound messages must be valid UTF-8, and must not contain the \u0000,
+ * \uFFFE, or \uFEFF escapes.  A message breaking these rules otherwise fails
+ * deep in jsonb input, or worse is stored and fails later on output, and
+ * takes the whole inbound statement with it.  When the inbound table takes
+ * raw messages (text or bytea), the trigger checks them here before parsing.
+ *
+ * Nearly all messages are plain ASCII with few escapes, so the check is
+ * split in two.  A vector loop looks at 32 bytes (AVX2) or 16 bytes (SSE2)
+ * at a time and only asks whether any of them is a backslash, a null, or
+ * has the high bit set.  Blocks with none of these are skipped whole.  The
+ * first block which has one is handed to the scalar loop, which validates
+ * UTF-8 sequences and escapes byte by byte and then returns to the vector
+ * loop.  Without SSE2 or AVX2 only the scalar loop is used.  AVX2 is only
+ * used when the module is built with it enabled (-mavx2), since it cannot
+ * be assumed on every server.
+ *
+ * Escapes are followed properly so that "\\u0000", an escaped backslash
+ * followed by the text u0000, is allowed.  Whether the message is otherwise
+ * valid JSON is left to jsonb input.
+ *
+ * Nothing in this file allocates or depends on the backend, so it can be
+ * tested standalone.
+ */
+
+#if defined(__AVX2__)
+#define VECTOR_WIDTH 32
+#elif defined(__SSE2__)
+#define VECTOR_WIDTH 16
+#endif
+
+static size_t check_from(const unsigned char *buf, size_t len, size_t pos,
+                         size_t stop, MessageCheck *result);
+static inline int hex_value(unsigned char c);
+
+/*
+ * MessageCheck check_message(const char *buf, size_t len, size_t *errpos)
+ *
+ * Checks the message, returning MESSAGE_OK if it is acceptable.  Otherwise
+ * *errpos is set to the offset of the offending byte or escape.
+ */
+MessageCheck
+check_message(const char *buf, size_t len, size_t *errpos)
+{
+    const unsigned char *ubuf = (const unsigned char *) buf;
+    MessageCheck result = MESSAGE_OK;
+    size_t pos = 0;
+
+#ifdef VECTOR_WIDTH
+#if defined(__AVX2__)
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i zero = _mm256_setzero_si256();
+#else
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i zero = _mm_setzero_si128();
+#endif
+
+    while (pos + VECTOR_WIDTH <= len)
+    {
+#if defined(__AVX2__)
+        __m256i v = _mm256_loadu_si256((const __m256i *) (ubuf + pos));
+        __m256i special = _mm256_or_si256(
+                              _mm256_or_si256(_mm256_cmpeq_epi8(v, backslash),
+                                              _mm256_cmpeq_epi8(v, zero)),
+                              v);
+
+        if (0 == _mm256_movemask_epi8(special))
+#else
+        __m128i v = _mm_loadu_si128((const __m128i *) (ubuf + pos));
+        __m128i special = _mm_or_si128(
+                              _mm_or_si128(_mm_cmpeq_epi8(v, backslash),
+                                           _mm_cmpeq_epi8(v, zero)),
+                              v);
+
+        if (0 == _mm_movemask_epi8(special))
+#endif
+        {
+            pos += VECTOR_WIDTH;
+            continue;
+        }
+
+        /* an escape or sequence may run past the block, so pos may too */
+        pos = check_from(ubuf, len, pos, pos + VECTOR_WIDTH, &result);
+        if (MESSAGE_OK != result)
+        {
+            *errpos = pos;
+            return result;
+        }
+    }
+#endif
+
+    pos = check_from(ubuf, len, pos, len, &result);
+    if (MESSAGE_OK != result)
+        *errpos = pos;
+    return result;
+}
+
+/*
+ * MessageCheck check_message_scalar(const char *buf, size_t len,
+ *                                   size_t *errpos)
+ *
+ * Same as check_message() without the vector loop.  Used by the tests to
+ * check that both give the same answers.
+ */
+MessageCheck
+check_message_scalar(const char *buf, size_t len, size_t *errpos)
+{
+    MessageCheck result = MESSAGE_OK;
+    size_t pos;
+
+    pos = check_from((const unsigned char *) buf, len, 0, len, &result);
+    if (MESSAGE_OK != result)
+        *errpos = pos;
+    return result;
+}
+
+/* Returns a short description of a failed check, for error messages and
+ * the dead letter table.
+ */
+const char *
+message_check_reason(MessageCheck check)
+{
+    switch (check)
+    {
+    case MESSAGE_OK:
+        return "valid";
+    case MESSAGE_INVALID_UTF8:
+        return "invalid UTF-8";
+    case MESSAGE_NULL_BYTE:
+        return "null byte";
+    case MESSAGE_FORBIDDEN_ESCAPE:
+        return "forbidden unicode escape";
+    }
+    return "unknown";
+}
+
+/* The scalar loop.  Checks from pos until at least stop, and returns the
+ * position it stopped at.  This is past stop if the last sequence or escape
+ * crossed it.  On failure *result is set and the position of the problem is
+ * returned.
+ */
+static size_t
+check_from(const unsigned char *buf, size_t len, size_t pos, size_t stop,
+           MessageCheck *result)
+{
+    while (pos < stop)
+    {
+        unsigned char c = buf[pos];
+
+        if (c < 0x80)
+        {
+            if ('\0' == c)
+            {
+                *result = MESSAGE_NULL_BYTE;
+                return pos;
+            }
+            if ('\\' != c)
+            {
+                ++pos;
+                continue;
+            }
+            /* an escape.  Anything other than \u is two bytes long. */
+            if (pos + 1 >= len || buf[pos + 1] >= 0x80)
+            {
+                ++pos;
+                continue;
+            }
+            if ('u' == buf[pos + 1] && pos + 6 <= len)
+            {
+                int h0 = hex_value(buf[pos + 2]);
+                int h1 = hex_value(buf[pos + 3]);
+                int h2 = hex_value(buf[pos + 4]);
+                int h3 = hex_value(buf[pos + 5]);
+
+                if ((h0 | h1 | h2 | h3) >= 0)
+                {
+                    int cp = h0 << 12 | h1 << 8 | h2 << 4 | h3;
+
+                    if (0x0000 == cp || 0xFFFE == cp || 0xFEFF == cp)
+                    {
+                        *result = MESSAGE_FORBIDDEN_ESCAPE;
+                        return pos;
+                    }
+                    pos += 6;
+                    continue;
+                }
+            }
+            pos += 2;
+            continue;
+        }
+
+        /* multi-byte sequences, without overlongs or surrogates */
+        if (c >= 0xC2 && c <= 0xDF)
+        {
+            if (pos + 1 < len && (buf[pos + 1] & 0xC0) == 0x80)
+            {
+                pos += 2;
+                continue;
+            }
+        }
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            if (pos + 2 < len && (buf[pos + 1] & 0xC0) == 0x80
+                && (buf[pos + 2] & 0xC0) == 0x80
+                && !(0xE0 == c && buf[pos + 1] < 0xA0)
+                && !(0xED == c && buf[pos + 1] > 0x9F))
+            {
+                pos += 3;
+                continue;
+            }
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+            if (pos + 3 < len && (buf[pos + 1] & 0xC0) == 0x80
+                && (buf[pos + 2] & 0xC0) == 0x80
+                && (buf[pos + 3] & 0xC0) == 0x80
+                && !(0xF0 == c && buf[pos + 1] < 0x90)
+                && !(0xF4 == c && buf[pos + 1] > 0x8F))
+            {
+                pos += 4;
+                continue;
+            }
+        }
+        *result = MESSAGE_INVALID_UTF8;
+        return pos;
+    }
+    return pos;
+}
+
+/* Returns the value of a hex digit, or -1 */
+static inline int
+hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
@@ -0,0 +1,18 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+/* Result of check_message(), see validate.c */
+typedef enum MessageCheck
+{
+    MESSAGE_OK,
+    MESSAGE_INVALID_UTF8,
+    MESSAGE_NULL_BYTE,
+    MESSAGE_FORBIDDEN_ESCAPE
+} MessageCheck;
+
+MessageCheck check_message(const char *buf, size_t len, size_t *errpos);
+MessageCheck check_message_scalar(const char *buf, size_t len,
+                                  size_t *errpos);
+const char *message_check_reason(MessageCheck check);
+
+#endif
@@ -0,0 +1,127 @@
+#include "xactbuf.h"
+#include <utils/memutils.h>
+
+/* Bagger per-transaction buffers
+ *
+ * Copyright (C) 2024-2025 One More Data
+ *
+ * The batch buffer (batch.c) and the partitions whose summaries were
+ * cleared (summary.c) are both kept in a hash keyed by partition name, which
+ * must not outlive the transaction.  The hash lives in a child of
+ * TopTransactionContext, so it is freed with the transaction in all cases,
+ * and a transaction callback forgets our pointers when that happens.
+ *
+ * A subtransaction abort only undoes the work of that subtransaction and
+ * those below it.  Errors caught in a function called for a row abort a
+ * subtransaction in the middle of a statement, and what was added before it
+ * must stay.  So the hash is kept, and the owner drops the entries added in
+ * the aborted subtransaction.  Subtransaction ids grow in start order, and
+ * the subtransactions below the aborted one started after it, so these are
+ * the entries added under ids not below the aborted one's.
+ */
+
+static void xact_buffer_forget(XactBuffer *buf);
+static void xact_buffer_xact_cb(XactEvent, void *);
+static void xact_buffer_subxact_cb(SubXactEvent, SubTransactionId,
+                                   SubTransactionId, void *);
+
+/*
+ * HTAB *xact_buffer_table(XactBuffer *buf)
+ *
+ * Returns the buffer's hash for the current transaction, creating it on
+ * first use.  Allocations which must live as long as the hash go in
+ * buf->cxt.
+ */
+HTAB *
+xact_buffer_table(XactBuffer *buf)
+{
+    HASHCTL ctl;
+
+    if (NULL != buf->table)
+        return buf->table;
+
+    if (!buf->registered)
+    {
+        RegisterXactCallback(xact_buffer_xact_cb, buf);
+        RegisterSubXactCallback(xact_buffer_subxact_cb, buf);
+        buf->registered = true;
+    }
+
+    if (buf->small)
+        buf->cxt = AllocSetContextCreate(TopTransactionContext,
+                                         "BaggerXactBufferCtx",
+                                         ALLOCSET_SMALL_SIZES);
+    else
+        buf->cxt = AllocSetContextCreate(TopTransactionContext,
+                                         "BaggerXactBufferCtx",
+                                         ALLOCSET_DEFAULT_SIZES);
+    ctl.keysize = MAXTABLELEN;
+    ctl.entrysize = buf->entrysize;
+    ctl.hash = partition_name_hash;
+    ctl.match = (HashCompareFunc) strncmp;
+    ctl.keycopy = (HashCopyFunc) strlcpy;
+    ctl.hcxt = buf->cxt;
+    buf->table = hash_create(buf->name, buf->nelem, &ctl,
+                             HASH_ELEM | HASH_FUNCTION | HASH_COMPARE
+                             | HASH_KEYCOPY | HASH_CONTEXT);
+    return buf->table;
+}
+
+/*
+ * void xact_buffer_release(XactBuffer *buf)
+ *
+ * Frees the buffer's hash and everything in its memory context before the
+ * end of the transaction.  The next xact_buffer_table() starts afresh.
+ */
+void
+xact_buffer_release(XactBuffer *buf)
+{
+    if (NULL == buf->cxt)
+        return;
+    MemoryContextDelete(buf->cxt);
+    xact_buffer_forget(buf);
+}
+
+/* Forgets the hash without freeing it, for when the context is gone */
+static void
+xact_buffer_forget(XactBuffer *buf)
+{
+    buf->cxt = NULL;
+    buf->table = NULL;
+}
+
+static void
+xact_buffer_xact_cb(XactEvent event, void *arg)
+{
+    XactBuffer *buf = (XactBuffer *) arg;
+
+    switch (event)
+    {
+    case XACT_EVENT_PRE_COMMIT:
+    case XACT_EVENT_PARALLEL_PRE_COMMIT:
+    case XACT_EVENT_PRE_PREPARE:
+        if (NULL != buf->table && NULL != buf->pre_commit)
+            buf->pre_commit(buf->table);
+        break;
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PARALLEL_COMMIT:
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PARALLEL_ABORT:
+    case XACT_EVENT_PREPARE:
+        /* TopTransactionContext is going away, and our hash with it */
+        xact_buffer_forget(buf);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+xact_buffer_subxact_cb(SubXactEvent event, SubTransactionId mySubid,
+                       SubTransactionId parentSubid, void *arg)
+{
+    XactBuffer *buf = (XactBuffer *) arg;
+
+    if (SUBXACT_EVENT_ABORT_SUB == event && NULL != buf->table)
+        buf->subxact_abort(buf->table, mySubid);
+}
@@ -0,0 +1,34 @@
+#ifndef XACTBUF_H
+#define XACTBUF_H
+
+#include "bagger.h"
+#include <access/xact.h>
+#include <utils/hsearch.h>
+
+/*
+ * A hash keyed by partition name, kept for at most the current transaction,
+ * see xactbuf.c.  The caller fills in the fields up to subxact_abort, and
+ * leaves the rest zero.
+ */
+typedef struct XactBuffer
+{
+    const char *name;           /* of the hash */
+    Size entrysize;             /* entries start with the MAXTABLELEN key */
+    long nelem;                 /* initial size of the hash */
+    bool small;                 /* use small blocks for the memory context */
+
+    /* optional, errors if the transaction must not commit */
+    void (*pre_commit)(HTAB *table);
+
+    /* drops what was added in subid and the subtransactions below it */
+    void (*subxact_abort)(HTAB *table, SubTransactionId subid);
+
+    MemoryContext cxt;          /* child of TopTransactionContext */
+    HTAB *table;                /* NULL until first used in a transaction */
+    bool registered;            /* callbacks registered */
+} XactBuffer;
+
+extern HTAB *xact_buffer_table(XactBuffer *buf);
+extern void xact_buffer_release(XactBuffer *buf);
+
+#endif
@@ -157,6 +157,53 @@ key_starts_with_null(void)
 	FAIL(ERRCODE_INVALID_ESCAPE_SEQUENCE);
 }
 
+static void
+array_index(void)
+{
+	Jsonpointer *jp;
+	char test[] = "/a/12/1b";
+
+	BEGIN;
+	NOCATCH;
+
+	jp = jsonpointer_parse(sizeof(test), test);
+
+	assert(!Jsonpointer_isdigit(jp));
+	jp = jp->next;
+	assert(Jsonpointer_isdigit(jp));
+	assert(strcmp(jp->ref, "12") == 0);
+	jp = jp->next;
+	assert(!Jsonpointer_isdigit(jp));
+	assert(jp->next == NULL);
+	OK;
+}
+
+static void
+compile(void)
+{
+	Jsonpointer_token *tok;
+	int n;
+	char test[] = "/a/12/1b/99999999999";
+
+	BEGIN;
+	NOCATCH;
+
+	tok = jsonpointer_compile(jsonpointer_parse(sizeof(test), test), &n);
+
+	assert(n == 4);
+	assert(tok[0].kind == JSONPOINTER_KEY);
+	assert(tok[0].keylen == 1 && strcmp(tok[0].key, "a") == 0);
+	assert(tok[1].kind == JSONPOINTER_INDEX && tok[1].index == 12);
+	assert(strcmp(tok[1].key, "12") == 0);
+	assert(tok[2].kind == JSONPOINTER_KEY);
+	assert(tok[2].keylen == 2);
+	/* too big for an index, so only a key */
+	assert(tok[3].kind == JSONPOINTER_KEY);
+	assert(tok[3].keylen == 11);
+	assert(tok[0].hash != tok[1].hash);
+	OK;
+}
+
 int
 main()
 {
@@ -168,4 +215,6 @@ main()
 	ptr_starts_with_null();
 	key_ends_with_null();
 	key_starts_with_null();
+	array_index();
+	compile();
 }
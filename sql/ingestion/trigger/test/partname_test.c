@@ -0,0 +1,59 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <postgres.h>
+#include "partname.h"
+
+/*
+Partition names do not use the backend at all, so like the time bucket tests
+no harness is needed.  The same names are checked against
+storage.partition_name() by t/sql/31-lw_storage_objects.pg, so both must be
+changed together.
+*/
+
+#define BEGIN do{ fputs(__func__,stderr); fputs(": ",stderr); }while(0)
+#define OK do{ fputs("ok\n", stderr); return; }while(0)
+
+static char *
+name(const char **labels, int count, const char *ts)
+{
+	static char buf[PARTITION_NAME_LEN + 1];
+	char suffix[HOUR_SUFFIX_LEN + 1];
+	uint64 hash = LABELS_HASH_INIT;
+	int64 hour;
+
+	for (int i = 0; i < count; ++i)
+		hash = labels_hash_add(hash, labels[i], strlen(labels[i]));
+	if (!iso8601_to_hour(ts, strlen(ts), &hour) || !format_hour(hour, suffix))
+		return NULL;
+	format_partition_name(hash, suffix, buf);
+	return buf;
+}
+
+/* The actual test cases */
+
+static void
+names(void)
+{
+	const char *ab[] = {"a", "b"};
+	const char *joined[] = {"a1:b"};
+	const char *long_label[] = {"abcdefghij"};
+	char first[PARTITION_NAME_LEN + 1];
+
+	BEGIN;
+	assert(strcmp(name(ab, 2, "2024-01-01 03:00"),
+				  "bp_bdd1428ad635dedc_2024_01_01_03") == 0);
+	assert(strcmp(name(NULL, 0, "2024-01-01T01"),
+				  "bp_cbf29ce484222325_2024_01_01_01") == 0);
+	/* labels cannot run together */
+	strcpy(first, name(joined, 1, "2024-01-01 03:00"));
+	assert(strcmp(first, name(ab, 2, "2024-01-01 03:00")) != 0);
+	assert(strlen(name(long_label, 1, "2024-01-01T03")) == PARTITION_NAME_LEN);
+	OK;
+}
+
+int
+main()
+{
+	names();
+}
@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <postgres.h>
+#include "placement.h"
+
+/*
+Placement does not use the backend at all, so like the time bucket tests no
+harness is needed.  The expected hashes and placements are also checked by
+t/45-servermap.t against the Perl implementation, so both must be changed
+together.
+*/
+
+#define BEGIN do{ fputs(__func__,stderr); fputs(": ",stderr); }while(0)
+#define OK do{ fputs("ok\n", stderr); return; }while(0)
+
+#define KEY(k) placement_hash((k), strlen(k))
+
+static placement_node three[] = {
+	{"host1_5432", 1, 0}, {"host2_5432", 1, 1}, {"host3_5432", 1, 2}
+};
+
+/* The actual test cases */
+
+static void
+hashes(void)
+{
+	BEGIN;
+	assert(KEY("") == UINT64CONST(17280346270528514342));
+	assert(KEY("bp_0000000000000000_2024_01_01_00")
+		   == UINT64CONST(1404596620676349489));
+	OK;
+}
+
+static void
+ring(void)
+{
+	placement_token ring[48];
+	int out[PLACEMENT_MAX_REPLICAS];
+
+	BEGIN;
+	assert(placement_ring_size(three, 3, 16) == 48);
+	placement_ring_build(three, 3, 16, ring);
+	assert(ring[0].hash == UINT64CONST(112457387503111145));
+	assert(ring[0].node == 1);
+	for (int i = 1; i < 48; ++i)
+		assert(ring[i - 1].hash <= ring[i].hash);
+
+	assert(placement_lookup(ring, 48, three,
+							KEY("bp_0000000000000000_2024_01_01_00"), 2,
+							out) == 2);
+	assert(out[0] == 1 && out[1] == 0);
+	assert(placement_lookup(ring, 48, three,
+							KEY("bp_cbf29ce484222325_2024_01_01_01"), 2,
+							out) == 2);
+	assert(out[0] == 2 && out[1] == 0);
+	/* never more copies than nodes */
+	assert(placement_lookup(ring, 48, three, 0, 5, out) == 3);
+	OK;
+}
+
+static void
+domains(void)
+{
+	placement_node racked[] = {
+		{"a_5432", 1, 0}, {"b_5432", 1, 0}, {"c_5432", 1, 1}
+	};
+	placement_token ring[192];
+	int out[PLACEMENT_MAX_REPLICAS];
+	char key[40];
+
+	BEGIN;
+	placement_ring_build(racked, 3, 64, ring);
+	for (int k = 0; k < 1000; ++k)
+	{
+		snprintf(key, sizeof(key), "key%d", k);
+		assert(placement_lookup(ring, 192, racked, KEY(key), 2, out) == 2);
+		assert(racked[out[0]].domain != racked[out[1]].domain);
+		/* a third copy has to share a domain */
+		assert(placement_lookup(ring, 192, racked, KEY(key), 3, out) == 3);
+	}
+	OK;
+}
+
+static void
+weights(void)
+{
+	placement_node weighted[] = {
+		{"small_5432", 1, 0}, {"large_5432", 3, 1}
+	};
+	placement_token ring[256];
+	int out[PLACEMENT_MAX_REPLICAS];
+	int primaries[2] = {0, 0};
+	char key[40];
+
+	BEGIN;
+	placement_ring_build(weighted, 2, 64, ring);
+	for (int k = 0; k < 10000; ++k)
+	{
+		snprintf(key, sizeof(key), "key%d", k);
+		placement_lookup(ring, 256, weighted, KEY(key), 1, out);
+		primaries[out[0]]++;
+	}
+	assert(primaries[1] > 2 * primaries[0]);
+	assert(primaries[1] < 4 * primaries[0]);
+	OK;
+}
+
+static void
+growth(void)
+{
+	placement_node four[] = {
+		{"host1_5432", 1, 0}, {"host2_5432", 1, 1}, {"host3_5432", 1, 2},
+		{"host4_5432", 1, 3}
+	};
+	placement_token before[192];
+	placement_token after[256];
+	int a[PLACEMENT_MAX_REPLICAS];
+	int b[PLACEMENT_MAX_REPLICAS];
+	int moved = 0;
+	char key[40];
+
+	BEGIN;
+	placement_ring_build(three, 3, 64, before);
+	placement_ring_build(four, 4, 64, after);
+	for (int k = 0; k < 10000; ++k)
+	{
+		snprintf(key, sizeof(key), "key%d", k);
+		placement_lookup(before, 192, three, KEY(key), 1, a);
+		placement_lookup(after, 256, four, KEY(key), 1, b);
+		/* keys only move to the new node */
+		assert(a[0] == b[0] || b[0] == 3);
+		moved += a[0] != b[0];
+	}
+	assert(moved > 1500 && moved < 3500);
+	OK;
+}
+
+int
+main()
+{
+	hashes();
+	ring();
+	domains();
+	weights();
+	growth();
+}
@@ -0,0 +1,58 @@
+-- Batch mode rows and subtransaction aborts
+SET client_min_messages = error;
+CREATE EXTENSION bagger_lw_storage;
+CREATE EXTENSION bagger_trigger;
+DO $$
+BEGIN
+    PERFORM storage.append_dimension('/service', NULL, NULL, NULL);
+END;
+$$;
+CREATE TABLE inbound (doc jsonb);
+CREATE TRIGGER route BEFORE INSERT ON inbound
+   FOR EACH ROW EXECUTE FUNCTION storage.bagger_route_row();
+CREATE TRIGGER flush AFTER INSERT ON inbound
+   FOR EACH STATEMENT EXECUTE FUNCTION storage.bagger_flush_batch();
+SET bagger.routing_mode = batch;
+CREATE FUNCTION routed() RETURNS bigint LANGUAGE plpgsql AS $$
+DECLARE total bigint := 0;
+        n bigint;
+        part name;
+BEGIN
+    FOR part IN SELECT relname FROM storage.partition LOOP
+        EXECUTE format('SELECT count(*) FROM partitions.%I', part) INTO n;
+        total := total + n;
+    END LOOP;
+    RETURN total;
+END;
+$$;
+-- catches an error in a subtransaction of its own
+CREATE FUNCTION caught(n int) RETURNS int LANGUAGE plpgsql AS $$
+BEGIN
+    BEGIN
+        PERFORM 1 / 0;
+    EXCEPTION WHEN division_by_zero THEN
+        NULL;
+    END;
+    RETURN n;
+END;
+$$;
+-- errors caught while the statement goes on keep the rows buffered before
+INSERT INTO inbound
+SELECT jsonb_build_object('timestamp', '2024-01-01T03:00:00Z',
+                          'service', 'app', 'n', caught(n))
+  FROM generate_series(1, 10) n;
+SELECT routed();
+-- a failed statement loses the rows it buffered, and only those
+BEGIN;
+SAVEPOINT s;
+INSERT INTO inbound
+SELECT jsonb_build_object('timestamp', '2024-01-01T03:00:00Z',
+                          'service', 'app', 'n', 10 / (3 - n))
+  FROM generate_series(1, 5) n;
+ROLLBACK TO s;
+INSERT INTO inbound
+SELECT jsonb_build_object('timestamp', '2024-01-01T03:00:00Z',
+                          'service', 'app', 'n', n)
+  FROM generate_series(1, 2) n;
+COMMIT;
+SELECT routed();
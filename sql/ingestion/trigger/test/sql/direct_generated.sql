@@ -0,0 +1,30 @@
+-- Direct mode rows in partitions with stored generated columns
+SET client_min_messages = error;
+CREATE EXTENSION bagger_lw_storage;
+CREATE EXTENSION bagger_trigger;
+DO $$
+BEGIN
+    PERFORM storage.append_dimension('/service', NULL, NULL, NULL);
+END;
+$$;
+CREATE TABLE inbound (doc jsonb);
+CREATE TRIGGER route BEFORE INSERT ON inbound
+   FOR EACH ROW EXECUTE FUNCTION storage.bagger_route_row();
+CREATE TRIGGER flush AFTER INSERT ON inbound
+   FOR EACH STATEMENT EXECUTE FUNCTION storage.bagger_flush_batch();
+SET bagger.routing_mode = direct;
+-- a typed column as added by compaction with compact_typed_columns
+DO $$
+BEGIN
+    EXECUTE format('ALTER TABLE %s ADD COLUMN n_1 int '
+                   'GENERATED ALWAYS AS ((data->>''n'')::int) STORED',
+                   storage.create_partition(array['app'],
+                                            '2024-01-01 03:00'));
+END;
+$$;
+SELECT storage.partition_name(array['app'], '2024-01-01 03:00') AS part \gset
+INSERT INTO inbound
+SELECT jsonb_build_object('timestamp', '2024-01-01T03:00:00Z',
+                          'service', 'app', 'n', n)
+  FROM generate_series(1, 3) n;
+SELECT n_1 FROM partitions.:"part" ORDER BY n_1;
@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <postgres.h>
+#include "timebucket.h"
+
+/*
+The time bucket functions do not use the backend at all, so unlike the
+jsonpointer tests no harness is needed.
+*/
+
+#define BEGIN do{ fputs(__func__,stderr); fputs(": ",stderr); }while(0)
+#define OK do{ fputs("ok\n", stderr); return; }while(0)
+
+static char *
+bucket(const char *ts)
+{
+	static char buf[HOUR_SUFFIX_LEN + 1];
+	int64 hour;
+
+	if (!iso8601_to_hour(ts, strlen(ts), &hour) || !format_hour(hour, buf))
+		return NULL;
+	return buf;
+}
+
+/* The actual test cases */
+
+static void
+iso_utc(void)
+{
+	BEGIN;
+	assert(strcmp(bucket("2024-01-01T03:02:00Z"), "2024_01_01_03") == 0);
+	assert(strcmp(bucket("2024-01-01T03:59:59.999999Z"), "2024_01_01_03") == 0);
+	assert(strcmp(bucket("2024-02-29 23:00:00"), "2024_02_29_23") == 0);
+	assert(strcmp(bucket("2024-12-31T23"), "2024_12_31_23") == 0);
+	assert(strcmp(bucket("2024-03-01"), "2024_03_01_00") == 0);
+	assert(strcmp(bucket("2000-02-29T05"), "2000_02_29_05") == 0);
+	assert(strcmp(bucket("2024-04-30T23:59:59,5"), "2024_04_30_23") == 0);
+	OK;
+}
+
+static void
+iso_offsets(void)
+{
+	BEGIN;
+	assert(strcmp(bucket("2024-01-01T03:02:00+02:00"), "2024_01_01_01") == 0);
+	assert(strcmp(bucket("2024-01-01T00:10:00+05:30"), "2023_12_31_18") == 0);
+	assert(strcmp(bucket("2023-12-31T22:30:00-0200"), "2024_01_01_00") == 0);
+	assert(strcmp(bucket("2024-01-01T03:02:00-01"), "2024_01_01_04") == 0);
+	OK;
+}
+
+static void
+iso_invalid(void)
+{
+	BEGIN;
+	assert(bucket("") == NULL);
+	assert(bucket("2024-1-01T03:00:00Z") == NULL);
+	assert(bucket("2024-13-01T03:00:00Z") == NULL);
+	assert(bucket("2024-01-01T24:00:00Z") == NULL);
+	assert(bucket("2024-02-31T01:00:00Z") == NULL);
+	assert(bucket("2023-02-29T01:00:00Z") == NULL);
+	assert(bucket("1900-02-29") == NULL);
+	assert(bucket("2024-04-31") == NULL);
+	assert(bucket("0000-01-01") == NULL);
+	assert(bucket("2024-01-01T03:00:60Z") == NULL);
+	assert(bucket("2024-01-01T03:00:00.Z") == NULL);
+	assert(bucket("2024-01-01T03:00:00:00Z") == NULL);
+	assert(bucket("2024-01-01T03:00:00+02:") == NULL);
+	assert(bucket("2024-01-01T03:00:00Zulu") == NULL);
+	assert(bucket("2024-01-01T03:00:00 +02:00") == NULL);
+	assert(bucket("yesterday") == NULL);
+	OK;
+}
+
+static void
+epoch(void)
+{
+	char buf[HOUR_SUFFIX_LEN + 1];
+
+	BEGIN;
+	assert(format_hour(epoch_to_hour(0), buf));
+	assert(strcmp(buf, "1970_01_01_00") == 0);
+	assert(format_hour(epoch_to_hour(1704078120), buf));
+	assert(strcmp(buf, "2024_01_01_03") == 0);
+	/* milliseconds */
+	assert(format_hour(epoch_to_hour(1704078120123), buf));
+	assert(strcmp(buf, "2024_01_01_03") == 0);
+	assert(format_hour(epoch_to_hour(-1), buf));
+	assert(strcmp(buf, "1969_12_31_23") == 0);
+	OK;
+}
+
+int
+main()
+{
+	iso_utc();
+	iso_offsets();
+	iso_invalid();
+	epoch();
+}
@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <postgres.h>
+#include "validate.h"
+
+/*
+The validation functions do not use the backend at all, so like the time
+bucket tests no harness is needed.  Messages are padded so that the
+interesting bytes land at different offsets within and across vector
+blocks.
+*/
+
+#define BEGIN do{ fputs(__func__,stderr); fputs(": ",stderr); }while(0)
+#define OK do{ fputs("ok\n", stderr); return; }while(0)
+
+/* Checks msg at every offset from 0 to 70, returning the result and
+ * asserting that the vector and scalar checks agree, including on the
+ * position of the error.
+ */
+static MessageCheck
+check(const char *msg, size_t len)
+{
+	char buf[256];
+	MessageCheck first = MESSAGE_OK;
+	int pad;
+
+	assert(len + 70 < sizeof(buf));
+	for (pad = 0; pad < 70; ++pad)
+	{
+		size_t vpos = 0, spos = 0;
+		MessageCheck v, s;
+
+		memset(buf, 'x', pad);
+		memcpy(buf + pad, msg, len);
+		v = check_message(buf, pad + len, &vpos);
+		s = check_message_scalar(buf, pad + len, &spos);
+		assert(v == s);
+		assert(v == MESSAGE_OK || vpos == spos);
+		if (0 == pad)
+			first = v;
+		assert(v == first);
+	}
+	return first;
+}
+
+#define CHECK(m) check(m, sizeof(m) - 1)
+
+/* The actual test cases */
+
+static void
+valid(void)
+{
+	BEGIN;
+	assert(CHECK("") == MESSAGE_OK);
+	assert(CHECK("{\"a\": \"plain ascii text\"}") == MESSAGE_OK);
+	assert(CHECK("{\"a\": \"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80\"}")
+	       == MESSAGE_OK);
+	assert(CHECK("{\"a\": \"\\u00e9 \\uFFFD \\n \\\" \"}") == MESSAGE_OK);
+	/* an escaped backslash followed by text, not an escape */
+	assert(CHECK("{\"a\": \"\\\\u0000\"}") == MESSAGE_OK);
+	/* short or malformed escapes are left to the JSON parser */
+	assert(CHECK("\\u00") == MESSAGE_OK);
+	assert(CHECK("\\uzzzz") == MESSAGE_OK);
+	OK;
+}
+
+static void
+invalid_utf8(void)
+{
+	BEGIN;
+	assert(CHECK("\x80") == MESSAGE_INVALID_UTF8);
+	assert(CHECK("\xc3") == MESSAGE_INVALID_UTF8);
+	assert(CHECK("\xc0\xaf") == MESSAGE_INVALID_UTF8);          /* overlong */
+	assert(CHECK("\xe0\x80\xaf") == MESSAGE_INVALID_UTF8);      /* overlong */
+	assert(CHECK("\xed\xa0\x80") == MESSAGE_INVALID_UTF8);      /* surrogate */
+	assert(CHECK("\xf4\x90\x80\x80") == MESSAGE_INVALID_UTF8);  /* > U+10FFFF */
+	assert(CHECK("\xff") == MESSAGE_INVALID_UTF8);
+	assert(CHECK("ok \xe2\x82") == MESSAGE_INVALID_UTF8);
+	OK;
+}
+
+static void
+forbidden(void)
+{
+	size_t pos = 0;
+	char nul[] = "{\"a\": \"x\0y\"}";
+
+	BEGIN;
+	assert(CHECK("{\"a\": \"\\u0000\"}") == MESSAGE_FORBIDDEN_ESCAPE);
+	assert(CHECK("{\"a\": \"\\uFFFE\"}") == MESSAGE_FORBIDDEN_ESCAPE);
+	assert(CHECK("{\"a\": \"\\ufeff\"}") == MESSAGE_FORBIDDEN_ESCAPE);
+	assert(CHECK("\\\\\\u0000") == MESSAGE_FORBIDDEN_ESCAPE);
+	assert(check(nul, sizeof(nul) - 1) == MESSAGE_NULL_BYTE);
+
+	assert(check_message("0123456789abcdef0123\\u0000", 26, &pos)
+	       == MESSAGE_FORBIDDEN_ESCAPE);
+	assert(pos == 20);
+	OK;
+}
+
+int
+main()
+{
+	valid();
+	invalid_utf8();
+	forbidden();
+}
@@ -24,6 +24,8 @@ create table storage.postgres_instance (
    port int,
    username varchar not null,
    status smallint not null default 0,
+   weight int not null default 1 check (weight > 0),
+   rack varchar,
    primary key (host, port),
    check (status >= 0 and status <= 3) -- if you change this, change docs below
 );
@@ -55,6 +57,15 @@ This leads to the following values:
 New states may be added in the future.
 $$;
 
+COMMENT ON COLUMN storage.postgres_instance.weight IS
+$$ Relative capacity of the instance.  Servermaps place ingest on instances in
+proportion to their weight.$$;
+
+COMMENT ON COLUMN storage.postgres_instance.rack IS
+$$ Failure domain of the instance, such as a rack or availability zone.
+Servermaps keep the copies of data in different failure domains where possible.
+If null, the host is the failure domain.$$;
+
 create table storage.servermap (
    id serial primary key,
    server_map json not null
@@ -157,21 +168,148 @@ comment on column storage.config.value is
 $$ JSON is selected here because it is richer than plain text and serialization
 libraries are available in all major languages.$$;
 
+create table storage.partition (
+    relname name primary key,
+    relid oid unique,
+    dimensions text[],
+    bucket timestamp not null,
+    state text not null default 'active' check (state in ('active', 'sealed')),
+    indexes_deferred boolean not null default false,
+    compacted_at timestamptz,
+    compact_error text,
+    row_estimate bigint,
+    byte_estimate bigint,
+    summarized_at timestamptz,
+    min_time timestamp,
+    max_time timestamp,
+    created_at timestamptz not null default now(),
+    unique (dimensions, bucket)
+);
+
+create index partition_bucket_idx on storage.partition (bucket);
+
+SELECT pg_catalog.pg_extension_config_dump('storage.partition', '');
+
+comment on table storage.partition is
+$$ The registry of data partitions on this storage node, one row per table in
+the partitions schema.
+
+This is local to each storage node and not published.  Partitions are added by
+create_partition() and removed by enforce_retention(), so that nothing needs to
+scan pg_class or parse table names, and partitions for a range of hours can be
+found through the bucket index.  register_partitions() brings the registry back
+in line with the catalog if tables were created or dropped by hand.$$;
+
+comment on column storage.partition.relname is
+$$ The table name in the partitions schema, see partition_name().$$;
+
+comment on column storage.partition.relid is
+$$ The table oid.  This is not preserved by dump and restore, and is refreshed
+by register_partitions().$$;
+
+comment on column storage.partition.dimensions is
+$$ The dimension labels of the partition's rows, in dimension order.  Null for
+tables found by register_partitions() which were not created by
+create_partition().$$;
+
+comment on column storage.partition.bucket is
+$$ The start of the partition's hour, in UTC.$$;
+
+comment on column storage.partition.state is
+$$ active while the partition can receive rows, sealed once its hour is over
+and it is no longer written to, see seal_partitions().$$;
+
+comment on column storage.partition.indexes_deferred is
+$$ True if the partition was created with only a BRIN index on the document
+time, see create_partition().  Its other indexes are built once it is
+sealed.$$;
+
+comment on column storage.partition.compacted_at is
+$$ When the partition was rewritten by compact_partitions(), or null if it has
+not been.$$;
+
+comment on column storage.partition.compact_error is
+$$ The error of the last attempt to compact the partition, or null.  Partitions
+with an error are left alone by compact_partitions() and summarized without
+being compacted.  Set it back to null to try again.$$;
+
+comment on column storage.partition.row_estimate is
+$$ Row and size estimates from the planner statistics, as of the last
+update_partition_estimates().  Null until then.$$;
+
+comment on column storage.partition.summarized_at is
+$$ When the partition's summary was built by summarize_partitions(), or null if
+it has none.  The summary is min_time, max_time, and the bloom filters in
+partition_bloom.
+
+The ingestion trigger sets this to null in the transaction writing rows to the
+partition, so that a summary never leaves out committed rows.  Rows written to
+a sealed partition other than through the trigger must do the same.$$;
+
+comment on column storage.partition.min_time is
+$$ The earliest and latest document time in the partition, as of its summary.
+Null if it has no rows with a document time.$$;
+
+create table storage.index_backfill (
+    index_id int not null,
+    relname name not null references storage.partition (relname)
+                          on delete cascade,
+    state text not null default 'pending'
+          check (state in ('pending', 'running', 'done', 'failed')),
+    attempts int not null default 0,
+    last_error text,
+    queued_at timestamptz not null default now(),
+    started_at timestamptz,
+    finished_at timestamptz,
+    primary key (index_id, relname)
+);
+
+create index index_backfill_state_idx on storage.index_backfill (state);
+
+SELECT pg_catalog.pg_extension_config_dump('storage.index_backfill', '');
+
+comment on table storage.index_backfill is
+$$ Indexes to be built on existing partitions, one row per index and partition.
+
+Partitions get the indexes valid for their hour when they are created.  Indexes
+defined after that are built here by the storage agent, see
+queue_index_backfill().  Jobs are kept when done so that progress can be
+reported, and removed with their partition.  A job left running by an agent
+which died is put back by reset_index_backfill().$$;
+
+create table storage.partition_bloom (
+    relname name not null references storage.partition (relname)
+                          on delete cascade,
+    pointer text not null,
+    hashes int not null,
+    bits varbit not null,
+    primary key (relname, pointer)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('storage.partition_bloom', '');
+
+comment on table storage.partition_bloom is
+$$ Bloom filters over the values of the summary_fields in sealed partitions, one
+row per partition and field, see summarize_partitions().  pointer is the JSON
+pointer of the field, and each value of the field in the partition sets the
+bits of bits which bloom_positions() returns for it.$$;
+
 -------------
 -- Instances
 ------------
 
 CREATE FUNCTION storage.register_pg_instance
-(in_host text, in_port int, in_username text)
+(in_host text, in_port int, in_username text, in_weight int default 1,
+ in_rack text default null)
 RETURNS storage.postgres_instance LANGUAGE SQL
 BEGIN ATOMIC
-INSERT INTO storage.postgres_instance (host, port, username)
-      VALUES (in_host, in_port, in_username)
+INSERT INTO storage.postgres_instance (host, port, username, weight, rack)
+      VALUES (in_host, in_port, in_username, coalesce(in_weight, 1), in_rack)
 RETURNING *;
 END;
 
 COMMENT ON FUNCTION storage.register_pg_instance
-(in_host text, in_port int, in_username text)
+(in_host text, in_port int, in_username text, in_weight int, in_rack text)
 IS
 $$This function registers a new Postgres instance as a storage node.
 
@@ -180,6 +318,8 @@ By design the new node is created offline (state 0).  The arguments are:
  - in_host:      The hostname or IP address of the host.
  - in_port:      The port that this Postgres instance is listening on.
  - in_username:  The username that Schaufel should connect as.
+ - in_weight:    Relative capacity of the instance, default 1.
+ - in_rack:      Failure domain of the instance, default the host.
 
 $$;
 
@@ -363,6 +503,11 @@ RETURNS storage.index LANGUAGE SQL BEGIN ATOMIC
 SELECT * FROM storage.index WHERE indexname = in_indexname;
 END;
 --
+CREATE FUNCTION storage.list_indexes()
+RETURNS SETOF storage.index LANGUAGE SQL BEGIN ATOMIC
+SELECT * FROM storage.index ORDER BY indexname;
+END;
+--
 CREATE FUNCTION storage.save_index(in_indexname text, 
 in_access_method text, in_tablespc text,
 in_valid_until timestamp, in_valid_from timestamp)
@@ -417,12 +562,6 @@ VALUES (in_server_map)
 RETURNING *;
 END;
 
-CREATE FUNCTION storage.servermap_rotate_num()
-RETURNS int language sql begin atomic
-SELECT count(*) from storage.postgres_instance
-group by host order by 1 desc limit 1;
-end;
-
 COMMENT ON FUNCTION storage.save_servermap(in_server_map json)
 IS
 $$ This function always inserts a new record.$$;
@@ -451,41 +590,977 @@ EXCEPTION WHEN unique_violation THEN -- rare enough to take the subtrans hit
 end;
 $$;
 
+---------------------
+-- Partitions
+---------------------
+
+CREATE FUNCTION storage.document_time(in_value jsonb)
+returns timestamp
+language sql immutable strict parallel safe
+as
+$$
+SELECT CASE jsonb_typeof(in_value)
+       WHEN 'number' THEN
+            (SELECT to_timestamp(e.secs) AT TIME ZONE 'UTC'
+               FROM (SELECT CASE WHEN abs(in_value::numeric) >= 100000000000
+                                 THEN in_value::numeric / 1000
+                                 ELSE in_value::numeric END) e(secs)
+              -- years 1 to 9999, as in partition names
+              WHERE e.secs >= -62135596800 AND e.secs < 253402300800)
+       WHEN 'string' THEN
+            (SELECT CASE WHEN t.y < 1 OR t.mo NOT BETWEEN 1 AND 12 THEN NULL
+                         WHEN t.d < 1
+                              OR t.d > CASE
+                                   WHEN t.mo IN (4, 6, 9, 11) THEN 30
+                                   WHEN t.mo <> 2 THEN 31
+                                   WHEN t.y % 4 = 0 AND (t.y % 100 <> 0
+                                                         OR t.y % 400 = 0)
+                                   THEN 29
+                                   ELSE 28 END
+                              OR t.h > 23 OR t.mi > 59 OR t.s >= 60
+                              OR t.oh > 23 OR t.om > 59
+                         THEN NULL
+                         ELSE make_timestamp(t.y, t.mo, t.d, t.h, t.mi,
+                                             t.s::float8)
+                              - t.sign * make_interval(hours => t.oh,
+                                                       mins => t.om)
+                    END
+               FROM regexp_match(in_value #>> '{}',
+                                 '^(\d{4})-(\d{2})-(\d{2})'
+                                 '(?:[Tt ](\d{2})(?::(\d{2})'
+                                 '(?::(\d{2})([.,]\d+)?)?)?)?'
+                                 '(?:[Zz]|([+-])(\d{2})(?::?(\d{2}))?)?$') m,
+                    LATERAL (SELECT m[1]::int, m[2]::int, m[3]::int,
+                                    coalesce(m[4]::int, 0),
+                                    coalesce(m[5]::int, 0),
+                                    trunc(coalesce(m[6]::numeric, 0)
+                                          + coalesce(('0.' || substr(m[7], 2))
+                                                     ::numeric, 0), 6),
+                                    CASE m[8] WHEN '-' THEN -1 ELSE 1 END,
+                                    coalesce(m[9]::int, 0),
+                                    coalesce(m[10]::int, 0))
+                            t(y, mo, d, h, mi, s, sign, oh, om)
+              WHERE m IS NOT NULL)
+       END;
+$$;
+
+COMMENT ON FUNCTION storage.document_time(jsonb) IS
+$$ Returns the document time for the value of the timestamp field, in UTC,
+following the same rules as the ingestion trigger: an ISO-8601 string, UTC if
+it has no zone, or seconds since the epoch, or milliseconds if too large to be
+seconds.  Returns null for anything else, including dates and times which do
+not exist and years outside 1 to 9999, and never raises an error.
+
+This is used in the BRIN index of partitions with deferred indexes, to sort
+compacted partitions, in partition summaries, and in queries, so one bad
+document must not fail any of these.  The string is checked field by field
+rather than cast, since casts raise errors and depend on the time zone.$$;
+
+CREATE FUNCTION storage.partition_name
+(in_dimensions text[], in_bucket timestamp)
+returns name
+language plpgsql immutable strict
+as
+$$
+declare key bytea;
+        hash numeric := 14695981039346656037;
+        low int;
+begin
+    SELECT convert_to(coalesce(string_agg(octet_length(coalesce(l, ''))
+                                              || ':' || coalesce(l, ''),
+                                          '' ORDER BY o), ''),
+                      pg_catalog.getdatabaseencoding())
+      INTO key
+      FROM unnest(in_dimensions) WITH ORDINALITY AS u(l, o);
+
+    -- 64 bit FNV-1a.  There is no unsigned 64 bit type, so we use numeric.
+    FOR i IN 0 .. length(key) - 1 LOOP
+        low := mod(hash, 256)::int;
+        hash := hash - low + (low # get_byte(key, i));
+        hash := mod(hash * 1099511628211, 18446744073709551616);
+    END LOOP;
+    RETURN 'bp_'
+           || lpad(to_hex(div(hash, 4294967296)::bigint), 8, '0')
+           || lpad(to_hex(mod(hash, 4294967296)::bigint), 8, '0')
+           || '_' || to_char(in_bucket, 'YYYY_MM_DD_HH24');
+end;
+$$;
+
+COMMENT ON FUNCTION storage.partition_name(text[], timestamp) IS
+$$ Returns the table name of the partition for the given dimension labels and
+hour.  This is bp_, a 64 bit FNV-1a hash of the labels in hex, and the hour as
+YYYY_MM_DD_HH.  Each label is hashed with its length in bytes and a colon in
+front of it, so that labels cannot run together.
+
+The ingestion trigger computes the same names in C.  Names are always 33 bytes
+long, so they never collide by truncation, and they are never parsed: the labels
+and hour are kept in storage.partition.$$;
+
+CREATE FUNCTION storage.query_partitions
+(in_labels jsonb, in_from timestamp, in_to timestamp)
+returns table (relname name, dimensions text[], bucket timestamp)
+language sql immutable strict
+as
+$$
+WITH RECURSIVE combination (depth, labels) AS (
+    SELECT 0, '{}'::text[]
+  UNION ALL
+    SELECT c.depth + 1, c.labels || l.label
+      FROM combination c,
+           jsonb_array_elements_text(in_labels -> c.depth) AS l(label)
+     WHERE c.depth < jsonb_array_length(in_labels)
+)
+SELECT storage.partition_name(c.labels, h), c.labels, h
+  FROM combination c,
+       generate_series(date_trunc('hour', in_from), in_to,
+                       interval '1 hour') AS h
+ WHERE c.depth = jsonb_array_length(in_labels)
+ ORDER BY h, c.labels;
+$$;
+
+COMMENT ON FUNCTION storage.query_partitions(jsonb, timestamp, timestamp) IS
+$$ Returns the partitions which can hold rows for a query, given the labels
+wanted for each dimension as a JSON array of arrays of strings, in dimension
+order, and the time range in UTC.  These are all combinations of one label per
+dimension, for each hour in the range, in hour order.
+
+Partitions are not looked up, so some of them may not exist on any storage
+node.  The query proxy uses this to find the partitions to search, and which
+nodes hold them in ring mode.$$;
+
+CREATE FUNCTION storage.create_partition
+(in_dimensions text[], in_bucket timestamp)
+returns regclass
+language plpgsql
+as
+$$
+declare part_hour timestamp;
+        part_name name;
+        part_rel regclass;
+        other text[];
+        storage_mode text;
+        defer boolean;
+        time_field text;
+        idx record;
+        field_str text;
+begin
+    part_hour := date_trunc('hour', in_bucket);
+    part_name := storage.partition_name(in_dimensions, part_hour);
+
+    -- Concurrent callers for the same partition wait here, and then find the
+    -- partition created by the first one.  The lock is released at the end
+    -- of the transaction, which is when the new table becomes visible.
+    PERFORM pg_advisory_xact_lock(hashtext('storage.create_partition'),
+                                  hashtext(part_name));
+    SELECT dimensions INTO other
+      FROM storage.partition WHERE relname = part_name;
+    IF FOUND AND other IS DISTINCT FROM in_dimensions THEN
+        RAISE EXCEPTION 'Partition name % for % collides with %',
+                        part_name, in_dimensions, other;
+    END IF;
+    part_rel := to_regclass(format('partitions.%I', part_name));
+    IF part_rel IS NOT NULL THEN
+        RETURN part_rel;
+    END IF;
+
+    CREATE SCHEMA IF NOT EXISTS partitions;
+    EXECUTE format('CREATE TABLE partitions.%I (data jsonb NOT NULL)',
+                   part_name);
+    part_rel := format('partitions.%I', part_name)::regclass;
+
+    -- Only partitions which can still be written to in their own hour are
+    -- worth deferring.  Late partitions get their indexes right away.
+    SELECT (value #>> '{}')::boolean INTO defer
+      FROM storage.config WHERE key = 'defer_indexes';
+    defer := coalesce(defer, false)
+             AND part_hour + interval '1 hour' > now() AT TIME ZONE 'UTC';
+
+    INSERT INTO storage.partition (relname, relid, dimensions, bucket,
+                                   indexes_deferred)
+         VALUES (part_name, part_rel, in_dimensions, part_hour, defer)
+    ON CONFLICT (relname) DO UPDATE
+            SET relid = excluded.relid, dimensions = excluded.dimensions,
+                bucket = excluded.bucket, state = 'active',
+                indexes_deferred = excluded.indexes_deferred;
+
+    SELECT upper(value #>> '{}') INTO storage_mode
+      FROM storage.config WHERE key = 'data_storage_mode';
+    IF storage_mode IS NOT NULL THEN
+        IF storage_mode NOT IN ('PLAIN', 'EXTERNAL', 'EXTENDED', 'MAIN') THEN
+            RAISE EXCEPTION 'Invalid data_storage_mode %', storage_mode;
+        END IF;
+        EXECUTE format('ALTER TABLE %s ALTER COLUMN data SET STORAGE %s',
+                       part_rel, storage_mode);
+    END IF;
+
+    IF defer THEN
+        SELECT value #>> '{}' INTO time_field
+          FROM storage.config WHERE key = 'timestamp_field';
+        EXECUTE format('CREATE INDEX %I ON %s USING brin '
+                       '(storage.document_time(data -> %L))',
+                       part_name || '_ts_brin', part_rel,
+                       coalesce(time_field, 'timestamp'));
+        RETURN part_rel;
+    END IF;
+
+    -- Indexes and fields are those valid for the partition's hour, not now.
+    FOR idx IN
+        SELECT * FROM storage.index
+         WHERE part_hour >= valid_from AND part_hour < valid_until
+    LOOP
+        SELECT string_agg('(' || expression || ')', ',' ORDER BY ordinality)
+          INTO field_str
+          FROM storage.index_field
+         WHERE index_id = idx.id
+               AND part_hour >= valid_from AND part_hour < valid_until;
+        CONTINUE WHEN field_str IS NULL;
+        EXECUTE format('CREATE INDEX %I ON %s USING %I (%s) TABLESPACE %I',
+                       part_name || '_' || idx.indexname, part_rel,
+                       idx.access_method, field_str, idx.tablespc);
+    END LOOP;
+    RETURN part_rel;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.create_partition(text[], timestamp) IS
+$$ Creates the partition for the given dimension labels and hour (in UTC) in
+the partitions schema, with the indexes valid for its hour, registers it in
+storage.partition, and returns it.  If the partition already exists it is
+returned as is.
+
+If the defer_indexes config key is true and the hour is not over yet, the
+partition only gets a BRIN index on the document time.  Partitions are written
+almost only during their own hour, and keeping every index up to date on each
+insert is most of the cost of ingest.  The other indexes are built by the
+storage agent once seal_partitions() has sealed the partition.
+
+This is called by the trigger when a row arrives for a partition which does not
+exist yet, and by provision_partitions().$$;
+
+CREATE FUNCTION storage.provision_partitions(in_hours int default null)
+returns int
+language plpgsql
+as
+$$
+declare hours int;
+        this_hour timestamp;
+        dims text[];
+        created int := 0;
+begin
+    SELECT greatest(max((value #>> '{}')::int), 1) INTO hours
+      FROM storage.config
+     WHERE key IN ('dimensions_hrs_in_future', 'indexes_hrs_in_future');
+    hours := coalesce(in_hours, hours, 1);
+    this_hour := date_trunc('hour', now() AT TIME ZONE 'UTC');
+
+    -- The dimension values in use are only known from the data, so we take
+    -- them from the partitions for the current and previous hour.
+    FOR dims IN
+        SELECT DISTINCT dimensions
+          FROM storage.partition
+         WHERE bucket >= this_hour - interval '1 hour'
+               AND bucket <= this_hour
+               AND dimensions IS NOT NULL
+    LOOP
+        FOR h IN 1 .. hours LOOP
+            CONTINUE WHEN EXISTS (
+                SELECT 1 FROM storage.partition
+                 WHERE dimensions = dims
+                       AND bucket = this_hour + make_interval(hours => h));
+            PERFORM storage.create_partition(dims,
+                   this_hour + make_interval(hours => h));
+            created := created + 1;
+        END LOOP;
+    END LOOP;
+    RETURN created;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.provision_partitions(int) IS
+$$ Creates the partitions for the next in_hours hours ahead of time, so that
+inserts do not have to wait on DDL at the top of the hour.  The default is the
+larger of dimensions_hrs_in_future and indexes_hrs_in_future, since these
+bound how far ahead partition layouts are known.
+
+Partitions are created for every combination of dimension labels registered
+for the current or previous hour.  New combinations are created by the trigger
+on first use.  Returns the number of partitions created.$$;
+
+CREATE FUNCTION storage.register_partitions()
+returns int
+language plpgsql
+as
+$$
+declare changed int;
+        removed int;
+begin
+    -- Tables we did not create have no known labels.  They are registered
+    -- with the hour from their name so that retention still applies.
+    INSERT INTO storage.partition (relname, relid, bucket)
+    SELECT relname, oid,
+           translate(left(right(relname, 13), 10), '_', '-')::date
+               + make_interval(hours => right(relname, 2)::int)
+      FROM pg_class
+     WHERE relnamespace = to_regnamespace('partitions')
+           AND relkind = 'r'
+           AND relname ~ '^bp_.*_\d{4}_\d{2}_\d{2}_\d{2}$'
+    ON CONFLICT (relname) DO UPDATE SET relid = excluded.relid
+     WHERE storage.partition.relid IS DISTINCT FROM excluded.relid;
+    GET DIAGNOSTICS changed = ROW_COUNT;
+
+    DELETE FROM storage.partition p
+     WHERE to_regclass(format('partitions.%I', p.relname)) IS NULL;
+    GET DIAGNOSTICS removed = ROW_COUNT;
+    RETURN changed + removed;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.register_partitions() IS
+$$ Brings storage.partition in line with the tables in the partitions schema,
+adding tables which are missing from it, refreshing oids after a restore, and
+removing entries for tables which no longer exist.  Returns the number of
+entries added, changed, or removed.
+
+This scans pg_class and is meant to be run when the storage agent starts, not
+on every retention run.$$;
+
+CREATE FUNCTION storage.update_partition_estimates
+(in_since timestamp default '-infinity')
+returns int
+language plpgsql
+as
+$$
+declare updated int;
+begin
+    UPDATE storage.partition p
+       SET row_estimate = nullif(c.reltuples, -1)::bigint,
+           byte_estimate = (c.relpages + coalesce(t.relpages, 0))::bigint
+                           * current_setting('block_size')::int
+      FROM pg_class c
+ LEFT JOIN pg_class t ON t.oid = c.reltoastrelid
+     WHERE c.oid = p.relid AND p.bucket >= in_since;
+    GET DIAGNOSTICS updated = ROW_COUNT;
+    RETURN updated;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.update_partition_estimates(timestamp) IS
+$$ Copies the planner's row and page counts of the partitions with buckets from
+in_since on into storage.partition.  These are as of the last VACUUM or ANALYZE
+of each partition, and cost no more than a catalog join to collect.  Returns
+the number of partitions updated.$$;
+
+CREATE FUNCTION storage.queue_index_backfill(in_index_id int default null)
+returns int
+language plpgsql
+as
+$$
+declare queued int;
+begin
+    INSERT INTO storage.index_backfill (index_id, relname)
+    SELECT i.id, p.relname
+      FROM storage.index i
+      JOIN storage.partition p
+           ON p.bucket >= i.valid_from AND p.bucket < i.valid_until
+     WHERE (in_index_id IS NULL OR i.id = in_index_id)
+           AND EXISTS (SELECT 1 FROM storage.index_field f
+                        WHERE f.index_id = i.id
+                              AND p.bucket >= f.valid_from
+                              AND p.bucket < f.valid_until)
+           AND to_regclass(format('partitions.%I',
+                                  p.relname || '_' || i.indexname)) IS NULL
+           AND NOT (p.indexes_deferred AND p.state = 'active')
+    ON CONFLICT (index_id, relname) DO NOTHING;
+    GET DIAGNOSTICS queued = ROW_COUNT;
+    RETURN queued;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.queue_index_backfill(int) IS
+$$ Queues a backfill job for each partition which should have the index, going
+by the partition's hour, but does not.  With no argument all indexes are
+checked.  Partitions are found through storage.partition, by hour.  Active
+partitions with deferred indexes are left until they are sealed.  Returns the
+number of jobs queued.$$;
+
+CREATE FUNCTION storage.claim_index_backfill()
+returns table (index_id int, relname name, bucket timestamp,
+               byte_estimate bigint, invalid_index boolean)
+language plpgsql
+as
+$$
+#variable_conflict use_column
+begin
+    RETURN QUERY
+    WITH claimed AS (
+        UPDATE storage.index_backfill b
+           SET state = 'running', started_at = now(),
+               attempts = b.attempts + 1
+          FROM storage.partition p, storage.index i
+         WHERE (b.index_id, b.relname) = (
+                   SELECT j.index_id, j.relname
+                     FROM storage.index_backfill j
+                     JOIN storage.partition jp ON jp.relname = j.relname
+                    WHERE j.state = 'pending'
+                 ORDER BY jp.bucket DESC
+                    LIMIT 1
+                      FOR UPDATE OF j SKIP LOCKED)
+               AND p.relname = b.relname AND i.id = b.index_id
+     RETURNING b.index_id, b.relname, p.bucket, p.byte_estimate,
+               EXISTS (SELECT 1 FROM pg_index x
+                        WHERE x.indexrelid = to_regclass(
+                                  format('partitions.%I',
+                                         b.relname || '_' || i.indexname))
+                              AND NOT x.indisvalid)
+    )
+    SELECT * FROM claimed;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.claim_index_backfill() IS
+$$ Marks the pending backfill job for the newest partition as running and
+returns it, or returns nothing if there is none.  Newer partitions go first
+since they are the most likely to be queried.
+
+invalid_index is true if a failed concurrent build left an invalid index behind,
+which must be dropped before building again.$$;
+
+CREATE FUNCTION storage.finish_index_backfill
+(in_index_id int, in_relname name, in_error text default null,
+ in_max_attempts int default 3)
+returns storage.index_backfill
+language sql
+BEGIN ATOMIC
+UPDATE storage.index_backfill
+   SET state = CASE WHEN in_error IS NULL THEN 'done'
+                    WHEN attempts >= in_max_attempts THEN 'failed'
+                    ELSE 'pending' END,
+       last_error = in_error,
+       finished_at = CASE WHEN in_error IS NULL THEN now() END
+ WHERE index_id = in_index_id AND relname = in_relname
+RETURNING *;
+END;
+
+COMMENT ON FUNCTION storage.finish_index_backfill(int, name, text, int) IS
+$$ Records the outcome of a backfill job.  A failed job is queued again until
+it has been tried in_max_attempts times.$$;
+
+CREATE FUNCTION storage.reset_index_backfill()
+returns int
+language plpgsql
+as
+$$
+declare reset int;
+begin
+    UPDATE storage.index_backfill SET state = 'pending'
+     WHERE state = 'running';
+    GET DIAGNOSTICS reset = ROW_COUNT;
+    RETURN reset;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.reset_index_backfill() IS
+$$ Puts jobs left running back in the queue.  Only the storage agent runs
+backfill jobs, so this is called when it starts.$$;
+
+CREATE VIEW storage.index_backfill_progress AS
+SELECT i.indexname,
+       count(*) FILTER (WHERE b.state = 'pending') AS pending,
+       count(*) FILTER (WHERE b.state = 'running') AS running,
+       count(*) FILTER (WHERE b.state = 'done') AS done,
+       count(*) FILTER (WHERE b.state = 'failed') AS failed,
+       min(b.queued_at) AS first_queued,
+       max(b.finished_at) AS last_finished
+  FROM storage.index_backfill b
+  JOIN storage.index i ON i.id = b.index_id
+ GROUP BY i.indexname;
+
+COMMENT ON VIEW storage.index_backfill_progress IS
+$$ Backfill job counts by state for each index.$$;
+
+CREATE FUNCTION storage.seal_partitions()
+returns int
+language plpgsql
+as
+$$
+declare delay int;
+        sealed int;
+begin
+    SELECT (value #>> '{}')::int INTO delay
+      FROM storage.config WHERE key = 'seal_after_minutes';
+    UPDATE storage.partition SET state = 'sealed'
+     WHERE state = 'active'
+           AND bucket + interval '1 hour'
+               + make_interval(mins => coalesce(delay, 10))
+               <= now() AT TIME ZONE 'UTC';
+    GET DIAGNOSTICS sealed = ROW_COUNT;
+    IF sealed > 0 THEN
+        PERFORM storage.queue_index_backfill();
+    END IF;
+    RETURN sealed;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.seal_partitions() IS
+$$ Seals the active partitions whose hour ended more than seal_after_minutes
+(default 10) ago, leaving time for late rows, and queues building the indexes
+they are missing.  Returns the number of partitions sealed.
+
+Sealed partitions can still be written to, but this is not expected.$$;
+
+CREATE VIEW storage.partition_status AS
+SELECT p.relname, p.dimensions, p.bucket, p.state = 'sealed' AS sealed,
+       NOT (p.indexes_deferred AND p.state = 'active')
+       AND NOT EXISTS (SELECT 1 FROM storage.index_backfill b
+                        WHERE b.relname = p.relname AND b.state <> 'done')
+           AS indexed,
+       p.compacted_at IS NOT NULL AS compacted
+  FROM storage.partition p;
+
+COMMENT ON VIEW storage.partition_status IS
+$$ For the read path: whether each partition is sealed, whether it has all
+indexes valid for its hour, and whether it was compacted.  Partitions which are not indexed should be
+searched by the document time, which always has a BRIN index on partitions with
+deferred indexes, rather than relying on the other indexes.$$;
+
 CREATE FUNCTION storage.enforce_retention
-()
-returns void
+(in_batch_size int default 50, in_lock_timeout text default '100ms',
+ in_skip name[] default '{}', out dropped int, out skipped name[],
+ out bytes_reclaimed bigint, out retained_hrs int)
 language plpgsql
 as
 $$
 declare retain_hrs int;
+        min_hrs int;
+        max_bytes bigint;
+        this_hour timestamp;
         retain_threshold timestamp;
-        delete_rel regclass;
+        emergency_threshold timestamp;
+        over_bytes bigint := 0;
+        part record;
+        part_bytes bigint;
 begin
-    select trim(both '"' from value)::int into retain_hrs
-     FROM storage.config WHERE key = 'retain_hrs';
-    IF NOT FOUND THEN
-        retain_hrs := 24;
-    END IF;
+    dropped := 0;
+    skipped := '{}';
+    bytes_reclaimed := 0;
+    SELECT (value #>> '{}')::int INTO retain_hrs
+      FROM storage.config WHERE key = 'retain_hrs';
+    retain_hrs := coalesce(retain_hrs, 24);
     IF retain_hrs = 0 THEN
         RETURN;
     END IF;
-    retain_threshold := now() - make_interval(hours => retain_hrs);
+    SELECT (value #>> '{}')::int INTO min_hrs
+      FROM storage.config WHERE key = 'retain_min_hrs';
+    min_hrs := least(coalesce(min_hrs, 1), retain_hrs);
+    SELECT (value #>> '{}')::bigint INTO max_bytes
+      FROM storage.config WHERE key = 'retain_max_bytes';
+
+    this_hour := date_trunc('hour', now() AT TIME ZONE 'UTC');
+    retain_threshold := this_hour - make_interval(hours => retain_hrs);
+    emergency_threshold := retain_threshold;
+    IF coalesce(max_bytes, 0) > 0 THEN
+        over_bytes := pg_database_size(current_database()) - max_bytes;
+        IF over_bytes > 0 THEN
+            emergency_threshold := this_hour - make_interval(hours => min_hrs);
+        END IF;
+    END IF;
 
-    FOR delete_rel IN 
-        SELECT oid FROM regclass 
-         WHERE relnamespace::regnamespace::text LIKE 'partition%' AND
-               remain_threshold >
-               to_timestamp(substring(relname from '.{13}$'),'YYYY_MM_DD_HH24')
+    PERFORM set_config('lock_timeout', in_lock_timeout, true);
+    FOR part IN
+        SELECT relname, bucket FROM storage.partition
+         WHERE bucket < emergency_threshold
+               AND relname <> ALL (coalesce(in_skip, '{}'))
+      ORDER BY bucket, relname
     LOOP
-        -- we may need to add some sort of lock management here.  My thinking
-        -- is that we could set a lock_timeout and skip those we cannot lock
-        -- for the current hour.  After all we will try agian next hour.
-        -- bot for V1, keeping it very simple.
-        execute format('drop table %s', delete_rel::text);
+        EXIT WHEN dropped >= in_batch_size;
+        -- past the normal threshold we only drop while over the size limit
+        EXIT WHEN part.bucket >= retain_threshold
+                  AND over_bytes - bytes_reclaimed <= 0;
+        BEGIN
+            part_bytes := coalesce(pg_total_relation_size(
+                              to_regclass(format('partitions.%I',
+                                                 part.relname))), 0);
+            EXECUTE format('DROP TABLE IF EXISTS partitions.%I', part.relname);
+            DELETE FROM storage.partition WHERE relname = part.relname;
+            dropped := dropped + 1;
+            bytes_reclaimed := bytes_reclaimed + part_bytes;
+        EXCEPTION WHEN lock_not_available THEN
+            -- in use, we will try again next run
+            skipped := skipped || part.relname;
+        END;
     END LOOP;
+
+    SELECT extract(epoch FROM this_hour - min(bucket))::int / 3600
+      INTO retained_hrs
+      FROM storage.partition;
 end;
 $$;
 
+COMMENT ON FUNCTION storage.enforce_retention(int, text, name[]) IS
+$$ Drops up to in_batch_size of the oldest partitions past the retention
+period, taken from storage.partition.  Each drop waits at most in_lock_timeout
+for its lock, and partitions which cannot be locked in that time are skipped
+and left for a later run, so that retention never stalls ingest or queries.
+Partitions named in in_skip are not tried, so a caller can pass on the
+partitions skipped by earlier batches of the same run.
+
+The retention period is retain_hrs hours (default 24, 0 disables retention).
+If retain_max_bytes is set and the database is larger than that, newer
+partitions are dropped too, oldest first, until enough space has been
+reclaimed or only retain_min_hrs hours (default 1) are left.
+
+Returns the number of partitions dropped, the names of those skipped, the
+total size of the dropped partitions, and the age in hours of the oldest
+partition left.  The caller should commit and call again, passing on the
+partitions skipped so far, while a full batch was dropped, so that locks are
+only held for one batch at a time.$$;
+
+CREATE FUNCTION storage.compact_partitions
+(in_limit int default 1, in_lock_timeout text default '1s',
+ in_skip name[] default '{}', out compacted int, out skipped name[],
+ out failed int, out bytes_before bigint, out bytes_after bigint)
+language plpgsql
+as
+$$
+declare time_field text;
+        compression text;
+        typed boolean;
+        part record;
+        part_rel regclass;
+        part_bytes bigint;
+        sort_key text;
+        index_defs text[];
+        col record;
+        idx text;
+begin
+    compacted := 0;
+    skipped := '{}';
+    failed := 0;
+    bytes_before := 0;
+    bytes_after := 0;
+    SELECT value #>> '{}' INTO time_field
+      FROM storage.config WHERE key = 'timestamp_field';
+    SELECT value #>> '{}' INTO compression
+      FROM storage.config WHERE key = 'compact_compression';
+    SELECT (value #>> '{}')::boolean INTO typed
+      FROM storage.config WHERE key = 'compact_typed_columns';
+
+    PERFORM set_config('lock_timeout', in_lock_timeout, true);
+    FOR part IN
+        SELECT p.relname, p.bucket
+          FROM storage.partition p
+          JOIN storage.partition_status s ON s.relname = p.relname
+         WHERE s.sealed AND s.indexed AND NOT s.compacted
+               AND p.compact_error IS NULL
+               AND p.relname <> ALL (coalesce(in_skip, '{}'))
+      ORDER BY p.bucket DESC, p.relname
+         LIMIT in_limit
+    LOOP
+        BEGIN
+            part_rel := format('partitions.%I', part.relname)::regclass;
+            EXECUTE format('LOCK TABLE %s IN ACCESS EXCLUSIVE MODE', part_rel);
+            part_bytes := pg_total_relation_size(part_rel);
+
+            -- Rows are sorted by time and then by the first field of the
+            -- first btree index, which is what most queries filter on.
+            SELECT f.expression INTO sort_key
+              FROM storage.index i
+              JOIN storage.index_field f ON f.index_id = i.id
+             WHERE i.access_method = 'btree'
+                   AND part.bucket >= i.valid_from
+                   AND part.bucket < i.valid_until
+                   AND part.bucket >= f.valid_from
+                   AND part.bucket < f.valid_until
+          ORDER BY i.id, f.ordinality
+             LIMIT 1;
+            EXECUTE format('CREATE TEMP TABLE bagger_compact AS '
+                           'SELECT data, row_number() OVER (ORDER BY '
+                           'storage.document_time(data -> %L)%s) AS n '
+                           'FROM %s',
+                           coalesce(time_field, 'timestamp'),
+                           coalesce(', (' || sort_key || ')', ''), part_rel);
+
+            -- Indexes are built again after loading, which is faster than
+            -- maintaining them and leaves them packed.
+            SELECT array_agg(pg_get_indexdef(indexrelid)) INTO index_defs
+              FROM pg_index WHERE indrelid = part_rel;
+            EXECUTE format('TRUNCATE %s', part_rel);
+
+            -- Typed columns take their type from the btree index on the
+            -- same expression, which is built from the fields valid for the
+            -- hour in ordinality order.  The table is empty now, so adding
+            -- them does not rewrite it.
+            FOR col IN
+                SELECT i.indexname || '_' || f.ordinality AS colname,
+                       f.expression,
+                       format_type(a.atttypid, a.atttypmod) AS coltype
+                  FROM storage.index i
+                  JOIN LATERAL (
+                        SELECT expression, ordinality,
+                               row_number() OVER (ORDER BY ordinality)
+                                   AS attnum
+                          FROM storage.index_field
+                         WHERE index_id = i.id
+                               AND part.bucket >= valid_from
+                               AND part.bucket < valid_until) f ON true
+                  JOIN pg_attribute a
+                       ON a.attrelid = to_regclass(format('partitions.%I',
+                              part.relname || '_' || i.indexname))
+                          AND a.attnum = f.attnum
+                 WHERE coalesce(typed, false) AND i.access_method = 'btree'
+                       AND part.bucket >= i.valid_from
+                       AND part.bucket < i.valid_until
+            LOOP
+                EXECUTE format('ALTER TABLE %s ADD COLUMN IF NOT EXISTS %I %s '
+                               'GENERATED ALWAYS AS (%s) STORED',
+                               part_rel, col.colname, col.coltype,
+                               col.expression);
+            END LOOP;
+
+            FOR idx IN
+                SELECT indexrelid::regclass::text
+                  FROM pg_index WHERE indrelid = part_rel
+            LOOP
+                EXECUTE 'DROP INDEX ' || idx;
+            END LOOP;
+            EXECUTE format('ALTER TABLE %s SET (fillfactor = 100), '
+                           'ALTER COLUMN data SET COMPRESSION %s',
+                           part_rel, coalesce(compression, 'lz4'));
+            -- The empty path returns the whole document, whatever its
+            -- type, decompressed, so that it is compressed again with the
+            -- new method instead of being copied as it is.
+            EXECUTE format('INSERT INTO %s (data) '
+                           'SELECT data #> ''{}'' FROM pg_temp.bagger_compact '
+                           'ORDER BY n', part_rel);
+            DROP TABLE pg_temp.bagger_compact;
+            FOREACH idx IN ARRAY coalesce(index_defs, '{}') LOOP
+                EXECUTE idx;
+            END LOOP;
+            EXECUTE format('ANALYZE %s', part_rel);
+
+            UPDATE storage.partition SET compacted_at = now()
+             WHERE relname = part.relname;
+            compacted := compacted + 1;
+            bytes_before := bytes_before + part_bytes;
+            bytes_after := bytes_after + pg_total_relation_size(part_rel);
+        EXCEPTION
+            WHEN lock_not_available THEN
+                -- in use, we will try again next run
+                skipped := skipped || part.relname;
+            WHEN others THEN
+                -- The rewrite was rolled back.  Recorded so that one bad
+                -- partition does not hold up the others on every run.
+                RAISE WARNING 'Could not compact %: %', part.relname, SQLERRM;
+                UPDATE storage.partition SET compact_error = SQLERRM
+                 WHERE relname = part.relname;
+                failed := failed + 1;
+        END;
+    END LOOP;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.compact_partitions(int, text, name[]) IS
+$$ Rewrites up to in_limit sealed and fully indexed partitions, newest first,
+into a layout for reading: rows sorted by document time and by the first field
+of the first btree index, documents compressed with compact_compression
+(default lz4), fillfactor 100, and indexes rebuilt.  Partitions which cannot be
+locked within in_lock_timeout are skipped and returned in skipped, and those
+in in_skip are not tried, so that the caller can pass them back in and move on.
+Partitions which fail to compact for any other reason are left as they were,
+with the error in compact_error, and are not tried again until it is cleared.
+
+If compact_typed_columns is true, each field of a btree index is also stored
+as a generated column of the index's type, named after the index and the
+field's ordinality, so that it can be read without the document.  Rows routed
+to the partition later fill these columns in every routing mode, direct mode
+included.
+
+The partition keeps its oid and name.  It is locked for the whole rewrite, so
+the caller should commit after each call.  Returns the number of partitions
+compacted and failed, and the total size before and after of those compacted.$$;
+
+CREATE FUNCTION storage.bloom_positions
+(in_value text, in_hashes int, in_bits int)
+returns setof int
+language sql immutable strict parallel safe
+as
+$$
+SELECT ((hashtextextended(in_value, i) % in_bits + in_bits) % in_bits)::int
+  FROM generate_series(1, in_hashes) i;
+$$;
+
+COMMENT ON FUNCTION storage.bloom_positions(text, int, int) IS
+$$ The bits in_value sets in a bloom filter of in_bits bits with in_hashes hash
+functions, see partition_bloom.$$;
+
+CREATE FUNCTION storage.pointer_path(in_pointer text)
+returns text[]
+language sql immutable strict parallel safe
+as
+$$
+SELECT CASE WHEN in_pointer NOT LIKE '/%' THEN ARRAY[in_pointer]
+            ELSE ARRAY(SELECT replace(replace(e, '~1', '/'), '~0', '~')
+                         FROM unnest(string_to_array(substr(in_pointer, 2),
+                                                     '/'))
+                              WITH ORDINALITY u(e, n)
+                     ORDER BY n)
+       END;
+$$;
+
+COMMENT ON FUNCTION storage.pointer_path(text) IS
+$$ The path of a JSON pointer, for the #> and #>> operators.  Names not starting
+with a slash are top level fields.$$;
+
+CREATE FUNCTION storage.summarize_partitions
+(in_limit int default 1, in_lock_timeout text default '1s',
+ in_skip name[] default '{}', out summarized int, out skipped name[])
+language plpgsql
+as
+$$
+declare time_field text;
+        fp_rate float8;
+        compacting boolean;
+        part record;
+        part_rel regclass;
+        lo timestamp;
+        hi timestamp;
+        field text;
+        vals text[];
+        n int;
+        m int;
+        k int;
+begin
+    summarized := 0;
+    skipped := '{}';
+    SELECT value #>> '{}' INTO time_field
+      FROM storage.config WHERE key = 'timestamp_field';
+    SELECT (value #>> '{}')::float8 INTO fp_rate
+      FROM storage.config WHERE key = 'summary_false_positive_rate';
+    fp_rate := coalesce(fp_rate, 0.01);
+    IF fp_rate <= 0 OR fp_rate >= 1 THEN
+        RAISE EXCEPTION 'Invalid summary_false_positive_rate %', fp_rate;
+    END IF;
+    -- Compaction reorders the rows and would spoil the work of reading them
+    -- here, so partitions to be compacted are left until they are, unless
+    -- compacting them failed.
+    SELECT (value #>> '{}')::boolean INTO compacting
+      FROM storage.config WHERE key = 'compact_partitions';
+
+    PERFORM set_config('lock_timeout', in_lock_timeout, true);
+    FOR part IN
+        SELECT p.relname
+          FROM storage.partition p
+          JOIN storage.partition_status s ON s.relname = p.relname
+         WHERE s.sealed
+               AND (s.compacted OR p.compact_error IS NOT NULL
+                    OR NOT coalesce(compacting, false))
+               AND p.summarized_at IS NULL
+               AND p.relname <> ALL (coalesce(in_skip, '{}'))
+      ORDER BY p.bucket DESC, p.relname
+         LIMIT in_limit
+    LOOP
+        part_rel := format('partitions.%I', part.relname)::regclass;
+        -- Waits for writers of late rows to commit, and keeps new ones out
+        -- until the summary is committed.  The ingestion trigger clears the
+        -- summary after writing, so rows are either read here or clear it.
+        BEGIN
+            EXECUTE format('LOCK TABLE %s IN SHARE MODE', part_rel);
+        EXCEPTION WHEN lock_not_available THEN
+            skipped := skipped || part.relname;
+            CONTINUE;
+        END;
+        EXECUTE format('SELECT min(t), max(t) FROM (SELECT '
+                       'storage.document_time(data -> %L) AS t FROM %s) d',
+                       coalesce(time_field, 'timestamp'), part_rel)
+           INTO lo, hi;
+
+        DELETE FROM storage.partition_bloom WHERE relname = part.relname;
+        FOR field IN
+            SELECT json_array_elements_text(value)
+              FROM storage.config WHERE key = 'summary_fields'
+        LOOP
+            EXECUTE format('SELECT array_agg(DISTINCT v) FROM (SELECT '
+                           'data #>> %L AS v FROM %s) d WHERE v IS NOT NULL',
+                           storage.pointer_path(field), part_rel)
+               INTO vals;
+            -- the size and number of hashes giving the false positive rate
+            -- for this many values
+            n := greatest(coalesce(cardinality(vals), 0), 1);
+            m := greatest(64, ceil(-n * ln(fp_rate) / ln(2) ^ 2))::int;
+            k := least(16, greatest(1, round(m::float8 / n * ln(2))))::int;
+            INSERT INTO storage.partition_bloom (relname, pointer, hashes, bits)
+            SELECT part.relname,
+                   CASE WHEN field LIKE '/%' THEN field
+                        ELSE '/' || replace(replace(field, '~', '~0'),
+                                            '/', '~1')
+                   END,
+                   k,
+                   string_agg(CASE WHEN s.pos IS NULL THEN '0' ELSE '1' END,
+                              '' ORDER BY b.i)::varbit
+              FROM generate_series(0, m - 1) b(i)
+         LEFT JOIN (SELECT DISTINCT storage.bloom_positions(v, k, m)
+                      FROM unnest(vals) v) s(pos) ON s.pos = b.i;
+        END LOOP;
+
+        UPDATE storage.partition
+           SET summarized_at = now(), min_time = lo, max_time = hi
+         WHERE relname = part.relname;
+        summarized := summarized + 1;
+    END LOOP;
+end;
+$$;
+
+COMMENT ON FUNCTION storage.summarize_partitions(int, text, name[]) IS
+$$ Builds the summaries of up to in_limit sealed partitions, newest first,
+which have none: the earliest and latest document time, and a
+bloom filter over the values of each field in the summary_fields config key, a
+JSON array of JSON pointers.  The filters are sized for the
+summary_false_positive_rate config key (default 0.01).  If compact_partitions
+is on, partitions are summarized once compacted, or once compacting them
+failed.
+
+Partitions are share locked while they are read, and those which cannot be
+locked within in_lock_timeout, because rows are being written to them, are
+skipped.  Partitions in in_skip are not considered, so that a caller going
+through all partitions can pass those skipped so far.  The caller should commit
+after each call.  Returns the number of partitions summarized and the names of
+those skipped.$$;
+
+CREATE FUNCTION storage.partition_may_match
+(in_relname name, in_from timestamp, in_to timestamp, in_values jsonb)
+returns boolean
+language sql stable parallel safe
+as
+$$
+SELECT p.summarized_at IS NULL
+       OR coalesce(p.min_time <= in_to AND p.max_time >= in_from, false)
+          AND NOT EXISTS (
+              SELECT 1
+                FROM jsonb_each(coalesce(in_values, '{}')) f
+                JOIN storage.partition_bloom b
+                     ON b.relname = p.relname AND b.pointer = f.key
+               WHERE NOT EXISTS (
+                     SELECT 1
+                       FROM jsonb_array_elements_text(f.value) v
+                      WHERE NOT EXISTS (
+                            SELECT 1
+                              FROM storage.bloom_positions(v, b.hashes,
+                                                           length(b.bits)) pos
+                             WHERE get_bit(b.bits, pos) = 0)))
+  FROM storage.partition p
+ WHERE p.relname = in_relname;
+$$;
+
+COMMENT ON FUNCTION storage.partition_may_match(name, timestamp, timestamp,
+                                                jsonb) IS
+$$ For the read path: false if the partition's summary rules out rows with a
+document time from in_from to in_to and, for each JSON pointer in in_values,
+one of the values listed for it, so that the partition need not be searched.
+Values are compared as text, as with the #>> operator.
+
+True if the partition has no summary, which is also the case once rows were
+written to it after it was summarized.$$;
+
 ---------------------
 -- Other
 ---------------------
@@ -0,0 +1,140 @@
+use Test2::V0 -target => { query => 'Bagger::Query',
+                           merge => 'Bagger::Query::Merge' };
+
+plan 17;
+
+# Query values
+
+is(query()->parse_value('myapp'), { value => 'myapp' }, 'Plain value');
+is(query()->parse_value('2024-01-01T03:02:00..2024-01-01T05:02:00'),
+   { from => '2024-01-01T03:02:00', to => '2024-01-01T05:02:00' }, 'Range');
+is(query()->parse_value('"""foo".."bar.."'), { from => '"foo', to => 'bar..' },
+   'Quoted range from the spec');
+is(query()->parse_value('5..'), { from => '5', to => undef }, 'Open range');
+is(query()->parse_value('"a..b"'), { value => 'a..b' }, 'Quoted value');
+like(dies { query()->parse_value('a"b') }, qr/Invalid query value/,
+     'Stray quote');
+
+# Dimensions, with a second one from 04:00, and document times as given
+
+package Test::Dimension {
+    sub new { my ($class, %args) = @_; return bless { %args }, $class }
+    sub fieldname { Bagger::Type::JSONPointer->new($_[0]->{field}) }
+    sub valid_from { $_[0]->{valid_from} }
+    sub valid_until { $_[0]->{valid_until} }
+    sub in_time_bounds {
+        my ($self, $at) = @_;
+        return $self->{valid_from} <= $at && $self->{valid_until} > $at;
+    }
+}
+my $dt = 'Bagger::Type::DateTime';
+my $dimensions = mock 'Bagger::Storage::Dimension' => (
+    override => [ list => sub {
+        (Test::Dimension->new(field => 'service',
+                              valid_from => $dt->inf_past,
+                              valid_until => $dt->inf_future),
+         Test::Dimension->new(field => 'host',
+                              valid_from => $dt->from_db('2024-01-01 04:00:00'),
+                              valid_until => $dt->inf_future)) } ],
+);
+my $times = mock 'Bagger::Query' => (
+    override => [ call_procedure => sub {
+        my ($class, %args) = @_;
+        return { document_time => ($args{args}[0] =~ tr/T"/ /dr) };
+    } ],
+);
+is(query()->from_params(time => '2024-01-01T03:00:00..2024-01-01T03:59:59',
+                        service => 'myapp')->labels,
+   [ [ 'myapp' ] ], 'Labels for the dimensions of the time range');
+like(dies { query()->from_params(
+                time => '2024-01-01T03:00:00..2024-01-01T04:30:00',
+                service => 'myapp') },
+     qr/The dimensions change at 2024-01-01.04:00:00/,
+     'Time ranges across a change of dimensions refused');
+undef $dimensions;
+undef $times;
+
+# Merging, with stand-in cursors which hand out their rows in batches
+
+package Test::Cursor {
+    sub new {
+        my ($class, @rows) = @_;
+        return bless { pending => [@rows], rows => [], done => 0 }, $class;
+    }
+    sub on_ready { $_[0]->{on_ready} = $_[1] }
+    sub rows { $_[0]->{rows} }
+    sub done { $_[0]->{done} }
+    sub error { $_[0]->{error} }
+    sub start { $_[0]->{started} = 1 }
+    sub cancel { $_[0]->{cancelled} = 1 }
+    sub next_row { shift @{$_[0]->{rows}} }
+    # deliver the next $n rows, and finish if there are none left
+    sub deliver {
+        my ($self, $n) = @_;
+        push @{$self->{rows}}, splice(@{$self->{pending}}, 0, $n);
+        $self->{done} = 1 unless @{$self->{pending}};
+        $self->{on_ready}->($self);
+    }
+    sub fail {
+        my ($self) = @_;
+        $self->{error} = { SQLSTATE => '57014', Message => 'cancelled' };
+        $self->{done} = 1;
+        $self->{on_ready}->($self);
+    }
+}
+
+my @docs;
+my $done;
+my @cursors = (Test::Cursor->new(['01', 'a'], ['03', 'c'], ['05', 'e']),
+               Test::Cursor->new(['02', 'b'], ['04', 'd']));
+my $merge = merge()->new(cursors => \@cursors,
+                         on_rows => sub { push @docs, @_ },
+                         on_done => sub { $done = [ @_ ] });
+$merge->start;
+ok((not grep { not $_->{started} } @cursors), 'Cursors started');
+$cursors[0]->deliver(2);
+is(\@docs, [], 'Nothing passed on while a cursor has no rows');
+$cursors[1]->deliver(1);
+is(\@docs, [qw(a b)], 'Rows passed on in time order until a cursor runs dry');
+$cursors[1]->deliver(1);
+$cursors[0]->deliver(1);
+is([ \@docs, $done ], [ [qw(a b c d e)], [undef] ], 'All rows merged');
+
+# copies of rows are dropped
+@docs = ();
+@cursors = (Test::Cursor->new(['01', 'a'], ['01', 'x'], ['02', 'b']),
+            Test::Cursor->new(['01', 'a'], ['01', 'x'], ['01', 'x'],
+                              ['02', 'c']),
+            Test::Cursor->new(['01', 'x'], ['02', 'b'], ['02', 'c']));
+$merge = merge()->new(cursors => \@cursors, copies => 2,
+                      on_rows => sub { push @docs, @_ },
+                      on_done => sub {});
+$merge->start;
+$_->deliver(10) for @cursors;
+is([ sort @docs ], [qw(a b c x x)],
+   'Copies dropped, documents ingested twice kept');
+
+# the consumer holds up the merge
+@docs = ();
+my $open = 0;
+@cursors = (Test::Cursor->new(map { [ sprintf('%02d', $_), $_ ] } 1 .. 9));
+$merge = merge()->new(cursors => \@cursors, chunk_rows => 2,
+                      can_write => sub { $open-- > 0 },
+                      on_rows => sub { push @docs, @_ },
+                      on_done => sub {});
+$merge->start;
+$cursors[0]->deliver(9);
+is(\@docs, [], 'Nothing passed on while the consumer is busy');
+$open = 2;
+$merge->pump;
+is(\@docs, [1 .. 4], 'One chunk passed on per turn the consumer allows');
+
+# errors end the merge
+@cursors = (Test::Cursor->new(['01', 'a']), Test::Cursor->new(['02', 'b']));
+$merge = merge()->new(cursors => \@cursors, on_rows => sub {},
+                      on_done => sub { $done = [ @_ ] });
+$merge->start;
+$cursors[1]->fail;
+is($done, [ { SQLSTATE => '57014', Message => 'cancelled' } ],
+   'Error passed on');
+ok($cursors[0]->{cancelled}, 'Other cursors cancelled');
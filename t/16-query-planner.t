@@ -0,0 +1,157 @@
+use Test2::V0 -target => { planner => 'Bagger::Query::Planner',
+                           query   => 'Bagger::Query',
+                           idx     => 'Bagger::Storage::Index',
+                           fld     => 'Bagger::Storage::Index::Field',
+                           dt      => 'Bagger::Type::DateTime',
+                           ptr     => 'Bagger::Type::JSONPointer' };
+
+plan 18;
+
+# Index expressions are quoted through the Lenkwerk connection, and
+# predicates through the storage node's, which this stands in for.
+package Test::DBH {
+    sub quote {
+        my ($self, $value) = @_;
+        $value =~ s/'/''/g;
+        return "'$value'";
+    }
+    sub quote_identifier { qq{"$_[1]"} }
+}
+my $dbh = bless {}, 'Test::DBH';
+my $mock = mock 'Bagger::Storage::Index::Field' => (
+    override => [ _get_dbh => sub { $dbh } ],
+);
+
+my @always = (valid_from => dt()->inf_past, valid_until => dt()->inf_future);
+
+sub index_on {
+    my ($name, $am, @expressions) = @_;
+    my $ordinal = 0;
+    return idx()->new(indexname => $name, access_method => $am, @always,
+                      fields => [ map { fld()->new(ordinality => $ordinal++,
+                                                   expression => $_,
+                                                   @always) }
+                                  @expressions ]);
+}
+
+sub choose {
+    my ($field, $values, @indexes) = @_;
+    my $planner = planner()->new(
+        filters => [ { pointer => ptr()->new($field), values => $values } ],
+        indexes => \@indexes,
+    );
+    my ($report) = $planner->report;
+    my ($predicate) = $planner->predicates($dbh);
+    return ($report->{index}, $report->{access}, $predicate);
+}
+
+my $myapp = [ { value => 'myapp' } ];
+
+is([ choose('service', $myapp) ],
+   [ undef, 'scan', q{((data->'service' #>> '{}') = 'myapp')} ],
+   'Text comparison without indexes');
+
+is([ choose('service', [ { value => 'myapp' }, { from => 'x', to => undef } ],
+            index_on('service', 'btree', q{data->>'service'})) ],
+   [ 'service', 'text',
+     q{((data->>'service') = 'myapp' OR (data->>'service') >= 'x')} ],
+   'Text index used for values and ranges');
+
+is([ choose('/a/b', $myapp, index_on('ab', 'btree', q{((data->'a')->>'b')})) ],
+   [ 'ab', 'text', q{(((data->'a')->>'b') = 'myapp')} ],
+   'Nested text index used, parentheses ignored');
+
+is([ choose('n', [ { from => 3, to => 7 } ],
+            index_on('n', 'btree', q{(data->'n')::"int"})) ],
+   [ 'n', 'cast',
+     q{(((data->'n')::"int") >= '3' AND ((data->'n')::"int") <= '7')} ],
+   'Cast index compares as its type');
+
+is([ (choose('n', [ { value => 'x' } ],
+             index_on('n', 'btree', q{(data->'n')::"int"})))[0, 1] ],
+   [ undef, 'scan' ], 'Cast index not used for values of other types');
+
+is([ choose('service', [ { value => '5' } ],
+            index_on('service', 'btree', q{data->'service'})) ],
+   [ 'service', 'json',
+     q{((data->'service') = '"5"'::jsonb OR (data->'service') = '5'::jsonb)}
+     . q{ AND ((data->'service' #>> '{}') = '5')} ],
+   'JSON index used with the JSON values a value stands for');
+
+is([ (choose('service', [ { from => 'a', to => 'b' } ],
+             index_on('service', 'btree', q{data->'service'})))[0, 1] ],
+   [ undef, 'scan' ], 'JSON index not used for ranges');
+
+is([ choose('/a/b', [ { value => "it's" } ],
+            index_on('docs', 'gin', 'data')) ],
+   [ 'docs', 'containment',
+     q{((data) @> '{"a":{"b":"it''s"}}'::jsonb)}
+     . q{ AND (((data->'a')->'b' #>> '{}') = 'it''s')} ],
+   'Containment on a GIN index on the document');
+
+is((choose('/a/b', $myapp, index_on('a', 'gin', q{data->'a'})))[2],
+   q{((data->'a') @> '{"b":"myapp"}'::jsonb)}
+   . q{ AND (((data->'a')->'b' #>> '{}') = 'myapp')},
+   'Containment on a GIN index on an object in the document');
+
+is([ (choose('service', $myapp, index_on('a_docs', 'gin', 'data'),
+             index_on('b_json', 'btree', q{data->'service'}),
+             index_on('c_text', 'btree', q{data->>'service'})))[0, 1] ],
+   [ 'c_text', 'text' ], 'Exact index preferred');
+
+is([ (choose('service', $myapp,
+             index_on('pair', 'btree', q{data->>'host'},
+                      q{data->>'service'})))[0, 1] ],
+   [ undef, 'scan' ], 'B-tree indexes only used for their first field');
+
+is([ (choose('service', [ { from => 'a', to => 'b' } ],
+             index_on('service', 'hash', q{data->>'service'})))[0, 1] ],
+   [ undef, 'scan' ], 'Hash indexes not used for ranges');
+
+is([ (choose('service', $myapp,
+             index_on('service', 'hash', q{data->>'service'})))[0, 1] ],
+   [ 'service', 'text' ], 'Hash indexes used for values');
+
+is([ choose('n', [ { from => undef, to => 4 } ],
+            index_on('n', 'btree', q{data->>'n'})) ],
+   [ undef, 'scan',
+     q{((CASE WHEN jsonb_typeof(data->'n') = 'number'}
+     . q{ THEN (data->'n')::numeric END) <= '4')} ],
+   'Ranges between numbers compare as numbers, not with a text index');
+
+is(planner()->new(
+       filters => [
+           { pointer => ptr()->new('service'), values => $myapp },
+           { pointer => ptr()->new('/a/b'), values => [ { from => 'x' } ] },
+           { pointer => ptr()->new('n'), values => [ { value => '3' } ] },
+       ],
+       indexes => [ index_on('n', 'btree', q{(data->'n')::"int"}) ],
+   )->summary_values,
+   { '/service' => [ 'myapp' ] },
+   'Summary values only for single values compared as text');
+
+my $query = query()->new(
+    labels => [], from => '2024-01-01 03:00:00', to => '2024-01-01 04:00:00',
+    timestamp_field => 'ts',
+    filters => [ { pointer => ptr()->new('service'), values => $myapp } ],
+    indexes => [ index_on('service', 'btree', q{data->>'service'}) ],
+);
+like($query->statement($dbh, 'p1'),
+     qr/\QWHERE storage.document_time(data -> 'ts') BETWEEN \E.*
+        \s+AND\s\Q((data->>'service') = 'myapp')\E/xs,
+     'Statement uses the planned predicates');
+
+my $cast = query()->new(
+    labels => [], from => '2024-01-01 03:00:00', to => '2024-01-01 04:00:00',
+    timestamp_field => 'ts',
+    filters => [ { pointer => ptr()->new('n'), values => [ { value => 5 } ] } ],
+    indexes => [ index_on('n', 'btree', q{(data->'n')::"int"}) ],
+);
+is([ $cast->_planner->predicates($dbh, indexed => 0) ],
+   [ q{((data->'n' #>> '{}') = '5')} ],
+   'Text comparison instead of casts where indexes may be missing');
+like($cast->statement($dbh, { relname => 'p1', indexed => 1 },
+                      { relname => 'p2', indexed => 0 }),
+     qr/\Q((data->'n')::"int") = '5'\E.*\sUNION\sALL\s.*
+        \Q((data->'n' #>> '{}') = '5')\E/xs,
+     'Casts only on indexed partitions');
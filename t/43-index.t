@@ -8,7 +8,7 @@ use Bagger::Test::DB::LW;
 use strict;
 use warnings;
 
-plan 31;
+plan 33;
 
 ### Constructor tests, without index_am
 
@@ -31,8 +31,11 @@ push @{$basic_idx->fields}, fld()->new(
 );
 ok(my $idx = $basic_idx->save, 'Saved idx');
 is($idx->create_statement('foo', 'bar'), 
-    q#CREATE INDEX "bar_test" ON "foo"."bar" ((data->'foo'),(data->'bar')) using gin TABLESPACE "pg_default"#, 
+    q#CREATE INDEX "bar_test" ON "foo"."bar" USING gin ((data->'foo'),(data->'bar')) TABLESPACE "pg_default"#, 
     'Create Statement is correct');
+is($idx->create_statement('foo', 'bar', concurrently => 1), 
+    q#CREATE INDEX CONCURRENTLY "bar_test" ON "foo"."bar" USING gin ((data->'foo'),(data->'bar')) TABLESPACE "pg_default"#, 
+    'Concurrent Create Statement is correct');
 
 ok(dies { pkg()->new() }, 'empty args dies');
 
@@ -73,6 +76,9 @@ is($idx->fields->[1]->valid_from, $idx->valid_from, 'Index and index field 1 hav
 
 is($idx->create_statement('foo', 'bar'), '',
     'Create Statement is correct when time out of bounds');
+like($idx->create_statement('foo', 'bar', at => dt()->hour_bound_plus(2)),
+    qr/^CREATE INDEX "bar_test2" ON "foo"."bar" USING gin /,
+    'Create Statement is generated for a time in bounds');
 
 is($idx->expire->valid_until, dt()->hour_bound_plus(1), 'Expired to correct hour bound');
 
@@ -2,7 +2,7 @@ use Test2::V0 -target => {smap => 'Bagger::Storage::Servermap',
                           inst => 'Bagger::Storage::Instance' };
 use Bagger::Test::DB::LW;
 
-plan(19);
+plan(32);
 
 my ($inst1, $inst2, $inst3, $smap);
 
@@ -25,18 +25,90 @@ ok($inst3->id, 'Instance 3 has id');
 ok($smap = smap()->new, 'Created new servermap');
 my $expected_smap =  { host1_5433 => { schaufel =>   $inst1->export,
                                        copies   => [ $inst1->export, 
-                                                     $inst2->export ], },
+                                                     $inst2->export ],
+                                       scale    => 1, },
                        host2_5433 => { schaufel =>   $inst2->export,
                                        copies   => [ $inst2->export,
-                                                     $inst3->export, ], },
+                                                     $inst3->export, ],
+                                       scale    => 1, },
                        host3_5433 => { schaufel =>   $inst3->export,
                                        copies   => [ $inst3->export,
-                                                     $inst1->export, ], },
-                       version => 1};
+                                                     $inst1->export, ],
+                                       scale    => 1, },
+                       version => 2, replication => 2};
 is($smap->server_map, $expected_smap, 'Servermap is correct');
 is($smap->id, undef, 'Servermap id is undefined.');
 ok($smap = $smap->save, 'Saved smap');
 ok($smap->id, 'Servermap now has an id');
 is(smap()->most_recent, $smap, 'get_most_recent returns what we just saved');
 is(smap()->get($smap->id), $smap, 'get by id returns correct smap');
-                      
+
+# Placement does not need the database
+my $inst4 = inst()->new(host => 'host4', port => '5433', username => 'bagger',
+                        id => 4);
+my $grown = smap()->placement(instances => [$inst1, $inst2, $inst3, $inst4],
+                              previous => $smap->server_map);
+is([ map { $_->{host} } @{$grown->{host1_5433}{copies}} ], ['host1', 'host2'],
+   'Copies from the previous servermap are kept');
+is([ map { $_->{host} } @{$grown->{host4_5433}{copies}} ], ['host4', 'host1'],
+   'New instance gets a copy and only one previous copy moves');
+
+my @racked = (
+    inst()->new(host => 'a', username => 'bagger', weight => 2, rack => 'r1'),
+    inst()->new(host => 'b', username => 'bagger', rack => 'r1'),
+    inst()->new(host => 'c', username => 'bagger', rack => 'r2'),
+    inst()->new(host => 'd', username => 'bagger', rack => 'r2'),
+    inst()->new(host => 'e', username => 'bagger', weight => 3, rack => 'r3'),
+);
+my %rack = map { $_->host => $_->rack } @racked;
+my $placed = smap()->placement(instances => \@racked, replication => 3);
+is([ grep { my %r = map { $rack{$_->{host}} => 1 } @{$placed->{$_}{copies}};
+            keys %r != 3 } grep { ref $placed->{$_} } keys %$placed ], [],
+   'Each entry has its three copies in three racks');
+is([ sort grep { ref $placed->{$_} and $placed->{$_}{schaufel}{host} eq 'e' }
+     keys %$placed ], [qw(e_5432 e_5432_2 e_5432_3)],
+   'One entry per unit of weight');
+is($placed->{e_5432_3}{scale}, 0.625, 'Scale is per unit of weight');
+my @uneven = map { inst()->new(host => "w$_", username => 'bagger',
+                               weight => $_ == 4 ? 4 : 1) } 1 .. 4;
+my $spread = smap()->placement(instances => \@uneven, replication => 2);
+is({ map { $_->{copies}[1]{host} => 1 }
+     grep { ref $_ and $_->{schaufel}{host} eq 'w4' } values %$spread },
+   { w1 => 1, w2 => 1, w3 => 1 },
+   'Replicas of a heavy instance are spread over the others');
+like(dies { smap()->placement(instances => [@racked[0 .. 1]],
+                              replication => 3) },
+     qr/at least 3 instances/, 'Too few instances for the copies');
+
+# Ring mode.  The hashes and placements are the same as in
+# sql/ingestion/trigger/test/placement_test.c, so change both together.
+is(smap()->placement_hash(''), 17280346270528514342, 'Hash of empty string');
+is(smap()->placement_hash('bp_0000000000000000_2024_01_01_00'),
+   1404596620676349489, 'Hash of a partition name');
+
+my @ringed = map { inst()->new(host => "host$_", username => 'bagger',
+                               id => $_) } (3, 1, 2);
+my $ring = smap()->ring_map(instances => \@ringed, vnodes => 16);
+is([ map { $_->{host} } @{$ring->{nodes}} ], [qw(host1 host2 host3)],
+   'Ring nodes are in host order');
+is({ map { $_ => [ map { $_->{host} } smap()->ring_lookup($_, $ring) ] }
+     qw(bp_0000000000000000_2024_01_01_00 bp_cbf29ce484222325_2024_01_01_01
+        bp_0123456789abcdef_2025_06_30_23) },
+   { bp_0000000000000000_2024_01_01_00 => [qw(host2 host1)],
+     bp_cbf29ce484222325_2024_01_01_01 => [qw(host3 host1)],
+     bp_0123456789abcdef_2025_06_30_23 => [qw(host2 host3)] },
+   'Ring lookups match the C placement');
+my $grown_ring = smap()->ring_map(
+    instances => [ @ringed, inst()->new(host => 'host4', username => 'bagger',
+                                        id => 4) ],
+    vnodes => 16);
+my @before = map { (smap()->ring_lookup("key$_", $ring))[0] } 0 .. 999;
+my @after = map { (smap()->ring_lookup("key$_", $grown_ring))[0] } 0 .. 999;
+is([ grep { $before[$_]{host} ne $after[$_]{host}
+            and $after[$_]{host} ne 'host4' } 0 .. 999 ], [],
+   'Adding a node only moves partitions to it');
+
+Bagger::Storage::Config->new(key => 'servermap_mode', value => 'ring')->save;
+like(dies { smap()->new->server_map }, qr/^Ring mode servermaps cannot/,
+     'Ring mode servermaps not generated');
+Bagger::Storage::Config->new(key => 'servermap_mode', value => 'fixed')->save;
@@ -44,11 +44,11 @@ inst->_get_dbh->commit;
 
 my @exp_messages = (
     "BEGIN",
-    qq!table storage.postgres_instance: INSERT: id[integer]:6 host[character varying]:'host1' port[integer]:5432 username[character varying]:'bagger' status[smallint]:0!,
+    qq!table storage.postgres_instance: INSERT: id[integer]:6 host[character varying]:'host1' port[integer]:5432 username[character varying]:'bagger' status[smallint]:0 weight[integer]:1 rack[character varying]:null!,
     "COMMIT",
     'BEGIN',
-    qq!table storage.postgres_instance: INSERT: id[integer]:7 host[character varying]:'host2' port[integer]:5432 username[character varying]:'bagger' status[smallint]:0!,
-    qq!table storage.postgres_instance: INSERT: id[integer]:8 host[character varying]:'host3' port[integer]:5432 username[character varying]:'bagger' status[smallint]:0!,
+    qq!table storage.postgres_instance: INSERT: id[integer]:7 host[character varying]:'host2' port[integer]:5432 username[character varying]:'bagger' status[smallint]:0 weight[integer]:1 rack[character varying]:null!,
+    qq!table storage.postgres_instance: INSERT: id[integer]:8 host[character varying]:'host3' port[integer]:5432 username[character varying]:'bagger' status[smallint]:0 weight[integer]:1 rack[character varying]:null!,
     "COMMIT",
     'BEGIN',
     qq|table storage.config: INSERT: id[integer]:13 key[text]:'testing1' value[json]:'"1"'|,
@@ -64,19 +64,19 @@ my @exp_hashref = (
         schema  => 'storage',
           type  => 'dml',
       operation => 'INSERT',
-       row_data => { host => 'host1', port => '5432', username => 'bagger', status => 0, id => 6 }},
+       row_data => { host => 'host1', port => '5432', username => 'bagger', status => 0, weight => 1, rack => undef, id => 6 }},
     undef,
     undef,
     { tablename => 'postgres_instance',
         schema  => 'storage',
           type  => 'dml',
       operation => 'INSERT',
-       row_data => { host => 'host2', port => '5432', username => 'bagger', status => 0, id => 7 }},
+       row_data => { host => 'host2', port => '5432', username => 'bagger', status => 0, weight => 1, rack => undef, id => 7 }},
     { tablename => 'postgres_instance',
         schema  => 'storage',
           type  => 'dml',
       operation => 'INSERT',
-       row_data => { host => 'host3', port => '5432', username => 'bagger', status => 0, id => 8 }},
+       row_data => { host => 'host3', port => '5432', username => 'bagger', status => 0, weight => 1, rack => undef, id => 8 }},
    undef,
    undef,
     { tablename => 'config',
@@ -0,0 +1,217 @@
+use Test2::V0 -target => { query => 'Bagger::Query',
+                           inst  => 'Bagger::Storage::Instance',
+                           smap  => 'Bagger::Storage::Servermap',
+                           conf  => 'Bagger::Storage::Config',
+                           dim   => 'Bagger::Storage::Dimension' };
+use Bagger::Test::DB::LW;
+use Bagger::Query::Cursor;
+use Bagger::Query::Merge;
+use Bagger::Agent::Query;
+use Bagger::Type::DateTime;
+use Bagger::Type::JSON;
+use AnyEvent;
+use AnyEvent::Handle;
+use DBI;
+use JSON;
+
+# The storage nodes are local PostgreSQL instances with bagger_lw_storage
+# installed in BAGGER_TEST_STORE_DB, listening on BAGGER_TEST_STORE_PORTS.
+
+skip_all('BAGGER_TEST_STORE not set') unless $ENV{BAGGER_TEST_STORE};
+skip_all('BAGGER_TEST_STORE_PORTS not set')
+    unless $ENV{BAGGER_TEST_STORE_PORTS};
+my @ports = sort { $a <=> $b } split /,/, $ENV{BAGGER_TEST_STORE_PORTS};
+skip_all('Three storage nodes are needed') if @ports < 3;
+my $host = $ENV{BAGGER_TEST_STORE_HOST} // 'localhost';
+my $user = $ENV{BAGGER_TEST_STORE_USER} // 'postgres';
+my $dbname = $ENV{BAGGER_TEST_STORE_DB} // 'bagger';
+
+plan 11;
+
+# Lenkwerk setup
+
+conf()->new(key => 'bagger_db', value => $dbname)->save;
+my @instances = map { inst()->new(host => $host, port => $_,
+                                  username => $user)->register
+                           ->set_status(Bagger::Storage::Instance::ONLINE) }
+                @ports;
+my %dbh = map { $_->port => DBI->connect(
+                    "dbi:Pg:host=$host;port=" . $_->port . ";dbname=$dbname",
+                    $user, undef, { AutoCommit => 1, RaiseError => 1,
+                                    PrintError => 0 }) }
+          @instances;
+
+my $at = Bagger::Type::DateTime->from_db('2024-01-01 03:00:00');
+my @dimensions = map { $_->fieldname->stringify }
+                 grep { $_->in_time_bounds($at) } dim()->list;
+
+# Documents every ten minutes from 03:00 to 04:50, half of them odd.  The
+# ones with labels b are never wanted.
+my @docs = map { { timestamp => sprintf('2024-01-01T%02d:%02d:00Z',
+                                        3 + int($_ / 6), $_ % 6 * 10),
+                   n => $_, kind => $_ % 2 ? 'odd' : 'even' } } 0 .. 11;
+
+sub wipe {
+    for my $dbh (values %dbh) {
+        $dbh->do('DROP SCHEMA IF EXISTS partitions CASCADE');
+        $dbh->do('DELETE FROM storage.partition');
+    }
+}
+
+# stores each document, with each set of labels, on the nodes returned for it
+sub store {
+    my ($nodes_for) = @_;
+    wipe();
+    for my $label ('a', 'b') {
+        my @labels = ($label) x @dimensions;
+        for my $doc (@docs) {
+            my $hour = substr($doc->{timestamp}, 0, 13) . ':00:00';
+            my ($relname) = $dbh{$ports[0]}->selectrow_array(
+                'SELECT storage.partition_name(?, ?)', {}, \@labels, $hour
+            );
+            for my $port ($nodes_for->($doc, $relname)) {
+                my ($rel) = $dbh{$port}->selectrow_array(
+                    'SELECT storage.create_partition(?, ?)', {},
+                    \@labels, $hour
+                );
+                $dbh{$port}->do("INSERT INTO $rel (data) VALUES (?)", {},
+                                encode_json({ %$doc, label => $label }));
+            }
+        }
+    }
+}
+
+sub run_query {
+    my ($query, %args) = @_;
+    my $plan = $query->plan(%args);
+    my $cv = AnyEvent->condvar;
+    my @found;
+    my $merge = Bagger::Query::Merge->new(
+        cursors => [ map { Bagger::Query::Cursor->new(
+                               query => $query, instance => $_->[0],
+                               relnames => $_->[1], batch_size => 2,
+                           ) } @{$plan->{nodes}} ],
+        copies  => $plan->{copies},
+        on_rows => sub { push @found, map { decode_json($_) } @_ },
+        on_done => sub { $cv->send(@_) },
+    );
+    $merge->start;
+    my $error = $cv->recv;
+    return ($error, [ map { $_->{n} } @found ], $plan);
+}
+
+my @wanted = map { ($_ => 'a') } @dimensions;
+my $query = query()->from_params(
+    time => '2024-01-01T03:30:00..2024-01-01T04:30:00', @wanted
+);
+my $odd = query()->from_params(
+    time => '2024-01-01T03:30:00..2024-01-01T04:30:00', @wanted,
+    kind => 'odd'
+);
+
+# Version 2 servermap: each entry's documents on its copies
+
+my $v2 = smap()->new(server_map => Bagger::Type::JSON->new(
+    smap()->placement(instances => \@instances, replication => 2)
+));
+my @entries = sort grep { ref $v2->server_map->{$_} } keys %{$v2->server_map};
+store(sub {
+    my ($doc) = @_;
+    my $entry = $v2->server_map->{$entries[$doc->{n} % @entries]};
+    return map { $_->{port} } @{$entry->{copies}};
+});
+
+my ($error, $found, $plan) = run_query($query, servermap => $v2,
+                                       instances => \@instances);
+is([ $plan->{copies}, scalar @{$plan->{nodes}} ], [ 2, 3 ],
+   'Every node searched for two copies');
+is([ $error, $found ], [ undef, [ 3 .. 9 ] ],
+   'Documents in the time range found once, in order');
+is([ (run_query($odd, servermap => $v2, instances => \@instances))[0, 1] ],
+   [ undef, [ 3, 5, 7, 9 ] ], 'Filter applied');
+
+my @degraded = (inst()->new(host => $host, port => $ports[0],
+                            username => $user, id => $instances[0]->id),
+                @instances[1 .. $#instances]);
+is([ (run_query($query, servermap => $v2, instances => \@degraded))[0, 1] ],
+   [ undef, [ 3 .. 9 ] ], 'Documents found once with a node down');
+
+# Ring servermap: each partition on its own nodes
+
+my $ring = smap()->new(server_map => Bagger::Type::JSON->new(
+    smap()->ring_map(instances => \@instances, replication => 2,
+                    vnodes => 16)
+));
+store(sub {
+    my ($doc, $relname) = @_;
+    return map { $_->{port} } $ring->ring_lookup($relname);
+});
+
+($error, $found, $plan) = run_query($query, servermap => $ring,
+                                    instances => \@instances);
+my @searched = map { @{$_->[1]} } @{$plan->{nodes}};
+my %distinct = map { $_ => 1 } @searched;
+is([ $plan->{copies}, scalar @searched, scalar keys %distinct ], [ 1, 2, 2 ],
+   'Each partition searched on one node');
+is([ $error, $found ], [ undef, [ 3 .. 9 ] ], 'Ring placed documents found');
+
+# a partition the node lists but cannot read
+my ($lost) = @{$plan->{nodes}[0]};
+$dbh{$lost->port}->do('DROP TABLE partitions.' . $plan->{nodes}[0][1][0]);
+($error) = run_query($query, servermap => $ring, instances => \@instances);
+like($error, { SQLSTATE => '42P01', Message => qr/^\Q$host\E:\d+: / },
+     'Node errors passed on');
+store(sub {
+    my ($doc, $relname) = @_;
+    return map { $_->{port} } $ring->ring_lookup($relname);
+});
+
+# Over HTTP, with the ring servermap saved
+
+$ring->save;
+inst()->_get_dbh->commit;
+Bagger::Agent::Query->start(host => '127.0.0.1', port => 0);
+
+sub get {
+    my ($query_string) = @_;
+    my $cv = AnyEvent->condvar;
+    my $response = '';
+    my $client;
+    $client = AnyEvent::Handle->new(
+        connect  => [ '127.0.0.1', Bagger::Agent::Query->port ],
+        on_read  => sub { $response .= delete $_[0]{rbuf} },
+        on_error => sub { undef $client; $cv->send },
+        on_eof   => sub { undef $client; $cv->send },
+    );
+    $client->push_write("GET /api/v1.0/query?$query_string HTTP/1.1\r\n"
+                        . "Host: localhost\r\n\r\n");
+    $cv->recv;
+    my ($head, $body) = split /\r\n\r\n/, $response, 2;
+    if ($head =~ /^Transfer-Encoding: chunked/mi) {
+        my $chunks = $body;
+        $body = '';
+        while ($chunks =~ s/^([0-9a-f]+)\r\n//) {
+            $body .= substr($chunks, 0, hex $1, '');
+            $chunks =~ s/^\r\n//;
+        }
+    }
+    return ((split / /, $head)[1], decode_json($body));
+}
+
+my $wanted = join('&', map { "$_=a" } @dimensions);
+my ($status, $body) = get(
+    "time=2024-01-01T03:30:00..2024-01-01T04:30:00&$wanted&kind=odd"
+);
+is($status, 200, 'Query succeeded');
+is([ map { $_->{n} } @$body ], [ 3, 5, 7, 9 ], 'Documents streamed');
+($status, $body) = get(
+    "time=2024-01-01T03:30:00..2024-01-01T04:50:00&$wanted&n=8..10"
+);
+is([ map { $_->{n} } @$body ], [ 8, 9, 10 ],
+   'Range filter between numbers compares numbers');
+($status, $body) = get($wanted);
+is([ $status, $body->{Message} ], [ 400, 'A time range is required' ],
+   'Bad request rejected');
+
+Bagger::Agent::Query->stop;
+wipe();